@@ -0,0 +1,87 @@
+
+
+#include "config.h"
+#include "bench.h"
+
+
+#if defined(UNIX)
+#   include <sys/resource.h>
+#endif
+
+
+static bool __bench_first__ = true;
+
+
+void bench_begin(const char *suite)
+{
+    printf("{\"suite\": \"%s\", \"results\": [", suite);
+    __bench_first__ = true;
+}
+
+
+void bench_report(const char *name, double seconds, size_t ops, size_t bytes, size_t tokens)
+{
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("%s\n    {\"name\": \"%s\", \"seconds\": %.6f, \"ops\": %lu, \"ns_per_op\": %.3f",
+           __bench_first__ ? "" : ",", name, seconds, (unsigned long) ops,
+           ops != 0 ? seconds * 1e9 / ops : 0.0);
+
+    if (bytes != 0) {
+        printf(", \"bytes\": %lu, \"mb_per_s\": %.3f", (unsigned long) bytes, bytes / seconds / 1e6);
+    }
+
+    if (tokens != 0) {
+        printf(", \"tokens\": %lu, \"tokens_per_s\": %.0f", (unsigned long) tokens, tokens / seconds);
+    }
+
+    printf(", \"peak_rss_kb\": %ld}", bench_peak_rss());
+    fflush(stdout);
+
+    __bench_first__ = false;
+}
+
+
+int bench_end(void)
+{
+    printf("\n]}\n");
+    return fflush(stdout) == 0 ? 0 : 1;
+}
+
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+long bench_peak_rss(void)
+{
+#if defined(UNIX)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#   if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#   else
+        return usage.ru_maxrss;
+#   endif
+    }
+#endif
+
+    return 0;
+}
+
+
+/* xorshift32, the same sequence on every run and every machine */
+uint32_t bench_rand(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
@@ -0,0 +1,31 @@
+
+
+#ifndef __BENCH__H__
+#define __BENCH__H__
+
+
+#include "config.h"
+
+
+/**
+ * The results of a benchmark binary, written to stdout as one JSON
+ * document:
+ *
+ *     {"suite": "lexer", "results": [
+ *         {"name": "flat", "seconds": 0.21, "ops": 4194304, "ns_per_op": 50.1,
+ *          "bytes": 4194304, "mb_per_s": 19.9, "tokens": 1048576,
+ *          "tokens_per_s": 4993000, "peak_rss_kb": 10240}]}
+ *
+ * bytes and tokens are only there when the benchmark has them, peak_rss_kb
+ * is the peak of the process so far.
+ **/
+void bench_begin(const char *suite);
+void bench_report(const char *name, double seconds, size_t ops, size_t bytes, size_t tokens);
+int bench_end(void);
+
+double bench_now(void);
+long bench_peak_rss(void);
+uint32_t bench_rand(uint32_t *x);
+
+
+#endif
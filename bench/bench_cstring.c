@@ -0,0 +1,184 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "cspool.h"
+#include "bench.h"
+
+#include <pthread.h>
+
+
+#define BENCH_CSTRING_OPS       (4 * 1000 * 1000)
+#define BENCH_CSPOOL_IDENTIFIERS 50000
+#define BENCH_CSPOOL_PUSHES     (8 * 1000 * 1000)
+#define BENCH_CSPOOL_MAX_THREADS 32
+
+
+static const char *words[] = {
+    "size", "count", "buffer", "node", "index", "value", "next", "prev",
+    "length", "token", "lexer", "reader", "stream", "macro", "name", "type",
+};
+
+
+static char *identifiers[BENCH_CSPOOL_IDENTIFIERS];
+static cspool_t *pool;
+
+
+typedef struct bench_worker_s {
+    size_t begin;
+    size_t end;
+} bench_worker_t;
+
+
+/* a spelling built a character and a word at a time, as the lexer does */
+static void __bench_concat__(void)
+{
+    cstring_t cs;
+    double start;
+    size_t i, bytes;
+
+    cs = cstring_new_n(NULL, 16);
+    start = bench_now();
+
+    for (i = 0; i < BENCH_CSTRING_OPS; i++) {
+        if (i & 3) {
+            cs = cstring_concat_ch(cs, 'a' + i % 26);
+        } else {
+            cs = cstring_concat_n(cs, words[i % 16], strlen(words[i % 16]));
+        }
+    }
+
+    bytes = cstring_length(cs);
+    bench_report("concat", bench_now() - start, BENCH_CSTRING_OPS, bytes, 0);
+
+    cstring_free(cs);
+}
+
+
+static void __bench_new_free__(void)
+{
+    cstring_t cs;
+    double start;
+    size_t i, bytes;
+
+    bytes = 0;
+    start = bench_now();
+
+    for (i = 0; i < BENCH_CSTRING_OPS; i++) {
+        cs = cstring_new(words[i % 16]);
+        bytes += cstring_length(cs);
+        cstring_free(cs);
+    }
+
+    bench_report("new_free", bench_now() - start, BENCH_CSTRING_OPS, bytes, 0);
+}
+
+
+static void __bench_format__(void)
+{
+    cstring_t cs;
+    double start;
+    size_t i, bytes;
+
+    bytes = 0;
+    start = bench_now();
+
+    for (i = 0; i < BENCH_CSTRING_OPS / 4; i++) {
+        cs = cstring_concat_pf(cstring_new_n(NULL, 32), "%s_%lu", words[i % 16], (unsigned long) i);
+        bytes += cstring_length(cs);
+        cstring_free(cs);
+    }
+
+    bench_report("format", bench_now() - start, BENCH_CSTRING_OPS / 4, bytes, 0);
+}
+
+
+static void __make_identifiers__(void)
+{
+    char buf[64];
+    size_t i, nwords;
+
+    nwords = sizeof(words) / sizeof(words[0]);
+
+    for (i = 0; i < BENCH_CSPOOL_IDENTIFIERS; i++) {
+        sprintf(buf, "%s_%s%lu", words[i % nwords], words[(i / nwords) % nwords],
+                (unsigned long) (i / (nwords * nwords)));
+        identifiers[i] = strdup(buf);
+    }
+}
+
+
+/* most pushes hit a small set of hot identifiers, like real sources */
+static void* __bench_worker__(void *arg)
+{
+    bench_worker_t *worker = arg;
+    uint32_t x;
+    size_t i, k;
+
+    x = (uint32_t) worker->begin * 2654435761u + 1;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        bench_rand(&x);
+        k = (x & 7) != 0 ? x % 512 : x % BENCH_CSPOOL_IDENTIFIERS;
+        cspool_push(pool, identifiers[k]);
+    }
+
+    return NULL;
+}
+
+
+/* the same pushes shared by nthreads, to show how the pool scales */
+static void __bench_cspool__(size_t nthreads)
+{
+    pthread_t threads[BENCH_CSPOOL_MAX_THREADS];
+    bench_worker_t workers[BENCH_CSPOOL_MAX_THREADS];
+    char name[32];
+    double start;
+    size_t i, step;
+
+    pool = cspool_create();
+
+    step = BENCH_CSPOOL_PUSHES / nthreads;
+    start = bench_now();
+
+    for (i = 0; i < nthreads; i++) {
+        workers[i].begin = i * step;
+        workers[i].end = (i + 1) * step;
+        pthread_create(&threads[i], NULL, __bench_worker__, &workers[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    start = bench_now() - start;
+
+    sprintf(name, "cspool_push_%lu", (unsigned long) nthreads);
+    bench_report(name, start, step * nthreads, 0, 0);
+
+    cspool_destroy(pool);
+}
+
+
+int main(void)
+{
+    size_t i, nthreads;
+
+    __make_identifiers__();
+
+    bench_begin("cstring");
+    __bench_concat__();
+    __bench_new_free__();
+    __bench_format__();
+
+    for (nthreads = 1; nthreads <= BENCH_CSPOOL_MAX_THREADS; nthreads *= 2) {
+        __bench_cspool__(nthreads);
+    }
+
+    for (i = 0; i < BENCH_CSPOOL_IDENTIFIERS; i++) {
+        free(identifiers[i]);
+    }
+
+    return bench_end();
+}
@@ -0,0 +1,131 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "dict.h"
+#include "map.h"
+#include "set.h"
+#include "bench.h"
+
+
+#define BENCH_DICT_KEYS         (256 * 1024)
+#define BENCH_DICT_LOOKUPS      (4 * 1000 * 1000)
+
+
+static const char *words[] = {
+    "size", "count", "buffer", "node", "index", "value", "next", "prev",
+    "length", "token", "lexer", "reader", "stream", "macro", "name", "type",
+};
+
+
+/* identifiers like those of sources, the second half never added */
+static cstring_t* __make_keys__(size_t n)
+{
+    cstring_t *keys;
+    size_t i, nwords;
+
+    nwords = sizeof(words) / sizeof(words[0]);
+    keys = pmalloc(sizeof(cstring_t) * n);
+
+    for (i = 0; i < n; i++) {
+        keys[i] = cstring_concat_pf(cstring_new_n(NULL, 32), "%s_%s%lu", words[i % nwords],
+                                    words[(i / nwords) % nwords], (unsigned long) (i / (nwords * nwords)));
+    }
+
+    return keys;
+}
+
+
+static void __bench_map__(cstring_t *keys)
+{
+    map_t *map;
+    double start;
+    size_t i, found;
+    uint32_t x;
+
+    map = map_create();
+
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_KEYS; i++) {
+        map_add(map, keys[i], keys[i]);
+    }
+    bench_report("map_add", bench_now() - start, BENCH_DICT_KEYS, 0, 0);
+
+    /* most lookups hit a small set of hot names, like the macros of sources */
+    x = 1;
+    found = 0;
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_LOOKUPS; i++) {
+        bench_rand(&x);
+        found += map_find(map, keys[(x & 7) != 0 ? x % 512 : x % BENCH_DICT_KEYS]) != NULL;
+    }
+    bench_report("map_find", bench_now() - start, BENCH_DICT_LOOKUPS, 0, 0);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_LOOKUPS; i++) {
+        bench_rand(&x);
+        found += map_find(map, keys[BENCH_DICT_KEYS + x % BENCH_DICT_KEYS]) != NULL;
+    }
+    bench_report("map_find_miss", bench_now() - start, BENCH_DICT_LOOKUPS, 0, 0);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_KEYS; i++) {
+        map_del(map, keys[i]);
+    }
+    bench_report("map_del", bench_now() - start, BENCH_DICT_KEYS, 0, 0);
+
+    map_destroy(map);
+
+    assert(found == BENCH_DICT_LOOKUPS);
+}
+
+
+static void __bench_set__(cstring_t *keys)
+{
+    set_t *set;
+    double start;
+    size_t i, found;
+    uint32_t x;
+
+    set = set_create();
+
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_KEYS; i++) {
+        set_add(set, keys[i]);
+    }
+    bench_report("set_add", bench_now() - start, BENCH_DICT_KEYS, 0, 0);
+
+    x = 1;
+    found = 0;
+    start = bench_now();
+    for (i = 0; i < BENCH_DICT_LOOKUPS; i++) {
+        bench_rand(&x);
+        found += set_has(set, keys[x % (2 * BENCH_DICT_KEYS)]);
+    }
+    bench_report("set_has", bench_now() - start, BENCH_DICT_LOOKUPS, 0, 0);
+
+    set_destroy(set);
+
+    (void) found;
+}
+
+
+int main(void)
+{
+    cstring_t *keys;
+    size_t i;
+
+    keys = __make_keys__(2 * BENCH_DICT_KEYS);
+
+    bench_begin("dict");
+    __bench_map__(keys);
+    __bench_set__(keys);
+
+    for (i = 0; i < 2 * BENCH_DICT_KEYS; i++) {
+        cstring_free(keys[i]);
+    }
+    pfree(keys);
+
+    return bench_end();
+}
@@ -0,0 +1,78 @@
+
+
+#include "config.h"
+#include "cstring.h"
+#include "token.h"
+#include "reader.h"
+#include "lexer.h"
+#include "bench.h"
+#include "corpus.h"
+
+
+#define BENCH_LEXER_BYTES       (8 * 1024 * 1024)
+#define BENCH_LEXER_TABLE_BYTES (50 * 1024 * 1024)
+
+
+static void __bench_lex__(const char *name, const char *fn, size_t bytes, bool literal_runs)
+{
+    lexer_t *lexer;
+    token_t *tok;
+    token_type_t type;
+    double start;
+    size_t n;
+
+    lexer = lexer_create();
+    lexer->literal_runs = literal_runs;
+    lexer_push(lexer, STREAM_TYPE_FILE, (const unsigned char*) fn);
+
+    n = 0;
+    start = bench_now();
+
+    do {
+        tok = lexer_get(lexer);
+        type = tok->type;
+        token_destroy(tok);
+        n++;
+    } while (type != TOKEN_END);
+
+    bench_report(name, bench_now() - start, n, bytes, n);
+
+    lexer_destroy(lexer);
+}
+
+
+int main(void)
+{
+    cstring_t dir, flat, strings, table;
+    size_t nflat, nstrings, ntable;
+
+    if ((dir = corpus_open()) == NULL) {
+        return 1;
+    }
+
+    flat = corpus_path(dir, "flat.c");
+    strings = corpus_path(dir, "strings.c");
+    table = corpus_path(dir, "table.c");
+
+    nflat = corpus_flat(flat, BENCH_LEXER_BYTES);
+    nstrings = corpus_strings(strings, BENCH_LEXER_BYTES, 4096);
+    ntable = corpus_table(table, BENCH_LEXER_TABLE_BYTES);
+
+    if (nflat == 0 || nstrings == 0 || ntable == 0) {
+        corpus_close(dir);
+        return 1;
+    }
+
+    bench_begin("lexer");
+    __bench_lex__("flat", flat, nflat, false);
+    __bench_lex__("strings", strings, nstrings, false);
+    __bench_lex__("table", table, ntable, false);
+    __bench_lex__("table_runs", table, ntable, true);
+
+    cstring_free(flat);
+    cstring_free(strings);
+    cstring_free(table);
+    corpus_close(dir);
+
+    return bench_end();
+}
@@ -0,0 +1,121 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "token.h"
+#include "number.h"
+#include "bench.h"
+
+
+#define BENCH_NUMBER_LITERALS   (1 << 16)
+#define BENCH_NUMBER_ROUNDS     64
+
+
+/**
+ * Literals like those of sources, decimal and hexadecimal of every length,
+ * some with a suffix. With a separator after the first digit, the same
+ * values take the general path of parse_number().
+ **/
+static token_t** __make_literals__(bool separated, unsigned long long *values, size_t *bytes)
+{
+    token_t **tokens;
+    char buf[64];
+    uint32_t x;
+    size_t i;
+    int n;
+
+    tokens = pmalloc(sizeof(token_t*) * BENCH_NUMBER_LITERALS);
+
+    *bytes = 0;
+    x = 2463534242u;
+    for (i = 0; i < BENCH_NUMBER_LITERALS; i++) {
+        bench_rand(&x);
+
+        switch (i % 4) {
+        case 0:
+            values[i] = x % 900 + 100;
+            n = sprintf(buf, "%llu", values[i]);
+            break;
+        case 1:
+            values[i] = x;
+            n = sprintf(buf, "%lluu", values[i]);
+            break;
+        case 2:
+            values[i] = (unsigned long long) x << 20 | (x & 0xfffff);
+            n = sprintf(buf, "%llu", values[i]);
+            break;
+        default:
+            values[i] = x;
+            n = sprintf(buf, "0x%08llx", values[i]);
+            break;
+        }
+
+        if (separated) {
+            memmove(buf + (i % 4 == 3 ? 4 : 2), buf + (i % 4 == 3 ? 3 : 1),
+                    n - (i % 4 == 3 ? 2 : 0));
+            buf[i % 4 == 3 ? 3 : 1] = '\'';
+            n++;
+        }
+
+        tokens[i] = token_create(TOKEN_NUMBER, cstring_new_n(buf, n), NULL);
+        *bytes += n;
+    }
+
+    return tokens;
+}
+
+
+static bool __bench_parse__(const char *name, token_t **tokens, unsigned long long *values,
+                            size_t bytes)
+{
+    number_t number;
+    double start;
+    size_t i, j;
+    bool ok;
+
+    ok = true;
+    start = bench_now();
+
+    for (j = 0; j < BENCH_NUMBER_ROUNDS; j++) {
+        for (i = 0; i < BENCH_NUMBER_LITERALS; i++) {
+            if (!parse_number(tokens[i], &number) || number.ul != values[i]) {
+                ok = false;
+            }
+        }
+    }
+
+    bench_report(name, bench_now() - start, BENCH_NUMBER_LITERALS * BENCH_NUMBER_ROUNDS,
+                 bytes * BENCH_NUMBER_ROUNDS, BENCH_NUMBER_LITERALS * BENCH_NUMBER_ROUNDS);
+
+    return ok;
+}
+
+
+int main(void)
+{
+    token_t **fast, **general;
+    unsigned long long *values;
+    size_t nfast, ngeneral, i;
+    bool ok;
+
+    values = pmalloc(sizeof(unsigned long long) * BENCH_NUMBER_LITERALS);
+
+    fast = __make_literals__(false, values, &nfast);
+    general = __make_literals__(true, values, &ngeneral);
+
+    bench_begin("number");
+    ok = __bench_parse__("fast", fast, values, nfast);
+    ok = __bench_parse__("general", general, values, ngeneral) && ok;
+
+    for (i = 0; i < BENCH_NUMBER_LITERALS; i++) {
+        token_destroy(fast[i]);
+        token_destroy(general[i]);
+    }
+
+    pfree(fast);
+    pfree(general);
+    pfree(values);
+
+    return bench_end() == 0 && ok ? 0 : 1;
+}
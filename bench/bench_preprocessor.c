@@ -0,0 +1,96 @@
+
+
+#include "config.h"
+#include "cstring.h"
+#include "token.h"
+#include "reader.h"
+#include "lexer.h"
+#include "preprocessor.h"
+#include "bench.h"
+#include "corpus.h"
+
+
+#define BENCH_PP_BYTES          (8 * 1024 * 1024)
+#define BENCH_PP_MACRO_LINES    20000
+#define BENCH_PP_DAG_DEPTH      24
+#define BENCH_PP_DAG_WIDTH      12
+#define BENCH_PP_DAG_ROUNDS     16
+
+
+static size_t __preprocess__(const char *fn)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *tok;
+    token_type_t type;
+    size_t n;
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_FILE, (const unsigned char*) fn);
+    pp = preprocessor_create(lexer);
+
+    n = 0;
+    do {
+        tok = preprocessor_get(pp);
+        type = tok->type;
+        token_destroy(tok);
+        n++;
+    } while (type != TOKEN_END);
+
+    preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+
+    return n;
+}
+
+
+static void __bench_preprocess__(const char *name, const char *fn, size_t bytes, size_t rounds)
+{
+    double start;
+    size_t n, i;
+
+    n = 0;
+    start = bench_now();
+
+    for (i = 0; i < rounds; i++) {
+        n += __preprocess__(fn);
+    }
+
+    bench_report(name, bench_now() - start, n, bytes * rounds, n);
+}
+
+
+int main(void)
+{
+    cstring_t dir, flat, macros, dag;
+    size_t nflat, nmacros, ndag;
+
+    if ((dir = corpus_open()) == NULL) {
+        return 1;
+    }
+
+    flat = corpus_path(dir, "flat.c");
+    macros = corpus_path(dir, "macros.c");
+    dag = corpus_path(dir, "dag.c");
+
+    nflat = corpus_flat(flat, BENCH_PP_BYTES);
+    nmacros = corpus_macros(macros, BENCH_PP_MACRO_LINES);
+    ndag = corpus_include_dag(dir, "dag.c", BENCH_PP_DAG_DEPTH, BENCH_PP_DAG_WIDTH);
+
+    if (nflat == 0 || nmacros == 0 || ndag == 0) {
+        corpus_close(dir);
+        return 1;
+    }
+
+    bench_begin("preprocessor");
+    __bench_preprocess__("flat", flat, nflat, 1);
+    __bench_preprocess__("macros", macros, nmacros, 1);
+    __bench_preprocess__("include_dag", dag, ndag, BENCH_PP_DAG_ROUNDS);
+
+    cstring_free(flat);
+    cstring_free(macros);
+    cstring_free(dag);
+    corpus_close(dir);
+
+    return bench_end();
+}
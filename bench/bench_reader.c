@@ -0,0 +1,86 @@
+
+
+#include "config.h"
+#include "cstring.h"
+#include "reader.h"
+#include "bench.h"
+#include "corpus.h"
+
+
+#define BENCH_READER_BYTES      (8 * 1024 * 1024)
+#define BENCH_READER_LOADS      16
+
+
+/* every character through reader_get(), the way the lexer used to read */
+static void __bench_get__(const char *name, const char *fn, size_t bytes)
+{
+    reader_t *reader;
+    double start;
+    size_t n;
+
+    reader = reader_create();
+    reader_push(reader, STREAM_TYPE_FILE, (const unsigned char*) fn);
+
+    n = 0;
+    start = bench_now();
+
+    while (reader_get(reader) != EOF) {
+        n++;
+    }
+
+    bench_report(name, bench_now() - start, n, bytes, 0);
+
+    reader_destroy(reader);
+}
+
+
+/* opening, reading and checking the encoding of a file */
+static void __bench_load__(const char *name, const char *fn, size_t bytes)
+{
+    reader_t *reader;
+    double start;
+    size_t i;
+
+    start = bench_now();
+
+    for (i = 0; i < BENCH_READER_LOADS; i++) {
+        reader = reader_create();
+        reader_push(reader, STREAM_TYPE_FILE, (const unsigned char*) fn);
+        reader_destroy(reader);
+    }
+
+    bench_report(name, bench_now() - start, BENCH_READER_LOADS, bytes * BENCH_READER_LOADS, 0);
+}
+
+
+int main(void)
+{
+    cstring_t dir, flat, strings;
+    size_t nflat, nstrings;
+
+    if ((dir = corpus_open()) == NULL) {
+        return 1;
+    }
+
+    flat = corpus_path(dir, "flat.c");
+    strings = corpus_path(dir, "strings.c");
+
+    nflat = corpus_flat(flat, BENCH_READER_BYTES);
+    nstrings = corpus_strings(strings, BENCH_READER_BYTES, 4096);
+
+    if (nflat == 0 || nstrings == 0) {
+        corpus_close(dir);
+        return 1;
+    }
+
+    bench_begin("reader");
+    __bench_get__("get_flat", flat, nflat);
+    __bench_get__("get_strings", strings, nstrings);
+    __bench_load__("load_flat", flat, nflat);
+
+    cstring_free(flat);
+    cstring_free(strings);
+    corpus_close(dir);
+
+    return bench_end();
+}
@@ -0,0 +1,186 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "array.h"
+#include "token.h"
+#include "bench.h"
+
+
+#define BENCH_TOKENS            (1024 * 1024)
+#define BENCH_ROUNDS            32
+#define BENCH_EXPANSIONS        (4 * 1000 * 1000)
+
+
+static token_t tokens[BENCH_TOKENS];
+
+
+/* appends a whole file worth of tokens, then reads them back in order */
+static double __array_tokens__(size_t *sum)
+{
+    array_t *a;
+    double start;
+    size_t i, r;
+
+    start = bench_now();
+
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        a = array_create_n(sizeof(token_t*), 8);
+        for (i = 0; i < BENCH_TOKENS; i++) {
+            array_cast_append(token_t*, a, &tokens[i]);
+        }
+        for (i = 0; i < array_length(a); i++) {
+            *sum += array_cast_at(token_t*, a, i)->spaces;
+        }
+        array_destroy(a);
+    }
+
+    return bench_now() - start;
+}
+
+
+static double __vec_tokens__(size_t *sum)
+{
+    token_vec_t v;
+    double start;
+    size_t i, r;
+
+    start = bench_now();
+
+    for (r = 0; r < BENCH_ROUNDS; r++) {
+        token_vec_init(&v);
+        for (i = 0; i < BENCH_TOKENS; i++) {
+            token_vec_push(&v, &tokens[i]);
+        }
+        for (i = 0; i < token_vec_length(&v); i++) {
+            *sum += token_vec_at(&v, i)->spaces;
+        }
+        token_vec_free(&v);
+    }
+
+    return bench_now() - start;
+}
+
+
+/* the pushed back tokens of the lexer, a stack going up and down */
+static double __array_unget__(size_t *sum)
+{
+    array_t *a;
+    double start;
+    size_t i, r, depth;
+
+    a = array_create_n(sizeof(token_t*), 8);
+    start = bench_now();
+
+    for (r = 0; r < BENCH_ROUNDS * 8; r++) {
+        for (i = 0; i < BENCH_TOKENS / 8; i++) {
+            depth = (i * 2654435761u >> 7) & 15;
+            while (depth--) {
+                array_cast_append(token_t*, a, &tokens[i]);
+            }
+            while (!array_is_empty(a)) {
+                *sum += array_cast_back(token_t*, a)->spaces;
+                array_pop_back(a);
+            }
+        }
+    }
+
+    start = bench_now() - start;
+    array_destroy(a);
+    return start;
+}
+
+
+static double __vec_unget__(size_t *sum)
+{
+    token_vec_t v;
+    double start;
+    size_t i, r, depth;
+
+    token_vec_init(&v);
+    start = bench_now();
+
+    for (r = 0; r < BENCH_ROUNDS * 8; r++) {
+        for (i = 0; i < BENCH_TOKENS / 8; i++) {
+            depth = (i * 2654435761u >> 7) & 15;
+            while (depth--) {
+                token_vec_push(&v, &tokens[i]);
+            }
+            while (!token_vec_is_empty(&v)) {
+                *sum += token_vec_pop(&v)->spaces;
+            }
+        }
+    }
+
+    start = bench_now() - start;
+    token_vec_free(&v);
+    return start;
+}
+
+
+/* the short lived token lists of the macro expansions */
+static double __array_expansions__(size_t *sum)
+{
+    array_t *a;
+    double start;
+    size_t i, j, n;
+
+    start = bench_now();
+
+    for (i = 0; i < BENCH_EXPANSIONS; i++) {
+        n = 1 + (i & 7);
+        a = array_create_n(sizeof(token_t*), 8);
+        for (j = 0; j < n; j++) {
+            array_cast_append(token_t*, a, &tokens[(i + j) % BENCH_TOKENS]);
+        }
+        *sum += array_cast_front(token_t*, a)->spaces + array_length(a);
+        array_destroy(a);
+    }
+
+    return bench_now() - start;
+}
+
+
+static double __vec_expansions__(size_t *sum)
+{
+    token_vec_t v;
+    double start;
+    size_t i, j, n;
+
+    start = bench_now();
+
+    for (i = 0; i < BENCH_EXPANSIONS; i++) {
+        n = 1 + (i & 7);
+        token_vec_init(&v);
+        for (j = 0; j < n; j++) {
+            token_vec_push(&v, &tokens[(i + j) % BENCH_TOKENS]);
+        }
+        *sum += token_vec_front(&v)->spaces + token_vec_length(&v);
+        token_vec_free(&v);
+    }
+
+    return bench_now() - start;
+}
+
+
+int main(void)
+{
+    size_t sum, i;
+
+    for (i = 0; i < BENCH_TOKENS; i++) {
+        tokens[i].spaces = i & 1;
+    }
+
+    sum = 0;
+
+    bench_begin("vec");
+    bench_report("array_tokens", __array_tokens__(&sum), BENCH_TOKENS * BENCH_ROUNDS, 0, 0);
+    bench_report("vec_tokens", __vec_tokens__(&sum), BENCH_TOKENS * BENCH_ROUNDS, 0, 0);
+    bench_report("array_unget", __array_unget__(&sum), BENCH_TOKENS * BENCH_ROUNDS, 0, 0);
+    bench_report("vec_unget", __vec_unget__(&sum), BENCH_TOKENS * BENCH_ROUNDS, 0, 0);
+    bench_report("array_expansions", __array_expansions__(&sum), BENCH_EXPANSIONS, 0, 0);
+    bench_report("vec_expansions", __vec_expansions__(&sum), BENCH_EXPANSIONS, 0, 0);
+
+    /* keeps the loops from being optimized away */
+    return bench_end() == 0 && sum != 0 ? 0 : 1;
+}
@@ -0,0 +1,359 @@
+
+
+#include "config.h"
+#include "cstring.h"
+#include "bench.h"
+#include "corpus.h"
+
+
+#if defined(UNIX)
+#   include <unistd.h>
+#   include <dirent.h>
+#endif
+
+
+#define CORPUS_SEED             2463534242u
+#define CORPUS_TABLE_COLUMNS    16
+#define CORPUS_TWICE_DEPTH      6
+#define CORPUS_OBJECT_CHAIN     32
+
+
+static const char *words[] = {
+    "size", "count", "buffer", "node", "index", "value", "next", "prev",
+    "length", "token", "lexer", "reader", "stream", "macro", "name", "type",
+};
+
+
+#define CORPUS_NWORDS           (sizeof(words) / sizeof(words[0]))
+
+
+cstring_t corpus_open(void)
+{
+#if defined(UNIX)
+    char dir[] = "/tmp/xccbenchXXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        return NULL;
+    }
+
+    return cstring_new(dir);
+#else
+    return NULL;
+#endif
+}
+
+
+/* removes the directory along with everything generated in it */
+void corpus_close(cstring_t dir)
+{
+#if defined(UNIX)
+    struct dirent *entry;
+    cstring_t fn;
+    DIR *d;
+
+    if ((d = opendir(dir)) != NULL) {
+        while ((entry = readdir(d)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            fn = corpus_path(dir, entry->d_name);
+            remove(fn);
+            cstring_free(fn);
+        }
+        closedir(d);
+    }
+
+    rmdir(dir);
+#endif
+
+    cstring_free(dir);
+}
+
+
+cstring_t corpus_path(cstring_t dir, const char *name)
+{
+    return cstring_concat_pf(cstring_dup(dir), "/%s", name);
+}
+
+
+static size_t __corpus_finish__(FILE *fp, size_t size)
+{
+    if (ferror(fp)) {
+        fclose(fp);
+        return 0;
+    }
+
+    return fclose(fp) == 0 ? size : 0;
+}
+
+
+/**
+ * A flat file of ordinary code: comments, declarations and functions with
+ * expressions, calls, character and string constants, and no directives.
+ **/
+size_t corpus_flat(const char *fn, size_t bytes)
+{
+    const char *a, *b;
+    FILE *fp;
+    size_t size, i;
+    uint32_t x, r[3];
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        return 0;
+    }
+
+    x = CORPUS_SEED;
+    size = 0;
+
+    for (i = 0; size < bytes; i++) {
+        a = words[bench_rand(&x) % CORPUS_NWORDS];
+        b = words[bench_rand(&x) % CORPUS_NWORDS];
+        r[0] = bench_rand(&x);
+        r[1] = bench_rand(&x);
+        r[2] = bench_rand(&x);
+
+        size += fprintf(fp,
+            "/* computes the %s of the %s */\n"
+            "static unsigned long %s_%s%lu(const struct %s *%s, int %s_count)\n"
+            "{\n"
+            "    unsigned long result = %luUL;\n"
+            "    int i;\n"
+            "\n"
+            "    for (i = 0; i < %s_count; i++) {\n"
+            "        result = (result << %u) ^ %s[i].%s + 0x%08x;\n"
+            "        if (result > %u && %s[i].%s != '%c') {\n"
+            "            result -= %s_%s%lu(%s + 1, %s_count - 1) * %u.%ue%u;\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    return result != 0 ? result : (unsigned long) sizeof(\"%s %s\");\n"
+            "}\n"
+            "\n",
+            a, b, a, b, (unsigned long) i, b, b, a, (unsigned long) (r[0] % 100000),
+            a, r[0] % 13 + 1, b, a, r[1], r[2] % 65536, b, b, 'a' + r[2] % 26,
+            a, b, (unsigned long) (i != 0 ? i - 1 : 0), b, a, r[1] % 97, r[2] % 1000, r[0] % 9,
+            a, b);
+    }
+
+    return __corpus_finish__(fp, size);
+}
+
+
+/* a table of integers, sixteen a line, like those of generated resources */
+size_t corpus_table(const char *fn, size_t bytes)
+{
+    FILE *fp;
+    size_t size, i;
+    uint32_t x;
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        return 0;
+    }
+
+    size = fprintf(fp, "static const unsigned int table[] = {\n");
+
+    x = CORPUS_SEED;
+    for (i = 0; size < bytes; i++) {
+        bench_rand(&x);
+        size += (i & 1) ? fprintf(fp, "0x%08x,", x) : fprintf(fp, "%u,", x % 100000);
+        size += fprintf(fp, i % CORPUS_TABLE_COLUMNS == CORPUS_TABLE_COLUMNS - 1 ? "\n" : " ");
+    }
+
+    size += fprintf(fp, "0 };\n");
+    return __corpus_finish__(fp, size);
+}
+
+
+/* string literals of about length characters, with a few escapes */
+size_t corpus_strings(const char *fn, size_t bytes, size_t length)
+{
+    static const char *escapes[] = { "\\n", "\\t", "\\\"", "\\\\", "\\x41", "\\101" };
+    FILE *fp;
+    size_t size, i, j;
+    uint32_t x;
+    int ch;
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        return 0;
+    }
+
+    x = CORPUS_SEED;
+    size = 0;
+
+    for (i = 0; size < bytes; i++) {
+        size += fprintf(fp, "static const char s%lu[] = \"", (unsigned long) i);
+
+        for (j = 0; j < length; j++) {
+            bench_rand(&x);
+            if (x % 61 == 0) {
+                size += fprintf(fp, "%s", escapes[(x >> 8) % (sizeof(escapes) / sizeof(escapes[0]))]);
+                continue;
+            }
+
+            ch = ' ' + (x >> 8) % 95;
+            fputc(ch == '"' || ch == '\\' ? '_' : ch, fp);
+            size++;
+        }
+
+        size += fprintf(fp, "\";\n");
+    }
+
+    return __corpus_finish__(fp, size);
+}
+
+
+/**
+ * Lines of the kind macro metaprogramming libraries are made of: chains
+ * of function-like macros doubling their expansion, pasting, stringizing,
+ * variadic selection, deferred calls rescanned by EVAL, and long chains
+ * of object-like macros.
+ **/
+size_t corpus_macros(const char *fn, size_t lines)
+{
+    FILE *fp;
+    size_t size, i;
+
+    if ((fp = fopen(fn, "wb")) == NULL) {
+        return 0;
+    }
+
+    size = fprintf(fp,
+        "#define CAT(a, b) CAT_(a, b)\n"
+        "#define CAT_(a, b) a ## b\n"
+        "#define STR(x) STR_(x)\n"
+        "#define STR_(x) #x\n"
+        "#define FIRST(a, ...) a\n"
+        "#define REST(a, ...) __VA_ARGS__\n"
+        "#define APPLY(m, ...) m(__VA_ARGS__)\n"
+        "#define EMPTY()\n"
+        "#define DEFER(m) m EMPTY()\n"
+        "#define EVAL(...) EVAL1(EVAL1(EVAL1(__VA_ARGS__)))\n"
+        "#define EVAL1(...) EVAL2(EVAL2(__VA_ARGS__))\n"
+        "#define EVAL2(...) __VA_ARGS__\n"
+        "#define ADD(a, b) ((a) + (b))\n"
+        "#define SUM3(a, b, c) ADD(ADD(a, b), c)\n"
+        "#define TWICE0(x) (x)\n");
+
+    for (i = 1; i <= CORPUS_TWICE_DEPTH; i++) {
+        size += fprintf(fp, "#define TWICE%lu(x) TWICE%lu(x) + TWICE%lu(x)\n",
+                        (unsigned long) i, (unsigned long) i - 1, (unsigned long) i - 1);
+    }
+
+    size += fprintf(fp, "#define OBJ0 0\n");
+    for (i = 1; i < CORPUS_OBJECT_CHAIN; i++) {
+        size += fprintf(fp, "#define OBJ%lu OBJ%lu + %lu\n",
+                        (unsigned long) i, (unsigned long) i - 1, (unsigned long) i);
+    }
+
+    for (i = 0; i < lines; i++) {
+        switch (i % 5) {
+        case 0:
+            size += fprintf(fp, "int CAT(v, %lu) = TWICE%d(%lu);\n",
+                            (unsigned long) i, CORPUS_TWICE_DEPTH, (unsigned long) i);
+            break;
+        case 1:
+            size += fprintf(fp, "const char *CAT(s, %lu) = STR(CAT(name_, %lu) FIRST(a, b, c));\n",
+                            (unsigned long) i, (unsigned long) i);
+            break;
+        case 2:
+            size += fprintf(fp, "int CAT(w, %lu) = EVAL(APPLY(SUM3, %lu, REST(0, 1, 2)));\n",
+                            (unsigned long) i, (unsigned long) i);
+            break;
+        case 3:
+            size += fprintf(fp, "int CAT(u, %lu) = EVAL(DEFER(ADD)(%lu, TWICE2(1)));\n",
+                            (unsigned long) i, (unsigned long) i);
+            break;
+        default:
+            size += fprintf(fp, "int CAT(o, %lu) = OBJ%d;\n",
+                            (unsigned long) i, CORPUS_OBJECT_CHAIN - 1);
+            break;
+        }
+    }
+
+    return __corpus_finish__(fp, size);
+}
+
+
+static size_t __corpus_header__(cstring_t dir, size_t level, size_t index,
+                                size_t depth, size_t width)
+{
+    char name[64];
+    cstring_t fn;
+    FILE *fp;
+    size_t size, i;
+
+    sprintf(name, "h%lu_%lu.h", (unsigned long) level, (unsigned long) index);
+    fn = corpus_path(dir, name);
+    fp = fopen(fn, "wb");
+    cstring_free(fn);
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    /* half of them guarded by #ifndef, the other half by #if !defined */
+    size = fprintf(fp, (index & 1) ? "#if !defined(H%lu_%lu)\n#define H%lu_%lu\n"
+                                   : "#ifndef H%lu_%lu\n#define H%lu_%lu\n",
+                   (unsigned long) level, (unsigned long) index,
+                   (unsigned long) level, (unsigned long) index);
+
+    if (level + 1 < depth) {
+        for (i = 0; i < width; i++) {
+            size += fprintf(fp, "#include \"h%lu_%lu.h\"\n", (unsigned long) level + 1, (unsigned long) i);
+        }
+    }
+
+    size += fprintf(fp,
+        "#define LEVEL%lu_%lu %lu\n"
+        "struct s%lu_%lu { int %s; unsigned long %s[LEVEL%lu_%lu + 1]; };\n"
+        "extern struct s%lu_%lu *%s_%lu_%lu(const char *%s, int);\n",
+        (unsigned long) level, (unsigned long) index, (unsigned long) level,
+        (unsigned long) level, (unsigned long) index,
+        words[index % CORPUS_NWORDS], words[(index + level + 1) % CORPUS_NWORDS],
+        (unsigned long) level, (unsigned long) index,
+        (unsigned long) level, (unsigned long) index, words[(level + index) % CORPUS_NWORDS],
+        (unsigned long) level, (unsigned long) index, words[index % CORPUS_NWORDS]);
+
+    size += fprintf(fp, "#endif\n");
+
+    return __corpus_finish__(fp, size);
+}
+
+
+/**
+ * A main file including every header of the first of depth levels of
+ * width headers, each of which includes every header of the next level,
+ * so that most #include directives find a header already included.
+ **/
+size_t corpus_include_dag(cstring_t dir, const char *name, size_t depth, size_t width)
+{
+    cstring_t fn;
+    FILE *fp;
+    size_t size, n, level, i;
+
+    size = 0;
+    for (level = 0; level < depth; level++) {
+        for (i = 0; i < width; i++) {
+            if ((n = __corpus_header__(dir, level, i, depth, width)) == 0) {
+                return 0;
+            }
+            size += n;
+        }
+    }
+
+    fn = corpus_path(dir, name);
+    fp = fopen(fn, "wb");
+    cstring_free(fn);
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < width; i++) {
+        size += fprintf(fp, "#include \"h0_%lu.h\"\n", (unsigned long) i);
+    }
+
+    size += fprintf(fp, "int main(void) { return LEVEL%lu_0; }\n", (unsigned long) depth - 1);
+
+    return __corpus_finish__(fp, size);
+}
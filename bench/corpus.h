@@ -0,0 +1,28 @@
+
+
+#ifndef __CORPUS__H__
+#define __CORPUS__H__
+
+
+#include "config.h"
+#include "cstring.h"
+
+
+/**
+ * Synthetic sources for the benchmarks. They are generated from a fixed
+ * seed, so that every run and every machine measures the same input.
+ * The generators write into a temporary directory made by corpus_open()
+ * and return the size of what they wrote, 0 when it could not be written.
+ **/
+cstring_t corpus_open(void);
+void corpus_close(cstring_t dir);
+cstring_t corpus_path(cstring_t dir, const char *name);
+
+size_t corpus_flat(const char *fn, size_t bytes);
+size_t corpus_table(const char *fn, size_t bytes);
+size_t corpus_strings(const char *fn, size_t bytes, size_t length);
+size_t corpus_macros(const char *fn, size_t lines);
+size_t corpus_include_dag(cstring_t dir, const char *name, size_t depth, size_t width);
+
+
+#endif
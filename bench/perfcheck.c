@@ -0,0 +1,700 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "array.h"
+
+#include <math.h>
+
+#if defined(UNIX)
+#   include <unistd.h>
+#   include <sys/utsname.h>
+#elif defined(WINDOWS)
+#   define popen    _popen
+#   define pclose   _pclose
+#endif
+
+
+/**
+ * Runs the benchmark binaries several times, takes the median and the
+ * median absolute deviation of the ns_per_op of every benchmark, and
+ * compares the medians with a baseline:
+ *
+ *     {"context": {...}, "tolerance": 0.25, "benchmarks": [
+ *         {"suite": "lexer", "name": "flat", "ns_per_op": 250.9, "tolerance": 0.3}]}
+ *
+ * A benchmark regresses when its median is more than its tolerance, or
+ * the default one, slower than the baseline, and the exit status is then
+ * 1. With -u, the baseline is written from the medians instead.
+ **/
+
+
+#define PERF_RUNS               5
+#define PERF_TOLERANCE          0.25
+#define PERF_NOISE_FACTOR       3.0
+#define PERF_NAME_SIZE          64
+#define PERF_CONTEXT_SIZE       256
+
+
+typedef struct perf_entry_s {
+    char suite[PERF_NAME_SIZE];
+    char name[PERF_NAME_SIZE];
+    double ns_per_op;
+    double tolerance;
+} perf_entry_t;
+
+
+typedef struct perf_result_s {
+    char suite[PERF_NAME_SIZE];
+    char name[PERF_NAME_SIZE];
+    array_t *samples;
+    double median;
+    double mad;
+} perf_result_t;
+
+
+typedef struct perf_context_s {
+    char cpu[PERF_CONTEXT_SIZE];
+    char system[PERF_CONTEXT_SIZE];
+    char compiler[PERF_CONTEXT_SIZE];
+    char flags[PERF_CONTEXT_SIZE];
+    long cores;
+} perf_context_t;
+
+
+typedef struct perf_parser_s {
+    array_t *entries;
+    double tolerance;
+    char cpu[PERF_CONTEXT_SIZE];
+    char flags[PERF_CONTEXT_SIZE];
+} perf_parser_t;
+
+
+static const char* __parse_value__(const char *p, perf_parser_t *ps, const char *suite);
+
+
+static const char* __skip__(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+
+    return p;
+}
+
+
+/* escapes other than \" and \\ are not written by the benchmarks, they are kept as is */
+static const char* __parse_string__(const char *p, char *buf, size_t size)
+{
+    size_t n;
+
+    if (*p++ != '"') {
+        return NULL;
+    }
+
+    for (n = 0; *p != '"'; p++) {
+        if (*p == '\0') {
+            return NULL;
+        }
+
+        if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+            p++;
+        }
+
+        if (n + 1 < size) {
+            buf[n++] = *p;
+        }
+    }
+
+    buf[n] = '\0';
+    return p + 1;
+}
+
+
+static const char* __parse_object__(const char *p, perf_parser_t *ps, const char *suite)
+{
+    perf_entry_t e;
+    char key[PERF_NAME_SIZE];
+    bool named;
+
+    memset(&e, 0, sizeof(e));
+    strcpy(e.suite, suite);
+    e.ns_per_op = -1;
+    e.tolerance = -1;
+    named = false;
+
+    p = __skip__(p + 1);
+    while (*p != '}') {
+        if ((p = __parse_string__(p, key, sizeof(key))) == NULL) {
+            return NULL;
+        }
+
+        p = __skip__(p);
+        if (*p++ != ':') {
+            return NULL;
+        }
+        p = __skip__(p);
+
+        if (*p == '"' && strcmp(key, "suite") == 0) {
+            p = __parse_string__(p, e.suite, sizeof(e.suite));
+        } else if (*p == '"' && strcmp(key, "name") == 0) {
+            p = __parse_string__(p, e.name, sizeof(e.name));
+            named = true;
+        } else if (*p == '"' && strcmp(key, "cpu") == 0) {
+            p = __parse_string__(p, ps->cpu, sizeof(ps->cpu));
+        } else if (*p == '"' && strcmp(key, "flags") == 0) {
+            p = __parse_string__(p, ps->flags, sizeof(ps->flags));
+        } else if (strcmp(key, "ns_per_op") == 0) {
+            e.ns_per_op = strtod(p, (char**) &p);
+        } else if (strcmp(key, "tolerance") == 0) {
+            e.tolerance = strtod(p, (char**) &p);
+        } else {
+            /* nested objects take the suite of the object they are in */
+            p = __parse_value__(p, ps, e.suite);
+        }
+
+        if (p == NULL) {
+            return NULL;
+        }
+
+        p = __skip__(p);
+        if (*p == ',') {
+            p = __skip__(p + 1);
+        } else if (*p != '}') {
+            return NULL;
+        }
+    }
+
+    if (named && e.ns_per_op >= 0) {
+        array_cast_append(perf_entry_t, ps->entries, e);
+    } else if (!named && e.tolerance >= 0) {
+        ps->tolerance = e.tolerance;
+    }
+
+    return p + 1;
+}
+
+
+static const char* __parse_value__(const char *p, perf_parser_t *ps, const char *suite)
+{
+    char buf[PERF_CONTEXT_SIZE];
+    const char *end;
+
+    switch (*p) {
+    case '{':
+        return __parse_object__(p, ps, suite);
+
+    case '[':
+        p = __skip__(p + 1);
+        while (*p != ']') {
+            if ((p = __parse_value__(p, ps, suite)) == NULL) {
+                return NULL;
+            }
+
+            p = __skip__(p);
+            if (*p == ',') {
+                p = __skip__(p + 1);
+            } else if (*p != ']') {
+                return NULL;
+            }
+        }
+        return p + 1;
+
+    case '"':
+        return __parse_string__(p, buf, sizeof(buf));
+
+    default:
+        for (end = p; isalnum((unsigned char) *end) || *end == '-' || *end == '+' || *end == '.'; end++) {
+            /* numbers, true, false and null */
+        }
+        return end != p ? end : NULL;
+    }
+}
+
+
+/* returns the benchmarks of a document, NULL when it is not JSON */
+static array_t* __parse__(const char *doc, perf_parser_t *ps)
+{
+    const char *p;
+
+    ps->entries = array_create_n(sizeof(perf_entry_t), 16);
+    ps->tolerance = PERF_TOLERANCE;
+    ps->cpu[0] = '\0';
+    ps->flags[0] = '\0';
+
+    p = __skip__(doc);
+    if (*p != '{' || (p = __parse_value__(p, ps, "")) == NULL) {
+        array_destroy(ps->entries);
+        return NULL;
+    }
+
+    return ps->entries;
+}
+
+
+static cstring_t __read_file__(const char *fn)
+{
+    char buf[4096];
+    cstring_t cs;
+    FILE *fp;
+    size_t n;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        return NULL;
+    }
+
+    cs = cstring_new_n(NULL, sizeof(buf));
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        cs = cstring_concat_n(cs, buf, n);
+    }
+
+    fclose(fp);
+    return cs;
+}
+
+
+/* the output of a benchmark binary, NULL when it failed */
+static cstring_t __run__(const char *bench)
+{
+    char buf[4096];
+    cstring_t cs;
+    FILE *fp;
+    size_t n;
+
+    if ((fp = popen(bench, "r")) == NULL) {
+        return NULL;
+    }
+
+    cs = cstring_new_n(NULL, sizeof(buf));
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        cs = cstring_concat_n(cs, buf, n);
+    }
+
+    if (pclose(fp) != 0) {
+        cstring_free(cs);
+        return NULL;
+    }
+
+    return cs;
+}
+
+
+static perf_result_t* __find_result__(array_t *results, const char *suite, const char *name)
+{
+    perf_result_t *r;
+    size_t i;
+
+    array_foreach(results, r, i) {
+        if (strcmp(r[i].suite, suite) == 0 && strcmp(r[i].name, name) == 0) {
+            return &r[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static perf_entry_t* __find_entry__(array_t *entries, const char *suite, const char *name)
+{
+    perf_entry_t *e;
+    size_t i;
+
+    array_foreach(entries, e, i) {
+        if (strcmp(e[i].suite, suite) == 0 && strcmp(e[i].name, name) == 0) {
+            return &e[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static int __compare_double__(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+
+static double __median__(double *v, size_t n)
+{
+    qsort(v, n, sizeof(double), __compare_double__);
+    return n & 1 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+static void __summarize__(perf_result_t *r)
+{
+    double *v, *dev;
+    size_t n, i;
+
+    v = array_prototype(r->samples, double);
+    n = array_length(r->samples);
+
+    r->median = __median__(v, n);
+
+    dev = pmalloc(sizeof(double) * n);
+    for (i = 0; i < n; i++) {
+        dev[i] = fabs(v[i] - r->median);
+    }
+
+    r->mad = __median__(dev, n);
+    pfree(dev);
+}
+
+
+/**
+ * The compiler and the flags are those the build passed for the benchmark
+ * binaries, the ones of perfcheck itself otherwise.
+ **/
+static void __context__(perf_context_t *ctx)
+{
+    char line[PERF_CONTEXT_SIZE];
+    char *p;
+    FILE *fp;
+
+    strcpy(ctx->cpu, "unknown");
+    strcpy(ctx->system, "unknown");
+    strcpy(ctx->compiler, "unknown");
+    strcpy(ctx->flags, "unknown");
+    ctx->cores = 0;
+
+#if defined(UNIX)
+    {
+        struct utsname uts;
+
+        if (uname(&uts) == 0) {
+            snprintf(ctx->system, sizeof(ctx->system), "%s %s %s",
+                     uts.sysname, uts.release, uts.machine);
+        }
+
+        ctx->cores = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+#endif
+
+    if ((fp = fopen("/proc/cpuinfo", "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (strncmp(line, "model name", 10) == 0 && (p = strchr(line, ':')) != NULL) {
+                for (p++; *p == ' ' || *p == '\t'; p++) {
+                    /* skips the blanks after the colon */
+                }
+                p[strcspn(p, "\r\n")] = '\0';
+                snprintf(ctx->cpu, sizeof(ctx->cpu), "%s", p);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+#if defined(PERF_COMPILER)
+    snprintf(ctx->compiler, sizeof(ctx->compiler), "%s", PERF_COMPILER);
+#elif defined(__clang__)
+    snprintf(ctx->compiler, sizeof(ctx->compiler), "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+    snprintf(ctx->compiler, sizeof(ctx->compiler), "gcc %s", __VERSION__);
+#elif defined(_MSC_VER)
+    snprintf(ctx->compiler, sizeof(ctx->compiler), "msvc %d", _MSC_VER);
+#endif
+
+#if defined(PERF_FLAGS)
+    snprintf(ctx->flags, sizeof(ctx->flags), "%s", PERF_FLAGS);
+#endif
+
+    /* the strings go into JSON as they are */
+    for (p = ctx->cpu; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            *p = '_';
+        }
+    }
+}
+
+
+static void __write_context__(FILE *fp, perf_context_t *ctx, size_t runs)
+{
+    fprintf(fp, "  \"context\": {\"cpu\": \"%s\", \"cores\": %ld, \"system\": \"%s\", "
+                "\"compiler\": \"%s\", \"flags\": \"%s\", \"runs\": %lu},\n",
+            ctx->cpu, ctx->cores, ctx->system, ctx->compiler, ctx->flags, (unsigned long) runs);
+}
+
+
+/**
+ * New benchmarks get the default tolerance, or three times their relative
+ * deviation when they are noisier than that; the others keep theirs.
+ **/
+static int __update__(const char *fn, array_t *results, array_t *baseline, double tolerance,
+                      perf_context_t *ctx, size_t runs)
+{
+    perf_result_t *r;
+    perf_entry_t *e;
+    double tol;
+    FILE *fp;
+    size_t i;
+
+    if ((fp = fopen(fn, "w")) == NULL) {
+        fprintf(stderr, "perfcheck: cannot write '%s'\n", fn);
+        return 2;
+    }
+
+    fprintf(fp, "{\n");
+    __write_context__(fp, ctx, runs);
+    fprintf(fp, "  \"tolerance\": %.2f,\n  \"benchmarks\": [", tolerance);
+
+    array_foreach(results, r, i) {
+        e = baseline != NULL ? __find_entry__(baseline, r[i].suite, r[i].name) : NULL;
+
+        if (e != NULL && e->tolerance >= 0) {
+            tol = e->tolerance;
+        } else if (r[i].median > 0 && PERF_NOISE_FACTOR * r[i].mad / r[i].median > tolerance) {
+            tol = PERF_NOISE_FACTOR * r[i].mad / r[i].median;
+        } else {
+            tol = -1;
+        }
+
+        fprintf(fp, "%s\n    {\"suite\": \"%s\", \"name\": \"%s\", \"ns_per_op\": %.3f",
+                i == 0 ? "" : ",", r[i].suite, r[i].name, r[i].median);
+        if (tol >= 0) {
+            fprintf(fp, ", \"tolerance\": %.2f", tol);
+        }
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "perfcheck: cannot write '%s'\n", fn);
+        return 2;
+    }
+
+    printf("perfcheck: wrote %lu benchmarks to %s\n", (unsigned long) array_length(results), fn);
+    return 0;
+}
+
+
+/* prints a table, writes the report if any and returns the number of regressions */
+static size_t __compare__(FILE *report, array_t *results, array_t *baseline, double tolerance)
+{
+    const char *status;
+    perf_result_t *r;
+    perf_entry_t *e;
+    double tol, change;
+    size_t i, regressions;
+
+    regressions = 0;
+
+    printf("%-14s %-22s %12s %10s %12s %8s  %s\n",
+           "suite", "benchmark", "median ns", "mad", "baseline", "change", "status");
+
+    if (report != NULL) {
+        fprintf(report, "  \"results\": [");
+    }
+
+    array_foreach(results, r, i) {
+        e = __find_entry__(baseline, r[i].suite, r[i].name);
+        tol = e != NULL && e->tolerance >= 0 ? e->tolerance : tolerance;
+        change = e != NULL && e->ns_per_op > 0 ? r[i].median / e->ns_per_op - 1 : 0;
+
+        if (e == NULL) {
+            status = "new";
+        } else if (change > tol) {
+            status = "regressed";
+            regressions++;
+        } else if (change < -tol) {
+            status = "faster";
+        } else {
+            status = "ok";
+        }
+
+        printf("%-14s %-22s %12.3f %10.3f %12.3f %+7.1f%%  %s\n",
+               r[i].suite, r[i].name, r[i].median, r[i].mad,
+               e != NULL ? e->ns_per_op : 0.0, change * 100, status);
+
+        if (report != NULL) {
+            fprintf(report, "%s\n    {\"suite\": \"%s\", \"name\": \"%s\", \"median\": %.3f, "
+                            "\"mad\": %.3f, \"baseline\": %.3f, \"tolerance\": %.2f, "
+                            "\"change\": %.4f, \"status\": \"%s\"}",
+                    i == 0 ? "" : ",", r[i].suite, r[i].name, r[i].median, r[i].mad,
+                    e != NULL ? e->ns_per_op : 0.0, tol, change, status);
+        }
+    }
+
+    /* a benchmark that went away can hide a regression, it has to be removed from the baseline */
+    array_foreach(baseline, e, i) {
+        if (__find_result__(results, e[i].suite, e[i].name) == NULL) {
+            printf("%-14s %-22s %12s %10s %12.3f %8s  %s\n",
+                   e[i].suite, e[i].name, "-", "-", e[i].ns_per_op, "-", "missing");
+            if (report != NULL) {
+                fprintf(report, ",\n    {\"suite\": \"%s\", \"name\": \"%s\", \"baseline\": %.3f, "
+                                "\"status\": \"missing\"}",
+                        e[i].suite, e[i].name, e[i].ns_per_op);
+            }
+            regressions++;
+        }
+    }
+
+    if (report != NULL) {
+        fprintf(report, "\n  ]\n}\n");
+    }
+
+    return regressions;
+}
+
+
+static void __usage__(void)
+{
+    fprintf(stderr,
+        "usage: perfcheck [-r runs] [-b baseline.json] [-o report.json] [-u] bench...\n"
+        "  -r runs    runs of every benchmark binary (default %d)\n"
+        "  -b file    the baseline to compare with, or to write with -u\n"
+        "  -o file    where to write the JSON report (default none)\n"
+        "  -u         write the baseline from this run instead of comparing\n",
+        PERF_RUNS);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *baseline_fn, *report_fn;
+    perf_parser_t ps;
+    perf_context_t ctx;
+    perf_result_t *r, result;
+    perf_entry_t *e;
+    array_t *results, *baseline, *entries;
+    cstring_t doc;
+    FILE *report;
+    size_t runs, run, regressions, i;
+    double tolerance;
+    bool update;
+    int argi, status;
+
+    runs = PERF_RUNS;
+    baseline_fn = NULL;
+    report_fn = NULL;
+    update = false;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-r") == 0 && argi + 1 < argc) {
+            runs = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-b") == 0 && argi + 1 < argc) {
+            baseline_fn = argv[++argi];
+        } else if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc) {
+            report_fn = argv[++argi];
+        } else if (strcmp(argv[argi], "-u") == 0) {
+            update = true;
+        } else {
+            __usage__();
+            return 2;
+        }
+    }
+
+    if (argi == argc || runs == 0 || baseline_fn == NULL) {
+        __usage__();
+        return 2;
+    }
+
+    tolerance = PERF_TOLERANCE;
+    baseline = NULL;
+
+    if ((doc = __read_file__(baseline_fn)) != NULL) {
+        baseline = __parse__(doc, &ps);
+        tolerance = ps.tolerance;
+        cstring_free(doc);
+
+        if (baseline == NULL) {
+            fprintf(stderr, "perfcheck: '%s' is not a baseline\n", baseline_fn);
+            return 2;
+        }
+    } else if (!update) {
+        fprintf(stderr, "perfcheck: cannot read '%s'\n", baseline_fn);
+        return 2;
+    }
+
+    __context__(&ctx);
+    if (baseline != NULL && !update && ps.cpu[0] != '\0' && strcmp(ps.cpu, ctx.cpu) != 0) {
+        fprintf(stderr, "perfcheck: warning: the baseline was measured on '%s', this is '%s'\n",
+                ps.cpu, ctx.cpu);
+    }
+    if (baseline != NULL && !update && ps.flags[0] != '\0' && strcmp(ps.flags, ctx.flags) != 0) {
+        fprintf(stderr, "perfcheck: warning: the baseline was built with '%s', this with '%s'\n",
+                ps.flags, ctx.flags);
+    }
+
+    results = array_create_n(sizeof(perf_result_t), 32);
+
+    for (; argi < argc; argi++) {
+        for (run = 0; run < runs; run++) {
+            fprintf(stderr, "perfcheck: %s (%lu/%lu)\n", argv[argi],
+                    (unsigned long) run + 1, (unsigned long) runs);
+
+            if ((doc = __run__(argv[argi])) == NULL) {
+                fprintf(stderr, "perfcheck: '%s' failed\n", argv[argi]);
+                return 2;
+            }
+
+            entries = __parse__(doc, &ps);
+            cstring_free(doc);
+
+            if (entries == NULL) {
+                fprintf(stderr, "perfcheck: '%s' did not write JSON\n", argv[argi]);
+                return 2;
+            }
+
+            array_foreach(entries, e, i) {
+                if ((r = __find_result__(results, e[i].suite, e[i].name)) == NULL) {
+                    memset(&result, 0, sizeof(result));
+                    strcpy(result.suite, e[i].suite);
+                    strcpy(result.name, e[i].name);
+                    result.samples = array_create_n(sizeof(double), runs);
+                    array_cast_append(perf_result_t, results, result);
+                    r = &array_cast_back(perf_result_t, results);
+                }
+
+                array_cast_append(double, r->samples, e[i].ns_per_op);
+            }
+
+            array_destroy(entries);
+        }
+    }
+
+    array_foreach(results, r, i) {
+        __summarize__(&r[i]);
+    }
+
+    if (update) {
+        status = __update__(baseline_fn, results, baseline, tolerance, &ctx, runs);
+    } else {
+        report = NULL;
+        if (report_fn != NULL) {
+            if ((report = fopen(report_fn, "w")) == NULL) {
+                fprintf(stderr, "perfcheck: cannot write '%s'\n", report_fn);
+                return 2;
+            }
+
+            fprintf(report, "{\n");
+            __write_context__(report, &ctx, runs);
+        }
+
+        regressions = __compare__(report, results, baseline, tolerance);
+
+        if (report != NULL) {
+            fclose(report);
+        }
+
+        if (regressions != 0) {
+            printf("perfcheck: %lu regression(s)\n", (unsigned long) regressions);
+        }
+
+        status = regressions != 0 ? 1 : 0;
+    }
+
+    array_foreach(results, r, i) {
+        array_destroy(r[i].samples);
+    }
+    array_destroy(results);
+
+    if (baseline != NULL) {
+        array_destroy(baseline);
+    }
+
+    return status;
+}
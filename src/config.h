@@ -27,6 +27,16 @@
 #endif
 
 
+/* a variable of its own in each thread */
+#if defined(_MSC_VER)
+#   define THREAD_LOCAL     __declspec(thread)
+#elif defined(__GNUC__)
+#   define THREAD_LOCAL     __thread
+#else
+#   define THREAD_LOCAL
+#endif
+
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
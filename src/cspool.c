@@ -1,11 +1,50 @@
 
 
 #include "config.h"
+#include "pmalloc.h"
+#include "array.h"
 #include "dict.h"
 #include "cspool.h"
 #include "cstring.h"
 
 
+#if defined(UNIX)
+#   define __cspool_lock_init__(lock)       pthread_rwlock_init((lock), NULL)
+#   define __cspool_lock_destroy__(lock)    pthread_rwlock_destroy(lock)
+#   define __cspool_read_lock__(lock)       pthread_rwlock_rdlock(lock)
+#   define __cspool_read_unlock__(lock)     pthread_rwlock_unlock(lock)
+#   define __cspool_write_lock__(lock)      pthread_rwlock_wrlock(lock)
+#   define __cspool_write_unlock__(lock)    pthread_rwlock_unlock(lock)
+#elif defined(WINDOWS)
+#   define __cspool_lock_init__(lock)       InitializeSRWLock(lock)
+#   define __cspool_lock_destroy__(lock)
+#   define __cspool_read_lock__(lock)       AcquireSRWLockShared(lock)
+#   define __cspool_read_unlock__(lock)     ReleaseSRWLockShared(lock)
+#   define __cspool_write_lock__(lock)      AcquireSRWLockExclusive(lock)
+#   define __cspool_write_unlock__(lock)    ReleaseSRWLockExclusive(lock)
+#else
+#   define __cspool_lock_init__(lock)
+#   define __cspool_lock_destroy__(lock)
+#   define __cspool_read_lock__(lock)
+#   define __cspool_read_unlock__(lock)
+#   define __cspool_write_lock__(lock)
+#   define __cspool_write_unlock__(lock)
+#endif
+
+
+/* strings at least this long are kept in their own allocation */
+#define CSPOOL_LARGE_STRING     (CSPOOL_CHUNK_SIZE / 4)
+
+
+#define __cspool_align__(n) \
+    (((n) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+
+
+static inline size_t __cspool_shard_index__(const unsigned char *s, size_t n);
+static cstring_t __cspool_intern__(cspool_t *pool, const char *s, size_t n, cstring_t cs);
+static cstring_t __cspool_store__(cspool_shard_t *shard, const char *s, size_t n, cstring_t cs);
+
+
 static inline
 uint64_t __hash_fn__(const void *key)
 {
@@ -21,70 +60,168 @@ int __compare_fn__(void *privdata, const void *key1, const void *key2)
 }
 
 
-static inline
-void __free_fn__(void *privdata, void *val) {
-    DICT_NOTUSED(privdata);
-    cstring_free((cstring_t)val);
-}
-
-
+/* the keys live in the chunks of their shard */
 dict_type_t __cspool_dict_type__ = {
     __hash_fn__,
     NULL,
     NULL,
     __compare_fn__,
-    __free_fn__,
+    NULL,
     NULL
 };
 
 
 cspool_t* cspool_create(void)
 {
-    cspool_t *pool = (cspool_t *)pmalloc(sizeof(cspool_t));
-    pool->d = dict_create(&__cspool_dict_type__, NULL);
+    cspool_t *pool;
+    size_t i;
+
+    pool = (cspool_t *)pmalloc(sizeof(cspool_t));
+
+    for (i = 0; i < CSPOOL_SHARDS; i++) {
+        __cspool_lock_init__(&pool->shards[i].lock);
+        pool->shards[i].d = dict_create(&__cspool_dict_type__, NULL);
+        pool->shards[i].chunks = NULL;
+        pool->shards[i].adopted = array_create_n(sizeof(cstring_t), 4);
+    }
+
     return pool;
 }
 
 
 void cspool_destroy(cspool_t *pool)
 {
-    dict_destroy(pool->d);
+    cspool_shard_t *shard;
+    cspool_chunk_t *chunk, *next;
+    cstring_t *adopted;
+    size_t i, j;
+
+    for (i = 0; i < CSPOOL_SHARDS; i++) {
+        shard = &pool->shards[i];
+
+        for (chunk = shard->chunks; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            pfree(chunk);
+        }
+
+        array_foreach(shard->adopted, adopted, j) {
+            cstring_free(adopted[j]);
+        }
+
+        array_destroy(shard->adopted);
+        dict_destroy(shard->d);
+        __cspool_lock_destroy__(&shard->lock);
+    }
+
     pfree(pool);
 }
 
 
 cstring_t cspool_push(cspool_t *pool, const char *s)
 {
-    void *ret;
-    dict_entry_t *entry;
+    return __cspool_intern__(pool, s, strlen(s), NULL);
+}
+
+
+cstring_t cspool_push_cs(cspool_t *pool, cstring_t cs)
+{
+    return __cspool_intern__(pool, (const char*) cs, cstring_length(cs), cs);
+}
 
-    entry = dict_add_or_find(pool->d, (void*)s);
-    if (!entry) {
-        return NULL;
+
+/**
+ * Other threads may still hold the string, it stays interned until the
+ * pool is destroyed so that a later push gives the same pointer back.
+ **/
+void cspool_pop(cspool_t *pool, const char *key)
+{
+    (void) pool;
+    (void) key;
+}
+
+
+size_t cspool_length(cspool_t *pool)
+{
+    cspool_shard_t *shard;
+    size_t i, n = 0;
+
+    for (i = 0; i < CSPOOL_SHARDS; i++) {
+        shard = &pool->shards[i];
+        __cspool_read_lock__(&shard->lock);
+        n += dict_length(shard->d);
+        __cspool_read_unlock__(&shard->lock);
+    }
+
+    return n;
+}
+
+
+/**
+ * Picks the shard from the length and the first and last bytes, cheap
+ * enough to not hash the whole string a second time for long ones.
+ **/
+static inline
+size_t __cspool_shard_index__(const unsigned char *s, size_t n)
+{
+    uint32_t h;
+    size_t i, m;
+
+    h = 2166136261u ^ (uint32_t) n;
+    m = n < 8 ? n : 8;
+
+    for (i = 0; i < m; i++) {
+        h = (h ^ s[i]) * 16777619u;
     }
 
-    ret = dict_get_key(entry);
-    if (ret == s) {
-        ret = cstring_new(s);
-        dict_set_key(pool->d, entry, ret);
+    for (i = n - m; i < n; i++) {
+        h = (h ^ s[i]) * 16777619u;
     }
 
-    return ret;
+    h ^= h >> 15;
+    return h & (CSPOOL_SHARDS - 1);
 }
 
 
-cstring_t cspool_push_cs(cspool_t *pool, cstring_t cs)
+static
+cstring_t __cspool_intern__(cspool_t *pool, const char *s, size_t n, cstring_t cs)
 {
-    cstring_t ret;
+    cspool_shard_t *shard;
     dict_entry_t *entry;
+    cstring_t ret = NULL;
+
+    shard = &pool->shards[__cspool_shard_index__((const unsigned char*) s, n)];
+
+    /**
+     * The dictionary never stays in the middle of a rehash once the write
+     * lock is released, so a lookup does not modify it.
+     **/
+    __cspool_read_lock__(&shard->lock);
+    entry = dict_find(shard->d, s);
+    if (entry != NULL) {
+        ret = dict_get_key(entry);
+    }
+    __cspool_read_unlock__(&shard->lock);
 
-    entry = dict_add_or_find(pool->d, cs);
-    if (!entry) {
-        return NULL;
+    if (ret == NULL) {
+        __cspool_write_lock__(&shard->lock);
+
+        entry = dict_add_or_find(shard->d, (void*) s);
+        if (entry != NULL) {
+            ret = dict_get_key(entry);
+            if (ret == (cstring_t) s) {
+                ret = __cspool_store__(shard, s, n, cs);
+                dict_set_key(shard->d, entry, ret);
+            }
+        }
+
+        while (dict_is_rehashing(shard->d)) {
+            dict_rehash(shard->d, 100);
+        }
+
+        __cspool_write_unlock__(&shard->lock);
     }
 
-    ret = dict_get_key(entry);
-    if (ret != cs) {
+    if (cs != NULL && ret != cs) {
         cstring_free(cs);
     }
 
@@ -92,7 +229,40 @@ cstring_t cspool_push_cs(cspool_t *pool, cstring_t cs)
 }
 
 
-void cspool_pop(cspool_t *pool, const char *key)
+static
+cstring_t __cspool_store__(cspool_shard_t *shard, const char *s, size_t n, cstring_t cs)
 {
-    dict_delete(pool->d, key);
+    cspool_chunk_t *chunk;
+    cstring_header_t *hdr;
+    size_t size;
+
+    if (n >= CSPOOL_LARGE_STRING) {
+        if (cs == NULL) {
+            cs = cstring_new_n(s, n);
+        }
+        *(cstring_t*) array_push_back(shard->adopted) = cs;
+        return cs;
+    }
+
+    size = __cspool_align__(sizeof(cstring_header_t) + n);
+
+    chunk = shard->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        chunk = pmalloc(CSPOOL_CHUNK_SIZE);
+        chunk->next = shard->chunks;
+        chunk->used = 0;
+        chunk->size = CSPOOL_CHUNK_SIZE - __cspool_align__(sizeof(cspool_chunk_t));
+        shard->chunks = chunk;
+    }
+
+    hdr = (cstring_header_t*) ((unsigned char*) chunk +
+        __cspool_align__(sizeof(cspool_chunk_t)) + chunk->used);
+    chunk->used += size;
+
+    hdr->length = n;
+    hdr->unused = 0;
+    memcpy(hdr->buffer, s, n);
+    hdr->buffer[n] = '\0';
+
+    return hdr->buffer;
 }
@@ -1,25 +1,73 @@
-
-
-#ifndef __CSPOOL__H__
-#define __CSPOOL__H__
-
-
-#include "config.h"
-#include "cstring.h"
-
-
-typedef struct dict_s dict_t;
-
-typedef struct cspool_s {
-    dict_t *d;
-} cspool_t;
-
-
-cspool_t* cspool_create(void);
-void cspool_destroy(cspool_t *pool);
-cstring_t cspool_push(cspool_t *pool, const char *s);
-cstring_t cspool_push_cs(cspool_t *pool, cstring_t cs);
-void cspool_pop(cspool_t *pool, const char *key);
-
-
-#endif
+
+
+#ifndef __CSPOOL__H__
+#define __CSPOOL__H__
+
+
+#include "config.h"
+#include "cstring.h"
+
+
+#if defined(UNIX)
+#   include <pthread.h>
+#elif defined(WINDOWS)
+#   include <Windows.h>
+#endif
+
+
+typedef struct dict_s  dict_t;
+typedef struct array_s array_t;
+
+
+#ifndef CSPOOL_SHARDS
+#define CSPOOL_SHARDS           16          /* a power of two */
+#endif
+
+#ifndef CSPOOL_CHUNK_SIZE
+#define CSPOOL_CHUNK_SIZE       (64 * 1024)
+#endif
+
+
+#if defined(UNIX)
+typedef pthread_rwlock_t cspool_lock_t;
+#elif defined(WINDOWS)
+typedef SRWLOCK cspool_lock_t;
+#else
+typedef int cspool_lock_t;
+#endif
+
+
+typedef struct cspool_chunk_s {
+    struct cspool_chunk_s *next;
+    size_t used;
+    size_t size;
+} cspool_chunk_t;
+
+
+typedef struct cspool_shard_s {
+    cspool_lock_t lock;
+    dict_t *d;
+    cspool_chunk_t *chunks;         /* the first one has room left */
+    array_t *adopted;               /* large strings, kept as they were pushed */
+} cspool_shard_t;
+
+
+/**
+ * Interned strings shared by every thread: lookups take the read lock of
+ * one shard, insertions its write lock. Strings are never moved nor freed
+ * before the pool, so their pointers can be compared across threads.
+ **/
+typedef struct cspool_s {
+    cspool_shard_t shards[CSPOOL_SHARDS];
+} cspool_t;
+
+
+cspool_t* cspool_create(void);
+void cspool_destroy(cspool_t *pool);
+cstring_t cspool_push(cspool_t *pool, const char *s);
+cstring_t cspool_push_cs(cspool_t *pool, cstring_t cs);
+void cspool_pop(cspool_t *pool, const char *key);
+size_t cspool_length(cspool_t *pool);
+
+
+#endif
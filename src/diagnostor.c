@@ -1,9 +1,13 @@
 
 
 #include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "array.h"
 #include "color.h"
 #include "token.h"
 #include "option.h"
+#include "encoding.h"
 #include "diagnostor.h"
 
 
@@ -26,7 +30,9 @@ int get_console_width() {
 	return csbi.srWindow.Right - csbi.srWindow.Left;
 #elif defined(UNIX)
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0) {
+        return 0;                   /* not a terminal, no line notes */
+    }
     return w.ws_col;
 #endif
     return 80;
@@ -41,13 +47,29 @@ int get_console_height() {
 	return csbi.srWindow.Bottom - csbi.srWindow.Top;
 #elif defined(UNIX)
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0) {
+        return 0;
+    }
     return w.ws_row;
 #endif
     return 25;
 }
 
 
+/**
+ * A diagnostor that writes is filled and written under the stdout lock so
+ * that diagnostics are never interleaved. A sink belongs to the thread of
+ * its stage and writes nothing, it needs no lock.
+ **/
+#if defined(UNIX)
+#   define __diagnostor_lock__(diag)        if (!(diag)->sink) flockfile(stdout)
+#   define __diagnostor_unlock__(diag)      if (!(diag)->sink) funlockfile(stdout)
+#else
+#   define __diagnostor_lock__(diag)
+#   define __diagnostor_unlock__(diag)
+#endif
+
+
 #ifndef MIN_LINE_LIMIT
 #define MIN_LINE_LIMIT  12
 #endif
@@ -56,14 +78,60 @@ int get_console_height() {
 diagnostor_t __diagnostor__ = {
     0,
     0,
+    0,
+    false,
+    false,
+    false,
+    false,
+    -1,
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    0,
 };
 
-diagnostor_t* diagnostor = &__diagnostor__;
-
-
-static void __write_linenote__(const unsigned char *linenote, size_t outputed, size_t width);
-static void __write_linenote_caution__(diagnostor_level_t level, linenote_t linenote,
-                                       size_t start, size_t length, size_t width);
+THREAD_LOCAL diagnostor_t* diagnostor = &__diagnostor__;
+
+
+static const char *__json_levels__[] = { "none", "note", "warning", "error", "fatal" };
+static const char *__sarif_levels__[] = { "none", "note", "warning", "error", "error" };
+
+static const char __sarif_head__[] =
+    "{\"version\":\"2.1.0\","
+    "\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\","
+    "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"xcc\"}},\"results\":[";
+
+
+static void __diagnostor_prepare__(diagnostor_t *diag);
+static void __diagnostor_atexit__(void);
+static int __diagnostor_width__(diagnostor_t *diag);
+static void __diagnostor_note__(diagnostor_t *diag, diagnostor_level_t level, const char *fn,
+                                size_t line, size_t column, linenote_t linenote,
+                                linenote_caution_t *linenote_caution, bool limited,
+                                const char *fmt, va_list args);
+static void __diagnostor_add__(diagnostor_t *diag, diagnostic_t *d, const char *fn,
+                               const unsigned char *message, size_t n, linenote_t linenote);
+static uint64_t __diagnostor_hash__(const unsigned char *key, size_t n);
+static bool __diagnostor_seen__(diagnostor_t *diag, const unsigned char *key, size_t n);
+static void __diagnostor_push__(diagnostor_t *diag, diagnostic_t *d);
+static uint32_t __diagnostor_copy__(diagnostor_t *diag, const void *data, size_t n);
+static uint32_t __diagnostor_copy_filename__(diagnostor_t *diag, const char *fn);
+static uint32_t __diagnostor_copy_linenote__(diagnostor_t *diag, linenote_t linenote, size_t start);
+static void __diagnostor_close_sarif__(diagnostor_t *diag);
+static cstring_t __render__(diagnostor_t *diag, cstring_t out, diagnostic_t *d);
+static cstring_t __render_json__(diagnostor_t *diag, cstring_t out, diagnostic_t *d);
+static cstring_t __render_sarif__(diagnostor_t *diag, cstring_t out, diagnostic_t *d);
+static cstring_t __render_json_string__(cstring_t out, const unsigned char *s);
+static cstring_t __render_linenote__(cstring_t out, const unsigned char *linenote,
+                                     size_t outputed, size_t width);
+static cstring_t __render_linenote_caution__(cstring_t out, diagnostor_level_t level,
+                                             size_t start, size_t length, size_t width);
 
 
 void warningf(const char *fmt, ...)
@@ -107,7 +175,7 @@ void warningf_with_linenote(const char *fn, size_t line, size_t column, linenote
 {
     va_list ap;
     va_start(ap, fmt);
-    diagnostor_notef_with_linenote(diagnostor, DIAGNOSTOR_LEVEL_WARNING, fn, line, column, linenote, fmt, ap);
+    diagnostor_notevf_with_linenote(diagnostor, DIAGNOSTOR_LEVEL_WARNING, fn, line, column, linenote, fmt, ap);
     va_end(ap);
 }
 
@@ -117,7 +185,7 @@ void errorf_with_linenote(const char *fn, size_t line, size_t column, linenote_t
 {
     va_list ap;
     va_start(ap, fmt);
-    diagnostor_notef_with_linenote(diagnostor, DIAGNOSTOR_LEVEL_ERROR, fn, line, column, linenote, fmt, ap);
+    diagnostor_notevf_with_linenote(diagnostor, DIAGNOSTOR_LEVEL_ERROR, fn, line, column, linenote, fmt, ap);
     va_end(ap);
 }
 
@@ -256,6 +324,22 @@ diagnostor_t* diagnostor_create(void)
     diagnostor_t *diag = pmalloc(sizeof(diagnostor_t));
     diag->nerrors = 0;
     diag->nwarnings = 0;
+    diag->nrepeats = 0;
+    diag->resident = false;
+    diag->sink = false;
+    diag->repeating = false;
+    diag->sarif = false;
+    diag->width = -1;
+    diag->filename = 0;
+    diag->nresults = 0;
+    diag->queue = NULL;
+    diag->text = NULL;
+    diag->key = NULL;
+    diag->output = NULL;
+    diag->keys = NULL;
+    diag->seen = NULL;
+    diag->nseen = 0;
+    diag->seen_size = 0;
     return diag;
 }
 
@@ -263,6 +347,19 @@ diagnostor_t* diagnostor_create(void)
 void diagnostor_destroy(diagnostor_t *diag)
 {
     assert(diag != NULL);
+
+    diagnostor_flush(diag);
+    __diagnostor_close_sarif__(diag);
+
+    if (diag->queue != NULL) {
+        array_destroy(diag->queue);
+        cstring_free(diag->text);
+        cstring_free(diag->key);
+        cstring_free(diag->output);
+        cstring_free(diag->keys);
+        pfree(diag->seen);
+    }
+
     pfree(diag);
 }
 
@@ -278,27 +375,7 @@ void diagnostor_notef(diagnostor_t *diag, diagnostor_level_t level, const char *
 
 void diagnostor_notevf(diagnostor_t *diag, diagnostor_level_t level, const char *fmt, va_list args)
 {
-    switch (level) {
-    case DIAGNOSTOR_LEVEL_NORMAL:
-        break;
-    case DIAGNOSTOR_LEVEL_NOTE:
-        printf(BRUSH_BOLD_CYAN("note: "));
-        break;
-    case DIAGNOSTOR_LEVEL_WARNING:
-        printf(BRUSH_BOLD_PURPLE("warning: "));
-        diag->nwarnings++;
-        break;
-    case DIAGNOSTOR_LEVEL_ERROR:
-        printf(BRUSH_BOLD_RED("error: "));
-        diag->nerrors++;
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    vprintf(fmt, args);
-    printf("\n");
+    __diagnostor_note__(diag, level, NULL, 0, 0, NULL, NULL, false, fmt, args);
 }
 
 
@@ -315,37 +392,10 @@ void diagnostor_notef_with_location(diagnostor_t *diag, diagnostor_level_t level
 void diagnostor_notevf_with_location(diagnostor_t *diag, diagnostor_level_t level,
                                     const char *fn, size_t line, size_t column, const char *fmt, va_list args)
 {
-    printf("%s:%lu:%lu: ", fn, line, column);
-
-    switch (level) {
-    case DIAGNOSTOR_LEVEL_NORMAL:
-        break;
-    case DIAGNOSTOR_LEVEL_NOTE:
-        printf(BRUSH_BOLD_CYAN("note: "));
-        break;
-    case DIAGNOSTOR_LEVEL_WARNING:
-        printf(BRUSH_BOLD_PURPLE("warning: "));
-        diag->nwarnings++;
-        break;
-    case DIAGNOSTOR_LEVEL_ERROR:
-        printf(BRUSH_BOLD_RED("error: "));
-        diag->nerrors++;
-        if (diag->nerrors >= option->ferror_limit) {
-            diagnostor_report(diag);
-            exit(-1);
-        }
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    vprintf(fmt, args);
-    printf("\n");
+    __diagnostor_note__(diag, level, fn, line, column, NULL, NULL, true, fmt, args);
 }
 
 
-
 void diagnostor_notef_with_linenote(diagnostor_t *diag, diagnostor_level_t level, const char *fn,
                                     size_t line, size_t column, linenote_t linenote, const char *fmt, ...)
 {
@@ -359,36 +409,7 @@ void diagnostor_notef_with_linenote(diagnostor_t *diag, diagnostor_level_t level
 void diagnostor_notevf_with_linenote(diagnostor_t *diag, diagnostor_level_t level, const char *fn,
                                      size_t line, size_t column, linenote_t linenote, const char *fmt, va_list args)
 {
-    printf("%s:%lu:%lu: ", fn, line, column);
-
-    switch (level) {
-    case DIAGNOSTOR_LEVEL_NORMAL:
-        break;
-    case DIAGNOSTOR_LEVEL_NOTE:
-        printf(BRUSH_BOLD_CYAN("note: "));
-        break;
-    case DIAGNOSTOR_LEVEL_WARNING:
-        printf(BRUSH_BOLD_PURPLE("warning: "));
-        diag->nwarnings++;
-        break;
-    case DIAGNOSTOR_LEVEL_ERROR:
-        printf(BRUSH_BOLD_RED("error: "));
-        diag->nerrors++;
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    vprintf(fmt, args);
-    printf("\n");
-
-    diagnostor_note_linenote(diag, linenote);
-
-    if (diag->nerrors >= option->ferror_limit) {
-        diagnostor_report(diag);
-        exit(-1);
-    }
+    __diagnostor_note__(diag, level, fn, line, column, linenote, NULL, true, fmt, args);
 }
 
 
@@ -408,83 +429,39 @@ void diagnostor_notevf_with_linenote_caution(diagnostor_t *diag, diagnostor_leve
                                             const char *fn, size_t line, size_t column, linenote_t linenote,
                                             linenote_caution_t *linenote_caution, const char *fmt, va_list args)
 {
-    printf("%s:%lu:%lu: ", fn, line, column);
-
-    switch (level) {
-    case DIAGNOSTOR_LEVEL_NORMAL:
-        break;
-    case DIAGNOSTOR_LEVEL_NOTE:
-        printf(BRUSH_BOLD_CYAN("note: "));
-        break;
-    case DIAGNOSTOR_LEVEL_WARNING:
-        printf(BRUSH_BOLD_PURPLE("warning: "));
-        diag->nwarnings++;
-        break;
-    case DIAGNOSTOR_LEVEL_ERROR:
-        printf(BRUSH_BOLD_RED("error: "));
-        diag->nerrors++;
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    vprintf(fmt, args);
-    printf("\n");
-
-    diagnostor_note_linenote_caution(diag, level, linenote, linenote_caution);
-
-    if (diag->nerrors >= option->ferror_limit) {
-        diagnostor_report(diag);
-        exit(-1);
-    }
+    __diagnostor_note__(diag, level, fn, line, column, linenote, linenote_caution, true, fmt, args);
 }
 
 
 void diagnostor_note_linenote(diagnostor_t *diag, linenote_t linenote)
 {
-    int width;
-    size_t outputed = 0;
+    diagnostic_t d;
 
-    width = get_console_width();
-    if (width < MIN_LINE_LIMIT) {
-        return;
-    }
+    memset(&d, 0, sizeof(d));
+    d.level = DIAGNOSTOR_LEVEL_NORMAL;
 
-    outputed += printf("   ");
-
-    __write_linenote__(linenote, outputed, width);
+    __diagnostor_lock__(diag);
+    __diagnostor_prepare__(diag);
+    __diagnostor_add__(diag, &d, NULL, NULL, 0, linenote);
+    __diagnostor_unlock__(diag);
 }
 
 
 void diagnostor_note_linenote_caution(diagnostor_t *diag, diagnostor_level_t level,
                                       linenote_t linenote, linenote_caution_t *linenote_caution)
 {
-    int width;
-    int zoom, zoom_limit;
-    size_t start = linenote_caution->start;
-    size_t length = linenote_caution->length;
-    size_t outputed = 0;
-
-    width = get_console_width();
-    if (width < MIN_LINE_LIMIT) {
-        return;
-    }
-
-    zoom = width - (int)start;
-    zoom_limit = (int)length;
-    if (zoom <= zoom_limit) {
-        outputed += printf("   ...");
-        linenote = linenote + start - 1;
-        start = outputed + 1;
-    } else {
-        outputed += printf("   ");
-        start += outputed;
-    }
-
-    __write_linenote__(linenote, outputed, width);
-
-    __write_linenote_caution__(level, linenote, start, length, width);
+    diagnostic_t d;
+
+    memset(&d, 0, sizeof(d));
+    d.level = level;
+    d.flags = DIAGNOSTIC_CAUTION;
+    d.start = (uint32_t) linenote_caution->start;
+    d.length = (uint32_t) linenote_caution->length;
+
+    __diagnostor_lock__(diag);
+    __diagnostor_prepare__(diag);
+    __diagnostor_add__(diag, &d, NULL, NULL, 0, linenote);
+    __diagnostor_unlock__(diag);
 }
 
 
@@ -501,11 +478,12 @@ void diagnostor_panicf(diagnostor_t *diag, const char *fmt, ...)
 
 void diagnostor_panicvf(diagnostor_t *diag, const char *fmt, va_list args)
 {
-    printf(BRUSH_BOLD_RED("fatal error: "));
-    vprintf(fmt, args);
-    printf("\n");
+    diag->sink = false;
+    __diagnostor_note__(diag, DIAGNOSTOR_LEVEL_FATAL, NULL, 0, 0, NULL, NULL, false, fmt, args);
     diagnostor_report(diag);
-    printf("compilation terminated.");
+    if (option->diagnostics_format == DIAGNOSTICS_FORMAT_TEXT) {
+        printf("compilation terminated.");
+    }
     exit(-1);
 }
 
@@ -525,19 +503,143 @@ void diagnostor_panicf_with_location(diagnostor_t *diag, const char *fn,
 void diagnostor_panicvf_with_location(diagnostor_t *diag, const char *fn,
                                       size_t line, size_t column, const char *fmt, va_list args)
 {
-    printf("%s:%lu:%lu: ", fn, line, column);
-    printf(BRUSH_BOLD_RED("fatal error: "));
-    vprintf(fmt, args);
-    printf("\n");
+    diag->sink = false;
+    __diagnostor_note__(diag, DIAGNOSTOR_LEVEL_FATAL, fn, line, column, NULL, NULL, false, fmt, args);
     diagnostor_report(diag);
-    printf("compilation terminated.");
+    if (option->diagnostics_format == DIAGNOSTICS_FORMAT_TEXT) {
+        printf("compilation terminated.");
+    }
     exit(-1);
 }
 
 
+/**
+ * Gives the diagnostics of a sink to diag in the order they were given to
+ * the sink, as if they were given to diag, then empties the sink.
+ **/
+void diagnostor_merge(diagnostor_t *diag, diagnostor_t *from)
+{
+    diagnostic_t *d, copy;
+    size_t i;
+
+    if (from->queue == NULL) {
+        return;
+    }
+
+    __diagnostor_lock__(diag);
+    __diagnostor_prepare__(diag);
+
+    diag->nrepeats += from->nrepeats;
+
+    array_foreach(from->queue, d, i) {
+        copy = d[i];
+        __diagnostor_add__(diag, &copy,
+                           copy.filename != 0 ? (char*) from->text + copy.filename : NULL,
+                           copy.message != 0 ? from->text + copy.message : NULL,
+                           copy.message != 0 ? strlen((char*) from->text + copy.message) : 0,
+                           copy.linenote != 0 ? from->text + copy.linenote : NULL);
+    }
+
+    __diagnostor_unlock__(diag);
+
+    array_clear(from->queue);
+    cstring_clear(from->text);
+    from->text = cstring_concat_ch(from->text, '\0');
+    from->filename = 0;
+}
+
+
+/**
+ * Renders the queued diagnostics and writes them out at once.
+ **/
+void diagnostor_flush(diagnostor_t *diag)
+{
+    diagnostic_t *d;
+    size_t i;
+
+    if (diag->sink) {
+        return;
+    }
+
+    __diagnostor_lock__(diag);
+
+    if (diag->queue != NULL && !array_is_empty(diag->queue)) {
+        cstring_clear(diag->output);
+
+        switch (option->diagnostics_format) {
+        case DIAGNOSTICS_FORMAT_JSON:
+            array_foreach(diag->queue, d, i) {
+                diag->output = __render_json__(diag, diag->output, &d[i]);
+            }
+            break;
+        case DIAGNOSTICS_FORMAT_SARIF:
+            array_foreach(diag->queue, d, i) {
+                diag->output = __render_sarif__(diag, diag->output, &d[i]);
+            }
+            break;
+        default:
+            array_foreach(diag->queue, d, i) {
+                diag->output = __render__(diag, diag->output, &d[i]);
+            }
+            break;
+        }
+
+        fwrite(diag->output, 1, cstring_length(diag->output), stdout);
+        fflush(stdout);
+
+        array_clear(diag->queue);
+        cstring_clear(diag->text);
+        diag->text = cstring_concat_ch(diag->text, '\0');
+        diag->filename = 0;
+    }
+
+    __diagnostor_unlock__(diag);
+}
+
+
+/**
+ * Starts over for another compilation: no counts, no diagnostics seen,
+ * and a console that may not be the same.
+ **/
+void diagnostor_reset(diagnostor_t *diag)
+{
+    diagnostor_flush(diag);
+
+    diag->nerrors = 0;
+    diag->nwarnings = 0;
+    diag->nrepeats = 0;
+    diag->repeating = false;
+    diag->width = -1;
+
+    if (diag->seen != NULL) {
+        memset(diag->seen, 0, sizeof(uint64_t) * diag->seen_size);
+        cstring_clear(diag->keys);
+        diag->keys = cstring_concat_ch(diag->keys, '\0');
+        diag->nseen = 0;
+    }
+}
+
+
+/**
+ * Writes out what is left, then the counts as text, or the end of the log
+ * for SARIF, which is only complete once reported.
+ **/
 void diagnostor_report(diagnostor_t *diag)
 {
-    if (diag->nwarnings != 0 && diag->nerrors != 0) {
+    diagnostor_flush(diag);
+
+    if (option->diagnostics_format == DIAGNOSTICS_FORMAT_SARIF) {
+        __diagnostor_lock__(diag);
+        if (!diag->sarif) {
+            printf("%s", __sarif_head__);
+            diag->sarif = true;
+        }
+        __diagnostor_unlock__(diag);
+        __diagnostor_close_sarif__(diag);
+
+    } else if (option->diagnostics_format != DIAGNOSTICS_FORMAT_TEXT) {
+        /* the counts are in the records */
+    } else if (diag->nwarnings != 0 && diag->nerrors != 0) {
         printf("%d warning and %d error generated.\n", diag->nwarnings, diag->nerrors);
     } else if (diag->nwarnings != 0) {
         printf("%d warning generated.\n", diag->nwarnings);
@@ -545,52 +647,413 @@ void diagnostor_report(diagnostor_t *diag)
         printf("%d error generated.\n", diag->nerrors);
     }
 
-    if (diag->nerrors != 0) {
+    if (diag->nerrors != 0 && !diag->resident) {
         exit(-1);
     }
 }
 
 
-static void __write_linenote__(const unsigned char *linenote, size_t outputed, size_t width)
+static
+void __diagnostor_prepare__(diagnostor_t *diag)
 {
-    size_t i;
+    if (diag->queue != NULL) {
+        return;
+    }
 
-    width -= 3;
-    for (i = outputed; *linenote != '\r' &&
-            *linenote != '\n' &&
-            *linenote &&
-            (width != 0 && i < width);
-         linenote++, i++) {
-        putchar(*linenote);
+    diag->queue = array_create(sizeof(diagnostic_t));
+    diag->text = cstring_new_n("", 1);
+    diag->key = cstring_new_n(NULL, 256);
+    diag->output = cstring_new_n(NULL, 4096);
+    diag->keys = cstring_new_n("", 1);
+    diag->seen_size = 256;
+    diag->seen = pmalloc(sizeof(uint64_t) * diag->seen_size);
+    diag->nseen = 0;
+    memset(diag->seen, 0, sizeof(uint64_t) * diag->seen_size);
+
+    /* what is left in the queue of the process goes out when it exits */
+    if (diag == &__diagnostor__) {
+        atexit(__diagnostor_atexit__);
+    }
+}
+
+
+static
+void __diagnostor_atexit__(void)
+{
+    diagnostor_flush(&__diagnostor__);
+    __diagnostor_close_sarif__(&__diagnostor__);
+}
+
+
+static
+int __diagnostor_width__(diagnostor_t *diag)
+{
+    if (diag->width < 0) {
+        diag->width = get_console_width();
     }
 
-    if (i == width && *linenote != '\r' && *linenote != '\n' && *linenote) {
-        printf("...\n");
+    return diag->width;
+}
+
+
+static
+void __diagnostor_note__(diagnostor_t *diag, diagnostor_level_t level, const char *fn,
+                         size_t line, size_t column, linenote_t linenote,
+                         linenote_caution_t *linenote_caution, bool limited,
+                         const char *fmt, va_list args)
+{
+    diagnostic_t d;
+    cstring_t message;
+
+    d.level = level;
+    d.flags = (linenote_caution != NULL ? DIAGNOSTIC_CAUTION : 0) | (limited ? DIAGNOSTIC_LIMITED : 0);
+    d.line = (uint32_t) line;
+    d.column = (uint32_t) column;
+    d.start = linenote_caution != NULL ? (uint32_t) linenote_caution->start : 0;
+    d.length = linenote_caution != NULL ? (uint32_t) linenote_caution->length : 0;
+
+    message = cstring_concat_vpf(cstring_new_n(NULL, 128), fmt, args);
+
+    __diagnostor_lock__(diag);
+    __diagnostor_prepare__(diag);
+    __diagnostor_add__(diag, &d, fn, message, cstring_length(message), linenote);
+    __diagnostor_unlock__(diag);
+
+    cstring_free(message);
+}
+
+
+/**
+ * Queues a diagnostic unless it repeats one, or follows one that did. A
+ * diagnostic without a message is a line note of the previous one.
+ **/
+static
+void __diagnostor_add__(diagnostor_t *diag, diagnostic_t *d, const char *fn,
+                        const unsigned char *message, size_t n, linenote_t linenote)
+{
+    uint32_t header[5];
+
+    switch (d->level) {
+    case DIAGNOSTOR_LEVEL_NORMAL:
+    case DIAGNOSTOR_LEVEL_NOTE:
+        if (diag->repeating) {
+            return;
+        }
+        break;
+    case DIAGNOSTOR_LEVEL_WARNING:
+    case DIAGNOSTOR_LEVEL_ERROR:
+        if (message == NULL) {
+            if (diag->repeating) {
+                return;
+            }
+            break;
+        }
+
+        header[0] = d->level | ((d->flags & DIAGNOSTIC_CAUTION) << 16);
+        header[1] = d->line;
+        header[2] = d->column;
+        header[3] = d->start;
+        header[4] = d->length;
+
+        diag->key = cstring_copy_n(diag->key, header, sizeof(header));
+        if (fn != NULL) {
+            diag->key = cstring_concat_n(diag->key, fn, strlen(fn));
+        }
+        diag->key = cstring_concat_ch(diag->key, '\0');
+        diag->key = cstring_concat_n(diag->key, message, n);
+
+        if ((diag->repeating = __diagnostor_seen__(diag, diag->key, cstring_length(diag->key)))) {
+            diag->nrepeats++;
+            return;
+        }
+
+        if (d->level == DIAGNOSTOR_LEVEL_WARNING) {
+            diag->nwarnings++;
+        } else {
+            diag->nerrors++;
+        }
+        break;
+    case DIAGNOSTOR_LEVEL_FATAL:
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    d->filename = fn != NULL ? __diagnostor_copy_filename__(diag, fn) : 0;
+    d->message = message != NULL ? __diagnostor_copy__(diag, message, n) : 0;
+    d->linenote = __diagnostor_copy_linenote__(diag, linenote, d->start);
+
+    if (d->message == 0 && d->linenote == 0) {
+        return;
+    }
+
+    __diagnostor_push__(diag, d);
+
+    if ((d->flags & DIAGNOSTIC_LIMITED) && diag->nerrors >= option->ferror_limit &&
+        !diag->resident && !diag->sink) {
+        diagnostor_report(diag);
+        exit(-1);
+    }
+}
+
+
+static
+uint64_t __diagnostor_hash__(const unsigned char *key, size_t n)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (n--) {
+        hash = (hash ^ *key++) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/**
+ * Whether the key was seen before, adding it when not. The table is open
+ * addressed, an entry holds the high half of the hash of a key and the
+ * offset of the key, after its length, in the keys of the diagnostor.
+ **/
+static
+bool __diagnostor_seen__(diagnostor_t *diag, const unsigned char *key, size_t n)
+{
+    uint64_t *table, hash, entry;
+    uint32_t length;
+    size_t i, j, offset, mask;
+
+    hash = __diagnostor_hash__(key, n);
+
+    mask = diag->seen_size - 1;
+    for (i = hash & mask; (entry = diag->seen[i]) != 0; i = (i + 1) & mask) {
+        if ((entry >> 32) != (hash >> 32)) {
+            continue;
+        }
+
+        offset = (size_t) (entry & 0xffffffff);
+        memcpy(&length, diag->keys + offset - sizeof(length), sizeof(length));
+        if (length == n && memcmp(diag->keys + offset, key, n) == 0) {
+            return true;
+        }
+    }
+
+    length = (uint32_t) n;
+    diag->keys = cstring_concat_n(diag->keys, &length, sizeof(length));
+    offset = cstring_length(diag->keys);
+    diag->keys = cstring_concat_n(diag->keys, key, n);
+
+    diag->seen[i] = (hash & 0xffffffff00000000ULL) | offset;
+
+    /* kept at most half full */
+    if (++diag->nseen * 2 > diag->seen_size) {
+        table = pmalloc(sizeof(uint64_t) * diag->seen_size * 2);
+        memset(table, 0, sizeof(uint64_t) * diag->seen_size * 2);
+        mask = diag->seen_size * 2 - 1;
+
+        for (i = 0; i < diag->seen_size; i++) {
+            if ((entry = diag->seen[i]) == 0) {
+                continue;
+            }
+
+            offset = (size_t) (entry & 0xffffffff);
+            memcpy(&length, diag->keys + offset - sizeof(length), sizeof(length));
+
+            hash = __diagnostor_hash__(diag->keys + offset, length);
+
+            for (j = hash & mask; table[j] != 0; j = (j + 1) & mask) {
+                continue;
+            }
+            table[j] = entry;
+        }
+
+        pfree(diag->seen);
+        diag->seen = table;
+        diag->seen_size *= 2;
+    }
+
+    return false;
+}
+
+
+static
+void __diagnostor_push__(diagnostor_t *diag, diagnostic_t *d)
+{
+    array_cast_append(diagnostic_t, diag->queue, *d);
+
+    if (!diag->sink && cstring_length(diag->text) >= DIAGNOSTOR_FLUSH_SIZE) {
+        diagnostor_flush(diag);
+    }
+}
+
+
+static
+uint32_t __diagnostor_copy__(diagnostor_t *diag, const void *data, size_t n)
+{
+    uint32_t offset = (uint32_t) cstring_length(diag->text);
+
+    diag->text = cstring_concat_n(diag->text, data, n);
+    diag->text = cstring_concat_ch(diag->text, '\0');
+    return offset;
+}
+
+
+/* diagnostics come in runs from the same file, its name is copied once */
+static
+uint32_t __diagnostor_copy_filename__(diagnostor_t *diag, const char *fn)
+{
+    if (diag->filename == 0 || strcmp((char*) diag->text + diag->filename, fn) != 0) {
+        diag->filename = __diagnostor_copy__(diag, fn, strlen(fn));
+    }
+
+    return diag->filename;
+}
+
+
+/**
+ * Copies no more of the source line than the console shows from the
+ * caution on, and nothing when there is no console to show it or the
+ * diagnostics are not written as text.
+ **/
+static
+uint32_t __diagnostor_copy_linenote__(diagnostor_t *diag, linenote_t linenote, size_t start)
+{
+    size_t n, limit;
+    int width;
+
+    if (linenote == NULL || option->diagnostics_format != DIAGNOSTICS_FORMAT_TEXT) {
+        return 0;
+    }
+
+    width = __diagnostor_width__(diag);
+    if (width < MIN_LINE_LIMIT) {
+        return 0;
+    }
+
+    limit = start + width + 1;
+    for (n = 0; n < limit && linenote[n] != '\r' && linenote[n] != '\n' && linenote[n]; n++) {
+        continue;
+    }
+
+    return __diagnostor_copy__(diag, linenote, n);
+}
+
+
+static
+cstring_t __render__(diagnostor_t *diag, cstring_t out, diagnostic_t *d)
+{
+    const unsigned char *linenote;
+    size_t width, start, outputed, n;
+
+    if (d->filename != 0) {
+        out = cstring_concat_pf(out, "%s:%lu:%lu: ", diag->text + d->filename,
+                                (unsigned long) d->line, (unsigned long) d->column);
+    }
+
+    if (d->message != 0) {
+        switch (d->level) {
+        case DIAGNOSTOR_LEVEL_NORMAL:
+            break;
+        case DIAGNOSTOR_LEVEL_NOTE:
+            out = cstring_concat_n(out, BRUSH_BOLD_CYAN("note: "),
+                                   sizeof(BRUSH_BOLD_CYAN("note: ")) - 1);
+            break;
+        case DIAGNOSTOR_LEVEL_WARNING:
+            out = cstring_concat_n(out, BRUSH_BOLD_PURPLE("warning: "),
+                                   sizeof(BRUSH_BOLD_PURPLE("warning: ")) - 1);
+            break;
+        case DIAGNOSTOR_LEVEL_ERROR:
+            out = cstring_concat_n(out, BRUSH_BOLD_RED("error: "),
+                                   sizeof(BRUSH_BOLD_RED("error: ")) - 1);
+            break;
+        case DIAGNOSTOR_LEVEL_FATAL:
+            out = cstring_concat_n(out, BRUSH_BOLD_RED("fatal error: "),
+                                   sizeof(BRUSH_BOLD_RED("fatal error: ")) - 1);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+
+        linenote = diag->text + d->message;
+        out = cstring_concat_n(out, linenote, strlen((char*) linenote));
+        out = cstring_concat_ch(out, '\n');
+    }
+
+    if (d->linenote == 0) {
+        return out;
+    }
+
+    linenote = diag->text + d->linenote;
+    width = diag->width;
+
+    if (!(d->flags & DIAGNOSTIC_CAUTION)) {
+        out = cstring_concat_n(out, "   ", 3);
+        return __render_linenote__(out, linenote, 3, width);
+    }
+
+    start = d->start;
+
+    if ((int) width - (int) start <= (int) d->length) {
+        out = cstring_concat_n(out, "   ...", 6);
+        outputed = 6;
+
+        n = strlen((char*) linenote);
+        linenote += start == 0 ? 0 : start - 1 < n ? start - 1 : n;
+        start = outputed + 1;
+
     } else {
-        printf("\n");
+        out = cstring_concat_n(out, "   ", 3);
+        outputed = 3;
+        start += outputed;
     }
+
+    out = __render_linenote__(out, linenote, outputed, width);
+
+    return __render_linenote_caution__(out, d->level, start, d->length, width);
 }
 
 
 static
-void __write_linenote_caution__(diagnostor_level_t level,
-                                linenote_t linenote,
-                                size_t start,
-                                size_t length,
-                                size_t width)
+cstring_t __render_linenote__(cstring_t out, const unsigned char *linenote,
+                              size_t outputed, size_t width)
+{
+    size_t n, length;
+
+    width -= 3;
+
+    length = strlen((char*) linenote);
+    n = outputed < width ? width - outputed : 0;
+    if (n > length) {
+        n = length;
+    }
+
+    out = cstring_concat_n(out, linenote, n);
+
+    if (outputed + n == width && linenote[n] != '\0') {
+        return cstring_concat_n(out, "...\n", 4);
+    }
+
+    return cstring_concat_ch(out, '\n');
+}
+
+
+static
+cstring_t __render_linenote_caution__(cstring_t out, diagnostor_level_t level,
+                                      size_t start, size_t length, size_t width)
 {
     size_t i, j;
     const char *tilde;
     const char *caret;
 
     for (i = 1, j = 1; i < start; i++, j++) {
-        putchar(' ');
+        out = cstring_concat_ch(out, ' ');
     }
 
     if (level == DIAGNOSTOR_LEVEL_WARNING) {
         caret = BRUSH_BOLD_PURPLE("^");
         tilde = BRUSH_BOLD_PURPLE("~");
-    } else if (level == DIAGNOSTOR_LEVEL_ERROR) {
+    } else if (level == DIAGNOSTOR_LEVEL_ERROR || level == DIAGNOSTOR_LEVEL_FATAL) {
         caret = BRUSH_BOLD_RED("^");
         tilde = BRUSH_BOLD_RED("~");
     } else if (level == DIAGNOSTOR_LEVEL_NOTE) {
@@ -598,11 +1061,173 @@ void __write_linenote_caution__(diagnostor_level_t level,
         tilde = BRUSH_BOLD_CYAN("~");
     } else {
         assert(false);
+        return cstring_concat_ch(out, '\n');
     }
 
-    printf(caret);
+    out = cstring_concat_n(out, caret, strlen(caret));
     for (i = 1; i < length && j < width; i++, j++) {
-        printf(tilde);
+        out = cstring_concat_n(out, tilde, strlen(tilde));
+    }
+
+    return cstring_concat_ch(out, '\n');
+}
+
+
+/* a record a line: {"level":..,"file":..,"line":..,"column":..,"caution":{..},"message":..} */
+static
+cstring_t __render_json__(diagnostor_t *diag, cstring_t out, diagnostic_t *d)
+{
+    if (d->message == 0) {
+        return out;
+    }
+
+    out = cstring_concat_pf(out, "{\"level\":\"%s\"", __json_levels__[d->level]);
+
+    if (d->filename != 0) {
+        out = cstring_concat_n(out, ",\"file\":", 8);
+        out = __render_json_string__(out, diag->text + d->filename);
+        out = cstring_concat_pf(out, ",\"line\":%lu,\"column\":%lu",
+                                (unsigned long) d->line, (unsigned long) d->column);
+    }
+
+    if ((d->flags & DIAGNOSTIC_CAUTION) && d->length != 0) {
+        out = cstring_concat_pf(out, ",\"caution\":{\"start\":%lu,\"length\":%lu}",
+                                (unsigned long) d->start, (unsigned long) d->length);
     }
-    printf("\n");
+
+    out = cstring_concat_n(out, ",\"message\":", 11);
+    out = __render_json_string__(out, diag->text + d->message);
+    return cstring_concat_n(out, "}\n", 2);
+}
+
+
+/**
+ * A result of the log, which is opened before the first one. The region
+ * spans the caution when there is one, from its column.
+ **/
+static
+cstring_t __render_sarif__(diagnostor_t *diag, cstring_t out, diagnostic_t *d)
+{
+    unsigned long column;
+
+    if (d->message == 0) {
+        return out;
+    }
+
+    if (!diag->sarif) {
+        out = cstring_concat_n(out, __sarif_head__, sizeof(__sarif_head__) - 1);
+        diag->sarif = true;
+        diag->nresults = 0;
+    }
+
+    if (diag->nresults++ != 0) {
+        out = cstring_concat_ch(out, ',');
+    }
+
+    out = cstring_concat_pf(out, "\n{\"level\":\"%s\",\"message\":{\"text\":", __sarif_levels__[d->level]);
+    out = __render_json_string__(out, diag->text + d->message);
+    out = cstring_concat_ch(out, '}');
+
+    if (d->filename != 0) {
+        column = (d->flags & DIAGNOSTIC_CAUTION) && d->length != 0 && d->start != 0 ? d->start : d->column;
+
+        out = cstring_concat_n(out, ",\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":",
+                               sizeof(",\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":") - 1);
+        out = __render_json_string__(out, diag->text + d->filename);
+        out = cstring_concat_pf(out, "},\"region\":{\"startLine\":%lu", (unsigned long) d->line);
+
+        if (column != 0) {
+            out = cstring_concat_pf(out, ",\"startColumn\":%lu", column);
+            if ((d->flags & DIAGNOSTIC_CAUTION) && d->length != 0) {
+                out = cstring_concat_pf(out, ",\"endColumn\":%lu", column + d->length);
+            }
+        }
+
+        out = cstring_concat_n(out, "}}}]", 4);
+    }
+
+    return cstring_concat_ch(out, '}');
+}
+
+
+/* ends the log opened by a result, or by diagnostor_report() without any */
+static
+void __diagnostor_close_sarif__(diagnostor_t *diag)
+{
+    __diagnostor_lock__(diag);
+
+    if (diag->sarif) {
+        printf("\n]}]}\n");
+        fflush(stdout);
+        diag->sarif = false;
+    }
+
+    __diagnostor_unlock__(diag);
+}
+
+
+/**
+ * Writes a string of JSON, with the bytes that are not UTF-8 replaced by
+ * U+FFFD so that the record stays valid whatever the source was.
+ **/
+static
+cstring_t __render_json_string__(cstring_t out, const unsigned char *s)
+{
+    char escape[8];
+    const unsigned char *run;
+    unsigned char ch;
+    size_t n, length;
+
+    out = cstring_concat_ch(out, '"');
+
+    for (n = strlen((char*) s); n != 0; ) {
+        for (run = s; n != 0 && *s >= 0x20 && *s < 0x7f && *s != '"' && *s != '\\'; s++, n--) {
+            continue;
+        }
+
+        out = cstring_concat_n(out, run, s - run);
+        if (n == 0) {
+            break;
+        }
+
+        ch = *s;
+
+        if (ch >= 0x80) {
+            length = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : 2;
+            if (length <= n && utf8_valid_span(s, length) == length) {
+                out = cstring_concat_n(out, s, length);
+                s += length;
+                n -= length;
+            } else {
+                out = cstring_concat_n(out, "\\ufffd", 6);
+                s++;
+                n--;
+            }
+            continue;
+        }
+
+        switch (ch) {
+        case '"':
+            out = cstring_concat_n(out, "\\\"", 2);
+            break;
+        case '\\':
+            out = cstring_concat_n(out, "\\\\", 2);
+            break;
+        case '\n':
+            out = cstring_concat_n(out, "\\n", 2);
+            break;
+        case '\t':
+            out = cstring_concat_n(out, "\\t", 2);
+            break;
+        default:
+            sprintf(escape, "\\u%04x", ch);
+            out = cstring_concat_n(out, escape, 6);
+            break;
+        }
+
+        s++;
+        n--;
+    }
+
+    return cstring_concat_ch(out, '"');
 }
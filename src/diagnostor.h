@@ -5,6 +5,13 @@
 
 
 #include "config.h"
+#include "cstring.h"
+
+
+/* the queue is written out once its strings grow past this */
+#ifndef DIAGNOSTOR_FLUSH_SIZE
+#define DIAGNOSTOR_FLUSH_SIZE   (64 * 1024)
+#endif
 
 
 typedef struct array_s array_t;
@@ -17,16 +24,67 @@ typedef enum diagnostor_level_e {
     DIAGNOSTOR_LEVEL_NOTE,
     DIAGNOSTOR_LEVEL_WARNING,
     DIAGNOSTOR_LEVEL_ERROR,
+    DIAGNOSTOR_LEVEL_FATAL,
 } diagnostor_level_t;
 
 
+#define DIAGNOSTIC_CAUTION      0x1     /* start and length are set */
+#define DIAGNOSTIC_LIMITED      0x2     /* counts towards -ferror-limit */
+
+
+/**
+ * A diagnostic waiting to be written. Its strings are copied into the text
+ * of the diagnostor and referred to by offset, 0 for none, so that they
+ * outlive the files and macros they come from.
+ **/
+typedef struct diagnostic_s {
+    uint16_t level;
+    uint16_t flags;
+    uint32_t filename;
+    uint32_t line;
+    uint32_t column;
+    uint32_t message;
+    uint32_t linenote;
+    uint32_t start;
+    uint32_t length;
+} diagnostic_t;
+
+
+/**
+ * Diagnostics are queued, and written together when the queue grows too
+ * large, on diagnostor_flush() or on diagnostor_report(), as text or in
+ * the format of -fdiagnostics-format. A warning or an error given again
+ * at the same place with the same message is counted as a repeat and
+ * dropped, along with the notes that follow it.
+ *
+ * A sink is the diagnostor of a stage run by a worker. It only queues, for
+ * the driver to merge into the diagnostor of the process in input order
+ * with diagnostor_merge(), and never exits.
+ **/
 typedef struct diagnostor_s {
     size_t nerrors;
     size_t nwarnings;
+    size_t nrepeats;
+    bool resident;                  /* outlives the compilation, errors never exit */
+    bool sink;
+    bool repeating;                 /* the last warning or error was a repeat */
+    bool sarif;                     /* in the results of a SARIF log */
+    int width;                      /* of the console, -1 until known */
+    uint32_t filename;              /* the last filename copied into the text */
+    size_t nresults;                /* written in the SARIF log */
+    array_t *queue;                 /* diagnostic_t */
+    cstring_t text;
+    cstring_t key;
+    cstring_t output;
+    cstring_t keys;                 /* of the warnings and errors seen */
+    uint64_t *seen;                 /* a hash and an offset in keys, 0 for free */
+    size_t nseen;
+    size_t seen_size;
 } diagnostor_t;
 
 
-extern diagnostor_t* diagnostor;
+/* the diagnostor of this thread, the one of its stage in a worker */
+extern THREAD_LOCAL diagnostor_t* diagnostor;
 
 
 #define diagnostor_has_error(diag) \
@@ -96,6 +154,9 @@ void diagnostor_note_linenote(diagnostor_t *diag, linenote_t linenote);
 void diagnostor_note_linenote_caution(diagnostor_t *diag, diagnostor_level_t level, linenote_t linenote,
                                       linenote_caution_t *linenote_caution);
 
+void diagnostor_merge(diagnostor_t *diag, diagnostor_t *from);
+void diagnostor_flush(diagnostor_t *diag);
+void diagnostor_reset(diagnostor_t *diag);
 void diagnostor_report(diagnostor_t *diag);
 
 
@@ -4,11 +4,17 @@
 #include "encoding.h"
 
 
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+
 static inline int __count_leading_ones__(char ch);
 static inline bool __parse_rune__(uint32_t *rune, size_t *rune_size, char *s, int n);
 static inline cstring_t __write8__(cstring_t cs, uint8_t u);
-static inline cstring_t __write16__(cstring_t cs, uint16_t u);
-static inline cstring_t __write32__(cstring_t cs, uint32_t u);
+static inline size_t __widen16__(const unsigned char *s, size_t n, unsigned char *to);
+static inline size_t __widen32__(const unsigned char *s, size_t n, unsigned char *to);
+static inline cstring_t __finish__(cstring_t cs, size_t length);
 
 
 cstring_t cstring_append_utf8(cstring_t cs, uint32_t rune)
@@ -42,10 +48,17 @@ cstring_t cstring_append_utf8(cstring_t cs, uint32_t rune)
 }
 
 
+/**
+ * The transcoders presize the output for the worst case, a unit for each
+ * byte, and widen the runs of ASCII a block at a time, decoding a rune at
+ * a time only past them. The units are little-endian.
+ **/
 cstring_t cstring_cast_to_utf16(cstring_t cs)
 {
     cstring_t to;
-    size_t i, length;
+    unsigned char *p;
+    uint32_t rune;
+    size_t i, length, rune_size;
 
     length = cstring_length(cs);
     to = cstring_new_n(NULL, length * sizeof(uint16_t));
@@ -53,53 +66,170 @@ cstring_t cstring_cast_to_utf16(cstring_t cs)
         return NULL;
     }
 
+    p = to;
+
     for (i = 0; i < length;) {
-        uint32_t rune;
-        size_t rune_size;
+        rune_size = __widen16__(cs + i, length - i, p);
+        i += rune_size;
+        p += rune_size * sizeof(uint16_t);
 
-        if (!__parse_rune__(&rune, &rune_size, &cs[i], length - i)) {
+        if (i == length) {
+            break;
+        }
+
+        if (!__parse_rune__(&rune, &rune_size, (char*) &cs[i], length - i)) {
             cstring_free(to);
             return NULL;
         }
 
-        if (rune < 0x10000) {
-            to = __write16__(to, rune);
-        } else {
-            to = __write16__(to, (rune >> 10) + 0xD7C0);
-            to = __write16__(to, (rune & 0x3FF) + 0xDC00);
+        if (rune >= 0x10000) {
+            p[0] = (unsigned char) ((rune >> 10) + 0xD7C0);
+            p[1] = (unsigned char) (((rune >> 10) + 0xD7C0) >> 8);
+            p += 2;
+            rune = (rune & 0x3FF) + 0xDC00;
         }
 
+        p[0] = (unsigned char) rune;
+        p[1] = (unsigned char) (rune >> 8);
+        p += 2;
+
         i += rune_size;
     }
 
-    return to;
+    return __finish__(to, p - to);
 }
 
 
 cstring_t cstring_cast_to_utf32(cstring_t cs)
 {
     cstring_t to;
-    size_t i, length;
+    unsigned char *p;
+    uint32_t rune;
+    size_t i, length, rune_size;
 
     length = cstring_length(cs);
     if ((to = cstring_new_n(NULL, length * sizeof(uint32_t))) == NULL) {
         return NULL;
     }
 
+    p = to;
+
     for (i = 0; i < length; ) {
-        uint32_t rune;
-        size_t rune_size;
+        rune_size = __widen32__(cs + i, length - i, p);
+        i += rune_size;
+        p += rune_size * sizeof(uint32_t);
+
+        if (i == length) {
+            break;
+        }
 
-        if (!__parse_rune__(&rune, &rune_size, cs, length - i)) {
+        if (!__parse_rune__(&rune, &rune_size, (char*) &cs[i], length - i)) {
+            cstring_free(to);
             return NULL;
         }
 
-        to = __write32__(to, rune);
+        p[0] = (unsigned char) rune;
+        p[1] = (unsigned char) (rune >> 8);
+        p[2] = (unsigned char) (rune >> 16);
+        p[3] = (unsigned char) (rune >> 24);
+        p += 4;
 
         i += rune_size;
     }
 
-    return to;
+    return __finish__(to, p - to);
+}
+
+
+/**
+ * The length of the run of ASCII at the start of s, sixteen bytes at a
+ * time with SSE2, eight at a time otherwise.
+ **/
+size_t utf8_ascii_span(const unsigned char *s, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (s + i)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t block;
+        memcpy(&block, s + i, sizeof(block));
+        if (block & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+#endif
+
+    while (i < n && s[i] < 0x80) {
+        i++;
+    }
+
+    return i;
+}
+
+
+/**
+ * The length of the well-formed UTF-8 at the start of s, as of RFC 3629:
+ * no overlong forms, no surrogates and nothing past U+10FFFF. The runs of
+ * ASCII are skipped a block at a time.
+ **/
+size_t utf8_valid_span(const unsigned char *s, size_t n)
+{
+    size_t i, len;
+    unsigned char ch, lo, hi;
+
+    for (i = 0; i < n; ) {
+        i += utf8_ascii_span(s + i, n - i);
+        if (i == n) {
+            break;
+        }
+
+        ch = s[i];
+        lo = 0x80;
+        hi = 0xBF;
+
+        if (ch >= 0xC2 && ch <= 0xDF) {
+            len = 2;
+        } else if (ch >= 0xE0 && ch <= 0xEF) {
+            len = 3;
+            if (ch == 0xE0) {
+                lo = 0xA0;
+            } else if (ch == 0xED) {
+                hi = 0x9F;
+            }
+        } else if (ch >= 0xF0 && ch <= 0xF4) {
+            len = 4;
+            if (ch == 0xF0) {
+                lo = 0x90;
+            } else if (ch == 0xF4) {
+                hi = 0x8F;
+            }
+        } else {
+            return i;
+        }
+
+        if (n - i < len || s[i + 1] < lo || s[i + 1] > hi ||
+            (len > 2 && (s[i + 2] & 0xC0) != 0x80) ||
+            (len > 3 && (s[i + 3] & 0xC0) != 0x80)) {
+            return i;
+        }
+
+        i += len;
+    }
+
+    return n;
+}
+
+
+bool utf8_validate(const unsigned char *s, size_t n)
+{
+    return utf8_valid_span(s, n) == n;
 }
 
 
@@ -170,20 +300,79 @@ cstring_t __write8__(cstring_t cs, uint8_t u)
 }
 
 
+/* widens the run of ASCII at the start of s, returns its length */
 static inline
-cstring_t __write16__(cstring_t cs, uint16_t u)
+size_t __widen16__(const unsigned char *s, size_t n, unsigned char *to)
 {
-    cs = cstring_push_ch(cs, u & 0xFF);
-    cs = cstring_push_ch(cs, u >> 8);
-    return cs;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (s + i));
+        if (_mm_movemask_epi8(block) != 0) {
+            break;
+        }
+        _mm_storeu_si128((__m128i*) (to + i * 2), _mm_unpacklo_epi8(block, zero));
+        _mm_storeu_si128((__m128i*) (to + i * 2 + 16), _mm_unpackhi_epi8(block, zero));
+    }
+#endif
+
+    for (; i < n && s[i] < 0x80; i++) {
+        to[i * 2] = s[i];
+        to[i * 2 + 1] = 0;
+    }
+
+    return i;
+}
+
+
+static inline
+size_t __widen32__(const unsigned char *s, size_t n, unsigned char *to)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i lo, hi;
+
+        if (_mm_movemask_epi8(block) != 0) {
+            break;
+        }
+
+        lo = _mm_unpacklo_epi8(block, zero);
+        hi = _mm_unpackhi_epi8(block, zero);
+        _mm_storeu_si128((__m128i*) (to + i * 4), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*) (to + i * 4 + 16), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i*) (to + i * 4 + 32), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*) (to + i * 4 + 48), _mm_unpackhi_epi16(hi, zero));
+    }
+#endif
+
+    for (; i < n && s[i] < 0x80; i++) {
+        to[i * 4] = s[i];
+        to[i * 4 + 1] = 0;
+        to[i * 4 + 2] = 0;
+        to[i * 4 + 3] = 0;
+    }
+
+    return i;
 }
 
 
+/* the output was written in place, past the length of the cstring */
 static inline
-cstring_t __write32__(cstring_t cs, uint32_t u)
+cstring_t __finish__(cstring_t cs, size_t length)
 {
-    cs = __write16__(cs, u & 0xFFFF);
-    cs = __write16__(cs, u >> 16);
+    cstring_header_t *hdr = cstring_of(cs);
+
+    hdr->unused += hdr->length - length;
+    hdr->length = length;
+    hdr->buffer[length] = '\0';
     return cs;
 }
 
@@ -22,6 +22,9 @@ cstring_t cstring_cast_to_utf16(cstring_t cs);
 cstring_t cstring_cast_to_utf32(cstring_t cs);
 
 size_t utf8_rune_size(int ch);
+size_t utf8_ascii_span(const unsigned char *s, size_t n);
+size_t utf8_valid_span(const unsigned char *s, size_t n);
+bool utf8_validate(const unsigned char *s, size_t n);
 
 
 #endif
@@ -0,0 +1,314 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "cspool.h"
+#include "dict.h"
+#include "map.h"
+#include "fcache.h"
+
+
+#if defined(UNIX)
+#   define __fcache_lock_init__(lock)       pthread_rwlock_init((lock), NULL)
+#   define __fcache_lock_destroy__(lock)    pthread_rwlock_destroy(lock)
+#   define __fcache_read_lock__(lock)       pthread_rwlock_rdlock(lock)
+#   define __fcache_read_unlock__(lock)     pthread_rwlock_unlock(lock)
+#   define __fcache_write_lock__(lock)      pthread_rwlock_wrlock(lock)
+#   define __fcache_write_unlock__(lock)    pthread_rwlock_unlock(lock)
+#elif defined(WINDOWS)
+#   define __fcache_lock_init__(lock)       InitializeSRWLock(lock)
+#   define __fcache_lock_destroy__(lock)
+#   define __fcache_read_lock__(lock)       AcquireSRWLockShared(lock)
+#   define __fcache_read_unlock__(lock)     ReleaseSRWLockShared(lock)
+#   define __fcache_write_lock__(lock)      AcquireSRWLockExclusive(lock)
+#   define __fcache_write_unlock__(lock)    ReleaseSRWLockExclusive(lock)
+#else
+#   define __fcache_lock_init__(lock)
+#   define __fcache_lock_destroy__(lock)
+#   define __fcache_read_lock__(lock)
+#   define __fcache_read_unlock__(lock)
+#   define __fcache_write_lock__(lock)
+#   define __fcache_write_unlock__(lock)
+#endif
+
+
+#if defined(__APPLE__)
+#   define __fcache_modify_nsec__(st)       ((st)->st_mtimespec.tv_nsec)
+#   define __fcache_change_nsec__(st)       ((st)->st_ctimespec.tv_nsec)
+#elif defined(UNIX)
+#   define __fcache_modify_nsec__(st)       ((st)->st_mtim.tv_nsec)
+#   define __fcache_change_nsec__(st)       ((st)->st_ctim.tv_nsec)
+#else
+#   define __fcache_modify_nsec__(st)       0L
+#   define __fcache_change_nsec__(st)       0L
+#endif
+
+
+static void __fcache_put__(fcache_t *cache, map_t *map, cstring_t key, void *value);
+static void __fcache_stat_dir__(const char *dir, fcache_dir_t *state);
+
+
+static
+void __fcache_free_fn__(void *privdata, const void *key, const void *value)
+{
+    (void) privdata;
+    (void) key;
+    pfree((void*) value);
+}
+
+
+static
+void __fcache_free_file_fn__(void *privdata, const void *key, const void *value)
+{
+    cstring_free(((fcache_file_t*) value)->text);
+    __fcache_free_fn__(privdata, key, value);
+}
+
+
+static
+void __fcache_free_stale__(fcache_t *cache)
+{
+    cstring_t *texts;
+    size_t i;
+
+    array_foreach(cache->stale, texts, i) {
+        cstring_free(texts[i]);
+    }
+
+    array_clear(cache->stale);
+}
+
+
+fcache_t* fcache_create(cspool_t *csp)
+{
+    fcache_t *cache;
+
+    cache = pmalloc(sizeof(fcache_t));
+
+    __fcache_lock_init__(&cache->lock);
+    cache->csp = csp;
+    cache->files = map_create();
+    cache->includes = map_create();
+    cache->dirs = map_create();
+    cache->stale = array_create_n(sizeof(cstring_t), 8);
+
+    return cache;
+}
+
+
+void fcache_destroy(fcache_t *cache)
+{
+    assert(cache != NULL);
+
+    map_scan(cache->files, __fcache_free_file_fn__, NULL);
+    map_destroy(cache->files);
+
+    map_scan(cache->includes, __fcache_free_fn__, NULL);
+    map_destroy(cache->includes);
+
+    map_scan(cache->dirs, __fcache_free_fn__, NULL);
+    map_destroy(cache->dirs);
+
+    __fcache_free_stale__(cache);
+    array_destroy(cache->stale);
+
+    __fcache_lock_destroy__(&cache->lock);
+    pfree(cache);
+}
+
+
+/**
+ * The text of the file when it did not change since it was cached, st is
+ * its status now.
+ **/
+cstring_t fcache_find_file(fcache_t *cache, cstring_t filename, struct stat *st)
+{
+    fcache_file_t *file;
+    cstring_t text = NULL;
+
+    __fcache_read_lock__(&cache->lock);
+
+    file = map_find(cache->files, filename);
+    if (file != NULL &&
+        file->size == st->st_size &&
+        file->ino == st->st_ino &&
+        file->modify_time == st->st_mtime &&
+        file->change_time == st->st_ctime &&
+        file->modify_nsec == __fcache_modify_nsec__(st) &&
+        file->change_nsec == __fcache_change_nsec__(st)) {
+        text = file->text;
+    }
+
+    __fcache_read_unlock__(&cache->lock);
+
+    return text;
+}
+
+
+/**
+ * Takes text, which stays readable until the next fcache_revalidate() even
+ * if the file is added again meanwhile.
+ **/
+void fcache_add_file(fcache_t *cache, cstring_t filename, struct stat *st, cstring_t text)
+{
+    fcache_file_t *file;
+
+    file = pmalloc(sizeof(fcache_file_t));
+    file->text = text;
+    file->size = st->st_size;
+    file->ino = st->st_ino;
+    file->modify_time = st->st_mtime;
+    file->change_time = st->st_ctime;
+    file->modify_nsec = __fcache_modify_nsec__(st);
+    file->change_nsec = __fcache_change_nsec__(st);
+
+    __fcache_write_lock__(&cache->lock);
+    __fcache_put__(cache, cache->files, filename, file);
+    __fcache_write_unlock__(&cache->lock);
+}
+
+
+cstring_t fcache_find_include(fcache_t *cache, cstring_t key, bool *system)
+{
+    fcache_include_t *include;
+    cstring_t filename = NULL;
+
+    __fcache_read_lock__(&cache->lock);
+
+    include = map_find(cache->includes, key);
+    if (include != NULL) {
+        filename = include->filename;
+        *system = include->system;
+    }
+
+    __fcache_read_unlock__(&cache->lock);
+
+    return filename;
+}
+
+
+void fcache_add_include(fcache_t *cache, cstring_t key, cstring_t filename, bool system)
+{
+    fcache_include_t *include;
+
+    include = pmalloc(sizeof(fcache_include_t));
+    include->filename = cspool_push_cs(cache->csp, cstring_dup(filename));
+    include->system = system;
+
+    __fcache_write_lock__(&cache->lock);
+    __fcache_put__(cache, cache->includes, key, include);
+    __fcache_write_unlock__(&cache->lock);
+}
+
+
+/**
+ * Makes the lookups depend on the directory of filename, a file added to
+ * or removed from it may change where an #include is found.
+ **/
+void fcache_watch(fcache_t *cache, const char *filename)
+{
+    fcache_dir_t *dir;
+    const char *slash;
+    cstring_t name;
+    bool watched;
+
+    slash = strrchr(filename, '/');
+    name = slash != NULL ? cstring_new_n(filename, slash == filename ? 1 : slash - filename) :
+                           cstring_new(".");
+
+    __fcache_read_lock__(&cache->lock);
+    watched = map_has(cache->dirs, name);
+    __fcache_read_unlock__(&cache->lock);
+
+    if (!watched) {
+        dir = pmalloc(sizeof(fcache_dir_t));
+        __fcache_stat_dir__(name, dir);
+
+        __fcache_write_lock__(&cache->lock);
+        __fcache_put__(cache, cache->dirs, name, dir);
+        __fcache_write_unlock__(&cache->lock);
+    }
+
+    cstring_free(name);
+}
+
+
+static
+void __fcache_check_dir_fn__(void *privdata, const void *key, const void *value)
+{
+    const fcache_dir_t *dir = value;
+    fcache_dir_t now;
+
+    __fcache_stat_dir__((const char*) key, &now);
+
+    if (now.exists != dir->exists || now.modify_time != dir->modify_time) {
+        *(bool*) privdata = false;
+    }
+}
+
+
+/**
+ * Drops the lookups if a directory they probed changed, and the texts of
+ * the files replaced since the last call, to be called while no thread
+ * uses the cache. Returns whether the lookups still hold.
+ **/
+bool fcache_revalidate(fcache_t *cache)
+{
+    bool valid = true;
+
+    __fcache_free_stale__(cache);
+
+    map_scan(cache->dirs, __fcache_check_dir_fn__, &valid);
+
+    if (!valid) {
+        map_scan(cache->includes, __fcache_free_fn__, NULL);
+        map_destroy(cache->includes);
+        cache->includes = map_create();
+
+        map_scan(cache->dirs, __fcache_free_fn__, NULL);
+        map_destroy(cache->dirs);
+        cache->dirs = map_create();
+    }
+
+    return valid;
+}
+
+
+/**
+ * Replaces the value of key, under the write lock. The text of a replaced
+ * file may still be read by another thread, it is kept until no thread
+ * uses the cache.
+ **/
+static
+void __fcache_put__(fcache_t *cache, map_t *map, cstring_t key, void *value)
+{
+    void *old;
+
+    if ((old = map_find(map, key)) != NULL) {
+        map_del(map, key);
+
+        if (map == cache->files) {
+            *(cstring_t*) array_push_back(cache->stale) = ((fcache_file_t*) old)->text;
+        }
+
+        pfree(old);
+    }
+
+    map_add(map, key, value);
+
+    /* lookups under the read lock must not step a rehash */
+    while (dict_is_rehashing((dict_t*) map)) {
+        dict_rehash((dict_t*) map, 100);
+    }
+}
+
+
+static
+void __fcache_stat_dir__(const char *dir, fcache_dir_t *state)
+{
+    struct stat st;
+
+    state->exists = stat(dir, &st) == 0;
+    state->modify_time = state->exists ? st.st_mtime : 0;
+}
@@ -0,0 +1,65 @@
+
+
+#ifndef __FCACHE__H__
+#define __FCACHE__H__
+
+
+#include "config.h"
+#include "cstring.h"
+#include "cspool.h"
+#include "map.h"
+#include "array.h"
+
+
+typedef struct fcache_file_s {
+    cstring_t text;                 /* owned by the cache */
+    off_t size;
+    ino_t ino;
+    time_t modify_time;
+    time_t change_time;
+    long modify_nsec;               /* 0 where the system has no finer times */
+    long change_nsec;
+} fcache_file_t;
+
+
+typedef struct fcache_include_s {
+    cstring_t filename;
+    bool system;
+} fcache_include_t;
+
+
+typedef struct fcache_dir_s {
+    bool exists;
+    time_t modify_time;
+} fcache_dir_t;
+
+
+/**
+ * The contents of the files read and the results of the #include lookups,
+ * shared by the stages of every translation unit that use the same string
+ * pool, for a driver that outlives one compilation. A file is reread once
+ * its size, inode or times change, the text it replaces is freed by the
+ * next fcache_revalidate(). A lookup holds until a directory it
+ * probed changes, which fcache_revalidate() checks between compilations.
+ **/
+typedef struct fcache_s {
+    cspool_lock_t lock;
+    cspool_t *csp;
+    map_t *files;                   /* fcache_file_t by filename */
+    map_t *includes;                /* fcache_include_t by lookup key */
+    map_t *dirs;                    /* fcache_dir_t of the probed directories */
+    array_t *stale;                 /* texts of the replaced files, maybe still read */
+} fcache_t;
+
+
+fcache_t* fcache_create(cspool_t *csp);
+void fcache_destroy(fcache_t *cache);
+cstring_t fcache_find_file(fcache_t *cache, cstring_t filename, struct stat *st);
+void fcache_add_file(fcache_t *cache, cstring_t filename, struct stat *st, cstring_t text);
+cstring_t fcache_find_include(fcache_t *cache, cstring_t key, bool *system);
+void fcache_add_include(fcache_t *cache, cstring_t key, cstring_t filename, bool system);
+void fcache_watch(fcache_t *cache, const char *filename);
+bool fcache_revalidate(fcache_t *cache);
+
+
+#endif
@@ -13,7 +13,13 @@
 #include "option.h"
 
 
+#ifndef LEXER_PASTE_BUFFER_SIZE
+#define LEXER_PASTE_BUFFER_SIZE     128
+#endif
+
+
 static inline token_t* __lexer_parse_number__(lexer_t *lexer, token_t *token, int ch);
+static token_t* __lexer_parse_literal_run__(lexer_t *lexer, token_t *token);
 static inline encoding_type_t __lexer_parse_encoding__(lexer_t *lexer, int ch);
 static inline token_t* __lexer_parse_character__(lexer_t *lexer, token_t *token, encoding_type_t ent);
 static inline token_t* __lexer_parse_string__(lexer_t *lexer, token_t *token, encoding_type_t ent);
@@ -21,7 +27,13 @@ static inline token_t* __lexer_parse_identifier__(lexer_t *lexer, token_t *token
 static inline bool __lexer_parse_spaces__(lexer_t *lexer, token_t *token);
 static inline token_t* __lexer_parse_comment__(lexer_t *lexer, token_t *token);
 
+static inline token_t* __lexer_next__(lexer_t *lexer);
+static inline bool __lexer_is_literal__(token_type_t type);
+static inline encoding_type_t __lexer_paste_encoding__(token_t *prefix, token_t *literal);
+static inline token_type_t __lexer_classify_spelling__(const unsigned char *s, size_t n);
 static inline token_t* __lexer_make_token__(lexer_t *lexer, token_t *token, token_type_t type);
+static inline token_t* __lexer_make_digraph__(lexer_t *lexer, token_t *token, token_type_t type,
+                                              const char *spelling);
 static inline void __lexer_mark_location__(lexer_t *lexer, token_t *token);
 static inline void __remark_location__(lexer_t *lexer, token_t *token);
 
@@ -33,6 +45,10 @@ lexer_t* lexer_create(void)
     lexer = pmalloc(sizeof(struct lexer_s));
 
     lexer->reader = reader_create();
+    token_vec_init(&lexer->snapshot);
+    lexer->begin_of_line = true;
+    lexer->literal_runs = false;
+    lexer->directive = false;
 
     return lexer;
 }
@@ -45,6 +61,10 @@ lexer_t* lexer_create_csp(cspool_t *csp)
     lexer = pmalloc(sizeof(struct lexer_s));
 
     lexer->reader = reader_create_csp(csp);
+    token_vec_init(&lexer->snapshot);
+    lexer->begin_of_line = true;
+    lexer->literal_runs = false;
+    lexer->directive = false;
 
     return lexer;
 }
@@ -58,8 +78,17 @@ bool lexer_push(lexer_t *lexer, stream_type_t type, const unsigned char* s)
 
 void lexer_destroy(lexer_t *lexer)
 {
+    token_t **tokens;
+    size_t i;
+
     assert(lexer != NULL);
 
+    vec_foreach(&lexer->snapshot, tokens, i) {
+        token_destroy(tokens[i]);
+    }
+
+    token_vec_free(&lexer->snapshot);
+
     reader_destroy(lexer->reader);
 
     pfree(lexer);
@@ -146,7 +175,7 @@ token_t* lexer_scan(lexer_t *lexer)
         return __lexer_make_token__(lexer, token, TOKEN_TILDE);
     case '!':
         return __lexer_make_token__(lexer, token, reader_try(lexer->reader, '=') ?
-                                                  TOKEN_EXCLAIM : TOKEN_EXCLAIMEQUAL);
+                                                  TOKEN_EXCLAIMEQUAL : TOKEN_EXCLAIM);
     case '/':
         if (reader_test(lexer->reader, '/') || reader_test(lexer->reader, '*')) {
             return __lexer_parse_comment__(lexer, token);
@@ -158,15 +187,15 @@ token_t* lexer_scan(lexer_t *lexer)
             return __lexer_make_token__(lexer, token, TOKEN_PERCENTEQUAL);
         }
         if (reader_try(lexer->reader, '>')) {
-            return __lexer_make_token__(lexer, token, TOKEN_R_BRACE);
+            return __lexer_make_digraph__(lexer, token, TOKEN_R_BRACE, "%>");
         }
         if (reader_try(lexer->reader, ':')) {
             if (reader_try(lexer->reader, '%')) {
                 if (reader_try(lexer->reader, ':'))
-                    return __lexer_make_token__(lexer, token, TOKEN_HASHHASH);
+                    return __lexer_make_digraph__(lexer, token, TOKEN_HASHHASH, "%:%:");
                 reader_unget(lexer->reader, '%');
             }
-            return __lexer_make_token__(lexer, token, TOKEN_HASH);
+            return __lexer_make_digraph__(lexer, token, TOKEN_HASH, "%:");
         }
         return __lexer_make_token__(lexer, token, TOKEN_PERCENT);
     case '<':
@@ -178,10 +207,10 @@ token_t* lexer_scan(lexer_t *lexer)
             return __lexer_make_token__(lexer, token, TOKEN_LESSEQUAL);
         }
         if (reader_try(lexer->reader, ':')) {
-            return __lexer_make_token__(lexer, token, TOKEN_L_SQUARE);
+            return __lexer_make_digraph__(lexer, token, TOKEN_L_SQUARE, "<:");
         }
         if (reader_try(lexer->reader, '%')) {
-            return __lexer_make_token__(lexer, token, TOKEN_L_BRACE);
+            return __lexer_make_digraph__(lexer, token, TOKEN_L_BRACE, "<%");
         }
         return __lexer_make_token__(lexer, token, TOKEN_LESS);
     case '>':
@@ -205,8 +234,10 @@ token_t* lexer_scan(lexer_t *lexer)
     case '?':
         return __lexer_make_token__(lexer, token, TOKEN_QUESTION);
     case ':':
-        return __lexer_make_token__(lexer, token, reader_try(lexer->reader, '>') ?
-                                                  TOKEN_R_SQUARE : TOKEN_COLON);
+        if (reader_try(lexer->reader, '>')) {
+            return __lexer_make_digraph__(lexer, token, TOKEN_R_SQUARE, ":>");
+        }
+        return __lexer_make_token__(lexer, token, TOKEN_COLON);
     case ';':
         return __lexer_make_token__(lexer, token, TOKEN_SEMI);
     case '=':
@@ -219,7 +250,11 @@ token_t* lexer_scan(lexer_t *lexer)
                                                   TOKEN_HASHHASH : TOKEN_HASH);
     case '0': case '1': case '2': case '3': case '4': 
     case '5': case '6': case '7': case '8': case '9':
-        return __lexer_parse_number__(lexer, token, ch);
+        token = __lexer_parse_number__(lexer, token, ch);
+        if (lexer->literal_runs && !lexer->directive) {
+            return __lexer_parse_literal_run__(lexer, token);
+        }
+        return token;
     case 'u': case 'U': case 'L': {
         encoding_type_t ent = __lexer_parse_encoding__(lexer, ch);
 
@@ -265,23 +300,232 @@ token_t* lexer_scan(lexer_t *lexer)
 }
 
 
-token_t* lexer_scan_header_name(lexer_t *lexer)
+array_t* lexer_tokenize(lexer_t *lexer)
 {
-    int ch;
+    array_t *tokens;
+    token_t *token;
+
+    tokens = array_create_n(sizeof(token_t*), 8);
+
+    for (;;) {
+        token = __lexer_next__(lexer);
+        if (token->type == TOKEN_EOF || token->type == TOKEN_END) {
+            token_destroy(token);
+            break;
+        }
+
+        if (token->type == TOKEN_NEWLINE) {
+            token_destroy(token);
+            continue;
+        }
+
+        array_cast_append(token_t*, tokens, token);
+    }
+
+    return tokens;
+}
+
+
+token_t* lexer_get(lexer_t *lexer)
+{
+    token_t *token;
+
+    if (!token_vec_is_empty(&lexer->snapshot)) {
+        return token_vec_pop(&lexer->snapshot);
+    }
+
+    token = __lexer_next__(lexer);
+    token->begin_of_line = lexer->begin_of_line;
+
+    if (token->type == TOKEN_HASH && token->begin_of_line) {
+        lexer->directive = true;
+    } else if (token->type == TOKEN_NEWLINE || token->type == TOKEN_EOF) {
+        lexer->directive = false;
+    }
+
+    lexer->begin_of_line = token->type == TOKEN_NEWLINE || token->type == TOKEN_EOF;
+    return token;
+}
+
+
+token_t* lexer_peek(lexer_t *lexer)
+{
+    token_t *token = lexer_get(lexer);
+    lexer_unget(lexer, token);
+    return token;
+}
+
+
+void lexer_eat(lexer_t *lexer)
+{
+    token_destroy(lexer_get(lexer));
+}
+
+
+void lexer_unget(lexer_t *lexer, token_t *tok)
+{
+    token_vec_push(&lexer->snapshot, tok);
+}
+
+
+bool lexer_try(lexer_t *lexer, token_type_t tt)
+{
+    if (lexer_peek(lexer)->type == tt) {
+        lexer_eat(lexer);
+        return true;
+    }
+    return false;
+}
+
+
+bool lexer_is_empty(lexer_t *lexer)
+{
+    return token_vec_is_empty(&lexer->snapshot) && reader_is_empty(lexer->reader);
+}
+
+
+/**
+ * Skips the rest of a false conditional group up to the next directive,
+ * dropping any pending tokens. Returns false at the end of the stream.
+ **/
+bool lexer_skip_to_directive(lexer_t *lexer)
+{
+    bool begin_of_line = lexer->begin_of_line;
     token_t *token;
 
+    if (!token_vec_is_empty(&lexer->snapshot)) {
+        /* the bottom of the snapshot is the last token read from the reader */
+        token = token_vec_front(&lexer->snapshot);
+        if (token->type == TOKEN_EOF || token->type == TOKEN_END) {
+            while (token_vec_length(&lexer->snapshot) > 1) {
+                token_destroy(token_vec_pop(&lexer->snapshot));
+            }
+            return false;
+        }
+
+        begin_of_line = token->type == TOKEN_NEWLINE;
+
+        while (!token_vec_is_empty(&lexer->snapshot)) {
+            token_destroy(token_vec_pop(&lexer->snapshot));
+        }
+    }
+
     if (reader_is_empty(lexer->reader)) {
-        return token_create(TOKEN_END, NULL, NULL);
+        return false;
     }
 
-    ch = reader_peek(lexer->reader);
-    if (ch == '"') {
+    if (!reader_skip_to_directive(lexer->reader, begin_of_line)) {
+        return false;
+    }
+
+    lexer->begin_of_line = true;
+    return true;
+}
+
+
+/**
+ * Pastes two tokens for the '##' operator by lexing the concatenation of
+ * their spellings in place, without pushing a stream. Returns NULL if the
+ * result is not exactly one preprocessing token.
+ **/
+token_t* lexer_paste(token_t *left, token_t *right)
+{
+    unsigned char buffer[LEXER_PASTE_BUFFER_SIZE];
+    unsigned char *s;
+    const char *l, *r;
+    size_t nl, nr;
+    token_type_t type;
+    token_t *token;
+
+    if (__lexer_is_literal__(left->type)) {
+        return NULL;
+    }
+
+    if (__lexer_is_literal__(right->type)) {
+        encoding_type_t ent = __lexer_paste_encoding__(left, right);
+        if (ent == ENCODING_NONE) {
+            return NULL;
+        }
+
+        type = right->type == TOKEN_CONSTANT_CHAR ? ent2tokt(ent, CHAR) : ent2tokt(ent, STRING);
+        token = token_create(type, cstring_dup(right->cs), &left->location);
+        token->spaces = left->spaces;
+        return token;
+    }
+
+    l = token_as_text(left);
+    r = token_as_text(right);
+    nl = strlen(l);
+    nr = strlen(r);
+
+    s = nl + nr <= sizeof(buffer) ? buffer : (unsigned char*) pmalloc(nl + nr);
+
+    memcpy(s, l, nl);
+    memcpy(s + nl, r, nr);
 
-    } else if (ch == '<') {
+    type = __lexer_classify_spelling__(s, nl + nr);
+    if (type == TOKEN_UNKNOWN) {
+        token = NULL;
 
     } else {
+        /* a punctuator keeps the spelling pasted, a digraph stays one */
+        token = token_create(type, cstring_new_n(s, nl + nr), &left->location);
+        token->spaces = left->spaces;
+    }
 
+    if (s != buffer) {
+        pfree(s);
     }
+
+    return token;
+}
+
+
+/**
+ * Scans the header name of an #include right after the directive name,
+ * "q-chars" or <h-chars> kept with their delimiters and without escapes.
+ * Returns NULL when the line does not start with one and has to be macro
+ * expanded, leaving it to be lexed as usual.
+ **/
+token_t* lexer_scan_header_name(lexer_t *lexer)
+{
+    int ch, close;
+    token_t *token;
+
+    if (!token_vec_is_empty(&lexer->snapshot) || reader_is_empty(lexer->reader)) {
+        return NULL;
+    }
+
+    token = token_create(TOKEN_UNKNOWN, cstring_new_n(NULL, 32), NULL);
+
+    __lexer_parse_spaces__(lexer, token);
+    __lexer_mark_location__(lexer, token);
+
+    ch = reader_peek(lexer->reader);
+    if (ch != '"' && ch != '<') {
+        token_destroy(token);
+        return NULL;
+    }
+
+    close = ch == '<' ? '>' : '"';
+    token->cs = cstring_push_ch(token->cs, (unsigned char) reader_get(lexer->reader));
+
+    /* an unterminated name is left for the preprocessor to report */
+    for (;;) {
+        ch = reader_peek(lexer->reader);
+        if (ch == '\n' || ch == EOF) {
+            break;
+        }
+
+        token->cs = cstring_push_ch(token->cs, (unsigned char) reader_get(lexer->reader));
+        if (ch == close) {
+            break;
+        }
+    }
+
+    lexer->begin_of_line = false;
+
+    return __lexer_make_token__(lexer, token, TOKEN_PP_HEADER_NAME);
 }
 
 
@@ -393,6 +637,194 @@ token_t* __lexer_parse_number__(lexer_t *lexer, token_t *token, int ch)
 }
 
 
+/**
+ * The value of a decimal, octal or hexadecimal integer without suffix or
+ * digit separators. Returns false for any other number or on overflow.
+ **/
+static
+bool __lexer_integer_value__(const unsigned char *s, size_t n, unsigned long long *value)
+{
+    unsigned long long v = 0;
+    unsigned int base = 10, digit;
+    size_t i = 0;
+
+    if (n > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        i = 2;
+    } else if (s[0] == '0') {
+        base = 8;
+    }
+
+    for (; i < n; i++) {
+        if (ISDIGIT(s[i])) {
+            digit = s[i] - '0';
+        } else if (base == 16 && isxdigit(s[i])) {
+            digit = (s[i] | 0x20) - 'a' + 10;
+        } else {
+            return false;
+        }
+
+        if (digit >= base || v > (ULLONG_MAX - digit) / base) {
+            return false;
+        }
+
+        v = v * base + digit;
+    }
+
+    *value = v;
+    return true;
+}
+
+
+/* the end of the pp-number starting at p, none of its characters translated */
+static inline
+const unsigned char* __lexer_span_number__(const unsigned char *p, const unsigned char *pe)
+{
+    int prev = -1;
+
+    for (; p < pe; prev = *p++) {
+        if (!(ISIDNUM(*p) || *p == '.' || *p == '\'' ||
+              ((*p == '+' || *p == '-') &&
+               (prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P')))) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+/**
+ * Extends an integer to the run of integers separated by commas following
+ * it on the line, spelled as written. The run is scanned in place in the
+ * text of the stream and ends at anything else, a single integer is left
+ * a TOKEN_NUMBER.
+ **/
+static
+token_t* __lexer_parse_literal_run__(lexer_t *lexer, token_t *token)
+{
+    unsigned long long value;
+    const unsigned char *s, *p, *pe, *q, *literal;
+    array_t *values;
+    size_t n;
+
+    if (!__lexer_integer_value__(token->cs, cstring_length(token->cs), &value)) {
+        return token;
+    }
+
+    if ((s = reader_span(lexer->reader, &n)) == NULL) {
+        return token;
+    }
+
+    values = NULL;
+    pe = s + n;
+
+    for (p = s; ; p = q) {
+        for (q = p; q < pe && (*q == ' ' || *q == '\t'); q++) {
+            continue;
+        }
+
+        if (q == pe || *q != ',') {
+            break;
+        }
+
+        for (q++; q < pe && (*q == ' ' || *q == '\t'); q++) {
+            continue;
+        }
+
+        if (q == pe || !ISDIGIT(*q)) {
+            break;
+        }
+
+        literal = q;
+        q = __lexer_span_number__(q, pe);
+
+        /* a spliced or translated character is left to the reader */
+        if (q < pe && (*q == '\\' || *q == '\r')) {
+            break;
+        }
+
+        if (values == NULL) {
+            values = array_create_n(sizeof(unsigned long long), 16);
+            array_cast_append(unsigned long long, values, value);
+        }
+
+        if (!__lexer_integer_value__(literal, q - literal, &value)) {
+            break;
+        }
+
+        array_cast_append(unsigned long long, values, value);
+    }
+
+    if (values == NULL) {
+        return token;
+    }
+
+    if (array_length(values) < 2) {
+        array_destroy(values);
+        return token;
+    }
+
+    token->cs = cstring_concat_n(token->cs, s, p - s);
+    reader_skip(lexer->reader, p - s);
+
+    token->run = values;
+    return __lexer_make_token__(lexer, token, TOKEN_LITERAL_RUN);
+}
+
+
+/**
+ * The tokens of a run as if it had been lexed without runs, for where the
+ * commas matter, the arguments of a macro.
+ **/
+array_t* lexer_split_run(token_t *run)
+{
+    const unsigned char *p, *pe, *start;
+    token_location_t location;
+    array_t *tokens;
+    token_t *token;
+    size_t spaces;
+
+    tokens = array_create_n(sizeof(token_t*), array_length(run->run) * 2);
+
+    location = run->location;
+    spaces = run->spaces;
+
+    p = run->cs;
+    pe = p + cstring_length(run->cs);
+
+    while (p < pe) {
+        if (*p == ' ' || *p == '\t') {
+            spaces++;
+            p++;
+            continue;
+        }
+
+        location.column = run->location.column + (p - run->cs);
+
+        if (*p == ',') {
+            token = token_create(TOKEN_COMMA, cstring_new_n(NULL, 8), &location);
+            p++;
+        } else {
+            for (start = p; p < pe && *p != ',' && *p != ' ' && *p != '\t'; p++) {
+                continue;
+            }
+            token = token_create(TOKEN_NUMBER, cstring_new_n(start, p - start), &location);
+        }
+
+        token->spaces = spaces;
+        token->hideset = run->hideset;
+        spaces = 0;
+
+        array_cast_append(token_t*, tokens, token);
+    }
+
+    array_cast_front(token_t*, tokens)->begin_of_line = run->begin_of_line;
+
+    return tokens;
+}
+
+
 static inline
 bool __lexer_is_universal_char__(lexer_t *lexer, int ch)
 {
@@ -513,9 +945,26 @@ int __lexer_parse_escaped__(lexer_t *lexer, token_t *token)
 static inline
 token_t* __lexer_parse_identifier__(lexer_t *lexer, token_t *token)
 {
+    const unsigned char *span;
+    size_t n, i;
     int ch;
 
     for (;;) {
+        /* in place as far as no splice nor escape comes, multibyte aside in ASCII files */
+        if ((span = reader_span(lexer->reader, &n)) != NULL) {
+            if (reader_is_ascii(lexer->reader)) {
+                for (i = 0; i < n && (ISIDNUM(span[i]) || span[i] == '$'); i++);
+            } else {
+                for (i = 0; i < n && (ISIDNUM(span[i]) || span[i] == '$' ||
+                                      (0x80 <= span[i] && span[i] <= 0xfd)); i++);
+            }
+
+            if (i != 0) {
+                token->cs = cstring_concat_n(token->cs, span, i);
+                reader_skip(lexer->reader, i);
+            }
+        }
+
         ch = reader_get(lexer->reader);
         if (ISIDNUM(ch) || ch == '$' || (0x80 <= ch && ch <= 0xfd)) {
             token->cs = cstring_concat_ch(token->cs, ch);
@@ -617,6 +1066,120 @@ token_t* __lexer_parse_string__(lexer_t *lexer, token_t *token, encoding_type_t
 }
 
 
+static inline
+bool __lexer_is_literal__(token_type_t type)
+{
+    return TOKEN_CONSTANT_STRING <= type && type <= TOKEN_CONSTANT_UTF8CHAR;
+}
+
+
+static inline
+encoding_type_t __lexer_paste_encoding__(token_t *prefix, token_t *literal)
+{
+    if (prefix->type != TOKEN_IDENTIFIER) {
+        return ENCODING_NONE;
+    }
+
+    if (literal->type != TOKEN_CONSTANT_STRING && literal->type != TOKEN_CONSTANT_CHAR) {
+        return ENCODING_NONE;
+    }
+
+    if (cstring_compare(prefix->cs, "L") == 0) {
+        return ENCODING_WCHAR;
+    }
+
+    if (cstring_compare(prefix->cs, "u") == 0) {
+        return ENCODING_CHAR16;
+    }
+
+    if (cstring_compare(prefix->cs, "U") == 0) {
+        return ENCODING_CHAR32;
+    }
+
+    if (cstring_compare(prefix->cs, "u8") == 0 && literal->type == TOKEN_CONSTANT_STRING) {
+        return ENCODING_UTF8;
+    }
+
+    return ENCODING_NONE;
+}
+
+
+static inline
+token_type_t __lexer_classify_spelling__(const unsigned char *s, size_t n)
+{
+#undef  VALID_SIGN
+#define VALID_SIGN(c, prevc) \
+  (((c) == '+' || (c) == '-') && \
+   ((prevc) == 'e' || (prevc) == 'E' \
+    || (((prevc) == 'p' || (prevc) == 'P') )))
+
+#undef  IS_IDENTIFIER_CHAR
+#define IS_IDENTIFIER_CHAR(c) \
+    (ISIDNUM(c) || (c) == '$' || (0x80 <= (c) && (c) <= 0xfd))
+
+    size_t i;
+
+    if (n == 0) {
+        return TOKEN_UNKNOWN;
+    }
+
+    if (ISDIGIT(s[0]) || (s[0] == '.' && n > 1 && ISDIGIT(s[1]))) {
+        for (i = 1; i < n; i++) {
+            if (!(ISIDNUM(s[i]) || s[i] == '.' || VALID_SIGN(s[i], s[i-1]) || s[i] == '\'')) {
+                return TOKEN_UNKNOWN;
+            }
+        }
+        return TOKEN_NUMBER;
+    }
+
+    if (IS_IDENTIFIER_CHAR(s[0])) {
+        for (i = 1; i < n; i++) {
+            if (!IS_IDENTIFIER_CHAR(s[i])) {
+                return TOKEN_UNKNOWN;
+            }
+        }
+        return TOKEN_IDENTIFIER;
+    }
+
+    return token_lookup_punctuator((const char*) s, n);
+
+#undef  IS_IDENTIFIER_CHAR
+#undef  VALID_SIGN
+}
+
+
+/**
+ * Scans the next token of the stream, folding spaces and comments into
+ * the spaces of the token which follows them.
+ **/
+static inline
+token_t* __lexer_next__(lexer_t *lexer)
+{
+    token_t *token;
+    size_t spaces = 0;
+
+    for (;;) {
+        token = lexer_scan(lexer);
+        if (token->type == TOKEN_SPACE) {
+            spaces += token->spaces;
+            token_destroy(token);
+            continue;
+        }
+
+        if (token->type == TOKEN_COMMENT) {
+            spaces++;
+            token_destroy(token);
+            continue;
+        }
+
+        break;
+    }
+
+    token->spaces = spaces;
+    return token;
+}
+
+
 static inline
 token_t* __lexer_make_token__(lexer_t *lexer, token_t *token, token_type_t type)
 {
@@ -625,6 +1188,16 @@ token_t* __lexer_make_token__(lexer_t *lexer, token_t *token, token_type_t type)
 }
 
 
+/* a digraph keeps its spelling, the other punctuators are spelled by type */
+static inline
+token_t* __lexer_make_digraph__(lexer_t *lexer, token_t *token, token_type_t type,
+                                const char *spelling)
+{
+    token->cs = cstring_concat_n(token->cs, spelling, strlen(spelling));
+    return __lexer_make_token__(lexer, token, type);
+}
+
+
 static inline
 void __lexer_mark_location__(lexer_t *lexer, token_t *token)
 {
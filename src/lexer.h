@@ -6,10 +6,12 @@
 
 #include "config.h"
 #include "cstring.h"
+#include "token.h"
 
 
 typedef struct array_s     array_t;
 typedef struct reader_s    reader_t;
+typedef struct cspool_s    cspool_t;
 typedef struct token_s     token_t;
 typedef enum token_type_e  token_type_t;
 typedef enum stream_type_e stream_type_t;
@@ -17,6 +19,17 @@ typedef enum stream_type_e stream_type_t;
 
 typedef struct lexer_s {
     reader_t *reader;
+    token_vec_t snapshot;           /* the tokens pushed back, last out first */
+    bool begin_of_line;
+
+    /**
+     * Lexes integers separated by commas on a line as one TOKEN_LITERAL_RUN,
+     * except on directive lines, see lexer_split_run(). Its values are in
+     * token->run, which aliases token->embed through their union, so only
+     * the type of a token says whether the pointer is a run.
+     **/
+    bool literal_runs;
+    bool directive;
 } lexer_t;
 
 
@@ -27,11 +40,15 @@ bool lexer_push(lexer_t *lexer, stream_type_t type, const unsigned char* s);
 array_t* lexer_tokenize(lexer_t *lexer);
 token_t* lexer_scan(lexer_t *lexer);
 token_t* lexer_scan_header_name(lexer_t *lexer);
+token_t* lexer_paste(token_t *left, token_t *right);
+array_t* lexer_split_run(token_t *run);
 token_t* lexer_get(lexer_t *lexer);
 token_t* lexer_peek(lexer_t *lexer);
 void lexer_eat(lexer_t *lexer);
 void lexer_unget(lexer_t *lexer, token_t *tok);
 bool lexer_try(lexer_t *lexer, token_type_t tt);
+bool lexer_is_empty(lexer_t *lexer);
+bool lexer_skip_to_directive(lexer_t *lexer);
 
 void lexer_stash(lexer_t *lexer);
 void lexer_unstash(lexer_t *lexer);
@@ -1,48 +1,931 @@
 
 
 #include "config.h"
-#include "option.h"
+#include "pmalloc.h"
 #include "cstring.h"
+#include "cspool.h"
+#include "token.h"
+#include "reader.h"
+#include "lexer.h"
+#include "preprocessor.h"
+#include "diagnostor.h"
+#include "option.h"
+#include "printer.h"
+#include "stage.h"
+#include "trace.h"
+#include "fcache.h"
+#include "server.h"
+#include "utils.h"
+
+
+#if defined(UNIX)
+#   include <pthread.h>
+#   include <unistd.h>
+#   include <fcntl.h>
+#   include <signal.h>
+#endif
+
+
+#ifndef DRIVER_MAX_JOBS
+#define DRIVER_MAX_JOBS     64
+#endif
+
+/* the number of macros in the -fpp-stats report */
+#ifndef DRIVER_PROFILE_TOP
+#define DRIVER_PROFILE_TOP  20
+#endif
+
+#ifndef DRIVER_TIME_TRACE
+#define DRIVER_TIME_TRACE   "time-trace.json"
+#endif
+
+
+typedef struct job_s {
+    const char *infile;
+    cstring_t output;               /* the preprocessed text of a worker, for -E */
+    bool failed;
+    bool done;
+    trace_t *trace;                 /* for -ftime-trace */
+    diagnostor_t *diag;             /* the sink of its stage */
+} job_t;
 
 
-static void parse_opts(option_t option, int argc, char *argv[]);
+typedef struct driver_s driver_t;
+
+
+typedef struct worker_s {
+    driver_t *driver;
+    size_t id;                      /* the thread id of its traces, the main thread is 0 */
+#if defined(UNIX)
+    pthread_t thread;
+#endif
+} worker_t;
+
+
+/**
+ * Workers take the next job in input order, the main thread writes the
+ * results in the same order as soon as a prefix of them is done, so the
+ * output does not depend on the number of workers.
+ **/
+struct driver_s {
+    job_t *jobs;
+    size_t njobs;
+    size_t next;
+    size_t nworkers;
+    cspool_t *csp;                  /* shared by the workers */
+    fcache_t *fcache;
+    int fd;                         /* where the jobs without workers print */
+    worker_t workers[DRIVER_MAX_JOBS];
+#if defined(UNIX)
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+#endif
+};
+
+
+static int __run__(int argc, char **argv, cspool_t *csp, fcache_t *fcache);
+static int __serve__(const char *path);
+static int __serve_request__(server_request_t *request, cspool_t *csp, fcache_t *fcache);
+static int __parse_opts__(int argc, char *argv[]);
+static void __usage__(void);
+static bool __parse_jobs__(const char *s);
+static void __compile__(driver_t *driver, job_t *job, int fd, size_t tid);
+static void __compile_stage__(driver_t *driver, job_t *job, int fd, size_t tid);
+static void __start_workers__(driver_t *driver, size_t nworkers);
+static void __join_workers__(driver_t *driver);
+static job_t* __next_job__(driver_t *driver);
+static void __finish_job__(driver_t *driver, job_t *job);
+static void __wait_job__(driver_t *driver, job_t *job);
+static cstring_t __replace_suffix__(const char *path, const char *suffix, bool strip_dir);
+static void __write_dependencies__(job_t *job, stage_t *stage, printer_t *printer);
+static bool __write_job__(FILE *fp, job_t *job);
+static void __write_time_trace__(driver_t *driver, uint64_t origin);
 
 
 int main(int argc, char **argv)
 {
-    option_t option;
-    
-    option = option_create();
+    cspool_t *csp;
+    fcache_t *fcache;
+    const char *path;
+    int status;
+
+    if (argc > 1 && strncmp(argv[1], "-fserver=", 9) == 0) {
+        return __serve__(argv[1] + 9);
+    }
 
-    parse_opts(option, argc, argv);
+    /* the server compiles, or this process when there is none */
+    if (argc > 1 && strncmp(argv[1], "-fclient=", 9) == 0) {
+        path = argv[1] + 9;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
 
-    option_destroy(option);
+        if ((status = server_forward(path, argc, argv)) >= 0) {
+            return status;
+        }
 
-    return 0;
+        /* nothing to stop */
+        if (argc == 2 && strcmp(argv[1], "-fserver-stop") == 0) {
+            return EXIT_SUCCESS;
+        }
+    }
+
+    csp = cspool_create();
+    fcache = fcache_create(csp);
+
+    status = __run__(argc, argv, csp, fcache);
+
+    fcache_destroy(fcache);
+    cspool_destroy(csp);
+
+    return status;
 }
 
 
-static 
-void parse_opts(option_t option, int argc, char *argv[])
+/**
+ * One run of the driver over the files of the arguments, with the string
+ * pool and the file cache left warm for the next one.
+ **/
+static
+int __run__(int argc, char **argv, cspool_t *csp, fcache_t *fcache)
 {
-    for (int i = 1; i < argc; i++) {
-        char *arg = argv[i];
+    driver_t driver;
+    const char *outfile;
+    FILE *fp;
+    uint64_t origin;
+    int status;
+    bool ok;
+    size_t i;
+
+    origin = NANOTIME();
+
+    if ((status = __parse_opts__(argc, argv)) >= 0) {
+        pfree((void*) option->infiles);
+        pfree((void*) option->include_paths);
+        return status;
+    }
+
+    /* -M writes the dependencies where the output goes, or to -MF */
+    outfile = option->Mflag && option->dep_file != NULL ? option->dep_file : option->outfile;
+
+    fp = stdout;
+    if ((option->Eflag || option->Mflag) && outfile[0] != '\0') {
+        if ((fp = fopen(outfile, "wb")) == NULL) {
+            errorf("cannot open output file '%s'", outfile);
+            pfree((void*) option->infiles);
+            pfree((void*) option->include_paths);
+            return EXIT_FAILURE;
+        }
+    }
+
+    driver.csp = csp;
+    driver.fcache = fcache;
+    driver.njobs = option->ninfiles;
+    driver.jobs = pmalloc(sizeof(job_t) * driver.njobs);
+    driver.next = 0;
+
+    for (i = 0; i < driver.njobs; i++) {
+        driver.jobs[i].infile = option->infiles[i];
+        driver.jobs[i].output = NULL;
+        driver.jobs[i].failed = false;
+        driver.jobs[i].done = false;
+        driver.jobs[i].trace = NULL;
+        driver.jobs[i].diag = NULL;
+    }
+
+    ok = true;
+
+    fflush(fp);
+    driver.fd = fileno(fp);
+
+    __start_workers__(&driver, option->jobs < driver.njobs ? option->jobs : driver.njobs);
+
+    for (i = 0; i < driver.njobs; i++) {
+        __wait_job__(&driver, &driver.jobs[i]);
+        if (!__write_job__(fp, &driver.jobs[i])) {
+            ok = false;
+        }
+    }
+
+    __join_workers__(&driver);
+
+    if (option->time_trace != NULL) {
+        __write_time_trace__(&driver, origin);
+    }
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    pfree(driver.jobs);
+    pfree((void*) option->infiles);
+    pfree((void*) option->include_paths);
+
+    report();
+
+    return ok && !has_error() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Compiles for the clients one at a time until one asks the server to
+ * stop, keeping the string pool and the file cache across compilations.
+ **/
+static
+int __serve__(const char *path)
+{
+    server_request_t request;
+    cspool_t *csp;
+    fcache_t *fcache;
+    int listener, status;
+    bool stop = false;
+
+    if ((listener = server_listen(path)) < 0) {
+        return EXIT_FAILURE;
+    }
+
+#if defined(UNIX)
+    /* a client going away must not take the server with it */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    csp = cspool_create();
+    fcache = fcache_create(csp);
+
+    diagnostor->resident = true;
+
+    while (!stop) {
+        if (!server_accept(listener, &request)) {
+            continue;
+        }
+
+        if (request.argc == 2 && strcmp(request.argv[1], "-fserver-stop") == 0) {
+            stop = true;
+            status = EXIT_SUCCESS;
+        } else {
+            status = __serve_request__(&request, csp, fcache);
+        }
+
+        server_reply(&request, status);
+        server_request_free(&request);
+    }
+
+#if defined(UNIX)
+    close(listener);
+    unlink(path);
+#endif
+
+    fcache_destroy(fcache);
+    cspool_destroy(csp);
+
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Runs the driver as if started by the client, in its directory and with
+ * its standard streams, from the default options and no diagnostics.
+ **/
+static
+int __serve_request__(server_request_t *request, cspool_t *csp, fcache_t *fcache)
+{
+#if defined(UNIX)
+    int saved[3];
+    int cwd, status, i;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < 3; i++) {
+        saved[i] = dup(i);
+        dup2(request->fds[i], i);
+    }
+
+    cwd = open(".", O_RDONLY);
+
+    option_init(option);
+    diagnostor_reset(diagnostor);
+
+    if (chdir((char*) request->cwd) != 0) {
+        errorf("cannot change to directory '%s'", (char*) request->cwd);
+        status = EXIT_FAILURE;
+
+    } else {
+        fcache_revalidate(fcache);
+        status = __run__(request->argc, request->argv, csp, fcache);
+    }
+
+    diagnostor_flush(diagnostor);
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+
+    if (cwd >= 0) {
+        if (fchdir(cwd) != 0) {
+            errorf("cannot change back to the directory of the server");
+        }
+        close(cwd);
+    }
+
+    return status;
+#else
+    (void) request;
+    (void) csp;
+    (void) fcache;
+    return EXIT_FAILURE;
+#endif
+}
+
+
+/* returns the exit status when the driver has nothing to run, else -1 */
+static
+int __parse_opts__(int argc, char *argv[])
+{
+    const char *arg;
+    int i;
+
+    option->infiles = pmalloc(sizeof(const char*) * argc);
+    option->ninfiles = 0;
+
+    option->include_paths = pmalloc(sizeof(const char*) * argc);
+    option->ninclude_paths = 0;
+
+    for (i = 1; i < argc; i++) {
+        arg = argv[i];
+
         if (strcmp(arg, "-o") == 0) {
             if (++i >= argc) {
-                printf("missing file name after '-o'");
+                errorf("missing filename after '-o'");
+                return EXIT_FAILURE;
             }
-            option->outfile = cstring_new(argv[i]);
-        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0 ||
-            strcmp(arg, "-v") == 0 || strcmp(arg, "--version") == 0) {
-            exit(EXIT_FAILURE);
-        } else if (!strcmp(arg, "-c")) {
+            option->outfile = argv[i];
+
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            __usage__();
+            return EXIT_SUCCESS;
+
+        } else if (strcmp(arg, "-c") == 0) {
             option->cflag = true;
-        } else if (!strcmp(arg, "-S")) {
+
+        } else if (strcmp(arg, "-S") == 0) {
             option->Sflag = true;
-        } else if (!strcmp(arg, "-E")) {
+
+        } else if (strcmp(arg, "-E") == 0) {
             option->Eflag = true;
-        } else if (!strcmp(arg, "-dump-ast")) {
+
+        } else if (strcmp(arg, "-P") == 0) {
+            option->Pflag = true;
+
+        } else if (strcmp(arg, "-fpp-stats") == 0) {
+            option->fpp_stats = true;
+
+        } else if (strcmp(arg, "-ftime-trace") == 0) {
+            option->time_trace = DRIVER_TIME_TRACE;
+
+        } else if (strncmp(arg, "-ftime-trace=", 13) == 0) {
+            if (arg[13] == '\0') {
+                errorf("missing filename after '-ftime-trace='");
+                return EXIT_FAILURE;
+            }
+            option->time_trace = arg + 13;
+
+        } else if (strncmp(arg, "-fdiagnostics-format=", 21) == 0) {
+            if (strcmp(arg + 21, "text") == 0) {
+                option->diagnostics_format = DIAGNOSTICS_FORMAT_TEXT;
+            } else if (strcmp(arg + 21, "json") == 0) {
+                option->diagnostics_format = DIAGNOSTICS_FORMAT_JSON;
+            } else if (strcmp(arg + 21, "sarif") == 0) {
+                option->diagnostics_format = DIAGNOSTICS_FORMAT_SARIF;
+            } else {
+                errorf("unknown diagnostics format: '%s'", arg + 21);
+                return EXIT_FAILURE;
+            }
+
+        } else if (strcmp(arg, "-Winvalid-utf8") == 0 || strcmp(arg, "-Wno-invalid-utf8") == 0) {
+            option->w_invalid_utf8 = arg[2] != 'n';
+
+        } else if (strcmp(arg, "-dump-ast") == 0) {
             option->dump_ast = true;
+
+        } else if (strncmp(arg, "-I", 2) == 0) {
+            if (arg[2] == '\0' && ++i >= argc) {
+                errorf("missing path after '-I'");
+                return EXIT_FAILURE;
+            }
+            option->include_paths[option->ninclude_paths++] = arg[2] != '\0' ? arg + 2 : argv[i];
+
+        } else if (strcmp(arg, "-M") == 0 || strcmp(arg, "-MM") == 0) {
+            option->Mflag = true;
+            option->MMflag = arg[2] == 'M';
+
+        } else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
+            option->MDflag = true;
+            option->MMflag = arg[2] == 'M';
+
+        } else if (strncmp(arg, "-MF", 3) == 0 || strncmp(arg, "-MT", 3) == 0) {
+            if (arg[3] == '\0' && ++i >= argc) {
+                errorf("missing filename after '%s'", arg);
+                return EXIT_FAILURE;
+            }
+            if (arg[2] == 'F') {
+                option->dep_file = arg[3] != '\0' ? arg + 3 : argv[i];
+            } else {
+                option->dep_target = arg[3] != '\0' ? arg + 3 : argv[i];
+            }
+
+        } else if (strcmp(arg, "-j") == 0) {
+            if (++i >= argc) {
+                errorf("missing number after '-j'");
+                return EXIT_FAILURE;
+            }
+            if (!__parse_jobs__(argv[i])) {
+                return EXIT_FAILURE;
+            }
+
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            if (!__parse_jobs__(arg + 2)) {
+                return EXIT_FAILURE;
+            }
+
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            errorf("unknown argument: '%s'", arg);
+            return EXIT_FAILURE;
+
+        } else {
+            option->infiles[option->ninfiles++] = arg;
         }
     }
-}
\ No newline at end of file
+
+    if (option->ninfiles == 0) {
+        errorf("no input files");
+        return EXIT_FAILURE;
+    }
+
+    if (option->ninfiles > 1 && option->outfile[0] != '\0' &&
+        (option->Eflag || option->cflag || option->Sflag)) {
+        errorf("cannot specify -o with -c, -S or -E with multiple files");
+        return EXIT_FAILURE;
+    }
+
+    if (option->ninfiles > 1 && option->dep_file != NULL && !option->Mflag) {
+        errorf("cannot specify -MF with multiple files");
+        return EXIT_FAILURE;
+    }
+
+    option->infile = option->infiles[0];
+    return -1;
+}
+
+
+static
+void __usage__(void)
+{
+    printf("usage: xcc [options] file...\n"
+           "       xcc -fserver=<socket>\n"
+           "       xcc -fclient=<socket> [options] file...\n"
+           "  -E          preprocess only\n"
+           "  -P          no line markers in the preprocessed output\n"
+           "  -fpp-stats  report the macros which cost the most to expand\n"
+           "  -ftime-trace[=<file>]\n"
+           "              write the time spent in each stage as a Chrome trace\n"
+           "  -fdiagnostics-format=<text|json|sarif>\n"
+           "              write the diagnostics as text, as a JSON object a line\n"
+           "              or as a SARIF log\n"
+           "  -I <dir>    add <dir> to the include search path\n"
+           "  -Winvalid-utf8\n"
+           "              warn of a source file that is not valid UTF-8\n"
+           "  -M, -MM     write the make dependencies instead of the output,\n"
+           "              without the system headers for -MM\n"
+           "  -MD, -MMD   write the make dependencies along with the output\n"
+           "  -MF <file>  write the dependencies to <file>\n"
+           "  -MT <target>\n"
+           "              the target of the dependencies\n"
+           "  -o <file>   place the output into <file>\n"
+           "  -j <n>      process the input files with <n> workers\n"
+           "  -fserver=<socket>\n"
+           "              compile for the clients of <socket> with warm caches,\n"
+           "              until one of them passes -fserver-stop\n"
+           "  -fclient=<socket>\n"
+           "              have the server of <socket> compile, if there is one\n");
+}
+
+
+static
+bool __parse_jobs__(const char *s)
+{
+    char *end;
+    long n;
+
+    n = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || n < 1) {
+        errorf("invalid number of jobs: '%s'", s);
+        return false;
+    }
+
+    option->jobs = n > DRIVER_MAX_JOBS ? DRIVER_MAX_JOBS : (size_t) n;
+    return true;
+}
+
+
+/**
+ * Prints the preprocessed file to fd, or into the output of the job when
+ * fd is -1 so that a worker does not write ahead of the previous files.
+ * The lexer is pulled by the preprocessor, its time is in the span of the
+ * Preprocessor stage. The diagnostics go to the sink of the job, which is
+ * the diagnostor of the thread meanwhile.
+ **/
+static
+void __compile__(driver_t *driver, job_t *job, int fd, size_t tid)
+{
+    diagnostor_t *diag;
+
+    job->diag = diagnostor_create();
+    job->diag->sink = true;
+
+    diag = diagnostor;
+    diagnostor = job->diag;
+
+    __compile_stage__(driver, job, fd, tid);
+
+    diagnostor = diag;
+}
+
+
+static
+void __compile_stage__(driver_t *driver, job_t *job, int fd, size_t tid)
+{
+    stage_t *stage;
+    printer_t *printer;
+    token_t *tok;
+    token_type_t type;
+    trace_t *trace = NULL;
+    size_t i;
+
+    if (option->time_trace != NULL) {
+        trace = job->trace = trace_create(tid);
+        trace_begin(trace, "driver", job->infile);
+        trace_begin(trace, "stage", stage_name(STAGE_READER));
+    }
+
+    stage = stage_create(driver->csp, driver->fcache);
+
+    for (i = 0; i < option->ninclude_paths; i++) {
+        preprocessor_add_include_path(stage->pp, option->include_paths[i]);
+    }
+
+    if (!lexer_push(stage->lexer, STREAM_TYPE_FILE, job->infile)) {
+        job->failed = true;
+        stage_destroy(stage);
+        if (trace != NULL) {
+            trace_end(trace, NULL);
+            trace_end(trace, NULL);
+        }
+        return;
+    }
+
+    if (trace != NULL) {
+        trace_end(trace, "\"bytes\":%lu", (unsigned long) reader_size(stage->lexer->reader));
+        trace_begin(trace, "stage", stage_name(STAGE_PREPROCESSOR));
+        preprocessor_set_trace(stage->pp, trace);
+    }
+
+    if (option->fpp_stats) {
+        preprocessor_enable_profile(stage->pp);
+    }
+
+    if (option->Eflag && !option->Mflag) {
+        printer = printer_create(fd);
+        printer->line_markers = !option->Pflag;
+
+        if (!printer_preprocess(printer, stage->pp)) {
+            errorf("cannot write the output of '%s'", job->infile);
+        }
+
+        if (fd < 0) {
+            job->output = printer_release(printer);
+        }
+
+        printer_destroy(printer);
+
+    } else {
+        /* nothing follows the preprocessor yet, check the tokens only */
+        do {
+            tok = preprocessor_expand(stage->pp);
+            type = tok->type;
+            token_destroy(tok);
+        } while (type != TOKEN_END);
+    }
+
+    if (trace != NULL) {
+        trace_end(trace, "\"tokens\":%lu", (unsigned long) stage->pp->trace_tokens);
+    }
+
+    if (option->Mflag) {
+        printer = printer_create(fd);
+        __write_dependencies__(job, stage, printer);
+
+        if (fd < 0) {
+            job->output = printer_release(printer);
+        }
+
+        printer_destroy(printer);
+
+    } else if (option->MDflag) {
+        __write_dependencies__(job, stage, NULL);
+    }
+
+    if (option->fpp_stats) {
+#if defined(UNIX)
+        flockfile(stderr);
+#endif
+        fprintf(stderr, "%s:\n", job->infile);
+        preprocessor_report_profile(stage->pp, stderr, DRIVER_PROFILE_TOP);
+#if defined(UNIX)
+        funlockfile(stderr);
+#endif
+    }
+
+    stage_destroy(stage);
+
+    if (trace != NULL) {
+        trace_end(trace, NULL);
+    }
+}
+
+
+#if defined(UNIX)
+
+static
+void* __worker__(void *arg)
+{
+    worker_t *worker = arg;
+    driver_t *driver = worker->driver;
+    job_t *job;
+
+    while ((job = __next_job__(driver)) != NULL) {
+        __compile__(driver, job, -1, worker->id);
+        __finish_job__(driver, job);
+    }
+
+    return NULL;
+}
+
+#endif
+
+
+static
+void __start_workers__(driver_t *driver, size_t nworkers)
+{
+#if defined(UNIX)
+    worker_t *worker;
+#endif
+
+    driver->nworkers = 0;
+
+#if defined(UNIX)
+    if (nworkers > 1) {
+        pthread_mutex_init(&driver->mutex, NULL);
+        pthread_cond_init(&driver->done, NULL);
+
+        while (driver->nworkers < nworkers) {
+            worker = &driver->workers[driver->nworkers];
+            worker->driver = driver;
+            worker->id = driver->nworkers + 1;
+
+            if (pthread_create(&worker->thread, NULL, __worker__, worker) != 0) {
+                break;
+            }
+            driver->nworkers++;
+        }
+
+        if (driver->nworkers != 0) {
+            return;
+        }
+
+        pthread_cond_destroy(&driver->done);
+        pthread_mutex_destroy(&driver->mutex);
+    }
+#else
+    (void) nworkers;
+#endif
+
+    /* no workers, the jobs are compiled in place by __wait_job__() */
+}
+
+
+static
+void __join_workers__(driver_t *driver)
+{
+#if defined(UNIX)
+    size_t i;
+
+    if (driver->nworkers != 0) {
+        for (i = 0; i < driver->nworkers; i++) {
+            pthread_join(driver->workers[i].thread, NULL);
+        }
+
+        pthread_cond_destroy(&driver->done);
+        pthread_mutex_destroy(&driver->mutex);
+    }
+#endif
+}
+
+
+static
+job_t* __next_job__(driver_t *driver)
+{
+    job_t *job = NULL;
+
+#if defined(UNIX)
+    pthread_mutex_lock(&driver->mutex);
+#endif
+
+    if (driver->next < driver->njobs) {
+        job = &driver->jobs[driver->next++];
+    }
+
+#if defined(UNIX)
+    pthread_mutex_unlock(&driver->mutex);
+#endif
+
+    return job;
+}
+
+
+static
+void __finish_job__(driver_t *driver, job_t *job)
+{
+#if defined(UNIX)
+    pthread_mutex_lock(&driver->mutex);
+    job->done = true;
+    pthread_cond_broadcast(&driver->done);
+    pthread_mutex_unlock(&driver->mutex);
+#else
+    (void) driver;
+    job->done = true;
+#endif
+}
+
+
+static
+void __wait_job__(driver_t *driver, job_t *job)
+{
+    if (driver->nworkers == 0) {
+        __compile__(driver, job, driver->fd, 0);
+        job->done = true;
+        return;
+    }
+
+#if defined(UNIX)
+    pthread_mutex_lock(&driver->mutex);
+    while (!job->done) {
+        pthread_cond_wait(&driver->done, &driver->mutex);
+    }
+    pthread_mutex_unlock(&driver->mutex);
+#endif
+}
+
+
+/**
+ * The path with its suffix replaced, or added if it has none, and its
+ * directories stripped if asked for.
+ **/
+static
+cstring_t __replace_suffix__(const char *path, const char *suffix, bool strip_dir)
+{
+    const char *base, *dot;
+
+    base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+
+    dot = strrchr(base, '.');
+    if (dot == NULL || dot == base) {
+        dot = base + strlen(base);
+    }
+
+    if (strip_dir) {
+        path = base;
+    }
+
+    return cstring_concat_n(cstring_new_n(path, dot - path), suffix, strlen(suffix));
+}
+
+
+/**
+ * Writes the Make rule of the job to the printer for -M, or else to the
+ * file of -MF or the one named after the output or the input for -MD.
+ **/
+static
+void __write_dependencies__(job_t *job, stage_t *stage, printer_t *printer)
+{
+    cstring_t target, filename, rule;
+    bool has_outfile;
+    FILE *fp;
+
+    has_outfile = option->outfile[0] != '\0';
+
+    if (option->dep_target != NULL) {
+        target = cstring_new(option->dep_target);
+    } else if (option->MDflag && has_outfile && !option->Eflag && !option->Mflag) {
+        target = cstring_new(option->outfile);
+    } else {
+        target = __replace_suffix__(job->infile, ".o", true);
+    }
+
+    rule = preprocessor_dependencies(stage->pp, (char*) target, job->infile, !option->MMflag);
+
+    if (printer != NULL) {
+        printer_write(printer, rule, cstring_length(rule));
+        if (!printer_flush(printer)) {
+            errorf("cannot write the dependencies of '%s'", job->infile);
+        }
+
+    } else {
+        if (option->dep_file != NULL) {
+            filename = cstring_new(option->dep_file);
+        } else if (has_outfile) {
+            filename = __replace_suffix__(option->outfile, ".d", false);
+        } else {
+            filename = __replace_suffix__(job->infile, ".d", true);
+        }
+
+        if ((fp = fopen((char*) filename, "w")) == NULL) {
+            errorf("cannot open dependency file '%s'", (char*) filename);
+        } else {
+            fwrite(rule, 1, cstring_length(rule), fp);
+            if (fclose(fp) != 0) {
+                errorf("cannot write dependency file '%s'", (char*) filename);
+            }
+        }
+
+        cstring_free(filename);
+    }
+
+    cstring_free(rule);
+    cstring_free(target);
+}
+
+
+/* the output of a job, then its diagnostics, whatever the worker was */
+static
+bool __write_job__(FILE *fp, job_t *job)
+{
+    if (job->failed) {
+        errorf("%s: No such file or directory", job->infile);
+    }
+
+    if (job->output != NULL) {
+        fflush(fp);
+        fwrite(job->output, 1, cstring_length(job->output), fp);
+        fflush(fp);
+        cstring_free(job->output);
+        job->output = NULL;
+    }
+
+    if (job->diag != NULL) {
+        diagnostor_merge(diagnostor, job->diag);
+        diagnostor_destroy(job->diag);
+        job->diag = NULL;
+    }
+
+    return !job->failed;
+}
+
+
+/**
+ * Writes the traces of all the jobs to one file, with the start of the
+ * driver as time zero.
+ **/
+static
+void __write_time_trace__(driver_t *driver, uint64_t origin)
+{
+    trace_t **traces;
+    FILE *fp;
+    size_t i;
+
+    traces = pmalloc(sizeof(trace_t*) * driver->njobs);
+    for (i = 0; i < driver->njobs; i++) {
+        traces[i] = driver->jobs[i].trace;
+    }
+
+    if ((fp = fopen(option->time_trace, "w")) == NULL) {
+        errorf("cannot open time trace file '%s'", option->time_trace);
+    } else {
+        if (!trace_write(fp, traces, driver->njobs, origin)) {
+            errorf("cannot write time trace file '%s'", option->time_trace);
+        }
+        fclose(fp);
+    }
+
+    for (i = 0; i < driver->njobs; i++) {
+        if (traces[i] != NULL) {
+            trace_destroy(traces[i]);
+        }
+    }
+
+    pfree(traces);
+}
@@ -9,13 +9,28 @@ static option_t __option__ = {
     LANG_STANDARD_DEFAULT,
     "",
     "",
+    NULL,
+    0,
+    1,
+    NULL,
+    NULL,
+    0,
+    NULL,
+    NULL,
     5,
+    DIAGNOSTICS_FORMAT_TEXT,
+    false,
+    false,
+    false,
+    false,
+    false,
     false,
     false,
     false,
     false,
     true,
     true,
+    false,
     true,
     true,
 };
@@ -48,11 +63,26 @@ void option_init(option_t *opt)
     opt->lang = LANG_STANDARD_DEFAULT;
     opt->infile = "";
     opt->outfile = "";
+    opt->infiles = NULL;
+    opt->ninfiles = 0;
+    opt->jobs = 1;
+    opt->time_trace = NULL;
+    opt->include_paths = NULL;
+    opt->ninclude_paths = 0;
+    opt->dep_file = NULL;
+    opt->dep_target = NULL;
     opt->ferror_limit = 5;
+    opt->diagnostics_format = DIAGNOSTICS_FORMAT_TEXT;
     opt->cflag = false;
     opt->Eflag = false;
+    opt->Pflag = false;
+    opt->fpp_stats = false;
+    opt->Mflag = false;
+    opt->MDflag = false;
+    opt->MMflag = false;
     opt->w_unterminated_comment = true;
     opt->w_backslash_newline_space = true;
+    opt->w_invalid_utf8 = false;
     opt->warn_no_newline_eof = true;
     opt->reserve_comment = true;
 }
@@ -19,21 +19,46 @@ typedef enum lang_standard_e {
 } lang_standard_t;
 
 
+typedef enum diagnostics_format_e {
+    DIAGNOSTICS_FORMAT_TEXT,
+    DIAGNOSTICS_FORMAT_JSON,            /* a JSON object a line */
+    DIAGNOSTICS_FORMAT_SARIF,           /* a SARIF 2.1.0 log */
+} diagnostics_format_t;
+
+
 typedef struct option_s {
     lang_standard_t lang;
 
     const char* infile;
     const char* outfile;
 
+    const char **infiles;
+    size_t ninfiles;
+    size_t jobs;                        /* -j, the number of workers */
+    const char *time_trace;             /* -ftime-trace, NULL when off */
+
+    const char **include_paths;         /* -I */
+    size_t ninclude_paths;
+
+    const char *dep_file;               /* -MF */
+    const char *dep_target;             /* -MT */
+
     size_t ferror_limit;
+    diagnostics_format_t diagnostics_format;    /* -fdiagnostics-format */
 
     bool cflag: 1;
     bool Sflag: 1;
     bool Eflag: 1;
+    bool Pflag: 1;
     bool dump_ast: 1;
+    bool fpp_stats: 1;
+    bool Mflag: 1;                      /* -M, -MM: the dependencies instead of the output */
+    bool MDflag: 1;                     /* -MD, -MMD: the dependencies along with it */
+    bool MMflag: 1;                     /* without the system headers */
 
     bool w_unterminated_comment: 1;
     bool w_backslash_newline_space: 1;
+    bool w_invalid_utf8: 1;
     bool warn_no_newline_eof: 1;
     bool reserve_comment: 1;
 } option_t;
@@ -5,31 +5,68 @@
 #include "cstring.h"
 #include "pmalloc.h"
 #include "token.h"
+#include "reader.h"
 #include "lexer.h"
 #include "diagnostor.h"
+#include "dict.h"
 #include "map.h"
 #include "set.h"
+#include "number.h"
+#include "utils.h"
+#include "trace.h"
+#include "fcache.h"
+#include "encoding.h"
 #include "preprocessor.h"
 
 
-#undef  ERRORF_WITH_TOKEN
-#define ERRORF_WITH_TOKEN(tok, fmt, ...) \
-    diag_errorf_with_tok((pp)->diag, (tok), fmt, __VA_ARGS__)
+#if defined(UNIX)
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#endif
 
 
-#undef  WARNINGF_WITH_TOKEN
-#define WARNINGF_WITH_TOKEN(tok, fmt, ...) \
-    diag_warningf_with_tok((pp)->diag, (tok), fmt, __VA_ARGS__)
+typedef struct include_s {
+    size_t conditions;              /* the depth of the condition stack at the #include */
+    bool system;
+} include_t;
+
+
+/**
+ * The bytes of an #embed, mapped from the file, or read into memory
+ * where it cannot be mapped.
+ **/
+typedef struct embed_s {
+    token_embed_t bytes;
+    void *map;
+    size_t length;                  /* of the mapping, 0 if read */
+} embed_t;
+
+
+/* the parameters of an #embed, the token lists are NULL when not given */
+typedef struct embed_params_s {
+    token_t *limit_token;
+    size_t limit;
+    array_t *prefix;
+    array_t *suffix;
+    array_t *if_empty;
+} embed_params_t;
 
 
-#undef  ERRORF_WITH_LOC
-#define ERRORF_WITH_LOC(loc, fmt, ...) \
-    diag_errorf_with_loc((pp)->diag, (loc), fmt, __VA_ARGS__)
+typedef struct trace_file_s {
+    size_t tokens;                  /* tokens returned when the file was entered */
+    size_t bytes;
+} trace_file_t;
 
 
-#undef  WARNINGF_WITH_LOC
-#define WARNINGF_WITH_LOC(loc, fmt, ...) \
-    diag_warningf_with_loc((pp)->diag, (loc), fmt, __VA_ARGS__)
+#undef  ERRORF_WITH_TOKEN
+#define ERRORF_WITH_TOKEN(tok, ...) \
+    errorf_with_token((tok), __VA_ARGS__)
+
+
+#undef  WARNINGF_WITH_TOKEN
+#define WARNINGF_WITH_TOKEN(tok, ...) \
+    warningf_with_token((tok), __VA_ARGS__)
 
 
 #ifndef TOKEN_EXPAND_NUMBER
@@ -46,55 +83,208 @@
 #define NATIVE_MACRO_DATE       "__DATE__"
 
 
-static token_t __preprocessor_expand__(preprocessor_t pp);
-static bool __preprocessor_parse_directive__(preprocessor_t pp, token_t hash);
-static inline array_t __preprocessor_substitute__(preprocessor_t pp, macro_t macro, map_t args, set_t hideset);
-static inline void __preprocessor_unget_tokens__(preprocessor_t pp, array_t tokens);
-static inline bool __preprocessor_parse_define__(preprocessor_t pp);
-static inline bool __preprocessor_predefined_std_include_paths__(preprocessor_t pp);
+typedef struct condition_cache_entry_s {
+    bool value;
+    array_t *names;             /* cstring_t, macros looked up while evaluating */
+    array_t *generations;       /* uint64_t, their generations at that time */
+} condition_cache_entry_t;
+
+
+typedef enum hideset_op_e {
+    HIDESET_ADD,
+    HIDESET_UNION,
+    HIDESET_INTERSECTION
+} hideset_op_t;
+
+
+/* a hideset operation by the pointers of its operands, see hideset_cache */
+typedef struct hideset_key_s {
+    hideset_op_t op;
+    const void *a;
+    const void *b;
+} hideset_key_t;
+
+
+static inline token_t* __preprocessor_next__(preprocessor_t *pp, bool newlines);
+static token_t* __preprocessor_expand__(preprocessor_t *pp);
+static bool __preprocessor_parse_directive__(preprocessor_t *pp, token_t *hash);
+static inline void __preprocessor_substitute__(preprocessor_t *pp, token_t *macroname_token,
+    macro_t *macro, map_t *args, set_t *hideset, token_vec_t *expand_tokens);
+static inline void __preprocessor_unget_tokens__(preprocessor_t *pp, array_t *tokens);
+static inline void __preprocessor_unget_expansion__(preprocessor_t *pp, token_vec_t *tokens);
+static inline bool __preprocessor_parse_define__(preprocessor_t *pp);
+static inline bool __preprocessor_predefined_std_include_paths__(preprocessor_t *pp);
+static inline void __preprocessor_skip_one_line__(preprocessor_t *pp);
+static void __preprocessor_skip_group__(preprocessor_t *pp);
+static void __preprocessor_check_unterminated__(preprocessor_t *pp, token_t *tok);
+static void __preprocessor_trace_enter_file__(preprocessor_t *pp);
+static void __preprocessor_trace_leave_file__(preprocessor_t *pp);
+static void __preprocessor_trace_token__(preprocessor_t *pp, token_t *tok);
+static inline macro_t* __preprocessor_find_macro__(preprocessor_t *pp, cstring_t name);
+static inline void __preprocessor_touch_macro__(preprocessor_t *pp, cstring_t name);
+static inline void __preprocessor_filter_add__(preprocessor_t *pp, cstring_t name);
+static inline void __preprocessor_filter_del__(preprocessor_t *pp, cstring_t name);
+static void __condition_cache_entry_destroy__(condition_cache_entry_t *entry);
+static void __embed_destroy__(embed_t *embed);
+
+
+static inline
+uint64_t __hideset_key_hash_fn__(const void *key)
+{
+    const hideset_key_t *k = key;
+    uint64_t h;
+
+    h = (uint64_t)(uintptr_t)k->a * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)(uintptr_t)k->b + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+
+    return h ^ (uint64_t)k->op;
+}
+
+
+static inline
+void* __hideset_key_dup_fn__(void *privdata, const void *key)
+{
+    hideset_key_t *dup;
+    DICT_NOTUSED(privdata);
+
+    dup = pmalloc(sizeof(hideset_key_t));
+    *dup = *(const hideset_key_t*)key;
+
+    return dup;
+}
+
+
+static inline
+int __hideset_key_compare_fn__(void *privdata, const void *key1, const void *key2)
+{
+    const hideset_key_t *k1 = key1, *k2 = key2;
+    DICT_NOTUSED(privdata);
+
+    return k1->op == k2->op && k1->a == k2->a && k1->b == k2->b;
+}
+
+
+static inline
+void __hideset_key_free_fn__(void *privdata, void *key)
+{
+    DICT_NOTUSED(privdata);
+    pfree(key);
+}
+
+
+/* the results are interned, the cache does not own them */
+static dict_type_t __hideset_cache_dict_type__ = {
+    __hideset_key_hash_fn__,
+    __hideset_key_dup_fn__,
+    NULL,
+    __hideset_key_compare_fn__,
+    __hideset_key_free_fn__,
+    NULL
+};
 
 
 static inline
-void __preprocessor_add_macro__(preprocessor_t pp, token_t macroname_token,
+void __preprocessor_add_macro__(preprocessor_t *pp, token_t *macroname_token,
     macro_type_t type, native_macro_pt native_macro_fn,
-    array_t body, array_t params, bool is_variadic);
+    array_t *body, array_t *params, bool is_variadic);
 static inline
-macro_t __macro_create__(macro_type_t type, token_t macroname_token, 
-    native_macro_pt native_macro_fn, array_t body, array_t params, bool is_variadic);
+macro_t* __macro_create__(macro_type_t type, token_t *macroname_token,
+    native_macro_pt native_macro_fn, array_t *body, array_t *params, bool is_variadic);
 static inline
-void __macro_destroy__(macro_t macro);
+void __macro_destroy__(macro_t *macro);
+
+static set_t* __preprocessor_hideset_add__(preprocessor_t *pp, set_t *hideset, macro_t *macro);
+static set_t* __preprocessor_hideset_union__(preprocessor_t *pp, set_t *a, set_t *b);
+static set_t* __preprocessor_hideset_intersection__(preprocessor_t *pp, set_t *a, set_t *b);
 
-static array_t __create_tokens__(void);
-static void __destroy_tokens__(array_t a);
+static array_t* __create_tokens__(void);
+static void __destroy_tokens__(array_t *a);
 
 
-preprocessor_t preprocessor_create(lexer_t lexer, option_t option, diag_t diag)
+preprocessor_t* preprocessor_create(lexer_t *lexer)
 {
-    preprocessor_t pp;
+    preprocessor_t *pp;
 
-    pp = (preprocessor_t) pmalloc(sizeof(struct preprocessor_s));
+    pp = (preprocessor_t*) pmalloc(sizeof(preprocessor_t));
 
     pp->std_include_paths = array_create_n(sizeof(cstring_t), 8);
+    pp->include_stack = array_create_n(sizeof(include_t), 8);
+    pp->includes = array_create_n(sizeof(include_file_t), 16);
+    pp->included = set_create();
+    pp->embeds = array_create_n(sizeof(embed_t*), 4);
+    pp->fcache = NULL;
+    pp->condition_directive_stack = array_create_n(sizeof(condition_directive_t), 8);
+    pp->snapshot = NULL;
     pp->macros = map_create();
+    pp->include_guard = NULL;
+    pp->once_guard = set_create();
+    pp->retired_macros = array_create_n(sizeof(macro_t*), 8);
+    pp->retired_args = array_create_n(sizeof(token_t*), 64);
+    pp->hidesets = map_create();
+    pp->hideset_cache = dict_create(&__hideset_cache_dict_type__, NULL);
+    pp->condition_cache = map_create();
+    pp->macro_generations = map_create();
+    pp->condition_trace = NULL;
+    pp->condition_cacheable = false;
     pp->lexer = lexer;
-    pp->diag = diag;
+
+    memset(pp->macro_filter, 0, sizeof(pp->macro_filter));
+    memset(&pp->stats, 0, sizeof(pp->stats));
+
+    pp->macro_profiles = NULL;
+    pp->profile = NULL;
+
+    pp->trace = NULL;
+    pp->trace_files = NULL;
+    pp->trace_tokens = 0;
+
+    pp->include_hook = NULL;
+    pp->include_hook_data = NULL;
 
     __preprocessor_predefined_std_include_paths__(pp);
+    pp->system_include_paths = array_length(pp->std_include_paths);
 
     return pp;
 }
 
 
-void map_scan_fn(void *privdata, const void *key, const void *value)
+static
+void __macro_scan_fn__(void *privdata, const void *key, const void *value)
 {
-    macro_t macro = (macro_t)value;
+    macro_t *macro = (macro_t*)value;
     __macro_destroy__(macro);
 }
 
 
-void preprocessor_destroy(preprocessor_t pp)
+static
+void __hideset_scan_fn__(void *privdata, const void *key, const void *value)
+{
+    set_destroy((set_t*)value);
+}
+
+
+static
+void __condition_cache_scan_fn__(void *privdata, const void *key, const void *value)
+{
+    __condition_cache_entry_destroy__((condition_cache_entry_t*)value);
+}
+
+
+static
+void __macro_profile_scan_fn__(void *privdata, const void *key, const void *value)
+{
+    macro_profile_t *profile = (macro_profile_t*)value;
+    cstring_free(profile->name);
+    pfree(profile);
+}
+
+
+void preprocessor_destroy(preprocessor_t *pp)
 {
     cstring_t *std_include_paths;
+    condition_directive_t *condition_directives;
+    embed_t **embeds;
+    macro_t **macros;
     size_t i;
 
     array_foreach(pp->std_include_paths, std_include_paths, i) {
@@ -102,755 +292,3275 @@ void preprocessor_destroy(preprocessor_t pp)
     }
 
     array_destroy(pp->std_include_paths);
-    
-    map_scan(pp->macros, map_scan_fn, NULL);
+
+    array_destroy(pp->include_stack);
+    array_destroy(pp->includes);
+    set_destroy(pp->included);
+    set_destroy(pp->once_guard);
+
+    array_foreach(pp->embeds, embeds, i) {
+        __embed_destroy__(embeds[i]);
+    }
+
+    array_destroy(pp->embeds);
+
+    array_foreach(pp->condition_directive_stack, condition_directives, i) {
+        token_destroy(condition_directives[i].token);
+    }
+
+    array_destroy(pp->condition_directive_stack);
+
+    map_scan(pp->macros, __macro_scan_fn__, NULL);
 
     map_destroy(pp->macros);
 
+    array_foreach(pp->retired_macros, macros, i) {
+        __macro_destroy__(macros[i]);
+    }
+
+    array_destroy(pp->retired_macros);
+
+    __destroy_tokens__(pp->retired_args);
+
+    map_scan(pp->hidesets, __hideset_scan_fn__, NULL);
+
+    map_destroy(pp->hidesets);
+
+    dict_destroy(pp->hideset_cache);
+
+    map_scan(pp->condition_cache, __condition_cache_scan_fn__, NULL);
+
+    map_destroy(pp->condition_cache);
+
+    map_destroy(pp->macro_generations);
+
+    if (pp->macro_profiles != NULL) {
+        map_scan(pp->macro_profiles, __macro_profile_scan_fn__, NULL);
+        map_destroy(pp->macro_profiles);
+    }
+
+    if (pp->trace_files != NULL) {
+        array_destroy(pp->trace_files);
+    }
+
     pfree(pp);
 }
 
 
-void preprocessor_add_include_path(preprocessor_t pp, const char *path)
+void preprocessor_add_include_path(preprocessor_t *pp, const char *path)
 {
     array_cast_append(cstring_t, pp->std_include_paths, cstring_new(path));
 }
 
 
-token_t preprocessor_expand(preprocessor_t pp)
+/**
+ * The next token, with the directives run and the newlines kept or not.
+ * The one loop behind preprocessor_expand(), preprocessor_get() and
+ * preprocessor_get_n(), inlined in each.
+ **/
+static inline
+token_t* __preprocessor_next__(preprocessor_t *pp, bool newlines)
 {
+    token_t *tok;
+
     for (;;) {
-        token_t tok = __preprocessor_expand__(pp);
-        if (__preprocessor_parse_directive__(pp, tok)) {
-            continue;
+        tok = __preprocessor_expand__(pp);
+
+        switch (tok->type) {
+        case TOKEN_NEWLINE:
+            if (!newlines) {
+                token_destroy(tok);
+                continue;
+            }
+            break;
+
+        case TOKEN_HASH:
+            if (__preprocessor_parse_directive__(pp, tok)) {
+                continue;
+            }
+            break;
+
+        case TOKEN_EOF:
+        case TOKEN_END:
+            __preprocessor_check_unterminated__(pp, tok);
+            break;
+
+        default:
+            break;
+        }
+
+        if (pp->trace != NULL) {
+            __preprocessor_trace_token__(pp, tok);
         }
+
         return tok;
     }
 }
 
 
-token_t preprocessor_peek(preprocessor_t pp)
+token_t* preprocessor_expand(preprocessor_t *pp)
 {
-    token_t tok = preprocessor_get(pp);
-    if (tok->type != TOKEN_END) preprocessor_unget(pp, tok);
-    return tok;
+    return __preprocessor_next__(pp, true);
 }
 
 
-token_t preprocessor_get(preprocessor_t pp)
+token_t* preprocessor_peek(preprocessor_t *pp)
 {
-    for (;;) {
-        token_t tok = preprocessor_expand(pp);
-        if (tok->type == TOKEN_NEWLINE) {
-            continue;
-        }
-        return tok;
-    }
+    token_t *tok = preprocessor_get(pp);
+    if (tok->type != TOKEN_END) preprocessor_unget(pp, tok);
+    return tok;
 }
 
 
-void preprocessor_unget(preprocessor_t pp, token_t tok)
+token_t* preprocessor_get(preprocessor_t *pp)
 {
-    assert(tok && tok->type != TOKEN_END);
-    lexer_unget(pp->lexer, tok);
+    return __preprocessor_next__(pp, false);
 }
 
 
-static inline
-bool __preprocessor_predefined_std_include_paths__(preprocessor_t pp)
+/**
+ * Fills tokens with up to n tokens as preprocessor_get() would return
+ * them, stopping after TOKEN_END, without a call per token and without
+ * pushing back to peek. Returns the number of tokens, owned by the caller.
+ **/
+size_t preprocessor_get_n(preprocessor_t *pp, token_t **tokens, size_t n)
 {
-    const char *std_paths[] = {
-        "/usr/local/lib/occ/include",
-        "/usr/local/include",
-        "/usr/include",
-        "/usr/include/linux",
-        "/usr/include/x86_64-linux-gnu",
-    };
+    size_t i = 0;
 
-    size_t npaths = sizeof(std_paths) / sizeof(const char*);
-    size_t i;
-
-    for (i = 0; i < npaths; i++) {
-        preprocessor_add_include_path(pp, std_paths[i]);
+    while (i < n) {
+        tokens[i] = __preprocessor_next__(pp, false);
+        if (tokens[i++]->type == TOKEN_END) {
+            break;
+        }
     }
 
-    return true;
+    return i;
 }
 
 
-static inline
-void __propagate_space__(array_t expand_tokens, token_t token)
+void preprocessor_unget(preprocessor_t *pp, token_t *tok)
 {
-    if ((expand_tokens != NULL) && (array_length(expand_tokens) > 0)) {
-        token_t t = array_cast_front(token_t, expand_tokens);
-        t->spaces = token->spaces;
-    }
+    assert(tok && tok->type != TOKEN_END);
+    lexer_unget(pp->lexer, tok);
 }
 
 
-static inline
-void __preprocessor_expand_object_macro__(preprocessor_t pp, token_t token, macro_t macro)
+/* the length of a name escaped for Make */
+static
+size_t __preprocessor_make_name_length__(const unsigned char *name)
 {
-    array_t expand_tokens;
-    set_t hideset;
-
-    hideset = token->hideset ? set_dup(token->hideset) : set_create();
-
-    set_add(hideset, token->cs);
-
-    expand_tokens = __preprocessor_substitute__(pp, macro, NULL, hideset);
-
-    __propagate_space__(expand_tokens, token);
-
-    __preprocessor_unget_tokens__(pp, expand_tokens);
-
-    set_destroy(hideset);
+    size_t n;
 
-    token_destroy(token);
+    for (n = 0; *name; name++, n++) {
+        if (*name == ' ' || *name == '\t' || *name == '#' || *name == '$') {
+            n++;
+        }
+    }
 
-    array_destroy(expand_tokens);
+    return n;
 }
 
 
+/* appends a name escaped for Make to cs */
 static
-array_t __preprocessor_parse_function_like_argument__(preprocessor_t pp, bool is_vararg)
+cstring_t __preprocessor_escape_make_name__(cstring_t cs, const unsigned char *name)
 {
-    array_t arg = __create_tokens__();
-    size_t level = 0;
-
-    for (; !lexer_is_eos(pp->lexer); ) {
-        token_t token = lexer_peek(pp->lexer);
-        if (((token->type == TOKEN_R_PAREN) || 
-             (token->type == TOKEN_COMMA && is_vararg == false)) && level == 0) {
-            break;
-        }
-
-        if (token->type == TOKEN_L_PAREN) {
-            level++;
-        }
-
-        if (token->type == TOKEN_R_PAREN) {
-            level--;
+    for (; *name; name++) {
+        if (*name == ' ' || *name == '\t' || *name == '#') {
+            cs = cstring_push_ch(cs, '\\');
+        } else if (*name == '$') {
+            cs = cstring_push_ch(cs, '$');
         }
-
-        array_cast_append(token_t, arg, token);
-        lexer_get(pp->lexer);
+        cs = cstring_push_ch(cs, *name);
     }
 
-    return arg;
+    return cs;
 }
 
 
-static
-bool __preprocessor_parse_function_like_arguments__(preprocessor_t pp, 
-    token_t macroname_token, macro_t macro, map_t args)
+/**
+ * The Make rule of target on the source and every file it included, the
+ * system headers left out unless asked for, with lines wrapped like GCC.
+ **/
+cstring_t preprocessor_dependencies(preprocessor_t *pp, const char *target,
+    const char *source, bool system_headers)
 {
-    token_t separator;
-    token_t *param_tokens;
-    size_t i, nparams;
-    
-    nparams = array_length(macro->function_like.params);
-    param_tokens = array_prototype(macro->function_like.params, token_t);
-    for (i = 0; !lexer_is_eos(pp->lexer); i++) {
-        if (i < nparams) {
-            array_t arg = __preprocessor_parse_function_like_argument__(pp,
-                param_tokens[i]->is_vararg);
-            map_add(args, param_tokens[i]->cs, arg);
+    include_file_t *file;
+    const unsigned char *name;
+    cstring_t cs;
+    size_t i, n, column;
+
+    cs = __preprocessor_escape_make_name__(cstring_new_n(NULL, 256), (const unsigned char*) target);
+    cs = cstring_push_ch(cs, ':');
+    column = cstring_length(cs);
+
+    /* the source first, then the files included */
+    for (i = 0; i <= array_length(pp->includes); i++) {
+        if (i == 0) {
+            name = (const unsigned char*) source;
         } else {
-            array_t arg = __preprocessor_parse_function_like_argument__(pp,
-                false);
-            __destroy_tokens__(arg);
-        }
-        
-        separator = lexer_peek(pp->lexer);
-        if (separator->type == TOKEN_R_PAREN) {
-            break;
+            file = &array_cast_at(include_file_t, pp->includes, i - 1);
+            if (file->system && !system_headers) {
+                continue;
+            }
+            name = file->filename;
         }
 
-        if (separator->type != TOKEN_COMMA) {
-            ERRORF_WITH_TOKEN(macroname_token,
-                "unterminated argument list invoking macro \"%s\"", token_as_text(macroname_token));
-            return false;
+        n = __preprocessor_make_name_length__(name);
+
+        if (column + 1 + n > PP_DEPENDENCIES_COLUMNS) {
+            cs = cstring_concat_n(cs, " \\\n", 3);
+            column = 0;
         }
 
-        lexer_eat(pp->lexer);
+        cs = cstring_push_ch(cs, ' ');
+        cs = __preprocessor_escape_make_name__(cs, name);
+        column += 1 + n;
     }
 
-    return true;
+    return cstring_push_ch(cs, '\n');
 }
 
 
-static
-bool __preprocessor_expand_function_macro__(preprocessor_t pp, token_t token, macro_t macro)
+/**
+ * Records the spans of the files read and of the slow macro expansions in
+ * trace, beginning with the file the lexer is reading.
+ **/
+void preprocessor_set_trace(preprocessor_t *pp, trace_t *trace)
 {
-    map_t args = map_create();
-    token_t r_paren_token;
-    array_t expand_tokens;
-    set_t hideset;
+    pp->trace = trace;
 
-    if (!lexer_try(pp->lexer, TOKEN_L_PAREN)) {
-        return false;
-    }
-   
-    if (!__preprocessor_parse_function_like_arguments__(pp, token, macro, args)) {
-        return false;
+    if (pp->trace_files == NULL) {
+        pp->trace_files = array_create_n(sizeof(trace_file_t), 8);
     }
 
-    r_paren_token = lexer_peek(pp->lexer);
-    if (r_paren_token->type != TOKEN_R_PAREN) {
-        ERRORF_WITH_TOKEN(token,
-            "unterminated argument list invoking macro \"%s\"", token_as_text(token));
-        return false;
+    if (!reader_is_empty(pp->lexer->reader)) {
+        __preprocessor_trace_enter_file__(pp);
     }
-    lexer_get(pp->lexer);
+}
 
-    hideset = token->hideset ? set_dup(token->hideset) : set_create();
 
-    if (r_paren_token->hideset != NULL) {
-        hideset = set_intersection(hideset, r_paren_token->hideset);
-    }
+static
+void __preprocessor_trace_enter_file__(preprocessor_t *pp)
+{
+    trace_file_t *file;
 
-    set_add(hideset, token->cs);
-    
-    expand_tokens = __create_tokens__();//__preprocessor_substitute__(pp, macro, args, hideset);
+    trace_begin(pp->trace, "source", (char*) reader_filename(pp->lexer->reader));
 
-    __propagate_space__(expand_tokens, token);
+    file = array_push_back(pp->trace_files);
+    file->tokens = pp->trace_tokens;
+    file->bytes = reader_size(pp->lexer->reader);
+}
 
-    __preprocessor_unget_tokens__(pp, expand_tokens);
 
-    set_destroy(hideset);
+static
+void __preprocessor_trace_leave_file__(preprocessor_t *pp)
+{
+    trace_file_t *file;
 
-    token_destroy(token);
+    file = &array_cast_back(trace_file_t, pp->trace_files);
 
-    array_destroy(expand_tokens);
+    trace_end(pp->trace, "\"bytes\":%lu,\"tokens\":%lu",
+        (unsigned long) file->bytes, (unsigned long) (pp->trace_tokens - file->tokens));
 
-    return true;
+    array_pop_back(pp->trace_files);
 }
 
 
-static 
-token_t __preprocessor_expand__(preprocessor_t pp)
+/* a file span ends with the end of its stream, they all end with the lexer */
+static
+void __preprocessor_trace_token__(preprocessor_t *pp, token_t *tok)
 {
-    token_t token;
-    macro_t macro;
+    pp->trace_tokens++;
 
-    for (;;) {
-        token = lexer_get(pp->lexer);
+    if (tok->type == TOKEN_EOF && !array_is_empty(pp->trace_files)) {
+        __preprocessor_trace_leave_file__(pp);
 
-        if ((token->type != TOKEN_IDENTIFIER) || 
-            (token->type == TOKEN_NEWLINE) || 
-            (token->hideset && set_has(token->hideset, token->cs)) || 
-            ((macro = map_find(pp->macros, token->cs)) == NULL)) {
-            return token;
-        }
-   
-        if (macro->type == PP_MACRO_OBJECT) {
-            __preprocessor_expand_object_macro__(pp, token, macro);
-            break;
-        } else if (macro->type == PP_MACRO_FUNCTION) {
-            if (!__preprocessor_expand_function_macro__(pp, token, macro)) {
-                return token;
-            }
-            break;
-        } else if (macro->type == PP_MACRO_NATIVE) {
-            macro->native_macro_fn(token);
-            break;
-        } else {
-            assert(false);
+    } else if (tok->type == TOKEN_END) {
+        while (!array_is_empty(pp->trace_files)) {
+            __preprocessor_trace_leave_file__(pp);
         }
     }
-
-    return __preprocessor_expand__(pp);
 }
 
 
-static inline 
-array_t __preprocessor_substitute_object_like__(preprocessor_t pp, array_t macro_body)
+void preprocessor_set_include_hook(preprocessor_t *pp, include_hook_pt fn, void *data)
 {
-    array_t expand_tokens;
-    token_t *macro_tokens;
-    size_t i;
-    
-    expand_tokens = __create_tokens__();
+    pp->include_hook = fn;
+    pp->include_hook_data = data;
+}
 
-    array_foreach(macro_body, macro_tokens, i) {
-        token_t token = token_dup(macro_tokens[i]);
-        array_cast_append(token_t, expand_tokens, token);
+
+/**
+ * Counts the expansions of the macros defined from now on, see
+ * preprocessor_report_profile().
+ **/
+void preprocessor_enable_profile(preprocessor_t *pp)
+{
+    if (pp->macro_profiles == NULL) {
+        pp->macro_profiles = map_create();
     }
-   
-    return expand_tokens;
 }
 
 
 static
-bool __add_hide_set__(set_t hideset, array_t expand_tokens)
+void __macro_profile_collect_fn__(void *privdata, const void *key, const void *value)
 {
-    token_t *tokens;
-    size_t i;
+    array_cast_append(macro_profile_t*, (array_t*)privdata, (macro_profile_t*)value);
+}
 
-    array_foreach(expand_tokens, tokens, i) {
-        set_t token_hs = tokens[i]->hideset;
-        if (token_hs != NULL) {
-            tokens[i]->hideset = set_union(hideset, token_hs);
-            set_destroy(token_hs);
-        } else {
-            tokens[i]->hideset = set_dup(hideset);
-        }
+
+static
+int __macro_profile_compare__(const void *a, const void *b)
+{
+    const macro_profile_t *l = *(const macro_profile_t**)a;
+    const macro_profile_t *r = *(const macro_profile_t**)b;
+
+    if (l->nanoseconds != r->nanoseconds) {
+        return l->nanoseconds < r->nanoseconds ? 1 : -1;
     }
 
-    return true;
+    return l->tokens < r->tokens ? 1 : l->tokens > r->tokens ? -1 : 0;
 }
 
 
 /**
-* Select an argument for expansion.
-*/
-static inline
-array_t __preprocessor_select__(map_t args, token_t index)
+ * Prints the top macros by the time spent expanding them.
+ **/
+void preprocessor_report_profile(preprocessor_t *pp, FILE *fp, size_t top)
 {
-    array_t arg;
+    macro_profile_t **profiles;
+    array_t *collected;
+    size_t i, n;
 
-    if (index->type != TOKEN_IDENTIFIER) {
-        return NULL;
+    if (pp->macro_profiles == NULL) {
+        return;
     }
 
-    arg = map_find(args, index->cs);
-    if (arg != NULL) {
-        array_t replacements;
-        size_t i, n;
+    collected = array_create_n(sizeof(macro_profile_t*), 64);
+    map_scan(pp->macro_profiles, __macro_profile_collect_fn__, collected);
+
+    profiles = array_prototype(collected, macro_profile_t*);
+    n = array_length(collected);
 
-        replacements = array_create_n(sizeof(token_t), 2);
+    qsort(profiles, n, sizeof(macro_profile_t*), __macro_profile_compare__);
 
-        for (i = 0, n = array_length(arg); i < n; i++) {
-            token_t token = array_cast_at(token_t, arg, i);
-            array_cast_append(token_t, replacements, token);
+    fprintf(fp, "%-32s %10s %10s %10s %8s %8s %10s\n",
+            "macro", "expansions", "tokens", "arg-tokens", "pastes", "strings", "ms");
+
+    for (i = 0; i < n && i < top; i++) {
+        if (profiles[i]->expansions == 0) {
+            break;
         }
 
-        __propagate_space__(replacements, index);
-        return replacements;
+        fprintf(fp, "%-32s %10lu %10lu %10lu %8lu %8lu %10.3f\n",
+                (char*) profiles[i]->name,
+                (unsigned long) profiles[i]->expansions,
+                (unsigned long) profiles[i]->tokens,
+                (unsigned long) profiles[i]->arg_tokens,
+                (unsigned long) profiles[i]->pastes,
+                (unsigned long) profiles[i]->stringifies,
+                profiles[i]->nanoseconds / 1e6);
     }
 
-    return NULL;
+    array_destroy(collected);
 }
 
 
 static inline
-token_t __preprocessor_stringify__(preprocessor_t pp, token_t template, array_t arg)
+bool __preprocessor_predefined_std_include_paths__(preprocessor_t *pp)
 {
-    token_t dst;
-    cstring_t cs = cstring_new_n(NULL, 24);
-    token_t *tokens;
-    size_t i, spaces;
+    const char *std_paths[] = {
+        "/usr/local/lib/occ/include",
+        "/usr/local/include",
+        "/usr/include",
+        "/usr/include/linux",
+        "/usr/include/x86_64-linux-gnu",
+    };
 
-    array_foreach(arg, tokens, i) {
-        spaces = tokens[i]->spaces;
-        while (spaces--) {
-            cs = cstring_concat_ch(cs, ' ');
-        }
-        cs = cstring_concat_n(cs, token_as_text(tokens[i]), strlen(token_as_text(tokens[i])));
-    }
+    size_t npaths = sizeof(std_paths) / sizeof(const char*);
+    size_t i;
 
-    dst = token_dup(template);
-    if (dst->cs) {
-        cstring_free(dst->cs);
+    for (i = 0; i < npaths; i++) {
+        preprocessor_add_include_path(pp, std_paths[i]);
     }
 
-    dst->type = TOKEN_CONSTANT_STRING;
-    dst->cs = cs;
-    return dst;
+    return true;
 }
 
 
-static inline 
-array_t __preprocessor_glue_token__(preprocessor_t pp, token_t left, token_t right)
+static inline
+void __propagate_space__(token_vec_t *expand_tokens, token_t *token)
 {
-    cstring_t cs;
-    cs = cstring_new(token_as_text(left));
-    cs = cstring_concat_n(cs, token_as_text(right), strlen(token_as_text(right)));
-    lexer_push(pp->lexer, STREAM_TYPE_STRING, cs);
-    return lexer_tokenize(pp->lexer);
+    if (!token_vec_is_empty(expand_tokens)) {
+        token_vec_front(expand_tokens)->spaces = token->spaces;
+    }
+}
+
+
+/**
+ * Adds the cost of an expansion to the profile of the macro, and traces
+ * the expansions slow enough to show up in a time trace.
+ **/
+static
+void __preprocessor_account_expansion__(preprocessor_t *pp, macro_t *macro, token_t *token,
+    token_vec_t *expand_tokens, uint64_t start)
+{
+    uint64_t duration;
+    size_t ntokens;
+
+    duration = NANOTIME() - start;
+    ntokens = token_vec_length(expand_tokens);
+
+    if (macro->profile != NULL) {
+        macro->profile->expansions++;
+        macro->profile->tokens += ntokens;
+        macro->profile->nanoseconds += duration;
+    }
+
+    if (pp->trace != NULL && duration >= PP_TRACE_MACRO_NANOSECONDS) {
+        trace_complete(pp->trace, "macro", (char*) token->cs, start, duration,
+            "\"tokens\":%lu", (unsigned long) ntokens);
+    }
 }
 
 
-static inline 
-void __preprocessor_glue__(preprocessor_t pp, array_t expand_tokens, token_t token)
+static inline
+void __preprocessor_expand_object_macro__(preprocessor_t *pp, token_t *token, macro_t *macro)
 {
-    token_t last;
-    array_t glue_token;
+    token_vec_t expand_tokens;
+    set_t *hideset;
+    macro_profile_t *outer;
+    uint64_t start = 0;
+
+    outer = pp->profile;
+    if (macro->profile != NULL || pp->trace != NULL) {
+        pp->profile = macro->profile;
+        start = NANOTIME();
+    }
+
+    hideset = __preprocessor_hideset_add__(pp, token->hideset, macro);
+
+    token_vec_init(&expand_tokens);
 
-    last = array_cast_back(token_t, expand_tokens);
+    __preprocessor_substitute__(pp, token, macro, NULL, hideset, &expand_tokens);
 
-    array_pop_back(expand_tokens);
+    __propagate_space__(&expand_tokens, token);
 
-    glue_token = __preprocessor_glue_token__(pp, last, token);
+    if (start != 0) {
+        __preprocessor_account_expansion__(pp, macro, token, &expand_tokens, start);
+        pp->profile = outer;
+    }
+
+    __preprocessor_unget_expansion__(pp, &expand_tokens);
+
+    token_destroy(token);
 
-    array_extend(expand_tokens, glue_token);
+    token_vec_free(&expand_tokens);
 }
 
 
-static inline 
-array_t __preprocessor_substitute_function_like__(preprocessor_t pp, bool is_variadic, 
-    array_t macro_body, map_t args)
+static
+array_t* __preprocessor_parse_function_like_argument__(preprocessor_t *pp, bool is_vararg)
 {
-    array_t expand_tokens;
-    size_t i, n;
+    array_t *arg = __create_tokens__();
+    size_t level = 0;
 
-    expand_tokens = array_create_n(sizeof(token_t), 8);
+    for (;;) {
+        token_t *token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_END || token->type == TOKEN_EOF) {
+            break;
+        }
 
-    n = array_length(macro_body);
+        if (((token->type == TOKEN_R_PAREN) ||
+             (token->type == TOKEN_COMMA && is_vararg == false)) && level == 0) {
+            break;
+        }
 
-    for (i = 0; i < n; i++) {
-        token_t token;
-        
-        token = array_cast_at(token_t, macro_body, i);
-        if (token->type == TOKEN_HASH) {
-            token_t stringify = array_cast_at(token_t, macro_body, ++i);
-            array_t replacements = __preprocessor_select__(args, stringify);
-
-            array_cast_append(token_t, expand_tokens, __preprocessor_stringify__(pp, token, replacements));
+        if (token->type == TOKEN_L_PAREN) {
+            level++;
+        }
+
+        if (token->type == TOKEN_R_PAREN) {
+            level--;
+        }
+
+        lexer_get(pp->lexer);
+
+        /* its commas separate the arguments */
+        if (token->type == TOKEN_LITERAL_RUN) {
+            array_t *split = lexer_split_run(token);
+            __preprocessor_unget_tokens__(pp, split);
+            array_destroy(split);
+            token_destroy(token);
             continue;
-        } else if (token->type == TOKEN_HASHHASH) {
-            token_t stringify = array_cast_at(token_t, macro_body, ++i);
-            array_t replacements = __preprocessor_select__(args, stringify);
-            if (replacements == NULL) {
-                __preprocessor_glue__(pp, expand_tokens, stringify);
+        }
 
-            } else {
-                size_t j, n;
+        if (token->type == TOKEN_NEWLINE) {
+            token_destroy(token);
+            continue;
+        }
 
-                if (array_length(replacements) == 0) {
-                    i++;
-                    continue;
-                } else {
-                    stringify = array_cast_front(token_t, replacements);
-                    __preprocessor_glue__(pp, expand_tokens, stringify);
+        array_cast_append(token_t*, arg, token);
+    }
 
-                    for (j = 1, n = array_length(replacements); j < n; j++) {
-                        array_cast_append(token_t, expand_tokens, array_cast_at(token_t, replacements, j));
-                    }
-                    continue;
-                }
-            }
-            
+    return arg;
+}
+
+
+static
+void __args_scan_fn__(void *privdata, const void *key, const void *value)
+{
+    __destroy_tokens__((array_t*)value);
+}
+
+
+/* the tokens of an argument are shared by its substitutions, see retired_args */
+static
+void __args_retire_fn__(void *privdata, const void *key, const void *value)
+{
+    preprocessor_t *pp = privdata;
+    array_t *arg = (array_t*)value;
+    token_t **tokens;
+    size_t i;
+
+    array_foreach(arg, tokens, i) {
+        if (tokens[i]->origin == NULL) {
+            array_cast_append(token_t*, pp->retired_args, tokens[i]);
         } else {
-            array_t replacements = __preprocessor_select__(args, token);
-            if (cstring_compare(token->cs, "c") == 0) {
-                printf("");
-            }
-            if (replacements != NULL) {
-                if (i + 1 < n && array_cast_at(token_t, macro_body, i + 1)->type == TOKEN_HASHHASH) {
-                    if (array_length(replacements) == 0) {
-                        i++;
-                    } else {
-                        array_extend(expand_tokens, replacements);
-                    }
-                } else {
-                    array_extend(expand_tokens, replacements);
-                }
-                continue;
-            } 
+            token_destroy(tokens[i]);
         }
-
-        token = token_dup(token);
-        array_cast_append(token_t, expand_tokens, token);
     }
 
-    return expand_tokens;
+    array_destroy(arg);
 }
 
 
-static inline 
-array_t __preprocessor_substitute__(preprocessor_t pp, macro_t macro, map_t args, set_t hideset)
+/**
+ * Collects the arguments of an invocation up to, not including, its ')'.
+ * Only a '...' parameter may be left out, and a macro of one parameter
+ * called with '()' gets one empty argument. On a wrong number of
+ * arguments the whole invocation, ')' included, is consumed.
+ **/
+static
+bool __preprocessor_parse_function_like_arguments__(preprocessor_t *pp,
+    token_t *macroname_token, macro_t *macro, map_t *args)
 {
-    array_t expand_tokens;
+    token_t *separator;
+    token_t **param_tokens;
+    size_t i, nparams;
+    bool empty;
 
-    switch (macro->type) {
-    case PP_MACRO_OBJECT:
-        expand_tokens = __preprocessor_substitute_object_like__(pp, 
-            macro->object_like.body);
-        break;
-    case PP_MACRO_FUNCTION:
-        expand_tokens = __preprocessor_substitute_function_like__(pp,
-            macro->function_like.is_variadic, macro->function_like.body, args);
-        break;
-    default:
-        assert(false);
+    nparams = array_length(macro->function_like.params);
+    param_tokens = array_prototype(macro->function_like.params, token_t*);
+    for (i = 0; ; ) {
+        array_t *arg = __preprocessor_parse_function_like_argument__(pp,
+            i < nparams && param_tokens[i]->is_vararg);
+
+        empty = array_is_empty(arg);
+        if (i < nparams) {
+            if (macro->profile != NULL) {
+                macro->profile->arg_tokens += array_length(arg);
+            }
+            map_add(args, param_tokens[i]->cs, arg);
+        } else {
+            __destroy_tokens__(arg);
+        }
+
+        i++;
+
+        separator = lexer_peek(pp->lexer);
+        if (separator->type == TOKEN_R_PAREN) {
+            break;
+        }
+
+        if (separator->type != TOKEN_COMMA) {
+            ERRORF_WITH_TOKEN(macroname_token,
+                "unterminated argument list invoking macro \"%s\"", token_as_text(macroname_token));
+            return false;
+        }
+
+        lexer_eat(pp->lexer);
+    }
+
+    /* 'F()' passes no argument to a macro without parameters */
+    if (nparams == 0 && i == 1 && empty) {
+        return true;
+    }
+
+    if (i > nparams) {
+        ERRORF_WITH_TOKEN(macroname_token,
+            "macro \"%s\" passed %lu arguments, but takes just %lu",
+            token_as_text(macroname_token), (unsigned long) i, (unsigned long) nparams);
+        lexer_eat(pp->lexer);
+        return false;
+    }
+
+    /* an omitted variadic argument is empty */
+    if (i + 1 == nparams && param_tokens[i]->is_vararg) {
+        map_add(args, param_tokens[i]->cs, __create_tokens__());
+        return true;
     }
 
-    __add_hide_set__(hideset, expand_tokens);
+    if (i < nparams) {
+        ERRORF_WITH_TOKEN(macroname_token,
+            "macro \"%s\" requires %lu arguments, but only %lu given",
+            token_as_text(macroname_token), (unsigned long) nparams, (unsigned long) i);
+        lexer_eat(pp->lexer);
+        return false;
+    }
 
-    return expand_tokens;
+    return true;
 }
 
 
 static
-bool __preprocessor_check_macro_body__(preprocessor_t pp, array_t body)
+bool __preprocessor_expand_function_macro__(preprocessor_t *pp, token_t *token, macro_t *macro)
 {
-    token_t token;
+    map_t *args;
+    token_t *r_paren_token;
+    token_vec_t expand_tokens;
+    set_t *hideset;
+    macro_profile_t *outer;
+    uint64_t start = 0;
 
-    if (array_is_empty(body)) {
-        return true;
+    if (!lexer_try(pp->lexer, TOKEN_L_PAREN)) {
+        return false;
     }
 
-    token = array_cast_front(token_t, body);
-    if (token->type == TOKEN_HASHHASH) {
-        ERRORF_WITH_TOKEN(token, "'##' cannot appear at start of macro expansion");
+    outer = pp->profile;
+    if (macro->profile != NULL || pp->trace != NULL) {
+        pp->profile = macro->profile;
+        start = NANOTIME();
+    }
+
+    args = map_create();
+
+    if (!__preprocessor_parse_function_like_arguments__(pp, token, macro, args)) {
+        map_scan(args, __args_scan_fn__, NULL);
+        map_destroy(args);
+        pp->profile = outer;
         return false;
     }
 
-    token = array_cast_back(token_t, body);
-    if (token->type == TOKEN_HASHHASH) {
-        ERRORF_WITH_TOKEN(token, "'##' cannot appear at end of macro expansion");
+    r_paren_token = lexer_get(pp->lexer);
+    if (r_paren_token->type != TOKEN_R_PAREN) {
+        ERRORF_WITH_TOKEN(token,
+            "unterminated argument list invoking macro \"%s\"", token_as_text(token));
+        lexer_unget(pp->lexer, r_paren_token);
+        map_scan(args, __args_scan_fn__, NULL);
+        map_destroy(args);
+        pp->profile = outer;
         return false;
     }
 
+    /* hideset = (HS & HS') + {T} */
+    hideset = __preprocessor_hideset_intersection__(pp, token->hideset, r_paren_token->hideset);
+    hideset = __preprocessor_hideset_add__(pp, hideset, macro);
+
+    token_destroy(r_paren_token);
+
+    token_vec_init(&expand_tokens);
+
+    __preprocessor_substitute__(pp, token, macro, args, hideset, &expand_tokens);
+
+    __propagate_space__(&expand_tokens, token);
+
+    if (start != 0) {
+        __preprocessor_account_expansion__(pp, macro, token, &expand_tokens, start);
+        pp->profile = outer;
+    }
+
+    __preprocessor_unget_expansion__(pp, &expand_tokens);
+
+    map_scan(args, __args_retire_fn__, pp);
+
+    map_destroy(args);
+
+    token_destroy(token);
+
+    token_vec_free(&expand_tokens);
+
     return true;
 }
 
 
 static
-void __preprocessor_skip_one_line__(preprocessor_t pp)
+token_t* __preprocessor_expand__(preprocessor_t *pp)
 {
-    for (; !lexer_is_eos(pp->lexer); ) {
-        token_t token = lexer_get(pp->lexer);
-        if (token->type == TOKEN_NEWLINE) {
+    token_t *token;
+    macro_t *macro;
+
+    for (;;) {
+        token = lexer_get(pp->lexer);
+
+        if ((token->type != TOKEN_IDENTIFIER) ||
+            (token->hideset && set_has(token->hideset, token->cs)) ||
+            ((macro = __preprocessor_find_macro__(pp, token->cs)) == NULL)) {
+            return token;
+        }
+
+        if (macro->type == PP_MACRO_OBJECT) {
+            __preprocessor_expand_object_macro__(pp, token, macro);
+            continue;
+        } else if (macro->type == PP_MACRO_FUNCTION) {
+            if (!__preprocessor_expand_function_macro__(pp, token, macro)) {
+                return token;
+            }
+            continue;
+        } else if (macro->type == PP_MACRO_NATIVE) {
+            macro->native_macro_fn(token);
+            return token;
+        } else {
+            assert(false);
+        }
+    }
+}
+
+
+/**
+ * Expands an object-like macro without copying its body: every token of
+ * the expansion is a reference to the shared body token, carrying the
+ * interned hideset and the location of the invocation.
+ **/
+static inline
+void __preprocessor_substitute_object_like__(preprocessor_t *pp, token_t *macroname_token,
+    array_t *macro_body, set_t *hideset, token_vec_t *expand_tokens)
+{
+    token_t **macro_tokens;
+    size_t i;
+
+    token_vec_reserve(expand_tokens, array_length(macro_body));
+
+    array_foreach(macro_body, macro_tokens, i) {
+        token_t *token = token_ref(macro_tokens[i], &macroname_token->location);
+        token->hideset = hideset;
+        token_vec_push(expand_tokens, token);
+    }
+}
+
+
+static
+bool __add_hide_set__(preprocessor_t *pp, set_t *hideset, token_vec_t *expand_tokens)
+{
+    token_t **tokens;
+    size_t i;
+
+    vec_foreach(expand_tokens, tokens, i) {
+        tokens[i]->hideset = __preprocessor_hideset_union__(pp, hideset, tokens[i]->hideset);
+    }
+
+    return true;
+}
+
+
+/**
+* Select an argument for expansion.
+*/
+static inline
+array_t* __preprocessor_select__(map_t *args, token_t *index)
+{
+    if (index->type != TOKEN_IDENTIFIER) {
+        return NULL;
+    }
+
+    return map_find(args, index->cs);
+}
+
+
+/**
+ * Fully macro-expands an argument before it is substituted, the expansion
+ * stops at a sentinel so it never reads past the argument.
+ **/
+static
+array_t* __preprocessor_expand_arg__(preprocessor_t *pp, array_t *arg)
+{
+    array_t *expanded;
+    token_t *sentinel;
+    size_t i;
+
+    expanded = __create_tokens__();
+    sentinel = token_create(TOKEN_EOF, NULL, NULL);
+
+    lexer_unget(pp->lexer, sentinel);
+
+    for (i = array_length(arg); i--; ) {
+        lexer_unget(pp->lexer, token_share(array_cast_at(token_t*, arg, i)));
+    }
+
+    for (;;) {
+        token_t *token = __preprocessor_expand__(pp);
+        if (token == sentinel) {
             token_destroy(token);
             break;
         }
-        token_destroy(token);
+        array_cast_append(token_t*, expanded, token);
     }
+
+    return expanded;
 }
 
 
-static
-bool __preprocessor_parse_object_like__(preprocessor_t pp, token_t macroname_token)
+static inline
+array_t* __preprocessor_select_expanded__(preprocessor_t *pp, map_t *args,
+    map_t *expanded_args, token_t *index)
+{
+    array_t *arg;
+    array_t *expanded;
+
+    if ((arg = __preprocessor_select__(args, index)) == NULL) {
+        return NULL;
+    }
+
+    if ((expanded = map_find(expanded_args, index->cs)) == NULL) {
+        expanded = __preprocessor_expand_arg__(pp, arg);
+        map_add(expanded_args, index->cs, expanded);
+    }
+
+    return expanded;
+}
+
+
+static inline
+void __preprocessor_append_arg__(token_vec_t *expand_tokens, array_t *arg, token_t *param)
 {
-    array_t macro_body;
+    token_t **tokens;
+    size_t i;
+
+    token_vec_reserve(expand_tokens, token_vec_length(expand_tokens) + array_length(arg));
+
+    array_foreach(arg, tokens, i) {
+        token_t *token = token_share(tokens[i]);
+        if (i == 0) {
+            token->spaces = param->spaces;
+        }
+        token_vec_push(expand_tokens, token);
+    }
+}
+
+
+/**
+ * The value of a string literal from its body, an unknown escape sequence
+ * keeping its backslash.
+ **/
+static
+cstring_t __preprocessor_unescape__(cstring_t body)
+{
+    static const char simple[] = "abfnrtv'\"?\\", values[] = "\a\b\f\n\r\t\v'\"?\\";
+    const unsigned char *p, *pe;
+    const char *escape;
+    uint32_t value;
+    cstring_t cs;
+    size_t n;
+
+    cs = cstring_new_n(NULL, cstring_length(body));
+
+    p = body;
+    pe = p + cstring_length(body);
+
+    while (p < pe) {
+        if (*p != '\\' || p + 1 == pe) {
+            cs = cstring_concat_ch(cs, *p++);
+            continue;
+        }
+
+        p++;
+
+        if (*p != '\0' && (escape = strchr(simple, *p)) != NULL) {
+            cs = cstring_concat_ch(cs, values[escape - simple]);
+            p++;
+
+        } else if (ISOCT(*p)) {
+            for (value = 0, n = 0; n < 3 && p < pe && ISOCT(*p); n++, p++) {
+                value = value * 8 + (*p - '0');
+            }
+            cs = cstring_concat_ch(cs, (unsigned char) value);
+
+        } else if (*p == 'x' && p + 1 < pe && ISHEX(p[1])) {
+            for (value = 0, p++; p < pe && ISHEX(*p); p++) {
+                value = value * 16 + (ISDIGIT(*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+            }
+            cs = cstring_concat_ch(cs, (unsigned char) value);
+
+        } else if ((*p == 'u' || *p == 'U') && pe - p > (*p == 'u' ? 4 : 8)) {
+            n = *p == 'u' ? 4 : 8;
+            for (value = 0, p++; n != 0 && ISHEX(*p); n--, p++) {
+                value = value * 16 + (ISDIGIT(*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+            }
+            cs = cstring_append_utf8(cs, value);
+
+        } else {
+            cs = cstring_concat_ch(cs, '\\');
+        }
+    }
+
+    return cs;
+}
+
+
+static inline
+token_t* __preprocessor_stringify__(preprocessor_t *pp, token_t *template, array_t *arg,
+                                   token_location_t *location)
+{
+    token_t *dst;
+    cstring_t cs = cstring_new_n(NULL, 24), spelled;
+    token_t **tokens;
+    bool stray = false;
+    size_t i, j;
+
+    /* the spaces between the tokens of the argument become one space */
+    array_foreach(arg, tokens, i) {
+        if (i != 0 && tokens[i]->spaces != 0) {
+            cs = cstring_concat_ch(cs, ' ');
+        }
+        cs = token_concat_spelling(cs, tokens[i]);
+        stray |= tokens[i]->type == TOKEN_BACKSLASH;
+    }
+
+    /**
+     * Only the " and \ of the literals are escaped, so a backslash outside
+     * them starts an escape sequence of the string: its value is taken from
+     * the body spelled as the string literal would be.
+     **/
+    if (stray) {
+        spelled = cstring_new_n(NULL, cstring_length(cs) * 2);
+
+        array_foreach(arg, tokens, i) {
+            if (i != 0 && tokens[i]->spaces != 0) {
+                spelled = cstring_concat_ch(spelled, ' ');
+            }
+
+            if (tokens[i]->type < TOKEN_CONSTANT_STRING ||
+                tokens[i]->type > TOKEN_CONSTANT_UTF8CHAR) {
+                spelled = token_concat_spelling(spelled, tokens[i]);
+                continue;
+            }
+
+            cstring_clear(cs);
+            cs = token_concat_spelling(cs, tokens[i]);
+            for (j = 0; j < cstring_length(cs); j++) {
+                if (cs[j] == '"' || cs[j] == '\\') {
+                    spelled = cstring_concat_ch(spelled, '\\');
+                }
+                spelled = cstring_concat_ch(spelled, cs[j]);
+            }
+        }
+
+        cstring_free(cs);
+        cs = __preprocessor_unescape__(spelled);
+        cstring_free(spelled);
+    }
+
+    dst = token_create(TOKEN_CONSTANT_STRING, cs, location);
+
+    if (pp->profile != NULL) {
+        pp->profile->stringifies++;
+    }
+    dst->spaces = template->spaces;
+    return dst;
+}
+
+
+static inline
+void __preprocessor_glue__(preprocessor_t *pp, token_vec_t *expand_tokens, token_t *token)
+{
+    token_t *last;
+    token_t *glue_token;
+
+    last = token_vec_back(expand_tokens);
+
+    if (pp->profile != NULL) {
+        pp->profile->pastes++;
+    }
+
+    glue_token = lexer_paste(last, token);
+    if (glue_token == NULL) {
+        ERRORF_WITH_TOKEN(last, "pasting \"%s\" and \"%s\" does not give a valid preprocessing token",
+            token_as_text(last), token_as_text(token));
+        token_vec_push(expand_tokens, token_dup(token));
+        return;
+    }
+
+    token_vec_pop(expand_tokens);
+
+    token_vec_push(expand_tokens, glue_token);
+
+    token_destroy(last);
+}
+
+
+static inline
+void __preprocessor_substitute_function_like__(preprocessor_t *pp, token_t *macroname_token,
+    bool is_variadic, array_t *macro_body, map_t *args, token_vec_t *expand_tokens)
+{
+    array_t *replacements;
+    map_t *expanded_args;
+    size_t i, n;
+
+    expanded_args = map_create();
+
+    n = array_length(macro_body);
+
+    for (i = 0; i < n; i++) {
+        token_t *token;
+
+        token = array_cast_at(token_t*, macro_body, i);
+        if (token->type == TOKEN_HASH && i + 1 < n) {
+            token_t *stringify = array_cast_at(token_t*, macro_body, i + 1);
+
+            replacements = __preprocessor_select__(args, stringify);
+            if (replacements != NULL) {
+                token_vec_push(expand_tokens,
+                    __preprocessor_stringify__(pp, token, replacements, &macroname_token->location));
+                i++;
+                continue;
+            }
+
+        } else if (token->type == TOKEN_HASHHASH && i + 1 < n) {
+            token_t *stringify = array_cast_at(token_t*, macro_body, ++i);
+
+            replacements = __preprocessor_select__(args, stringify);
+            if (replacements == NULL) {
+                if (token_vec_is_empty(expand_tokens)) {
+                    token_vec_push(expand_tokens, token_ref(stringify, &macroname_token->location));
+                } else {
+                    __preprocessor_glue__(pp, expand_tokens, stringify);
+                }
+
+            } else if (!array_is_empty(replacements)) {
+                size_t j, m;
+
+                if (token_vec_is_empty(expand_tokens)) {
+                    __preprocessor_append_arg__(expand_tokens, replacements, stringify);
+                    continue;
+                }
+
+                __preprocessor_glue__(pp, expand_tokens, array_cast_front(token_t*, replacements));
+
+                for (j = 1, m = array_length(replacements); j < m; j++) {
+                    token_vec_push(expand_tokens, token_share(array_cast_at(token_t*, replacements, j)));
+                }
+            }
+            continue;
+
+        } else {
+            replacements = __preprocessor_select__(args, token);
+            if (replacements != NULL) {
+                if (array_length(replacements) == 0 && i + 1 < n &&
+                    array_cast_at(token_t*, macro_body, i + 1)->type == TOKEN_HASHHASH) {
+                    /* placemarker: 'x ## y' with an empty 'x' is just 'y' */
+                    i++;
+                } else if (i + 1 < n &&
+                    array_cast_at(token_t*, macro_body, i + 1)->type == TOKEN_HASHHASH) {
+                    __preprocessor_append_arg__(expand_tokens, replacements, token);
+                } else {
+                    replacements = __preprocessor_select_expanded__(pp, args, expanded_args, token);
+                    __preprocessor_append_arg__(expand_tokens, replacements, token);
+                }
+                continue;
+            }
+        }
+
+        token_vec_push(expand_tokens, token_ref(token, &macroname_token->location));
+    }
+
+    map_scan(expanded_args, __args_retire_fn__, pp);
+
+    map_destroy(expanded_args);
+}
+
+
+static inline
+void __preprocessor_substitute__(preprocessor_t *pp, token_t *macroname_token,
+    macro_t *macro, map_t *args, set_t *hideset, token_vec_t *expand_tokens)
+{
+    switch (macro->type) {
+    case PP_MACRO_OBJECT:
+        __preprocessor_substitute_object_like__(pp, macroname_token,
+            macro->object_like.body, hideset, expand_tokens);
+        return;
+    case PP_MACRO_FUNCTION:
+        __preprocessor_substitute_function_like__(pp, macroname_token,
+            macro->function_like.is_variadic, macro->function_like.body, args, expand_tokens);
+        break;
+    default:
+        assert(false);
+        return;
+    }
+
+    __add_hide_set__(pp, hideset, expand_tokens);
+}
+
+
+static
+bool __preprocessor_check_macro_body__(preprocessor_t *pp, array_t *body)
+{
+    token_t *token;
+
+    if (array_is_empty(body)) {
+        return true;
+    }
+
+    token = array_cast_front(token_t*, body);
+    if (token->type == TOKEN_HASHHASH) {
+        ERRORF_WITH_TOKEN(token, "'##' cannot appear at start of macro expansion");
+        return false;
+    }
+
+    token = array_cast_back(token_t*, body);
+    if (token->type == TOKEN_HASHHASH) {
+        ERRORF_WITH_TOKEN(token, "'##' cannot appear at end of macro expansion");
+        return false;
+    }
+
+    return true;
+}
+
+
+static inline
+void __preprocessor_skip_one_line__(preprocessor_t *pp)
+{
+    for (;;) {
+        token_t *token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
+        lexer_eat(pp->lexer);
+    }
+}
+
+
+static
+bool __preprocessor_parse_macro_body__(preprocessor_t *pp, array_t *macro_body)
+{
+    for (;;) {
+        token_t *token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
+        lexer_get(pp->lexer);
+        array_cast_append(token_t*, macro_body, token);
+    }
+
+    if (!array_is_empty(macro_body)) {
+        array_cast_front(token_t*, macro_body)->spaces = 0;
+    }
+
+    return __preprocessor_check_macro_body__(pp, macro_body);
+}
+
+
+static
+bool __preprocessor_parse_object_like__(preprocessor_t *pp, token_t *macroname_token)
+{
+    array_t *macro_body;
+
+    macro_body = __create_tokens__();
+
+    if (!__preprocessor_parse_macro_body__(pp, macro_body)) {
+        token_destroy(macroname_token);
+        __destroy_tokens__(macro_body);
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    __preprocessor_add_macro__(pp, macroname_token,
+        PP_MACRO_OBJECT, NULL, macro_body, NULL, false);
+
+    return true;
+}
+
+
+static
+bool __preprocessor_add_function_like_param__(preprocessor_t *pp,
+    array_t *params, token_t *identifier_token)
+{
+    token_t **tokens;
+    size_t i;
+
+    array_foreach(params, tokens, i) {
+        if (cstring_compare(tokens[i]->cs, identifier_token->cs) == 0) {
+            ERRORF_WITH_TOKEN(identifier_token,
+                "duplicate macro parameter \"%s\"", token_as_text(identifier_token));
+            return false;
+        }
+    }
+
+    array_cast_append(token_t*, params, identifier_token);
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_function_like_params__(preprocessor_t *pp, array_t *params, bool *variadic)
+{
+    token_t *token;
+    bool prev_ident = false;
+
+    for (;;) {
+        token = lexer_peek(pp->lexer);
+        switch (token->type) {
+        case TOKEN_IDENTIFIER:
+            if (prev_ident == true) {
+                ERRORF_WITH_TOKEN(token, "macro parameters must be comma-separated");
+                return false;
+            }
+
+            prev_ident = true;
+
+            if (!__preprocessor_add_function_like_param__(pp, params, token)) {
+                return false;
+            }
+
+            lexer_get(pp->lexer);
+            continue;
+        case TOKEN_R_PAREN:
+            if (prev_ident == true || array_is_empty(params)) {
+                lexer_eat(pp->lexer);
+                return true;
+            }
+        case TOKEN_COMMA:
+            if (prev_ident == false) {
+                ERRORF_WITH_TOKEN(token, "parameter name missing");
+                return false;
+            }
+            lexer_eat(pp->lexer);
+            prev_ident = false;
+            continue;
+        case TOKEN_ELLIPSIS:
+            *variadic = true;
+
+            if (prev_ident == false) {
+                /* anonymous variadic macros */
+                const char *va_args = NATIVE_MACRO_VARIADIC;
+                const size_t n_va_args = sizeof(NATIVE_MACRO_VARIADIC) - 1;
+                token = token_dup(token);
+                token_unshare(token);
+                token->type = TOKEN_IDENTIFIER;
+                token->cs = cstring_copy_n(token->cs, va_args, n_va_args);
+                token->is_vararg = true;
+                if (!__preprocessor_add_function_like_param__(pp, params, token)) {
+                    token_destroy(token);
+                    return false;
+                }
+
+            } else {
+                /* named variadic macros */
+                array_cast_back(token_t*, params)->is_vararg = true;
+            }
+
+            lexer_eat(pp->lexer);
+
+            if (lexer_try(pp->lexer, TOKEN_R_PAREN)) {
+                return true;
+            }
+
+            token = lexer_peek(pp->lexer);
+        case TOKEN_NEWLINE:
+        case TOKEN_EOF:
+        case TOKEN_END:
+            ERRORF_WITH_TOKEN(token, "missing ')' in macro parameter list");
+            return false;
+        default:
+            ERRORF_WITH_TOKEN(token,
+                "\"%s\" may not appear in macro parameter list", token_as_text(token));
+            return false;
+        }
+    }
+
+    return false;
+}
+
+
+static
+bool __preprocessor_parse_function_like__(preprocessor_t *pp, token_t *macroname_token)
+{
+    array_t *macro_params;
+    array_t *macro_body;
+    bool is_variadic = false;
+
+    /* eat '(' */
+    lexer_eat(pp->lexer);
+
+    macro_params = __create_tokens__();
+    if (!__preprocessor_parse_function_like_params__(pp, macro_params, &is_variadic)) {
+        assert((is_variadic == false) || (is_variadic == true && !array_is_empty(macro_params)));
+        __preprocessor_skip_one_line__(pp);
+        __destroy_tokens__(macro_params);
+        token_destroy(macroname_token);
+        return false;
+    }
+
+    macro_body = __create_tokens__();
+    if (!__preprocessor_parse_macro_body__(pp, macro_body)) {
+        __preprocessor_skip_one_line__(pp);
+        __destroy_tokens__(macro_params);
+        __destroy_tokens__(macro_body);
+        token_destroy(macroname_token);
+        return false;
+    }
+
+    __preprocessor_add_macro__(pp, macroname_token,
+        PP_MACRO_FUNCTION, NULL, macro_body, macro_params, is_variadic);
+
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_define__(preprocessor_t *pp)
+{
+    token_t *macroname_token;
+    token_t *l_paren_token;
+
+    macroname_token = lexer_get(pp->lexer);
+    if (macroname_token->type != TOKEN_IDENTIFIER) {
+        ERRORF_WITH_TOKEN(macroname_token, "macro names must be identifiers");
+        token_destroy(macroname_token);
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    l_paren_token = lexer_peek(pp->lexer);
+    if (l_paren_token->type == TOKEN_L_PAREN && l_paren_token->spaces == 0) {
+        return __preprocessor_parse_function_like__(pp, macroname_token);
+    }
+
+    return __preprocessor_parse_object_like__(pp, macroname_token);
+}
+
+
+static
+bool __preprocessor_parse_undef__(preprocessor_t *pp)
+{
+    token_t *macroname_token;
+    macro_t *macro;
+
+    macroname_token = lexer_get(pp->lexer);
+    if (macroname_token->type != TOKEN_IDENTIFIER) {
+        ERRORF_WITH_TOKEN(macroname_token, "macro names must be identifiers");
+        token_destroy(macroname_token);
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    if ((macro = map_find(pp->macros, macroname_token->cs)) != NULL) {
+        array_cast_append(macro_t*, pp->retired_macros, macro);
+        map_del(pp->macros, macroname_token->cs);
+        __preprocessor_filter_del__(pp, macroname_token->cs);
+        __preprocessor_touch_macro__(pp, macroname_token->cs);
+    }
+
+    token_destroy(macroname_token);
+
+    if (lexer_peek(pp->lexer)->type != TOKEN_NEWLINE) {
+        WARNINGF_WITH_TOKEN(lexer_peek(pp->lexer), "extra tokens at end of #undef directive");
+        __preprocessor_skip_one_line__(pp);
+    }
+
+    return true;
+}
+
+
+static inline
+bool __preprocessor_is_directive__(token_t *token, const char *name)
+{
+    return token->type == TOKEN_IDENTIFIER && cstring_compare(token->cs, name) == 0;
+}
+
+
+static inline
+void __preprocessor_skip_extra_tokens__(preprocessor_t *pp, token_t *directive_token)
+{
+    token_t *token = lexer_peek(pp->lexer);
+
+    if (token->type != TOKEN_NEWLINE &&
+        token->type != TOKEN_EOF &&
+        token->type != TOKEN_END) {
+        WARNINGF_WITH_TOKEN(token, "extra tokens at end of #%s directive", directive_token->cs);
+        __preprocessor_skip_one_line__(pp);
+    }
+}
+
+
+/**
+ * Skips a false group without tokenizing it, stopping in front of the
+ * #elif, #else or #endif that belongs to the current conditional. Only
+ * the names of directives are lexed, to keep track of nesting.
+ **/
+static
+void __preprocessor_skip_group__(preprocessor_t *pp)
+{
+    token_t *hash, *directive_token;
+    size_t depth = 0;
+
+    while (lexer_skip_to_directive(pp->lexer)) {
+        hash = lexer_get(pp->lexer);
+        directive_token = lexer_get(pp->lexer);
+
+        if (__preprocessor_is_directive__(directive_token, "if") ||
+            __preprocessor_is_directive__(directive_token, "ifdef") ||
+            __preprocessor_is_directive__(directive_token, "ifndef")) {
+            depth++;
+
+        } else if (depth > 0) {
+            if (__preprocessor_is_directive__(directive_token, "endif")) {
+                depth--;
+            }
+
+        } else if (__preprocessor_is_directive__(directive_token, "elif") ||
+            __preprocessor_is_directive__(directive_token, "else") ||
+            __preprocessor_is_directive__(directive_token, "endif")) {
+            lexer_unget(pp->lexer, directive_token);
+            lexer_unget(pp->lexer, hash);
+            return;
+        }
+
+        token_destroy(hash);
+        token_destroy(directive_token);
+    }
+}
+
+
+static inline
+void __preprocessor_push_condition__(preprocessor_t *pp, token_t *directive_token, bool condiction)
+{
+    condition_directive_t *cd;
+
+    cd = (condition_directive_t*) array_push_back(pp->condition_directive_stack);
+    cd->condiction = condiction;
+    cd->has_else = false;
+    cd->token = token_dup(directive_token);
+
+    if (!condiction) {
+        __preprocessor_skip_group__(pp);
+    }
+}
+
+
+typedef struct condition_value_s {
+    unsigned long long v;
+    bool is_unsigned;
+} condition_value_t;
+
+
+/**
+ * Cursor over the macro-expanded tokens of a #if/#elif line, which always
+ * ends with a sentinel token.
+ **/
+typedef struct condition_cursor_s {
+    preprocessor_t *pp;
+    token_t *directive_token;
+    token_t **tokens;
+    size_t i;
+    size_t n;
+    size_t skip_evaluation;     /* in the dead operand of &&, || or ?: */
+    bool error;
+} condition_cursor_t;
+
+
+static condition_value_t __preprocessor_eval_expression__(condition_cursor_t *cursor);
+static condition_value_t __preprocessor_eval_conditional__(condition_cursor_t *cursor);
+static condition_value_t __preprocessor_eval_unary__(condition_cursor_t *cursor);
+
+
+static inline
+token_t* __condition_cursor_peek__(condition_cursor_t *cursor)
+{
+    return cursor->tokens[cursor->i];
+}
+
+
+static inline
+token_t* __condition_cursor_next__(condition_cursor_t *cursor)
+{
+    token_t *token = cursor->tokens[cursor->i];
+    if (cursor->i + 1 < cursor->n) {
+        cursor->i++;
+    }
+    return token;
+}
+
+
+static inline
+bool __condition_cursor_try__(condition_cursor_t *cursor, token_type_t type)
+{
+    if (__condition_cursor_peek__(cursor)->type == type) {
+        __condition_cursor_next__(cursor);
+        return true;
+    }
+    return false;
+}
+
+
+static inline
+bool __condition_cursor_is_end__(condition_cursor_t *cursor)
+{
+    return cursor->i + 1 == cursor->n;
+}
+
+
+#define CONDITION_ERRORF(cursor, tok, ...)                                      \
+    do {                                                                        \
+        if (!(cursor)->error) {                                                 \
+            ERRORF_WITH_TOKEN((tok)->type == TOKEN_EOF ?                        \
+                (cursor)->directive_token : (tok), __VA_ARGS__);                \
+        }                                                                       \
+        (cursor)->error = true;                                                 \
+    } while (false)
+
+
+static inline
+condition_value_t __condition_value__(unsigned long long v, bool is_unsigned)
+{
+    condition_value_t value;
+    value.v = v;
+    value.is_unsigned = is_unsigned;
+    return value;
+}
+
+
+/**
+ * Parses the operand of 'defined' at the cursor, the operator itself has
+ * already been consumed.
+ **/
+static
+condition_value_t __preprocessor_eval_defined__(condition_cursor_t *cursor, token_t *defined_token)
+{
+    token_t *token;
+    bool paren;
+
+    paren = __condition_cursor_try__(cursor, TOKEN_L_PAREN);
+
+    token = __condition_cursor_peek__(cursor);
+    if (token->type != TOKEN_IDENTIFIER) {
+        CONDITION_ERRORF(cursor, defined_token, "operator \"defined\" requires an identifier");
+        return __condition_value__(0, false);
+    }
+
+    __condition_cursor_next__(cursor);
+
+    if (paren && !__condition_cursor_try__(cursor, TOKEN_R_PAREN)) {
+        CONDITION_ERRORF(cursor, defined_token, "missing ')' after \"defined\"");
+        return __condition_value__(0, false);
+    }
+
+    return __condition_value__(__preprocessor_find_macro__(cursor->pp, token->cs) != NULL, false);
+}
+
+
+static
+condition_value_t __preprocessor_eval_primary__(condition_cursor_t *cursor)
+{
+    condition_value_t value;
+    number_t number;
+    token_t *token;
+
+    token = __condition_cursor_peek__(cursor);
+
+    switch (token->type) {
+    case TOKEN_NUMBER:
+        __condition_cursor_next__(cursor);
+        if (!parse_number(token, &number)) {
+            cursor->error = true;
+            return __condition_value__(0, false);
+        }
+
+        if (number.property & NUMBER_FLOATING) {
+            CONDITION_ERRORF(cursor, token, "floating constant in preprocessor expression");
+            return __condition_value__(0, false);
+        }
+
+        if (number.property & NUMBER_IMAGINARY) {
+            CONDITION_ERRORF(cursor, token, "imaginary number in preprocessor expression");
+            return __condition_value__(0, false);
+        }
+
+        value = __condition_value__(number.ul, (number.property & NUMBER_UNSIGNED) != 0);
+        if (!value.is_unsigned && (long long) value.v < 0) {
+            /* only decimal constants are expected to fit in a signed type */
+            if (number.radix == 10) {
+                WARNINGF_WITH_TOKEN(token, "integer constant is so large that it is unsigned");
+            }
+            value.is_unsigned = true;
+        }
+        return value;
+
+    case TOKEN_CONSTANT_CHAR:
+    case TOKEN_CONSTANT_WCHAR:
+    case TOKEN_CONSTANT_CHAR16:
+    case TOKEN_CONSTANT_CHAR32:
+        __condition_cursor_next__(cursor);
+        if (!parse_char(token, &number)) {
+            CONDITION_ERRORF(cursor, token, "empty character constant");
+            return __condition_value__(0, false);
+        }
+        return __condition_value__(number.ul,
+            token->type == TOKEN_CONSTANT_CHAR16 || token->type == TOKEN_CONSTANT_CHAR32);
+
+    case TOKEN_IDENTIFIER:
+        __condition_cursor_next__(cursor);
+        if (cstring_compare(token->cs, "defined") == 0) {
+            return __preprocessor_eval_defined__(cursor, token);
+        }
+
+        /* identifiers that are not macros evaluate to 0 */
+        return __condition_value__(0, false);
+
+    case TOKEN_L_PAREN:
+        __condition_cursor_next__(cursor);
+        value = __preprocessor_eval_expression__(cursor);
+        if (!__condition_cursor_try__(cursor, TOKEN_R_PAREN)) {
+            CONDITION_ERRORF(cursor, __condition_cursor_peek__(cursor),
+                "missing ')' in expression");
+        }
+        return value;
+
+    default:
+        if (__condition_cursor_is_end__(cursor)) {
+            CONDITION_ERRORF(cursor, token, "#%s with no expression",
+                cursor->directive_token->cs);
+        } else {
+            CONDITION_ERRORF(cursor, token, "token \"%s\" is not valid in preprocessor expressions",
+                token_as_text(token));
+        }
+        return __condition_value__(0, false);
+    }
+}
+
+
+static
+condition_value_t __preprocessor_eval_unary__(condition_cursor_t *cursor)
+{
+    condition_value_t value;
+
+    if (__condition_cursor_try__(cursor, TOKEN_PLUS)) {
+        return __preprocessor_eval_unary__(cursor);
+    }
+
+    if (__condition_cursor_try__(cursor, TOKEN_MINUS)) {
+        value = __preprocessor_eval_unary__(cursor);
+        value.v = 0 - value.v;
+        return value;
+    }
+
+    if (__condition_cursor_try__(cursor, TOKEN_TILDE)) {
+        value = __preprocessor_eval_unary__(cursor);
+        value.v = ~value.v;
+        return value;
+    }
+
+    if (__condition_cursor_try__(cursor, TOKEN_EXCLAIM)) {
+        value = __preprocessor_eval_unary__(cursor);
+        return __condition_value__(value.v == 0, false);
+    }
+
+    return __preprocessor_eval_primary__(cursor);
+}
+
+
+static inline
+int __condition_precedence__(token_type_t type)
+{
+    switch (type) {
+    case TOKEN_STAR: case TOKEN_SLASH: case TOKEN_PERCENT:
+        return 10;
+    case TOKEN_PLUS: case TOKEN_MINUS:
+        return 9;
+    case TOKEN_LESSLESS: case TOKEN_GREATERGREATER:
+        return 8;
+    case TOKEN_LESS: case TOKEN_GREATER: case TOKEN_LESSEQUAL: case TOKEN_GREATEREQUAL:
+        return 7;
+    case TOKEN_EQUALEQUAL: case TOKEN_EXCLAIMEQUAL:
+        return 6;
+    case TOKEN_AMP:
+        return 5;
+    case TOKEN_CARET:
+        return 4;
+    case TOKEN_PIPE:
+        return 3;
+    case TOKEN_AMPAMP:
+        return 2;
+    case TOKEN_PIPEPIPE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+static inline
+unsigned long long __condition_shift__(condition_value_t l, long long n, bool left)
+{
+    if (n < 0) {
+        left = !left;
+        n = -n;
+    }
+
+    if (left) {
+        return n >= 64 ? 0 : l.v << n;
+    }
+
+    if (l.is_unsigned) {
+        return n >= 64 ? 0 : l.v >> n;
+    }
+
+    if (n >= 64) {
+        return (long long) l.v < 0 ? ~0ULL : 0;
+    }
+
+    return (unsigned long long) ((long long) l.v >> n);
+}
+
+
+static
+condition_value_t __preprocessor_eval_binary_operator__(condition_cursor_t *cursor,
+    token_t *op, condition_value_t l, condition_value_t r)
+{
+    bool is_unsigned = l.is_unsigned || r.is_unsigned;
+
+#undef  SIGNED
+#define SIGNED(value)   ((long long) (value).v)
+
+    switch (op->type) {
+    case TOKEN_STAR:
+        return __condition_value__(l.v * r.v, is_unsigned);
+
+    case TOKEN_SLASH:
+    case TOKEN_PERCENT:
+        if (r.v == 0) {
+            if (cursor->skip_evaluation == 0) {
+                CONDITION_ERRORF(cursor, op, "division by zero in #%s", cursor->directive_token->cs);
+            }
+            return __condition_value__(0, is_unsigned);
+        }
+
+        if (is_unsigned) {
+            return __condition_value__(op->type == TOKEN_SLASH ? l.v / r.v : l.v % r.v, true);
+        }
+
+        if (SIGNED(r) == -1) {
+            /* avoids trapping on LLONG_MIN / -1 */
+            return __condition_value__(op->type == TOKEN_SLASH ? 0 - l.v : 0, false);
+        }
+
+        return __condition_value__(op->type == TOKEN_SLASH ?
+            (unsigned long long) (SIGNED(l) / SIGNED(r)) :
+            (unsigned long long) (SIGNED(l) % SIGNED(r)), false);
+
+    case TOKEN_PLUS:
+        return __condition_value__(l.v + r.v, is_unsigned);
+    case TOKEN_MINUS:
+        return __condition_value__(l.v - r.v, is_unsigned);
+
+    case TOKEN_LESSLESS:
+        return __condition_value__(__condition_shift__(l, r.is_unsigned && SIGNED(r) < 0 ? 64 : SIGNED(r), true),
+            l.is_unsigned);
+    case TOKEN_GREATERGREATER:
+        return __condition_value__(__condition_shift__(l, r.is_unsigned && SIGNED(r) < 0 ? 64 : SIGNED(r), false),
+            l.is_unsigned);
+
+    case TOKEN_LESS:
+        return __condition_value__(is_unsigned ? l.v < r.v : SIGNED(l) < SIGNED(r), false);
+    case TOKEN_GREATER:
+        return __condition_value__(is_unsigned ? l.v > r.v : SIGNED(l) > SIGNED(r), false);
+    case TOKEN_LESSEQUAL:
+        return __condition_value__(is_unsigned ? l.v <= r.v : SIGNED(l) <= SIGNED(r), false);
+    case TOKEN_GREATEREQUAL:
+        return __condition_value__(is_unsigned ? l.v >= r.v : SIGNED(l) >= SIGNED(r), false);
+    case TOKEN_EQUALEQUAL:
+        return __condition_value__(l.v == r.v, false);
+    case TOKEN_EXCLAIMEQUAL:
+        return __condition_value__(l.v != r.v, false);
+
+    case TOKEN_AMP:
+        return __condition_value__(l.v & r.v, is_unsigned);
+    case TOKEN_CARET:
+        return __condition_value__(l.v ^ r.v, is_unsigned);
+    case TOKEN_PIPE:
+        return __condition_value__(l.v | r.v, is_unsigned);
+
+    case TOKEN_AMPAMP:
+        return __condition_value__(l.v && r.v, false);
+    case TOKEN_PIPEPIPE:
+        return __condition_value__(l.v || r.v, false);
+
+    default:
+        assert(false);
+        return __condition_value__(0, false);
+    }
+
+#undef  SIGNED
+}
+
+
+/**
+ * Precedence climbing over the binary operators, the right operand of
+ * && and || is parsed but not evaluated when the left one decides.
+ **/
+static
+condition_value_t __preprocessor_eval_binary__(condition_cursor_t *cursor, int min_precedence)
+{
+    condition_value_t l, r;
+    token_t *op;
+    int precedence;
+    bool skip;
+
+    l = __preprocessor_eval_unary__(cursor);
+
+    for (;;) {
+        op = __condition_cursor_peek__(cursor);
+        precedence = __condition_precedence__(op->type);
+        if (precedence == 0 || precedence < min_precedence) {
+            return l;
+        }
+
+        __condition_cursor_next__(cursor);
+
+        skip = (op->type == TOKEN_AMPAMP && l.v == 0) ||
+               (op->type == TOKEN_PIPEPIPE && l.v != 0);
+
+        cursor->skip_evaluation += skip;
+        r = __preprocessor_eval_binary__(cursor, precedence + 1);
+        cursor->skip_evaluation -= skip;
+
+        l = __preprocessor_eval_binary_operator__(cursor, op, l, r);
+    }
+}
+
+
+static
+condition_value_t __preprocessor_eval_conditional__(condition_cursor_t *cursor)
+{
+    condition_value_t condiction, l, r;
+    token_t *question;
+
+    condiction = __preprocessor_eval_binary__(cursor, 1);
+
+    question = __condition_cursor_peek__(cursor);
+    if (!__condition_cursor_try__(cursor, TOKEN_QUESTION)) {
+        return condiction;
+    }
+
+    cursor->skip_evaluation += condiction.v == 0;
+    l = __preprocessor_eval_expression__(cursor);
+    cursor->skip_evaluation -= condiction.v == 0;
+
+    if (!__condition_cursor_try__(cursor, TOKEN_COLON)) {
+        CONDITION_ERRORF(cursor, question, "'?' without following ':'");
+        return __condition_value__(0, false);
+    }
+
+    cursor->skip_evaluation += condiction.v != 0;
+    r = __preprocessor_eval_conditional__(cursor);
+    cursor->skip_evaluation -= condiction.v != 0;
+
+    return __condition_value__(condiction.v ? l.v : r.v, l.is_unsigned || r.is_unsigned);
+}
+
+
+static
+condition_value_t __preprocessor_eval_expression__(condition_cursor_t *cursor)
+{
+    condition_value_t value;
+
+    value = __preprocessor_eval_conditional__(cursor);
+
+    while (__condition_cursor_try__(cursor, TOKEN_COMMA)) {
+        value = __preprocessor_eval_conditional__(cursor);
+    }
+
+    return value;
+}
+
+
+/**
+ * Replaces 'defined X' and 'defined ( X )' in the raw tokens of a #if line
+ * by 1 or 0, so that their operands are not macro-expanded.
+ **/
+static
+void __preprocessor_replace_defined__(preprocessor_t *pp, array_t *line, array_t *tokens)
+{
+    token_t *token, *name;
+    size_t i, j, n;
+    bool paren;
+
+    n = array_length(line);
+
+    for (i = 0; i < n; i++) {
+        token = array_cast_at(token_t*, line, i);
+
+        if (token->type != TOKEN_IDENTIFIER || cstring_compare(token->cs, "defined") != 0) {
+            array_cast_append(token_t*, tokens, token_dup(token));
+            continue;
+        }
+
+        paren = i + 1 < n && array_cast_at(token_t*, line, i + 1)->type == TOKEN_L_PAREN;
+        j = i + 1 + paren;
+
+        if (j >= n || (name = array_cast_at(token_t*, line, j))->type != TOKEN_IDENTIFIER ||
+            (paren && (j + 1 >= n || array_cast_at(token_t*, line, j + 1)->type != TOKEN_R_PAREN))) {
+            /* leaves the malformed operator to the evaluator to report */
+            array_cast_append(token_t*, tokens, token_dup(token));
+            continue;
+        }
+
+        token = token_create(TOKEN_NUMBER,
+            cstring_new(__preprocessor_find_macro__(pp, name->cs) != NULL ? "1" : "0"),
+            &token->location);
+        token->spaces = array_cast_at(token_t*, line, i)->spaces;
+        array_cast_append(token_t*, tokens, token);
+
+        i = j + paren;
+    }
+}
+
+
+static
+condition_value_t __preprocessor_eval_value__(preprocessor_t *pp, token_t *directive_token,
+    array_t *line, bool *error)
+{
+    condition_cursor_t cursor;
+    condition_value_t value;
+    array_t *tokens, *expanded;
+    token_t *sentinel;
+    size_t i;
+
+    tokens = __create_tokens__();
+
+    __preprocessor_replace_defined__(pp, line, tokens);
+
+    expanded = __create_tokens__();
+    sentinel = token_create(TOKEN_EOF, NULL, &directive_token->location);
+
+    lexer_unget(pp->lexer, sentinel);
+
+    for (i = array_length(tokens); i--; ) {
+        lexer_unget(pp->lexer, array_cast_at(token_t*, tokens, i));
+    }
+
+    array_destroy(tokens);
+
+    for (;;) {
+        token_t *token = __preprocessor_expand__(pp);
+        array_cast_append(token_t*, expanded, token);
+        if (token == sentinel) {
+            break;
+        }
+    }
+
+    cursor.pp = pp;
+    cursor.directive_token = directive_token;
+    cursor.tokens = array_prototype(expanded, token_t*);
+    cursor.i = 0;
+    cursor.n = array_length(expanded);
+    cursor.skip_evaluation = 0;
+    cursor.error = false;
+
+    value = __preprocessor_eval_expression__(&cursor);
+
+    if (!__condition_cursor_is_end__(&cursor)) {
+        CONDITION_ERRORF(&cursor, __condition_cursor_peek__(&cursor),
+            "missing binary operator before token \"%s\"",
+            token_as_text(__condition_cursor_peek__(&cursor)));
+    }
+
+    *error = cursor.error;
+
+    __destroy_tokens__(expanded);
+
+    return value;
+}
+
+
+static
+bool __preprocessor_eval_line__(preprocessor_t *pp, token_t *directive_token, array_t *line, bool *error)
+{
+    condition_value_t value;
+
+    value = __preprocessor_eval_value__(pp, directive_token, line, error);
+
+    return !*error && value.v != 0;
+}
+
+
+/**
+ * The cache key is the spelling of the raw line, each token prefixed by
+ * its type so that literals cannot collide with identifiers.
+ **/
+static
+cstring_t __preprocessor_condition_key__(array_t *line)
+{
+    token_t **tokens;
+    const char *text;
+    cstring_t key;
+    size_t i;
+
+    key = cstring_new_n(NULL, array_length(line) * 8);
+
+    array_foreach(line, tokens, i) {
+        text = token_as_text(tokens[i]);
+        key = cstring_push_ch(key, (unsigned char) tokens[i]->type);
+        key = cstring_concat_n(key, text, strlen(text));
+        key = cstring_push_ch(key, '\0');
+    }
+
+    return key;
+}
+
+
+static inline
+uint64_t __preprocessor_macro_generation__(preprocessor_t *pp, cstring_t name)
+{
+    dict_entry_t *entry = dict_find((dict_t*)pp->macro_generations, name);
+    return entry == NULL ? 0 : dict_get_unsigned_integer_val(entry);
+}
+
+
+static
+bool __condition_cache_entry_is_valid__(preprocessor_t *pp, condition_cache_entry_t *entry)
+{
+    size_t i, n;
+
+    for (i = 0, n = array_length(entry->names); i < n; i++) {
+        if (__preprocessor_macro_generation__(pp, array_cast_at(cstring_t, entry->names, i)) !=
+            array_cast_at(uint64_t, entry->generations, i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static
+void __condition_cache_entry_destroy__(condition_cache_entry_t *entry)
+{
+    cstring_t *names;
+    size_t i;
+
+    array_foreach(entry->names, names, i) {
+        cstring_free(names[i]);
+    }
+
+    array_destroy(entry->names);
+    array_destroy(entry->generations);
+    pfree(entry);
+}
+
+
+/**
+ * Evaluates the controlling expression of #if or #elif. Results are
+ * cached by the spelling of the line and reused while every macro looked
+ * up during the evaluation, defined or not, keeps its generation.
+ **/
+static
+bool __preprocessor_eval_condition__(preprocessor_t *pp, token_t *directive_token)
+{
+    condition_cache_entry_t *entry;
+    array_t *line;
+    cstring_t key, *names;
+    bool value, error;
+    size_t i;
+
+    line = __create_tokens__();
+
+    for (;;) {
+        token_t *token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
+        array_cast_append(token_t*, line, lexer_get(pp->lexer));
+    }
+
+    key = __preprocessor_condition_key__(line);
+
+    entry = map_find(pp->condition_cache, key);
+    if (entry != NULL && __condition_cache_entry_is_valid__(pp, entry)) {
+        cstring_free(key);
+        __destroy_tokens__(line);
+        return entry->value;
+    }
+
+    pp->condition_trace = array_create_n(sizeof(cstring_t), 8);
+    pp->condition_cacheable = true;
+
+    value = __preprocessor_eval_line__(pp, directive_token, line, &error);
+
+    if (!error && pp->condition_cacheable) {
+        if (entry != NULL) {
+            map_del(pp->condition_cache, key);
+            __condition_cache_entry_destroy__(entry);
+        }
+
+        entry = (condition_cache_entry_t*) pmalloc(sizeof(condition_cache_entry_t));
+        entry->value = value;
+        entry->names = pp->condition_trace;
+        entry->generations = array_create_n(sizeof(uint64_t), array_length(entry->names) + 1);
+
+        array_foreach(entry->names, names, i) {
+            array_cast_append(uint64_t, entry->generations,
+                __preprocessor_macro_generation__(pp, names[i]));
+        }
+
+        map_add(pp->condition_cache, key, entry);
+
+    } else {
+        array_foreach(pp->condition_trace, names, i) {
+            cstring_free(names[i]);
+        }
+        array_destroy(pp->condition_trace);
+    }
+
+    pp->condition_trace = NULL;
+
+    cstring_free(key);
+    __destroy_tokens__(line);
+
+    return value;
+}
+
+
+static inline
+uint32_t __macro_filter_hash__(cstring_t name)
+{
+    const unsigned char *p = (const unsigned char*) name;
+    size_t n = cstring_length(name);
+    uint32_t h = 2166136261u;
+
+    /* FNV-1a, far cheaper than the map's siphash on short names */
+    while (n--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+
+    return h;
+}
+
+
+#define MACRO_FILTER_SLOT1(h)   ((h) % PP_MACRO_FILTER_SIZE)
+#define MACRO_FILTER_SLOT2(h)   (((h) >> 16 ^ (h) << 5) % PP_MACRO_FILTER_SIZE)
+
+
+static inline
+bool __preprocessor_filter_test__(preprocessor_t *pp, cstring_t name)
+{
+    uint32_t h = __macro_filter_hash__(name);
+    return pp->macro_filter[MACRO_FILTER_SLOT1(h)] && pp->macro_filter[MACRO_FILTER_SLOT2(h)];
+}
+
+
+static inline
+void __preprocessor_filter_add__(preprocessor_t *pp, cstring_t name)
+{
+    uint32_t h = __macro_filter_hash__(name);
+    unsigned char *a = &pp->macro_filter[MACRO_FILTER_SLOT1(h)];
+    unsigned char *b = &pp->macro_filter[MACRO_FILTER_SLOT2(h)];
+
+    /* a saturated counter sticks, which only costs false positives */
+    if (*a != UCHAR_MAX) (*a)++;
+    if (*b != UCHAR_MAX) (*b)++;
+}
+
+
+static inline
+void __preprocessor_filter_del__(preprocessor_t *pp, cstring_t name)
+{
+    uint32_t h = __macro_filter_hash__(name);
+    unsigned char *a = &pp->macro_filter[MACRO_FILTER_SLOT1(h)];
+    unsigned char *b = &pp->macro_filter[MACRO_FILTER_SLOT2(h)];
+
+    if (*a != UCHAR_MAX) (*a)--;
+    if (*b != UCHAR_MAX) (*b)--;
+}
+
+
+/**
+ * Every lookup of a macro by name goes through here, so that evaluating
+ * a #if can record what its result depends on.
+ **/
+static inline
+macro_t* __preprocessor_find_macro__(preprocessor_t *pp, cstring_t name)
+{
+    macro_t *macro;
+
+    pp->stats.macro_lookups++;
+
+    if (!__preprocessor_filter_test__(pp, name)) {
+        pp->stats.macro_lookups_filtered++;
+        macro = NULL;
+
+    } else if ((macro = map_find(pp->macros, name)) == NULL) {
+        pp->stats.macro_lookups_missed++;
+    }
+
+    if (pp->condition_trace != NULL) {
+        array_cast_append(cstring_t, pp->condition_trace, cstring_dup(name));
+        if (macro != NULL && macro->type == PP_MACRO_NATIVE) {
+            /* such as __LINE__, which changes without being redefined */
+            pp->condition_cacheable = false;
+        }
+    }
+
+    return macro;
+}
+
+
+/* bumps the generation of a macro name, on every #define and #undef */
+static inline
+void __preprocessor_touch_macro__(preprocessor_t *pp, cstring_t name)
+{
+    dict_entry_t *entry = dict_add_or_find((dict_t*)pp->macro_generations, name);
+    entry->v.u64++;
+}
+
+
+static
+bool __preprocessor_parse_if__(preprocessor_t *pp, token_t *directive_token)
+{
+    __preprocessor_push_condition__(pp, directive_token,
+        __preprocessor_eval_condition__(pp, directive_token));
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_ifdef__(preprocessor_t *pp, token_t *directive_token, bool defined)
+{
+    token_t *macroname_token;
+    bool condiction;
+
+    macroname_token = lexer_get(pp->lexer);
+    if (macroname_token->type != TOKEN_IDENTIFIER) {
+        if (macroname_token->type == TOKEN_NEWLINE) {
+            ERRORF_WITH_TOKEN(directive_token, "no macro name given in #%s directive",
+                directive_token->cs);
+            lexer_unget(pp->lexer, macroname_token);
+        } else {
+            ERRORF_WITH_TOKEN(macroname_token, "macro names must be identifiers");
+            token_destroy(macroname_token);
+            __preprocessor_skip_one_line__(pp);
+        }
+        __preprocessor_push_condition__(pp, directive_token, false);
+        return false;
+    }
+
+    condiction = (__preprocessor_find_macro__(pp, macroname_token->cs) != NULL) == defined;
+
+    token_destroy(macroname_token);
+
+    __preprocessor_skip_extra_tokens__(pp, directive_token);
+
+    __preprocessor_push_condition__(pp, directive_token, condiction);
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_elif__(preprocessor_t *pp, token_t *directive_token)
+{
+    condition_directive_t *cd;
+
+    if (array_is_empty(pp->condition_directive_stack)) {
+        ERRORF_WITH_TOKEN(directive_token, "#elif without #if");
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    cd = &array_cast_back(condition_directive_t, pp->condition_directive_stack);
+    if (cd->has_else) {
+        ERRORF_WITH_TOKEN(directive_token, "#elif after #else");
+    }
+
+    if (cd->condiction) {
+        /* the expression of a #elif after a taken group is not evaluated */
+        __preprocessor_skip_group__(pp);
+        return true;
+    }
+
+    if (__preprocessor_eval_condition__(pp, directive_token)) {
+        cd->condiction = true;
+    } else {
+        __preprocessor_skip_group__(pp);
+    }
+
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_else__(preprocessor_t *pp, token_t *directive_token)
+{
+    condition_directive_t *cd;
+
+    if (array_is_empty(pp->condition_directive_stack)) {
+        ERRORF_WITH_TOKEN(directive_token, "#else without #if");
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    cd = &array_cast_back(condition_directive_t, pp->condition_directive_stack);
+    if (cd->has_else) {
+        ERRORF_WITH_TOKEN(directive_token, "#else after #else");
+    }
+
+    cd->has_else = true;
+
+    __preprocessor_skip_extra_tokens__(pp, directive_token);
+
+    if (cd->condiction) {
+        __preprocessor_skip_group__(pp);
+    } else {
+        cd->condiction = true;
+    }
+
+    return true;
+}
+
+
+static
+bool __preprocessor_parse_endif__(preprocessor_t *pp, token_t *directive_token)
+{
+    if (array_is_empty(pp->condition_directive_stack)) {
+        ERRORF_WITH_TOKEN(directive_token, "#endif without #if");
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    __preprocessor_skip_extra_tokens__(pp, directive_token);
+
+    token_destroy(array_cast_back(condition_directive_t, pp->condition_directive_stack).token);
+    array_pop_back(pp->condition_directive_stack);
+    return true;
+}
+
+
+/* the macro expanded rest of the line of a directive, up to the newline */
+static
+array_t* __preprocessor_expand_line__(preprocessor_t *pp, token_t *directive_token)
+{
+    array_t *line, *expanded;
+    token_t *sentinel, *token;
+
+    line = __create_tokens__();
+
+    for (;;) {
+        token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
+        array_cast_append(token_t*, line, lexer_get(pp->lexer));
+    }
+
+    expanded = __create_tokens__();
+    sentinel = token_create(TOKEN_EOF, NULL, &directive_token->location);
+
+    lexer_unget(pp->lexer, sentinel);
+    __preprocessor_unget_tokens__(pp, line);
+    array_destroy(line);
+
+    for (;;) {
+        token = __preprocessor_expand__(pp);
+        if (token == sentinel) {
+            token_destroy(token);
+            break;
+        }
+        array_cast_append(token_t*, expanded, token);
+    }
+
+    return expanded;
+}
+
+
+/**
+ * Builds the header name of a computed #include from its macro expanded
+ * line, a string literal or the spellings from '<' to '>'.
+ **/
+static
+token_t* __preprocessor_expand_header_name__(preprocessor_t *pp, token_t *directive_token)
+{
+    array_t *expanded;
+    token_t *header;
+    token_t **tokens;
+    size_t i, n;
+
+    expanded = __preprocessor_expand_line__(pp, directive_token);
+
+    tokens = array_prototype(expanded, token_t*);
+    n = array_length(expanded);
+    header = NULL;
+
+    if (n == 0) {
+        ERRORF_WITH_TOKEN(directive_token, "#include expects \"FILENAME\" or <FILENAME>");
+
+    } else if (tokens[0]->type == TOKEN_CONSTANT_STRING && n == 1) {
+        header = token_create(TOKEN_PP_HEADER_NAME,
+            cstring_concat_pf(cstring_new_n(NULL, cstring_length(tokens[0]->cs) + 2),
+                "\"%s\"", (char*) tokens[0]->cs), &tokens[0]->location);
+
+    } else if (tokens[0]->type == TOKEN_LESS) {
+        header = token_create(TOKEN_PP_HEADER_NAME, cstring_new("<"), &tokens[0]->location);
+
+        for (i = 1; i < n && tokens[i]->type != TOKEN_GREATER; i++) {
+            if (i > 1 && tokens[i]->spaces != 0) {
+                header->cs = cstring_push_ch(header->cs, ' ');
+            }
+            header->cs = cstring_concat_n(header->cs, token_as_text(tokens[i]),
+                                          strlen(token_as_text(tokens[i])));
+        }
+
+        if (i == n) {
+            ERRORF_WITH_TOKEN(tokens[0], "missing terminating > character");
+            token_destroy(header);
+            header = NULL;
+        } else {
+            header->cs = cstring_push_ch(header->cs, '>');
+            if (i + 1 != n) {
+                WARNINGF_WITH_TOKEN(tokens[i + 1], "extra tokens at end of #%s directive",
+                    directive_token->cs);
+            }
+        }
+
+    } else {
+        ERRORF_WITH_TOKEN(tokens[0], "#include expects \"FILENAME\" or <FILENAME>");
+    }
+
+    __destroy_tokens__(expanded);
+
+    return header;
+}
+
+
+static
+bool __preprocessor_file_exists__(preprocessor_t *pp, const char *filename)
+{
+    struct stat st;
+
+    if (pp->fcache != NULL) {
+        fcache_watch(pp->fcache, filename);
+    }
+
+    return stat(filename, &st) == 0 && !S_ISDIR(st.st_mode);
+}
+
+
+static
+cstring_t __preprocessor_search_paths__(preprocessor_t *pp, const char *name,
+    size_t begin, size_t end)
+{
+    cstring_t filename;
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        filename = cstring_concat_pf(
+            cstring_dup(array_cast_at(cstring_t, pp->std_include_paths, i)), "/%s", name);
+
+        if (__preprocessor_file_exists__(pp, filename)) {
+            return filename;
+        }
+
+        cstring_free(filename);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Looks a quoted name up next to the including file first, then in the
+ * paths added by preprocessor_add_include_path(), then in the predefined
+ * ones.
+ **/
+static
+cstring_t __preprocessor_search_include__(preprocessor_t *pp, const char *name,
+    bool angled, cstring_t dir, bool *system)
+{
+    cstring_t filename;
+
+    if (name[0] == '/') {
+        *system = false;
+        return __preprocessor_file_exists__(pp, name) ? cstring_new(name) : NULL;
+    }
+
+    if (!angled) {
+        filename = cstring_concat_n(cstring_dup(dir), name, strlen(name));
+
+        if (__preprocessor_file_exists__(pp, filename)) {
+            *system = !array_is_empty(pp->include_stack) &&
+                      array_cast_back(include_t, pp->include_stack).system;
+            return filename;
+        }
+
+        cstring_free(filename);
+    }
+
+    filename = __preprocessor_search_paths__(pp, name,
+        pp->system_include_paths, array_length(pp->std_include_paths));
+    if (filename != NULL) {
+        *system = false;
+        return filename;
+    }
+
+    *system = true;
+    return __preprocessor_search_paths__(pp, name, 0, pp->system_include_paths);
+}
+
+
+/**
+ * The lookups of the cache are told apart by everything the search looks
+ * at, the directory of the including file and the include paths.
+ **/
+static
+cstring_t __preprocessor_find_include__(preprocessor_t *pp, const char *name,
+    bool angled, bool *system)
+{
+    cstring_t *paths;
+    cstring_t dir, key, filename;
+    const char *includer, *slash;
+    bool includer_system;
+    size_t i;
+
+    includer = reader_is_empty(pp->lexer->reader) ? NULL :
+               (const char*) reader_filename(pp->lexer->reader);
+    slash = includer != NULL ? strrchr(includer, '/') : NULL;
+
+    dir = slash != NULL ? cstring_new_n(includer, slash - includer + 1) : cstring_new("");
+
+    if (pp->fcache == NULL) {
+        filename = __preprocessor_search_include__(pp, name, angled, dir, system);
+        cstring_free(dir);
+        return filename;
+    }
+
+    includer_system = !array_is_empty(pp->include_stack) &&
+                      array_cast_back(include_t, pp->include_stack).system;
+
+    key = cstring_concat_pf(cstring_new_n(NULL, 256), "%c%c%s\n",
+        angled ? '<' : '"', includer_system ? 's' : 'u', angled ? "" : (char*) dir);
+
+    array_foreach(pp->std_include_paths, paths, i) {
+        key = cstring_concat_pf(key, "%s%s\n", i == pp->system_include_paths ? "\n" : "",
+                                (char*) paths[i]);
+    }
+
+    key = cstring_concat_n(key, name, strlen(name));
+
+    filename = fcache_find_include(pp->fcache, key, system);
+    if (filename != NULL) {
+        filename = cstring_dup(filename);
+
+    } else {
+        filename = __preprocessor_search_include__(pp, name, angled, dir, system);
+        if (filename != NULL) {
+            fcache_add_include(pp->fcache, key, filename, *system);
+        }
+    }
+
+    cstring_free(key);
+    cstring_free(dir);
+
+    return filename;
+}
+
+
+/**
+ * Starts reading the included file. Its tokens follow the newline of the
+ * directive, already taken from the including file.
+ **/
+static
+bool __preprocessor_parse_include__(preprocessor_t *pp, token_t *directive_token)
+{
+    token_t *header;
+    include_t *include;
+    include_file_t *file;
+    cstring_t name, filename, interned;
+    size_t length;
+    bool angled, system;
+
+    header = lexer_scan_header_name(pp->lexer);
+    if (header == NULL) {
+        header = __preprocessor_expand_header_name__(pp, directive_token);
+        if (header == NULL) {
+            __preprocessor_skip_one_line__(pp);
+            return false;
+        }
+    } else {
+        __preprocessor_skip_extra_tokens__(pp, directive_token);
+    }
+
+    length = cstring_length(header->cs);
+    angled = header->cs[0] == '<';
+
+    if (length < 2 || header->cs[length - 1] != (angled ? '>' : '"')) {
+        ERRORF_WITH_TOKEN(header, "missing terminating %c character", angled ? '>' : '"');
+        token_destroy(header);
+        return false;
+    }
+
+    if (length == 2) {
+        ERRORF_WITH_TOKEN(header, "empty filename in #%s", directive_token->cs);
+        token_destroy(header);
+        return false;
+    }
+
+    if (reader_depth(pp->lexer->reader) >= PP_MAX_INCLUDE_DEPTH) {
+        ERRORF_WITH_TOKEN(header, "#%s nested too deeply", directive_token->cs);
+        token_destroy(header);
+        return false;
+    }
+
+    name = cstring_new_n(header->cs + 1, length - 2);
+
+    filename = __preprocessor_find_include__(pp, (char*) name, angled, &system);
+    if (filename == NULL) {
+        ERRORF_WITH_TOKEN(header, "'%s' file not found", (char*) name);
+        cstring_free(name);
+        token_destroy(header);
+        return false;
+    }
+
+    if (!lexer_push(pp->lexer, STREAM_TYPE_FILE, (unsigned char*) filename)) {
+        ERRORF_WITH_TOKEN(header, "cannot open '%s'", (char*) filename);
+        cstring_free(filename);
+        cstring_free(name);
+        token_destroy(header);
+        return false;
+    }
+
+    /* the name interned by the reader, the same for every #include of the file */
+    interned = reader_filename(pp->lexer->reader);
+
+    if (set_has(pp->once_guard, interned)) {
+        reader_pop(pp->lexer->reader);
+        cstring_free(filename);
+        cstring_free(name);
+        token_destroy(header);
+        return true;
+    }
+
+    include = array_push_back(pp->include_stack);
+    include->conditions = array_length(pp->condition_directive_stack);
+    include->system = system;
+
+    if (!set_has(pp->included, interned)) {
+        set_add(pp->included, interned);
+
+        file = array_push_back(pp->includes);
+        file->filename = interned;
+        file->system = system;
+    }
+
+    if (pp->trace != NULL) {
+        __preprocessor_trace_enter_file__(pp);
+    }
+
+    if (pp->include_hook != NULL) {
+        pp->include_hook(pp->include_hook_data, interned, 1, true, system);
+    }
+
+    cstring_free(filename);
+    cstring_free(name);
+    token_destroy(header);
+    return true;
+}
+
+
+/**
+ * The balanced tokens of a parameter of #embed, from the '(' at *i to
+ * its ')', which *i is left past. Returns NULL if it is not closed.
+ **/
+static
+array_t* __preprocessor_embed_param_tokens__(preprocessor_t *pp, token_t *name,
+    array_t *line, size_t *i)
+{
+    token_t **tokens;
+    array_t *param;
+    size_t n, depth;
+
+    tokens = array_prototype(line, token_t*);
+    n = array_length(line);
+
+    if (*i >= n || tokens[*i]->type != TOKEN_L_PAREN) {
+        ERRORF_WITH_TOKEN(name, "missing '(' after #embed parameter '%s'", (char*) name->cs);
+        return NULL;
+    }
+
+    param = __create_tokens__();
+
+    for ((*i)++, depth = 0; *i < n; (*i)++) {
+        if (tokens[*i]->type == TOKEN_L_PAREN) {
+            depth++;
+        } else if (tokens[*i]->type == TOKEN_R_PAREN && depth-- == 0) {
+            (*i)++;
+            return param;
+        }
+
+        array_cast_append(token_t*, param, token_dup(tokens[*i]));
+    }
+
+    ERRORF_WITH_TOKEN(name, "missing ')' after #embed parameter '%s'", (char*) name->cs);
+    __destroy_tokens__(param);
+    return NULL;
+}
+
+
+/**
+ * Parses the parameters following the header name of an #embed, with
+ * the standard names also accepted as __name__. The limit is evaluated
+ * like an #if expression.
+ **/
+static
+bool __preprocessor_parse_embed_params__(preprocessor_t *pp, token_t *directive_token,
+    array_t *line, embed_params_t *params)
+{
+    condition_value_t value;
+    token_t **tokens, *name;
+    array_t *param, **slot;
+    const char *s;
+    size_t i, n, length;
+    bool error;
+
+    tokens = array_prototype(line, token_t*);
+    n = array_length(line);
+
+    for (i = 0; i < n; ) {
+        name = tokens[i++];
+
+        if (name->type != TOKEN_IDENTIFIER) {
+            ERRORF_WITH_TOKEN(name, "expected a parameter name in #%s directive",
+                (char*) directive_token->cs);
+            return false;
+        }
+
+        /* a vendor parameter, prefix::name */
+        if (i + 2 < n && tokens[i]->type == TOKEN_COLON && tokens[i + 1]->type == TOKEN_COLON) {
+            ERRORF_WITH_TOKEN(name, "unknown #embed parameter '%s::%s'",
+                (char*) name->cs, token_as_text(tokens[i + 2]));
+            return false;
+        }
+
+        s = (char*) name->cs;
+        length = cstring_length(name->cs);
+
+        if (length > 4 && s[0] == '_' && s[1] == '_' && s[length - 2] == '_' && s[length - 1] == '_') {
+            s += 2;
+            length -= 4;
+        }
+
+        if (length == 5 && memcmp(s, "limit", 5) == 0) {
+            slot = NULL;
+        } else if (length == 6 && memcmp(s, "prefix", 6) == 0) {
+            slot = &params->prefix;
+        } else if (length == 6 && memcmp(s, "suffix", 6) == 0) {
+            slot = &params->suffix;
+        } else if (length == 8 && memcmp(s, "if_empty", 8) == 0) {
+            slot = &params->if_empty;
+        } else {
+            ERRORF_WITH_TOKEN(name, "unknown #embed parameter '%s'", (char*) name->cs);
+            return false;
+        }
+
+        if (slot != NULL ? *slot != NULL : params->limit_token != NULL) {
+            ERRORF_WITH_TOKEN(name, "duplicate #embed parameter '%s'", (char*) name->cs);
+            return false;
+        }
+
+        if ((param = __preprocessor_embed_param_tokens__(pp, name, line, &i)) == NULL) {
+            return false;
+        }
+
+        if (slot != NULL) {
+            *slot = param;
+            continue;
+        }
+
+        params->limit_token = name;
+
+        if (array_is_empty(param)) {
+            ERRORF_WITH_TOKEN(name, "#embed parameter '%s' expects an expression", (char*) name->cs);
+            __destroy_tokens__(param);
+            return false;
+        }
+
+        value = __preprocessor_eval_value__(pp, name, param, &error);
+        __destroy_tokens__(param);
+
+        if (error) {
+            return false;
+        }
+
+        if (!value.is_unsigned && (long long) value.v < 0) {
+            ERRORF_WITH_TOKEN(name, "#embed parameter '%s' must not be negative", (char*) name->cs);
+            return false;
+        }
+
+        params->limit = value.v > (size_t) -1 ? (size_t) -1 : (size_t) value.v;
+    }
+
+    return true;
+}
+
+
+static
+void __embed_destroy__(embed_t *embed)
+{
+#if defined(UNIX)
+    if (embed->length != 0) {
+        munmap(embed->map, embed->length);
+    } else
+#endif
+    if (embed->map != NULL) {
+        pfree(embed->map);
+    }
+
+    pfree(embed);
+}
+
+
+/**
+ * Maps at most limit bytes of the file, the preprocessor keeps them until
+ * it is destroyed since the tokens refer to them.
+ **/
+static
+embed_t* __preprocessor_map_embed__(preprocessor_t *pp, const char *filename, size_t limit)
+{
+    embed_t *embed;
+    struct stat st;
+    FILE *fp;
+    size_t size;
+
+    if (stat(filename, &st) != 0 || S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    size = (size_t) st.st_size < limit ? (size_t) st.st_size : limit;
+
+    embed = pmalloc(sizeof(embed_t));
+    embed->bytes.data = NULL;
+    embed->bytes.size = size;
+    embed->map = NULL;
+    embed->length = 0;
+
+    if (size == 0) {
+        return embed;
+    }
+
+#if defined(UNIX)
+    {
+        int fd;
+
+        if ((fd = open(filename, O_RDONLY)) >= 0) {
+            embed->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+
+            if (embed->map != MAP_FAILED) {
+                embed->bytes.data = embed->map;
+                embed->length = size;
+                return embed;
+            }
+
+            embed->map = NULL;
+        }
+    }
+#endif
+
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        pfree(embed);
+        return NULL;
+    }
+
+    embed->map = pmalloc(size);
+    embed->bytes.data = embed->map;
+
+    if (fread(embed->map, 1, size, fp) != size) {
+        fclose(fp);
+        __embed_destroy__(embed);
+        return NULL;
+    }
+
+    fclose(fp);
+    return embed;
+}
+
+
+static
+void __preprocessor_append_embed_tokens__(array_t *out, array_t *tokens)
+{
+    token_t **toks;
+    token_t *token;
+    size_t i;
+
+    array_foreach(tokens, toks, i) {
+        token = token_dup(toks[i]);
+        token->begin_of_line = false;
+        array_cast_append(token_t*, out, token);
+    }
+}
+
+
+/**
+ * Replaces an #embed by a single token referring to the bytes of the file
+ * between the tokens of its prefix and suffix, or by the tokens of its
+ * if_empty when there are no bytes. Only a printer spells the bytes out.
+ **/
+static
+bool __preprocessor_parse_embed__(preprocessor_t *pp, token_t *directive_token)
+{
+    embed_params_t params;
+    token_t *header, *token;
+    embed_t *embed;
+    include_file_t *file;
+    array_t *line, *out;
+    cstring_t name, filename, interned;
+    size_t length;
+    bool angled, system, ok;
+
+    header = lexer_scan_header_name(pp->lexer);
+    if (header == NULL) {
+        ERRORF_WITH_TOKEN(directive_token, "#%s expects \"FILENAME\" or <FILENAME>",
+            (char*) directive_token->cs);
+        __preprocessor_skip_one_line__(pp);
+        return false;
+    }
+
+    line = __create_tokens__();
+
+    for (;;) {
+        token = lexer_peek(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
+        array_cast_append(token_t*, line, lexer_get(pp->lexer));
+    }
+
+    params.limit_token = NULL;
+    params.limit = (size_t) -1;
+    params.prefix = NULL;
+    params.suffix = NULL;
+    params.if_empty = NULL;
+
+    embed = NULL;
+    name = NULL;
+    filename = NULL;
+    ok = false;
+
+    length = cstring_length(header->cs);
+    angled = header->cs[0] == '<';
+
+    if (length < 2 || header->cs[length - 1] != (angled ? '>' : '"')) {
+        ERRORF_WITH_TOKEN(header, "missing terminating %c character", angled ? '>' : '"');
+        goto done;
+    }
+
+    if (length == 2) {
+        ERRORF_WITH_TOKEN(header, "empty filename in #%s", (char*) directive_token->cs);
+        goto done;
+    }
+
+    if (!__preprocessor_parse_embed_params__(pp, directive_token, line, &params)) {
+        goto done;
+    }
+
+    name = cstring_new_n(header->cs + 1, length - 2);
+
+    filename = __preprocessor_find_include__(pp, (char*) name, angled, &system);
+    if (filename == NULL) {
+        ERRORF_WITH_TOKEN(header, "'%s' file not found", (char*) name);
+        goto done;
+    }
+
+    if ((embed = __preprocessor_map_embed__(pp, filename, params.limit)) == NULL) {
+        ERRORF_WITH_TOKEN(header, "cannot open '%s'", (char*) filename);
+        goto done;
+    }
+
+    array_cast_append(embed_t*, pp->embeds, embed);
+
+    interned = cspool_push_cs(pp->lexer->reader->cspool, cstring_dup(filename));
+    if (!set_has(pp->included, interned)) {
+        set_add(pp->included, interned);
+
+        file = array_push_back(pp->includes);
+        file->filename = interned;
+        file->system = system;
+    }
+
+    /* the tokens take the place of the directive, in front of its newline */
+    out = __create_tokens__();
+
+    if (embed->bytes.size == 0) {
+        if (params.if_empty != NULL) {
+            __preprocessor_append_embed_tokens__(out, params.if_empty);
+        }
+
+    } else {
+        if (params.prefix != NULL) {
+            __preprocessor_append_embed_tokens__(out, params.prefix);
+        }
 
-    macro_body = array_create_n(sizeof(token_t), 8);
+        token = token_create(TOKEN_PP_EMBED, NULL, &header->location);
+        token->embed = &embed->bytes;
+        token->spaces = array_is_empty(out) ? 0 : 1;
+        array_cast_append(token_t*, out, token);
 
-    for (;;) {
-        token_t token = lexer_peek(pp->lexer);
-        if (token->type == TOKEN_NEWLINE) {
-            break;
+        if (params.suffix != NULL) {
+            __preprocessor_append_embed_tokens__(out, params.suffix);
         }
-        lexer_get(pp->lexer);
-        array_cast_append(token_t, macro_body, token);
     }
 
-    if (!__preprocessor_check_macro_body__(pp, macro_body)) {
-        token_destroy(macroname_token);
-        __destroy_tokens__(macro_body);
-        __preprocessor_skip_one_line__(pp);
-        return false;
+    if (!array_is_empty(out)) {
+        array_cast_at(token_t*, out, 0)->spaces = 0;
     }
 
-    __preprocessor_add_macro__(pp, macroname_token,
-        PP_MACRO_OBJECT, NULL, macro_body, NULL, false);
+    __preprocessor_unget_tokens__(pp, out);
+    array_destroy(out);
 
-    return true;
+    ok = true;
+
+done:
+    if (params.prefix != NULL) {
+        __destroy_tokens__(params.prefix);
+    }
+    if (params.suffix != NULL) {
+        __destroy_tokens__(params.suffix);
+    }
+    if (params.if_empty != NULL) {
+        __destroy_tokens__(params.if_empty);
+    }
+    if (filename != NULL) {
+        cstring_free(filename);
+    }
+    if (name != NULL) {
+        cstring_free(name);
+    }
+
+    __destroy_tokens__(line);
+    token_destroy(header);
+    return ok;
 }
 
 
+/**
+ * Reports the conditionals left open by the file ending with tok, an
+ * included file only closes its own.
+ **/
 static
-bool __preprocessor_add_function_like_param__(preprocessor_t pp,
-    array_t params, token_t identifier_token)
+void __preprocessor_check_unterminated__(preprocessor_t *pp, token_t *tok)
 {
-    token_t *tokens;
-    size_t i;
-
-    array_foreach(params, tokens, i) {
-        if (cstring_compare(tokens[i]->cs, identifier_token->cs) == 0) {
-            ERRORF_WITH_TOKEN(identifier_token,
-                "duplicate macro parameter \"%s\"", token_as_text(identifier_token));
-            return false;
+    condition_directive_t *cd;
+    size_t base = 0;
+
+    if (tok->type == TOKEN_EOF && !array_is_empty(pp->include_stack)) {
+        base = array_cast_back(include_t, pp->include_stack).conditions;
+        array_pop_back(pp->include_stack);
+
+        /* the reader is back in the includer */
+        if (pp->include_hook != NULL) {
+            pp->include_hook(pp->include_hook_data,
+                reader_filename(pp->lexer->reader), reader_line(pp->lexer->reader), false,
+                !array_is_empty(pp->include_stack) &&
+                array_cast_back(include_t, pp->include_stack).system);
         }
+    } else if (tok->type == TOKEN_END) {
+        array_clear(pp->include_stack);
     }
 
-    array_cast_append(token_t, params, identifier_token);
-    return true;
+    while (array_length(pp->condition_directive_stack) > base) {
+        cd = &array_cast_back(condition_directive_t, pp->condition_directive_stack);
+        ERRORF_WITH_TOKEN(cd->token, "unterminated #%s", cd->token->cs);
+        token_destroy(cd->token);
+        array_pop_back(pp->condition_directive_stack);
+    }
 }
 
 
+/* appends the spellings of the rest of the line, as they were spaced */
 static
-bool __preprocessor_parse_function_like_params__(preprocessor_t pp, array_t params, bool *variadic)
+cstring_t __preprocessor_concat_line__(preprocessor_t *pp, cstring_t cs)
 {
-    token_t token;
-    bool prev_ident = false;
+    token_t *token;
 
     for (;;) {
         token = lexer_peek(pp->lexer);
-        switch (token->type) {
-        case TOKEN_IDENTIFIER:
-            if (prev_ident == true) {
-                ERRORF_WITH_TOKEN(token, "macro parameters must be comma-separated");
-                return false;
-            }
-
-            prev_ident = true;
-
-            if (!__preprocessor_add_function_like_param__(pp, params, token)) {
-                return false;
-            }
-
-            lexer_get(pp->lexer);
-            continue;
-        case TOKEN_R_PAREN:
-            if (prev_ident == true || array_is_empty(params)) {
-                lexer_eat(pp->lexer);
-                return true;
-            }
-        case TOKEN_COMMA:
-            if (prev_ident == false) {
-                ERRORF_WITH_TOKEN(token, "parameter name missing");
-                return false;
-            }
-            lexer_eat(pp->lexer);
-            prev_ident = false;
-            continue;
-        case TOKEN_ELLIPSIS:
-            *variadic = true;
-
-            if (prev_ident == false) {
-                /* anonymous variadic macros */
-                const char *va_args = "__VA_ARGS__";
-                const size_t n_va_args = 11;
-                token = token_dup(token);
-                token->type = TOKEN_IDENTIFIER;
-                token->cs = cstring_copy_n(token->cs, va_args, n_va_args);
-                token->is_vararg = true;
-                if (!__preprocessor_add_function_like_param__(pp, params, token)) {
-                    return false;
-                }
-
-            } else {
-                /* named variadic macros */
-                array_cast_back(token_t, params)->is_vararg = true;
-            }
-
-            lexer_eat(pp->lexer);
+        if (token->type == TOKEN_NEWLINE ||
+            token->type == TOKEN_EOF ||
+            token->type == TOKEN_END) {
+            break;
+        }
 
-            if (lexer_try(pp->lexer, TOKEN_R_PAREN)) {
-                return true;
-            }
-        case TOKEN_NEWLINE:
-        case TOKEN_END:
-            ERRORF_WITH_TOKEN(token, "missing ')' in macro parameter list");
-            return false;
-        default:
-            ERRORF_WITH_TOKEN(token, 
-                "\"%s\" may not appear in macro parameter list", token_as_text(token));
-            return false;
+        token = lexer_get(pp->lexer);
+        if (token->spaces != 0) {
+            cs = cstring_concat_ch(cs, ' ');
         }
+        cs = token_concat_spelling(cs, token);
+        token_destroy(token);
     }
 
-    return false;
+    return cs;
 }
 
 
 static
-bool __preprocessor_parse_function_like_body__(preprocessor_t pp, array_t macro_body)
+bool __preprocessor_parse_diagnostic__(preprocessor_t *pp, token_t *directive_token, bool error)
 {
-    for (; !lexer_is_empty(pp->lexer); ) {
-        token_t token = lexer_peek(pp->lexer);
-        if (token->type == TOKEN_NEWLINE) {
-            lexer_eat(pp->lexer);
-            return true;
-        }
+    cstring_t cs;
 
-        array_cast_append(token_t, macro_body, token);
-        lexer_get(pp->lexer);
-    }
+    cs = cstring_concat_pf(cstring_new_n(NULL, 64), "#%s", (char*) directive_token->cs);
+    cs = __preprocessor_concat_line__(pp, cs);
 
-    if (!__preprocessor_check_macro_body__(pp, macro_body)) {
-        __destroy_tokens__(macro_body);
-        return false;
+    if (error) {
+        ERRORF_WITH_TOKEN(directive_token, "%s", (char*) cs);
+    } else {
+        WARNINGF_WITH_TOKEN(directive_token, "%s", (char*) cs);
     }
 
-    return false;
+    cstring_free(cs);
+    return !error;
 }
 
 
+/**
+ * '#pragma once' keeps the file from being included again. Any other
+ * pragma is passed on as one TOKEN_PP_PRAGMA spelled as its whole line,
+ * for the output of -E and the stages that follow.
+ **/
 static
-bool __preprocessor_parse_function_like__(preprocessor_t pp, token_t macroname_token)
+bool __preprocessor_parse_pragma__(preprocessor_t *pp, token_t *hash, token_t *directive_token)
 {
-    array_t macro_params;
-    array_t macro_body;
-    bool is_variadic = false;
-
-    /* eat '(' */
-    lexer_eat(pp->lexer);
+    token_t *token, *pragma;
+    cstring_t cs;
 
-    macro_params = __create_tokens__();
-    if (!__preprocessor_parse_function_like_params__(pp, macro_params, &is_variadic)) {
-        assert((is_variadic == false) || (is_variadic == true && !array_is_empty(macro_params)));
-        __preprocessor_skip_one_line__(pp);
-        __destroy_tokens__(macro_params);
-        token_destroy(macroname_token);
-        return false;
+    token = lexer_peek(pp->lexer);
+    if (__preprocessor_is_directive__(token, "once")) {
+        lexer_eat(pp->lexer);
+        __preprocessor_skip_extra_tokens__(pp, directive_token);
+        set_add(pp->once_guard, reader_filename(pp->lexer->reader));
+        return true;
     }
 
-    macro_body = __create_tokens__();
-    if (!__preprocessor_parse_function_like_body__(pp, macro_body)) {
-        __preprocessor_skip_one_line__(pp);
-        __destroy_tokens__(macro_params);
-        __destroy_tokens__(macro_body);
-        token_destroy(macroname_token);
-        return false;
+    cs = cstring_concat_pf(cstring_new_n(NULL, 64), "#%s", (char*) directive_token->cs);
+    if (token->type != TOKEN_NEWLINE && token->type != TOKEN_EOF && token->type != TOKEN_END) {
+        cs = cstring_concat_ch(cs, ' ');
+        token->spaces = 0;
     }
+    cs = __preprocessor_concat_line__(pp, cs);
 
-    __preprocessor_add_macro__(pp, macroname_token,
-        PP_MACRO_FUNCTION, NULL, macro_body, macro_params, is_variadic);
-
+    pragma = token_create(TOKEN_PP_PRAGMA, cs, &hash->location);
+    pragma->begin_of_line = true;
+    lexer_unget(pp->lexer, pragma);
     return true;
 }
 
 
+/**
+ * #line and the GNU line marker '# 33 "file" 1 3' number the next line
+ * of the file being read, and rename it when a filename is given.
+ **/
 static
-bool __preprocessor_parse_define__(preprocessor_t pp)
+bool __preprocessor_parse_line__(preprocessor_t *pp, token_t *directive_token, bool marker)
 {
-    token_t macroname_token;
-    token_t l_paren_token;
-
-    macroname_token = lexer_get(pp->lexer);
-    if (macroname_token->type != TOKEN_IDENTIFIER) {
-        ERRORF_WITH_TOKEN(macroname_token, "macro names must be identifiers");
-        token_destroy(macroname_token);
-        __preprocessor_skip_one_line__(pp);
-        return false;
+    array_t *expanded;
+    token_t **tokens;
+    size_t n, line;
+    const char *filename;
+    bool ok;
+
+    if (marker) {
+        lexer_unget(pp->lexer, token_dup(directive_token));
     }
 
-    l_paren_token = lexer_peek(pp->lexer);
-    if (l_paren_token->type == TOKEN_L_PAREN && l_paren_token->spaces == 0) {
-        return __preprocessor_parse_function_like__(pp, macroname_token);
+    expanded = __preprocessor_expand_line__(pp, directive_token);
+    tokens = array_prototype(expanded, token_t*);
+    n = array_length(expanded);
+    ok = false;
+
+    if (n == 0) {
+        ERRORF_WITH_TOKEN(directive_token, "#line directive requires a positive integer argument");
+
+    } else if (tokens[0]->type != TOKEN_NUMBER ||
+               strspn((char*) tokens[0]->cs, "0123456789") != cstring_length(tokens[0]->cs)) {
+        ERRORF_WITH_TOKEN(tokens[0], "\"%s\" after #line is not a positive integer",
+            token_as_text(tokens[0]));
+
+    } else if (n > 1 && tokens[1]->type != TOKEN_CONSTANT_STRING) {
+        ERRORF_WITH_TOKEN(tokens[1], "invalid filename \"%s\"", token_as_text(tokens[1]));
+
+    } else {
+        if (n > 2 && !marker) {
+            WARNINGF_WITH_TOKEN(tokens[2], "extra tokens at end of #line directive");
+        }
+
+        line = strtoul((char*) tokens[0]->cs, NULL, 10);
+        filename = n > 1 ? (char*) tokens[1]->cs : NULL;
+        reader_set_line(pp->lexer->reader, line, filename);
+        ok = true;
     }
 
-    return __preprocessor_parse_object_like__(pp, macroname_token);
+    __destroy_tokens__(expanded);
+    return ok;
 }
 
 
 static
-bool __preprocessor_parse_directive__(preprocessor_t pp, token_t hash)
+bool __preprocessor_parse_directive__(preprocessor_t *pp, token_t *hash)
 {
-    if (hash->begin_of_line && 
-        hash->type == TOKEN_HASH && 
-        (hash->hideset == NULL || set_is_empty(hash->hideset))) {
-        token_t directive_token;
+    if (hash->begin_of_line &&
+        hash->type == TOKEN_HASH &&
+        hash->hideset == NULL) {
+        token_t *directive_token;
 
         directive_token = lexer_get(pp->lexer);
 
         if (directive_token->type == TOKEN_NEWLINE) {
+            /* null directive */
+            lexer_unget(pp->lexer, directive_token);
             token_destroy(hash);
-            return false;
-        }
-
-        if (directive_token->type == TOKEN_NUMBER) {
-            /* TODO: GNU remark linenum */
-            return false;
+            return true;
         }
 
-        if (cstring_compare(directive_token->cs, "define") == 0) {
+        if (__preprocessor_is_directive__(directive_token, "define")) {
             __preprocessor_parse_define__(pp);
+        } else if (__preprocessor_is_directive__(directive_token, "undef")) {
+            __preprocessor_parse_undef__(pp);
+        } else if (__preprocessor_is_directive__(directive_token, "if")) {
+            __preprocessor_parse_if__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "ifdef")) {
+            __preprocessor_parse_ifdef__(pp, directive_token, true);
+        } else if (__preprocessor_is_directive__(directive_token, "ifndef")) {
+            __preprocessor_parse_ifdef__(pp, directive_token, false);
+        } else if (__preprocessor_is_directive__(directive_token, "elif")) {
+            __preprocessor_parse_elif__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "else")) {
+            __preprocessor_parse_else__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "endif")) {
+            __preprocessor_parse_endif__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "include")) {
+            __preprocessor_parse_include__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "embed")) {
+            __preprocessor_parse_embed__(pp, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "line")) {
+            __preprocessor_parse_line__(pp, directive_token, false);
+        } else if (directive_token->type == TOKEN_NUMBER) {
+            __preprocessor_parse_line__(pp, directive_token, true);
+        } else if (__preprocessor_is_directive__(directive_token, "pragma")) {
+            __preprocessor_parse_pragma__(pp, hash, directive_token);
+        } else if (__preprocessor_is_directive__(directive_token, "error")) {
+            __preprocessor_parse_diagnostic__(pp, directive_token, true);
+        } else if (__preprocessor_is_directive__(directive_token, "warning")) {
+            __preprocessor_parse_diagnostic__(pp, directive_token, false);
+        } else {
+            ERRORF_WITH_TOKEN(directive_token, "invalid preprocessing directive #%s",
+                token_as_text(directive_token));
+            __preprocessor_skip_one_line__(pp);
         }
 
         token_destroy(hash);
@@ -862,42 +3572,78 @@ bool __preprocessor_parse_directive__(preprocessor_t pp, token_t hash)
 }
 
 
-static inline 
-void __preprocessor_unget_tokens__(preprocessor_t pp, array_t tokens)
+static inline
+void __preprocessor_unget_tokens__(preprocessor_t *pp, array_t *tokens)
 {
     size_t i;
     if (tokens != NULL) {
         for (i = array_length(tokens); i--; ) {
-            lexer_unget(pp->lexer, array_cast_at(token_t, tokens, i));
+            lexer_unget(pp->lexer, array_cast_at(token_t*, tokens, i));
         }
     }
 }
 
 
+/**
+ * Pushes an expansion back in front of the input, straight onto the
+ * snapshot of the lexer, which ends up holding it in reverse.
+ **/
+static inline
+void __preprocessor_unget_expansion__(preprocessor_t *pp, token_vec_t *tokens)
+{
+    token_vec_t *snapshot = &pp->lexer->snapshot;
+    token_t **dst;
+    size_t i, n;
+
+    n = token_vec_length(tokens);
+    token_vec_reserve(snapshot, token_vec_length(snapshot) + n);
+
+    dst = snapshot->data + snapshot->length;
+    for (i = 0; i < n; i++) {
+        dst[i] = tokens->data[n - 1 - i];
+    }
+
+    snapshot->length += n;
+}
+
+
 static inline
-void __preprocessor_add_macro__(preprocessor_t pp, token_t macroname_token,
+void __preprocessor_add_macro__(preprocessor_t *pp, token_t *macroname_token,
     macro_type_t type, native_macro_pt native_macro_fn,
-    array_t body, array_t params, bool is_variadic)
+    array_t *body, array_t *params, bool is_variadic)
 {
-    macro_t macro;
+    macro_t *macro;
 
-    if (map_has(pp->macros, macroname_token->cs)) {
+    if ((macro = map_find(pp->macros, macroname_token->cs)) != NULL) {
         WARNINGF_WITH_TOKEN(macroname_token, "\"%s\" redefined", macroname_token->cs);
-        __macro_destroy__(map_find(pp->macros, macroname_token->cs));
+        array_cast_append(macro_t*, pp->retired_macros, macro);
         map_del(pp->macros, macroname_token->cs);
+    } else {
+        __preprocessor_filter_add__(pp, macroname_token->cs);
     }
 
     macro = __macro_create__(type, macroname_token, native_macro_fn, body, params, is_variadic);
 
+    if (pp->macro_profiles != NULL) {
+        macro->profile = map_find(pp->macro_profiles, macroname_token->cs);
+        if (macro->profile == NULL) {
+            macro->profile = pcalloc(1, sizeof(macro_profile_t));
+            macro->profile->name = cstring_dup(macroname_token->cs);
+            map_add(pp->macro_profiles, macroname_token->cs, macro->profile);
+        }
+    }
+
     map_add(pp->macros, macroname_token->cs, macro);
+
+    __preprocessor_touch_macro__(pp, macroname_token->cs);
 }
 
 
 static inline
-macro_t __macro_create__(macro_type_t type, token_t macroname_token,
-    native_macro_pt native_macro_fn, array_t body, array_t params, bool is_variadic)
+macro_t* __macro_create__(macro_type_t type, token_t *macroname_token,
+    native_macro_pt native_macro_fn, array_t *body, array_t *params, bool is_variadic)
 {
-    macro_t macro = (macro_t) pmalloc(sizeof(struct macro_s));
+    macro_t *macro = (macro_t*) pmalloc(sizeof(macro_t));
 
     switch (type) {
     case PP_MACRO_OBJECT: {
@@ -920,37 +3666,22 @@ macro_t __macro_create__(macro_type_t type, token_t macroname_token,
 
     macro->name_token = macroname_token;
     macro->type = type;
+    macro->profile = NULL;
     return macro;
 }
 
 
 static inline
-void __macro_destroy__(macro_t macro)
+void __macro_destroy__(macro_t *macro)
 {
-    token_t *tokens;
-    size_t i;
-
     switch (macro->type) {
     case PP_MACRO_OBJECT: {
-        array_foreach(macro->object_like.body, tokens, i) {
-            token_destroy(tokens[i]);
-        }
-        array_destroy(macro->object_like.body);
-
+        __destroy_tokens__(macro->object_like.body);
         break;
     }
     case PP_MACRO_FUNCTION: {
-        array_foreach(macro->function_like.body, tokens, i) {
-            token_destroy(tokens[i]);
-        }
-        array_destroy(macro->function_like.body);
-
-        array_foreach(macro->function_like.params, tokens, i) {
-            token_destroy(tokens[i]);
-        }
-
-        array_destroy(macro->function_like.params);
-
+        __destroy_tokens__(macro->function_like.body);
+        __destroy_tokens__(macro->function_like.params);
         break;
     }
     case PP_MACRO_NATIVE: {
@@ -968,16 +3699,181 @@ void __macro_destroy__(macro_t macro)
 
 
 static
-array_t __create_tokens__(void)
+int __hideset_name_compare__(const void *a, const void *b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+
+/**
+ * Hidesets are immutable and interned by their sorted names, so the tokens
+ * of an expansion share one set and equal sets are compared by pointer.
+ * An empty hideset is represented by NULL.
+ **/
+static
+set_t* __preprocessor_intern_hideset__(preprocessor_t *pp, set_t *hideset)
+{
+    dict_iterator_t *iter;
+    dict_entry_t *entry;
+    array_t *names;
+    cstring_t key;
+    cstring_t *keys;
+    set_t *interned;
+    size_t i;
+
+    if (set_is_empty(hideset)) {
+        set_destroy(hideset);
+        return NULL;
+    }
+
+    names = array_create_n(sizeof(cstring_t), dict_length((dict_t*)hideset));
+
+    iter = dict_get_iterator((dict_t*)hideset);
+    while ((entry = dict_next(iter)) != NULL) {
+        array_cast_append(cstring_t, names, dict_get_key(entry));
+    }
+    dict_release_iterator(iter);
+
+    qsort(names->elts, array_length(names), sizeof(cstring_t), __hideset_name_compare__);
+
+    key = cstring_new_n(NULL, 32);
+    array_foreach(names, keys, i) {
+        if (i != 0) {
+            key = cstring_push_ch(key, ' ');
+        }
+        key = cstring_concat_n(key, keys[i], cstring_length(keys[i]));
+    }
+
+    array_destroy(names);
+
+    if ((interned = map_find(pp->hidesets, key)) != NULL) {
+        set_destroy(hideset);
+    } else {
+        map_add(pp->hidesets, key, hideset);
+        interned = hideset;
+    }
+
+    cstring_free(key);
+    return interned;
+}
+
+
+static
+set_t* __preprocessor_hideset_cached__(preprocessor_t *pp, hideset_op_t op, const void *a, const void *b)
+{
+    hideset_key_t key;
+
+    key.op = op;
+    key.a = a;
+    key.b = b;
+
+    return dict_fetch_value(pp->hideset_cache, &key);
+}
+
+
+static
+set_t* __preprocessor_hideset_cache__(preprocessor_t *pp, hideset_op_t op, const void *a,
+    const void *b, set_t *r)
+{
+    hideset_key_t key;
+
+    key.op = op;
+    key.a = a;
+    key.b = b;
+
+    dict_add(pp->hideset_cache, &key, r);
+    return r;
+}
+
+
+/**
+ * The macro stands for its name in the cache, a redefinition only costs
+ * a miss since the result is interned.
+ **/
+static
+set_t* __preprocessor_hideset_add__(preprocessor_t *pp, set_t *hideset, macro_t *macro)
+{
+    cstring_t name;
+    set_t *r;
+
+    name = macro->name_token->cs;
+
+    if (hideset != NULL && set_has(hideset, name)) {
+        return hideset;
+    }
+
+    if ((r = __preprocessor_hideset_cached__(pp, HIDESET_ADD, hideset, macro)) == NULL) {
+        r = hideset ? set_dup(hideset) : set_create();
+        set_add(r, name);
+        r = __preprocessor_intern_hideset__(pp, r);
+        __preprocessor_hideset_cache__(pp, HIDESET_ADD, hideset, macro, r);
+    }
+
+    return r;
+}
+
+
+static
+set_t* __preprocessor_hideset_union__(preprocessor_t *pp, set_t *a, set_t *b)
+{
+    set_t *r;
+
+    if (a == NULL || a == b) {
+        return b;
+    }
+
+    if (b == NULL) {
+        return a;
+    }
+
+    if ((r = __preprocessor_hideset_cached__(pp, HIDESET_UNION, a, b)) == NULL) {
+        r = __preprocessor_intern_hideset__(pp, set_union(a, b));
+        __preprocessor_hideset_cache__(pp, HIDESET_UNION, a, b, r);
+    }
+
+    return r;
+}
+
+
+static
+set_t* __preprocessor_hideset_intersection__(preprocessor_t *pp, set_t *a, set_t *b)
+{
+    dict_entry_t *entry;
+    hideset_key_t key;
+
+    if (a == NULL || b == NULL) {
+        return NULL;
+    }
+
+    if (a == b) {
+        return a;
+    }
+
+    /* an empty intersection is cached as NULL, so look up the entry */
+    key.op = HIDESET_INTERSECTION;
+    key.a = a;
+    key.b = b;
+
+    if ((entry = dict_find(pp->hideset_cache, &key)) != NULL) {
+        return dict_get_val(entry);
+    }
+
+    return __preprocessor_hideset_cache__(pp, HIDESET_INTERSECTION, a, b,
+        __preprocessor_intern_hideset__(pp, set_intersection(a, b)));
+}
+
+
+static
+array_t* __create_tokens__(void)
 {
-    return array_create_n(sizeof(token_t), 8);
+    return array_create_n(sizeof(token_t*), 8);
 }
 
 
 static
-void __destroy_tokens__(array_t a)
+void __destroy_tokens__(array_t *a)
 {
-    token_t *tokens;
+    token_t **tokens;
     size_t i;
 
     array_foreach(a, tokens, i) {
@@ -5,16 +5,16 @@
 
 
 #include "config.h"
+#include "dict.h"
 #include "map.h"
 #include "set.h"
 
 
-typedef struct array_s*     array_t;
-typedef struct token_s*     token_t;
-typedef struct lexer_s*     lexer_t;
-typedef struct dict_s*      dict_t;
-typedef struct option_s*    option_t;
-typedef struct reader_s*    reader_t;
+typedef struct array_s      array_t;
+typedef struct token_s      token_t;
+typedef struct lexer_s      lexer_t;
+typedef struct trace_s      trace_t;
+typedef struct fcache_s     fcache_t;
 
 
 typedef enum macro_type_e {
@@ -24,7 +24,29 @@ typedef enum macro_type_e {
 } macro_type_t;
 
 
-typedef bool (*native_macro_pt) (token_t tok);
+typedef bool (*native_macro_pt) (token_t *tok);
+
+/**
+ * Told of every file entered by an #include, at its first line, and of
+ * every return to the includer, at the line after the directive.
+ **/
+typedef void (*include_hook_pt) (void *data, cstring_t filename, size_t line,
+                                 bool enter, bool system);
+
+
+/**
+ * What the expansions of a macro cost, kept by name across redefinitions.
+ * The time includes the macros expanded in the arguments.
+ **/
+typedef struct macro_profile_s {
+    cstring_t name;
+    size_t expansions;
+    size_t tokens;                  /* produced by the substitutions */
+    size_t arg_tokens;              /* collected for the arguments */
+    size_t pastes;
+    size_t stringifies;
+    uint64_t nanoseconds;
+} macro_profile_t;
 
 
 typedef struct macro_s {
@@ -32,50 +54,153 @@ typedef struct macro_s {
 
     union {
         struct {
-            array_t body;
+            array_t *body;
         } object_like;
 
         struct {
-            array_t body;
-            array_t params;
+            array_t *body;
+            array_t *params;
             bool is_variadic;
         } function_like;
 
         native_macro_pt native_macro_fn;
     };
 
-    token_t name_token;
-} *macro_t;
+    token_t *name_token;
+
+    macro_profile_t *profile;       /* NULL unless profiling */
+} macro_t;
 
 
 typedef struct condition_directive_s {
-    bool condiction;
-} *condition_directive_t;
+    bool condiction;            /* a group of this conditional was taken */
+    bool has_else;
+    token_t *token;             /* the opening directive, for diagnostics */
+} condition_directive_t;
+
+
+#ifndef PP_MAX_INCLUDE_DEPTH
+#define PP_MAX_INCLUDE_DEPTH        200
+#endif
+
+
+/* the width of the lines of preprocessor_dependencies() */
+#ifndef PP_DEPENDENCIES_COLUMNS
+#define PP_DEPENDENCIES_COLUMNS     76
+#endif
+
+
+/* expansions at least this long get a span in the time trace */
+#ifndef PP_TRACE_MACRO_NANOSECONDS
+#define PP_TRACE_MACRO_NANOSECONDS  50000
+#endif
+
+
+#ifndef PP_MACRO_FILTER_SIZE
+#define PP_MACRO_FILTER_SIZE    4096
+#endif
+
+
+/* a file read by #include or #embed */
+typedef struct include_file_s {
+    cstring_t filename;             /* as resolved, interned by the reader */
+    bool system;                    /* found in a predefined include path */
+} include_file_t;
+
+
+typedef struct preprocessor_stats_s {
+    size_t macro_lookups;
+    size_t macro_lookups_filtered;      /* rejected by the filter without hashing */
+    size_t macro_lookups_missed;        /* passed the filter but not a macro */
+} preprocessor_stats_t;
 
 
 typedef struct preprocessor_s {
-    array_t std_include_paths;
-   
-    array_t condition_directive_stack;
-  
-    array_t snapshot;
-    lexer_t lexer;
-
-    map_t macros;
-    set_t include_guard;
-    set_t once_guard;
-
-    diag_t diag;
-} *preprocessor_t;
-
-
-preprocessor_t preprocessor_create(lexer_t lexer, option_t option, diag_t diag);
-void preprocessor_destroy(preprocessor_t pp);
-void preprocessor_add_include_path(preprocessor_t pp, const char *path);
-token_t preprocessor_expand(preprocessor_t pp);
-token_t preprocessor_peek(preprocessor_t pp);
-token_t preprocessor_get(preprocessor_t pp);
-void preprocessor_unget(preprocessor_t pp, token_t tok);
+    array_t *std_include_paths;
+    size_t system_include_paths;        /* the first ones, predefined */
+
+    /**
+     * The depth of the condition stack when each file being read was
+     * included, and every file included, once, in the order of inclusion.
+     **/
+    array_t *include_stack;
+    array_t *includes;
+    set_t *included;
+    array_t *embeds;                    /* the bytes of the #embed tokens */
+    fcache_t *fcache;                   /* NULL, or the lookups shared with other units */
+
+    array_t *condition_directive_stack;
+
+    array_t *snapshot;
+    lexer_t *lexer;
+
+    map_t *macros;
+    set_t *include_guard;
+    set_t *once_guard;                  /* the files of a #pragma once, by interned name */
+
+    /**
+     * Macro bodies are shared by the tokens of their expansions, so
+     * redefined and undefined macros are retired instead of destroyed.
+     **/
+    array_t *retired_macros;
+
+    /**
+     * Likewise the tokens of macro arguments, referenced by the expansions
+     * they were substituted into. They are kept until the preprocessor is
+     * destroyed, trading memory for a copy of every substituted token.
+     **/
+    array_t *retired_args;
+
+    /* interned hidesets, shared by the tokens of an expansion */
+    map_t *hidesets;
+    dict_t *hideset_cache;              /* results by operation and operand pointers */
+
+    /**
+     * Results of #if/#elif expressions by their spelling, each valid as long
+     * as the macros looked up while evaluating it keep the same generation.
+     **/
+    map_t *condition_cache;
+    map_t *macro_generations;
+    array_t *condition_trace;
+    bool condition_cacheable;
+
+    /**
+     * Counting bloom filter over the names of the defined macros, most
+     * identifiers are not macros and are rejected before the map lookup.
+     **/
+    unsigned char macro_filter[PP_MACRO_FILTER_SIZE];
+
+    preprocessor_stats_t stats;
+
+    /* by macro name, NULL unless profiling, see preprocessor_enable_profile() */
+    map_t *macro_profiles;
+    macro_profile_t *profile;       /* of the macro being substituted */
+
+    /* NULL unless tracing, see preprocessor_set_trace() */
+    trace_t *trace;
+    array_t *trace_files;           /* the files of the open spans */
+    size_t trace_tokens;
+
+    /* NULL unless set, see preprocessor_set_include_hook() */
+    include_hook_pt include_hook;
+    void *include_hook_data;
+} preprocessor_t;
+
+
+preprocessor_t* preprocessor_create(lexer_t *lexer);
+void preprocessor_destroy(preprocessor_t *pp);
+void preprocessor_add_include_path(preprocessor_t *pp, const char *path);
+cstring_t preprocessor_dependencies(preprocessor_t *pp, const char *target,
+                                    const char *source, bool system_headers);
+token_t* preprocessor_expand(preprocessor_t *pp);
+token_t* preprocessor_peek(preprocessor_t *pp);
+token_t* preprocessor_get(preprocessor_t *pp);
+size_t preprocessor_get_n(preprocessor_t *pp, token_t **tokens, size_t n);
+void preprocessor_unget(preprocessor_t *pp, token_t *tok);
+void preprocessor_enable_profile(preprocessor_t *pp);
+void preprocessor_set_trace(preprocessor_t *pp, trace_t *trace);
+void preprocessor_set_include_hook(preprocessor_t *pp, include_hook_pt fn, void *data);
+void preprocessor_report_profile(preprocessor_t *pp, FILE *fp, size_t top);
 
 
 #endif
@@ -0,0 +1,473 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "token.h"
+#include "preprocessor.h"
+#include "printer.h"
+
+
+#if defined(UNIX)
+#   include <unistd.h>
+#   include <sys/uio.h>
+#   include <errno.h>
+#elif defined(WINDOWS)
+#   include <io.h>
+#   define write(fd, buf, n)    _write((fd), (buf), (unsigned int) (n))
+#endif
+
+
+static bool __printer_write_fd__(int fd, const unsigned char *data, size_t n);
+static bool __printer_writev_fd__(int fd, const unsigned char *a, size_t an,
+                                  const unsigned char *b, size_t bn);
+static void __printer_newline__(printer_t *printer);
+static void __printer_sync__(printer_t *printer, token_t *token);
+static void __printer_mark__(printer_t *printer, const char *flag);
+static void __printer_include_fn__(void *data, cstring_t filename, size_t line,
+                                   bool enter, bool system);
+static bool __printer_avoid_paste__(printer_t *printer, token_t *token, unsigned char ch);
+
+
+printer_t* printer_create(int fd)
+{
+    printer_t *printer;
+
+    printer = pmalloc(sizeof(printer_t));
+
+    printer->fd = fd;
+    printer->cs = fd < 0 ? cstring_new_n(NULL, PRINTER_BUFFER_SIZE) : NULL;
+    printer->buffer = pmalloc(PRINTER_BUFFER_SIZE);
+    printer->used = 0;
+    printer->size = PRINTER_BUFFER_SIZE;
+    printer->failed = false;
+
+    printer->line_markers = true;
+    printer->filename = NULL;
+    printer->line = 0;
+    printer->line_started = false;
+    printer->system = false;
+
+    printer->last_type = TOKEN_UNKNOWN;
+    printer->last_length = 0;
+
+    return printer;
+}
+
+
+void printer_destroy(printer_t *printer)
+{
+    assert(printer != NULL);
+
+    printer_flush(printer);
+
+    if (printer->cs != NULL) {
+        cstring_free(printer->cs);
+    }
+
+    pfree(printer->buffer);
+    pfree(printer);
+}
+
+
+bool printer_flush(printer_t *printer)
+{
+    if (printer->used == 0) {
+        return !printer->failed;
+    }
+
+    if (printer->fd < 0) {
+        printer->cs = cstring_concat_n(printer->cs, printer->buffer, printer->used);
+    } else if (!printer->failed && !__printer_write_fd__(printer->fd, printer->buffer, printer->used)) {
+        printer->failed = true;
+    }
+
+    printer->used = 0;
+    return !printer->failed;
+}
+
+
+/**
+ * Hands the text written so far over to the caller, only for a printer
+ * created without a file descriptor.
+ **/
+cstring_t printer_release(printer_t *printer)
+{
+    cstring_t cs;
+
+    assert(printer->fd < 0);
+
+    printer_flush(printer);
+
+    cs = printer->cs;
+    printer->cs = cstring_new_n(NULL, 0);
+    return cs;
+}
+
+
+void printer_write(printer_t *printer, const void *data, size_t n)
+{
+    if (n <= printer->size - printer->used) {
+        memcpy(printer->buffer + printer->used, data, n);
+        printer->used += n;
+        return;
+    }
+
+    /* too long to be worth the copy, written along with the buffer */
+    if (printer->fd >= 0 && n >= printer->size / 2) {
+        if (!printer->failed &&
+            !__printer_writev_fd__(printer->fd, printer->buffer, printer->used, data, n)) {
+            printer->failed = true;
+        }
+        printer->used = 0;
+        return;
+    }
+
+    printer_flush(printer);
+
+    if (n > printer->size) {
+        printer->cs = cstring_concat_n(printer->cs, data, n);
+        return;
+    }
+
+    memcpy(printer->buffer, data, n);
+    printer->used = n;
+}
+
+
+void printer_print(printer_t *printer, token_t *token)
+{
+    unsigned char *p, *spelling, *aside;
+    size_t spaces, size, n;
+
+    switch (token->type) {
+    case TOKEN_NEWLINE:
+        if (printer->line_started) {
+            __printer_newline__(printer);
+        }
+        return;
+    case TOKEN_EOF:
+    case TOKEN_END:
+        return;
+    case TOKEN_PP_PRAGMA:
+        /* a line of its own, the newline of the directive follows */
+        if (printer->line_started) {
+            __printer_newline__(printer);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!printer->line_started) {
+        __printer_sync__(printer, token);
+    }
+
+    size = token_spelling_size(token);
+
+    if (printer->used + token->spaces + size + 1 > printer->size) {
+        printer_flush(printer);
+    }
+
+    /* spelled in place past the room for the spaces, a huge literal aside */
+    aside = NULL;
+    if (token->spaces + size + 1 <= printer->size) {
+        spelling = printer->buffer + printer->used + token->spaces + 1;
+    } else {
+        spelling = aside = pmalloc(size);
+    }
+
+    n = token_spell(token, spelling);
+
+    spaces = token->spaces;
+    if (spaces == 0 && n != 0 && printer->line_started &&
+        __printer_avoid_paste__(printer, token, spelling[0])) {
+        spaces = 1;
+    }
+
+    printer->last_length = n < sizeof(printer->last) ? n : sizeof(printer->last);
+    memcpy(printer->last, spelling + n - printer->last_length, printer->last_length);
+    printer->last_type = token->type;
+
+    if (aside != NULL) {
+        while (spaces--) {
+            printer_write(printer, " ", 1);
+        }
+        printer_write(printer, aside, n);
+        pfree(aside);
+
+    } else {
+        p = printer->buffer + printer->used;
+        memset(p, ' ', spaces);
+        memmove(p + spaces, spelling, n);
+        printer->used += spaces + n;
+    }
+
+    printer->line_started = true;
+}
+
+
+bool printer_preprocess(printer_t *printer, preprocessor_t *pp)
+{
+    token_t *tok;
+    token_type_t type;
+
+    preprocessor_set_include_hook(pp, __printer_include_fn__, printer);
+
+    do {
+        tok = preprocessor_expand(pp);
+        type = tok->type;
+        printer_print(printer, tok);
+        token_destroy(tok);
+    } while (type != TOKEN_END);
+
+    preprocessor_set_include_hook(pp, NULL, NULL);
+
+    if (printer->line_started) {
+        __printer_newline__(printer);
+    }
+
+    return printer_flush(printer);
+}
+
+
+static
+bool __printer_write_fd__(int fd, const unsigned char *data, size_t n)
+{
+    long written;
+
+    while (n != 0) {
+        written = write(fd, data, n);
+        if (written < 0) {
+#if defined(UNIX)
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            return false;
+        }
+
+        data += written;
+        n -= written;
+    }
+
+    return true;
+}
+
+
+static
+bool __printer_writev_fd__(int fd, const unsigned char *a, size_t an,
+                           const unsigned char *b, size_t bn)
+{
+#if defined(UNIX)
+    struct iovec iov[2];
+    long written;
+
+    while (an != 0) {
+        iov[0].iov_base = (void*) a;
+        iov[0].iov_len = an;
+        iov[1].iov_base = (void*) b;
+        iov[1].iov_len = bn;
+
+        written = writev(fd, iov, 2);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        if ((size_t) written < an) {
+            a += written;
+            an -= written;
+            continue;
+        }
+
+        b += written - an;
+        bn -= written - an;
+        an = 0;
+    }
+#endif
+
+    return __printer_write_fd__(fd, a, an) && __printer_write_fd__(fd, b, bn);
+}
+
+
+static
+void __printer_newline__(printer_t *printer)
+{
+    printer_write(printer, "\n", 1);
+    printer->line++;
+    printer->line_started = false;
+    printer->last_type = TOKEN_UNKNOWN;
+    printer->last_length = 0;
+}
+
+
+/**
+ * Brings the output to the line of the first token of a line, with blank
+ * lines for a short gap, or a line marker for a long gap, a line going
+ * backwards or another file.
+ **/
+static
+void __printer_sync__(printer_t *printer, token_t *token)
+{
+    size_t line;
+
+    if (token->location.filename == NULL) {
+        return;
+    }
+
+    line = token->location.line;
+
+    if (printer->filename != NULL &&
+        (printer->filename == token->location.filename ||
+         cstring_compare_cs(printer->filename, token->location.filename) == 0) &&
+        line >= printer->line && line - printer->line <= PRINTER_MAX_BLANK_LINES) {
+
+        while (printer->line < line) {
+            printer_write(printer, "\n", 1);
+            printer->line++;
+        }
+        return;
+    }
+
+    printer->filename = token->location.filename;
+    printer->line = line;
+
+    __printer_mark__(printer, "");
+}
+
+
+/* writes the line marker of the current file and line */
+static
+void __printer_mark__(printer_t *printer, const char *flag)
+{
+    char marker[64];
+    const unsigned char *p;
+
+    if (!printer->line_markers) {
+        return;
+    }
+
+    printer_write(printer, marker, sprintf(marker, "# %lu \"", (unsigned long) printer->line));
+
+    for (p = printer->filename; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            printer_write(printer, "\\", 1);
+        }
+        printer_write(printer, p, 1);
+    }
+
+    printer_write(printer, "\"", 1);
+    printer_write(printer, flag, strlen(flag));
+
+    if (printer->system) {
+        printer_write(printer, " 3", 2);
+    }
+
+    printer_write(printer, "\n", 1);
+}
+
+
+/**
+ * Marks the entry into an included file and the return to its includer
+ * as they happen, an included file without tokens is marked too.
+ **/
+static
+void __printer_include_fn__(void *data, cstring_t filename, size_t line,
+                            bool enter, bool system)
+{
+    printer_t *printer = data;
+
+    if (printer->line_started) {
+        __printer_newline__(printer);
+    }
+
+    printer->filename = filename;
+    printer->line = line;
+    printer->system = system;
+
+    __printer_mark__(printer, enter ? " 1" : " 2");
+}
+
+
+/**
+ * The characters that make a longer punctuator of one ending with c, by
+ * the first two characters of the longer one for "..." and "%:%:". A
+ * space more than needed, as between -> and >, is harmless.
+ **/
+static inline
+const char* __printer_followers__(unsigned char c)
+{
+    switch (c) {
+    case '-':
+        return "->=";
+    case '+':
+        return "+=";
+    case '<':
+        return "<=:%";
+    case '>':
+        return ">=";
+    case '&':
+        return "&=";
+    case '|':
+        return "|=";
+    case '%':
+        return "=>:";
+    case ':':
+        return ">%";
+    case '#':
+        return "#";
+    case '.':
+        return ".";
+    case '=': case '!': case '*': case '/': case '^':
+        return "=";
+    default:
+        return "";
+    }
+}
+
+
+/**
+ * Whether the token would be lexed together with the previous one if it
+ * were printed right after it, and needs a space in between.
+ **/
+static
+bool __printer_avoid_paste__(printer_t *printer, token_t *token, unsigned char ch)
+{
+    token_type_t last = printer->last_type;
+
+    if (last == TOKEN_UNKNOWN || printer->last_length == 0) {
+        return false;
+    }
+
+    switch (last) {
+    case TOKEN_IDENTIFIER:
+        return isalnum(ch) || ch == '_' || ch == '\'' || ch == '"' || ch >= 0x80;
+    case TOKEN_NUMBER:
+    case TOKEN_PP_EMBED:
+    case TOKEN_LITERAL_RUN:
+        return isalnum(ch) || ch == '_' || ch == '.' || ch == '+' || ch == '-' || ch >= 0x80;
+    default:
+        break;
+    }
+
+    if (TOKEN_L_SQUARE <= last && last <= TOKEN_HASHHASH) {
+        if (last == TOKEN_PERIOD && isdigit(ch)) {
+            return true;
+        }
+
+        if (last == TOKEN_SLASH && (ch == '*' || ch == '/')) {
+            return true;
+        }
+
+        if (!ispunct(ch)) {
+            return false;
+        }
+
+        return strchr(__printer_followers__(printer->last[printer->last_length - 1]), ch) != NULL;
+    }
+
+    return false;
+}
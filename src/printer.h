@@ -0,0 +1,63 @@
+
+
+#ifndef __PRINTER__H__
+#define __PRINTER__H__
+
+
+#include "config.h"
+#include "cstring.h"
+#include "token.h"
+
+
+typedef struct preprocessor_s   preprocessor_t;
+
+
+#ifndef PRINTER_BUFFER_SIZE
+#define PRINTER_BUFFER_SIZE     (64 * 1024)
+#endif
+
+/* more blank lines than this are replaced by a line marker */
+#ifndef PRINTER_MAX_BLANK_LINES
+#define PRINTER_MAX_BLANK_LINES 8
+#endif
+
+
+/**
+ * Writes the preprocessed token stream as text through one reusable
+ * buffer, to a file descriptor or, without one, to a string. Lines are
+ * kept in step with the sources with GCC style line markers, flagged 1
+ * entering an included file, 2 returning from one and 3 in a system
+ * header.
+ **/
+typedef struct printer_s {
+    int fd;
+    cstring_t cs;
+
+    unsigned char *buffer;
+    size_t used;
+    size_t size;
+    bool failed;
+
+    bool line_markers;
+    cstring_t filename;             /* of the current output line */
+    size_t line;
+    bool line_started;
+    bool system;                    /* the file is a system header */
+
+    /* the previous token of the line, to not paste it with the next */
+    token_type_t last_type;
+    unsigned char last[4];
+    size_t last_length;
+} printer_t;
+
+
+printer_t* printer_create(int fd);
+void printer_destroy(printer_t *printer);
+bool printer_flush(printer_t *printer);
+cstring_t printer_release(printer_t *printer);
+void printer_write(printer_t *printer, const void *data, size_t n);
+void printer_print(printer_t *printer, token_t *token);
+bool printer_preprocess(printer_t *printer, preprocessor_t *pp);
+
+
+#endif
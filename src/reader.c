@@ -24,10 +24,12 @@
 #include "pmalloc.h"
 #include "cstring.h"
 #include "cspool.h"
+#include "fcache.h"
 #include "reader.h"
 #include "utils.h"
 #include "option.h"
 #include "diagnostor.h"
+#include "encoding.h"
 
 
 #ifndef STREAM_STASHED_DEPTH
@@ -44,6 +46,7 @@ struct stream_s {
     stream_type_t type;
 
     cstring_t fn;
+    cstring_t text;
 
     cstring_t stashed;
 
@@ -60,6 +63,7 @@ struct stream_s {
     time_t access_time;
 
     int lastch;
+    bool ascii;                     /* no byte past 0x7f, nothing multibyte to mind */
 };
 
 
@@ -71,13 +75,14 @@ struct stream_s {
     } while (false)
 
 
-static bool __stream_init__(cspool_t *cspool, stream_t *stream,
+static bool __stream_init__(reader_t *reader, stream_t *stream,
                             stream_type_t type, const unsigned char *s);
 static void __stream_uninit__(stream_t *stream);
 static void __stream_push__(stream_t *stream, int ch);
 static int __stream_pop__(stream_t *stream);
 static int __stream_next__(stream_t *stream);
 static int __stream_peek__(stream_t *stream);
+static void __stream_check_encoding__(stream_t *stream);
 
 
 reader_t* reader_create(void)
@@ -87,15 +92,19 @@ reader_t* reader_create(void)
     reader->clean_csp = true;
     reader->streams = array_create_n(sizeof(stream_t), READER_STREAM_DEPTH);
     reader->last = NULL;
+    reader->fcache = NULL;
     return reader;
 }
 
 
 reader_t* reader_create_csp(cspool_t *csp)
 {
-    reader_t *reader = reader_create();
+    reader_t *reader = (reader_t*) pmalloc(sizeof(reader_t));
     reader->cspool = csp;
     reader->clean_csp = false;
+    reader->streams = array_create_n(sizeof(stream_t), READER_STREAM_DEPTH);
+    reader->last = NULL;
+    reader->fcache = NULL;
     return reader;
 }
 
@@ -119,6 +128,17 @@ void reader_destroy(reader_t *reader)
 }
 
 
+/**
+ * Sets the cache of the files read, shared with the readers of the other
+ * translation units, the same string pool holding their filenames.
+ **/
+void reader_set_fcache(reader_t *reader, fcache_t *fcache)
+{
+    assert(fcache == NULL || fcache->csp == reader->cspool);
+    reader->fcache = fcache;
+}
+
+
 size_t reader_depth(reader_t *reader)
 {
     return array_length(reader->streams);
@@ -158,7 +178,8 @@ bool reader_push(reader_t *reader, stream_type_t type, const unsigned char *s)
 
     stream = array_push_back(reader->streams);
 
-    if (!__stream_init__(reader->cspool, stream, type, s)) {
+    if (!__stream_init__(reader, stream, type, s)) {
+        array_pop_back(reader->streams);
         return false;
     }
 
@@ -252,6 +273,236 @@ cstring_t reader_filename(reader_t *reader)
 }
 
 
+/**
+ * Numbers the next line of the stream being read, and renames it when
+ * filename is not NULL, for #line.
+ **/
+void reader_set_line(reader_t *reader, size_t line, const char *filename)
+{
+    assert(reader->last != NULL);
+
+    reader->last->line = line;
+
+    if (filename != NULL) {
+        reader->last->fn = cspool_push(reader->cspool, filename);
+    }
+}
+
+
+size_t reader_size(reader_t *reader)
+{
+    assert(reader->last != NULL);
+    return cstring_length(reader->last->text);
+}
+
+
+/**
+ * The raw characters left in the current stream, to be scanned in place
+ * and then passed with reader_skip(). The caller stops at a newline, a
+ * carriage return or a backslash, which the reader translates. Empty
+ * while characters are pushed back.
+ **/
+const unsigned char* reader_span(reader_t *reader, size_t *n)
+{
+    stream_t *stream = reader->last;
+
+    if (stream == NULL || (stream->stashed != NULL && cstring_length(stream->stashed) > 0)) {
+        *n = 0;
+        return NULL;
+    }
+
+    *n = stream->pe - stream->pc;
+    return stream->pc;
+}
+
+
+/* whether the current stream is pure ASCII, with no multibyte character */
+bool reader_is_ascii(reader_t *reader)
+{
+    return reader->last == NULL || reader->last->ascii;
+}
+
+
+void reader_skip(reader_t *reader, size_t n)
+{
+    stream_t *stream = reader->last;
+
+    assert(stream->pc + n <= stream->pe);
+
+    if (n != 0) {
+        stream->pc += n;
+        stream->column += n;
+        stream->lastch = stream->pc[-1];
+    }
+}
+
+
+/**
+ * Skips raw source bytes up to the next '#' that starts a logical line,
+ * leaving the stream positioned on it. Comments, literals and splices are
+ * only followed far enough to tell where logical lines begin, the skipped
+ * text is never tokenized. Returns false at the end of the stream.
+ **/
+bool reader_skip_to_directive(reader_t *reader, bool begin_of_line)
+{
+    stream_t *stream;
+    unsigned char *pc, *pe;
+    int quote;
+
+    assert(reader->last != NULL);
+
+    stream = reader->last;
+
+    if (stream->stashed != NULL && cstring_length(stream->stashed) > 0) {
+        /* the bottom of the stash was the last character read from pc */
+        begin_of_line = stream->stashed[0] == '\n';
+        cstring_clear(stream->stashed);
+    }
+
+    pc = stream->pc;
+    pe = stream->pe;
+
+#undef  STREAM_SKIP_NEWLINE
+#define STREAM_SKIP_NEWLINE()                               \
+    do {                                                    \
+        if (*pc++ == '\r' && pc < pe && *pc == '\n') {      \
+            pc++;                                           \
+        }                                                   \
+        stream->line++;                                     \
+        stream->line_note = pc;                             \
+    } while (false)
+
+#undef  STREAM_IS_NEWLINE
+#define STREAM_IS_NEWLINE(p)    (*(p) == '\n' || *(p) == '\r')
+
+#undef  STREAM_IS_SPLICE
+#define STREAM_IS_SPLICE(p)     \
+    (*(p) == '\\' && (p) + 1 < pe && STREAM_IS_NEWLINE((p) + 1))
+
+    while (pc < pe) {
+        if (begin_of_line) {
+            /* whitespace and comments may precede the '#' */
+            while (pc < pe) {
+                if (*pc == ' ' || *pc == '\t' || *pc == '\f' || *pc == '\v') {
+                    pc++;
+
+                } else if (STREAM_IS_SPLICE(pc)) {
+                    pc++;
+                    STREAM_SKIP_NEWLINE();
+
+                } else if (*pc == '/' && pc + 1 < pe && pc[1] == '*') {
+                    for (pc += 2; pc < pe; ) {
+                        if (*pc == '*' && pc + 1 < pe && pc[1] == '/') {
+                            pc += 2;
+                            break;
+                        }
+                        if (STREAM_IS_NEWLINE(pc)) {
+                            STREAM_SKIP_NEWLINE();
+                        } else {
+                            pc++;
+                        }
+                    }
+
+                } else {
+                    break;
+                }
+            }
+
+            if (pc < pe && *pc == '#') {
+                stream->pc = pc;
+                stream->column = pc - stream->line_note + 1;
+                stream->lastch = '\n';
+                return true;
+            }
+
+            begin_of_line = false;
+        }
+
+        if (pc >= pe) {
+            break;
+        }
+
+        switch (*pc) {
+        case '\n':
+        case '\r':
+            STREAM_SKIP_NEWLINE();
+            begin_of_line = true;
+            break;
+
+        case '\\':
+            pc++;
+            if (pc < pe && STREAM_IS_NEWLINE(pc)) {
+                STREAM_SKIP_NEWLINE();
+            }
+            break;
+
+        case '/':
+            pc++;
+            if (pc < pe && *pc == '*') {
+                for (pc++; pc < pe; ) {
+                    if (*pc == '*' && pc + 1 < pe && pc[1] == '/') {
+                        pc += 2;
+                        break;
+                    }
+                    if (STREAM_IS_NEWLINE(pc)) {
+                        STREAM_SKIP_NEWLINE();
+                    } else {
+                        pc++;
+                    }
+                }
+
+            } else if (pc < pe && *pc == '/') {
+                while (pc < pe && !STREAM_IS_NEWLINE(pc)) {
+                    if (STREAM_IS_SPLICE(pc)) {
+                        pc++;
+                        STREAM_SKIP_NEWLINE();
+                    } else {
+                        pc++;
+                    }
+                }
+            }
+            break;
+
+        case '\"':
+        case '\'':
+            /**
+             * skipped groups may contain unbalanced quotes such as
+             * apostrophes in prose, so literals end at the newline.
+             **/
+            quote = *pc++;
+            while (pc < pe && !STREAM_IS_NEWLINE(pc)) {
+                if (*pc == '\\' && pc + 1 < pe) {
+                    pc++;
+                    if (STREAM_IS_NEWLINE(pc)) {
+                        STREAM_SKIP_NEWLINE();
+                    } else {
+                        pc++;
+                    }
+                    continue;
+                }
+                if (*pc++ == quote) {
+                    break;
+                }
+            }
+            break;
+
+        default:
+            pc++;
+            break;
+        }
+    }
+
+#undef  STREAM_IS_SPLICE
+#undef  STREAM_IS_NEWLINE
+#undef  STREAM_SKIP_NEWLINE
+
+    stream->pc = pe;
+    stream->column = 1;
+    stream->lastch = '\n';
+    return false;
+}
+
+
 cstring_t linenote2cs(linenote_t linenote)
 {
     const unsigned char *p = (const unsigned char *)linenote;
@@ -269,9 +520,10 @@ cstring_t linenote2cs(linenote_t linenote)
 
 
 static
-bool __stream_init__(cspool_t *cspool, stream_t *stream,
+bool __stream_init__(reader_t *reader, stream_t *stream,
                      stream_type_t type, const unsigned char *s)
 {
+    cspool_t *cspool = reader->cspool;
     cstring_t text = NULL;
 
     switch (type) {
@@ -280,6 +532,18 @@ bool __stream_init__(cspool_t *cspool, stream_t *stream,
         FILE *fp;
         struct stat st;
 
+        if (reader->fcache != NULL && stat(s, &st) == 0) {
+            stream->fn = cspool_push_cs(cspool, cstring_new(s));
+
+            text = fcache_find_file(reader->fcache, stream->fn, &st);
+            if (text != NULL) {
+                stream->modify_time = st.st_mtime;
+                stream->access_time = st.st_atime;
+                stream->change_time = st.st_ctime;
+                break;
+            }
+        }
+
         if ((fp = fopen(s, "rb")) == NULL) {
             return false;
         }
@@ -297,7 +561,13 @@ bool __stream_init__(cspool_t *cspool, stream_t *stream,
         stream->modify_time = st.st_mtime;
         stream->access_time = st.st_atime;
         stream->change_time = st.st_ctime;
-        text = cspool_push_cs(cspool, cstring_new_n(buf, st.st_size));
+        text = cstring_new_n(buf, st.st_size);
+
+        if (reader->fcache != NULL) {
+            fcache_add_file(reader->fcache, stream->fn, &st, text);
+        } else {
+            text = cspool_push_cs(cspool, text);
+        }
 
         pfree(buf);
         fclose(fp);
@@ -319,16 +589,67 @@ bool __stream_init__(cspool_t *cspool, stream_t *stream,
     }
 
     stream->type = type;
+    stream->text = text;
     stream->stashed = NULL;
     stream->line_note = stream->pc = text;
     stream->pe = &text[cstring_length(text)];
     stream->line = 1;
     stream->column = 1;
     stream->lastch = '\0';
+    stream->ascii = true;
+
+    if (type == STREAM_TYPE_FILE) {
+        __stream_check_encoding__(stream);
+    }
+
     return true;
 }
 
 
+/**
+ * Once a file is loaded: its byte order mark is skipped, and it is told
+ * apart as pure ASCII, as most are, or else validated as UTF-8, in a pass
+ * that skips the runs of ASCII a block at a time.
+ **/
+static
+void __stream_check_encoding__(stream_t *stream)
+{
+    const unsigned char *p, *bad, *line;
+    size_t n, valid, lineno;
+
+    n = stream->pe - stream->pc;
+    if (n >= 3 && stream->pc[0] == 0xEF && stream->pc[1] == 0xBB && stream->pc[2] == 0xBF) {
+        stream->pc += 3;
+        stream->line_note = stream->pc;
+        n -= 3;
+    }
+
+    stream->ascii = utf8_ascii_span(stream->pc, n) == n;
+    if (stream->ascii || !option_get(w_invalid_utf8)) {
+        return;
+    }
+
+    valid = utf8_valid_span(stream->pc, n);
+    if (valid == n) {
+        return;
+    }
+
+    bad = stream->pc + valid;
+    line = stream->pc;
+    lineno = 1;
+
+    for (p = stream->pc; p < bad; p++) {
+        if (*p == '\n') {
+            line = p + 1;
+            lineno++;
+        }
+    }
+
+    warningf_with_linenote_position(stream->fn, lineno, bad - line + 1, line,
+                                    bad - line + 1, 1, "invalid UTF-8 character <%02x>", *bad);
+}
+
+
 static
 void __stream_uninit__(stream_t *stream)
 {
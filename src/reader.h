@@ -11,6 +11,7 @@
 typedef struct array_s      array_t;
 typedef struct stream_s     stream_t;
 typedef struct cspool_s     cspool_t;
+typedef struct fcache_s     fcache_t;
 
 
 typedef enum stream_type_e {
@@ -27,12 +28,14 @@ typedef struct reader_s {
     stream_t *last;
     cspool_t *cspool;
     bool clean_csp;
+    fcache_t *fcache;               /* NULL, or shared by the readers of one pool */
 } reader_t;
 
 
 reader_t* reader_create(void);
 reader_t* reader_create_csp(cspool_t *csp);
 void reader_destroy(reader_t *reader);
+void reader_set_fcache(reader_t *reader, fcache_t *fcache);
 size_t reader_depth(reader_t *reader);
 bool reader_is_empty(reader_t *reader);
 bool reader_push(reader_t *reader, stream_type_t type, const unsigned char *s);
@@ -42,9 +45,15 @@ int reader_peek(reader_t *reader);
 void reader_unget(reader_t *reader, int ch);
 bool reader_try(reader_t *reader, int ch);
 bool reader_test(reader_t *reader, int ch);
+bool reader_skip_to_directive(reader_t *reader, bool begin_of_line);
+const unsigned char* reader_span(reader_t *reader, size_t *n);
+void reader_skip(reader_t *reader, size_t n);
+bool reader_is_ascii(reader_t *reader);
 size_t reader_line(reader_t *reader);
 size_t reader_column(reader_t *reader);
 cstring_t reader_filename(reader_t *reader);
+void reader_set_line(reader_t *reader, size_t line, const char *filename);
+size_t reader_size(reader_t *reader);
 time_t reader_modify_time(reader_t *reader);
 time_t reader_change_time(reader_t *reader);
 time_t reader_access_time(reader_t *reader);
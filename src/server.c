@@ -0,0 +1,393 @@
+
+
+/* for struct ucred and SO_PEERCRED */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#   define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "pmalloc.h"
+#include "cstring.h"
+#include "token.h"
+#include "diagnostor.h"
+#include "server.h"
+
+
+#if defined(UNIX)
+#   include <unistd.h>
+#   include <errno.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/un.h>
+#endif
+
+
+#if defined(UNIX)
+
+static bool __server_address__(const char *path, struct sockaddr_un *addr);
+static bool __server_peer_is_owner__(int fd);
+static bool __server_read__(int fd, void *data, size_t n);
+static bool __server_write__(int fd, const void *data, size_t n);
+
+
+/**
+ * Listens on a Unix socket at path, replacing a stale socket file but not
+ * a server still running there. The socket is only open to its owner, the
+ * server reads and writes files with his rights. Returns -1 on failure.
+ **/
+int server_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, bound;
+
+    if (!__server_address__(path, &addr)) {
+        errorf("socket path too long: '%s'", path);
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        errorf("cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        errorf("a server is already listening on '%s'", path);
+        close(fd);
+        return -1;
+    }
+
+    unlink(path);
+
+    /* created 0600 rather than opened to everyone until the chmod */
+    mask = umask(S_IRWXG | S_IRWXO);
+    bound = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    umask(mask);
+
+    if (bound != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(fd, 64) != 0) {
+        errorf("cannot listen on '%s': %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+bool server_accept(int listener, server_request_t *request)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    uint32_t size;
+    char *p, *end;
+    int i;
+
+    request->fd = -1;
+    request->fds[0] = request->fds[1] = request->fds[2] = -1;
+    request->cwd = NULL;
+    request->argc = 0;
+    request->argv = NULL;
+    request->buffer = NULL;
+
+    while ((request->fd = accept(listener, NULL, NULL)) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    /* only the user running the server may have it compile, or stop it */
+    if (!__server_peer_is_owner__(request->fd)) {
+        goto failure;
+    }
+
+    /* the size of the strings comes with the streams of the client */
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(request->fd, &msg, MSG_WAITALL) != sizeof(size)) {
+        goto failure;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        goto failure;
+    }
+
+    memcpy(request->fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+    if (size == 0 || size > SERVER_MAX_REQUEST) {
+        goto failure;
+    }
+
+    request->buffer = cstring_new_n(NULL, size);
+    if (!__server_read__(request->fd, request->buffer, size) || request->buffer[size - 1] != '\0') {
+        goto failure;
+    }
+
+    end = (char*) request->buffer + size;
+
+    for (p = request->buffer; p < end; p += strlen(p) + 1) {
+        request->argc++;
+    }
+
+    /* the working directory, then the arguments */
+    request->argc--;
+    if (request->argc < 1) {
+        goto failure;
+    }
+
+    request->argv = pmalloc(sizeof(char*) * (request->argc + 1));
+
+    p = request->buffer;
+    request->cwd = cstring_new(p);
+    p += strlen(p) + 1;
+
+    for (i = 0; i < request->argc; i++) {
+        request->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    request->argv[i] = NULL;
+    return true;
+
+failure:
+    server_request_free(request);
+    return false;
+}
+
+
+void server_reply(server_request_t *request, int status)
+{
+    int32_t code = status;
+
+    __server_write__(request->fd, &code, sizeof(code));
+}
+
+
+void server_request_free(server_request_t *request)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (request->fds[i] >= 0) {
+            close(request->fds[i]);
+        }
+    }
+
+    if (request->fd >= 0) {
+        close(request->fd);
+    }
+
+    if (request->cwd != NULL) {
+        cstring_free(request->cwd);
+    }
+
+    if (request->argv != NULL) {
+        pfree(request->argv);
+    }
+
+    if (request->buffer != NULL) {
+        cstring_free(request->buffer);
+    }
+}
+
+
+/**
+ * Has the server at path compile with the arguments, in the working
+ * directory and with the standard streams of this process. Returns the
+ * exit status of the compilation, or -1 when there is no server there.
+ **/
+int server_forward(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    char cwd[PATH_MAX];
+    cstring_t buffer;
+    uint32_t size;
+    int32_t status;
+    int fds[3] = { 0, 1, 2 };
+    int fd, i;
+
+    if (!__server_address__(path, &addr) || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    buffer = cstring_concat_n(cstring_new_n(NULL, 1024), cwd, strlen(cwd) + 1);
+    for (i = 0; i < argc; i++) {
+        buffer = cstring_concat_n(buffer, argv[i], strlen(argv[i]) + 1);
+    }
+
+    size = (uint32_t) cstring_length(buffer);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+
+    /* what this process buffered goes out before the server writes */
+    fflush(stdout);
+    fflush(stderr);
+
+    if (sendmsg(fd, &msg, 0) != sizeof(size) ||
+        !__server_write__(fd, buffer, cstring_length(buffer)) ||
+        !__server_read__(fd, &status, sizeof(status))) {
+        errorf("lost the connection to the server on '%s'", path);
+        status = EXIT_FAILURE;
+    }
+
+    cstring_free(buffer);
+    close(fd);
+
+    return status;
+}
+
+
+static
+bool __server_address__(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+
+static
+bool __server_peer_is_owner__(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t n = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &n) == 0 && cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+
+static
+bool __server_read__(int fd, void *data, size_t n)
+{
+    unsigned char *p = data;
+    long got;
+
+    while (n != 0) {
+        got = read(fd, p, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        p += got;
+        n -= got;
+    }
+
+    return true;
+}
+
+
+static
+bool __server_write__(int fd, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    long written;
+
+    while (n != 0) {
+        written = write(fd, p, n);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        n -= written;
+    }
+
+    return true;
+}
+
+#else
+
+int server_listen(const char *path)
+{
+    errorf("the compile server needs Unix sockets");
+    (void) path;
+    return -1;
+}
+
+
+bool server_accept(int listener, server_request_t *request)
+{
+    (void) listener;
+    (void) request;
+    return false;
+}
+
+
+void server_reply(server_request_t *request, int status)
+{
+    (void) request;
+    (void) status;
+}
+
+
+void server_request_free(server_request_t *request)
+{
+    (void) request;
+}
+
+
+int server_forward(const char *path, int argc, char **argv)
+{
+    (void) path;
+    (void) argc;
+    (void) argv;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,39 @@
+
+
+#ifndef __SERVER__H__
+#define __SERVER__H__
+
+
+#include "config.h"
+#include "cstring.h"
+
+
+/* the largest request accepted, the working directory and arguments */
+#ifndef SERVER_MAX_REQUEST
+#define SERVER_MAX_REQUEST      (1024 * 1024)
+#endif
+
+
+/**
+ * A compilation asked by a client: its working directory, its arguments
+ * and its standard streams, received along with the request so that the
+ * server writes to the terminal or files of the client directly.
+ **/
+typedef struct server_request_s {
+    int fd;                         /* the connection, the status is sent back on it */
+    int fds[3];
+    cstring_t cwd;
+    int argc;
+    char **argv;
+    cstring_t buffer;               /* holds the strings */
+} server_request_t;
+
+
+int server_listen(const char *path);
+bool server_accept(int listener, server_request_t *request);
+void server_reply(server_request_t *request, int status);
+void server_request_free(server_request_t *request);
+int server_forward(const char *path, int argc, char **argv);
+
+
+#endif
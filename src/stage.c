@@ -0,0 +1,56 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "token.h"
+#include "diagnostor.h"
+#include "reader.h"
+#include "lexer.h"
+#include "preprocessor.h"
+#include "stage.h"
+
+
+/* fcache is NULL, or a cache of the files read over the same pool */
+stage_t* stage_create(cspool_t *csp, fcache_t *fcache)
+{
+    stage_t *stage;
+
+    stage = pmalloc(sizeof(stage_t));
+
+    stage->diag = diagnostor;
+    stage->lexer = lexer_create_csp(csp);
+    stage->lexer->literal_runs = true;
+    stage->reader = stage->lexer->reader;
+    stage->pp = preprocessor_create(stage->lexer);
+
+    reader_set_fcache(stage->reader, fcache);
+    stage->pp->fcache = fcache;
+
+    return stage;
+}
+
+
+void stage_destroy(stage_t *stage)
+{
+    assert(stage != NULL);
+
+    preprocessor_destroy(stage->pp);
+    lexer_destroy(stage->lexer);
+    pfree(stage);
+}
+
+
+const char* stage_name(stage_type_t type)
+{
+    switch (type) {
+    case STAGE_READER:
+        return "Reader";
+    case STAGE_LEXER:
+        return "Lexer";
+    case STAGE_PREPROCESSOR:
+        return "Preprocessor";
+    default:
+        assert(false);
+        return "";
+    }
+}
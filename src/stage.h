@@ -1,32 +1,42 @@
-
-
-#ifndef __STAGE__H__
-#define __STAGE__H__
-
-
-#include "config.h"
-
-
-typedef struct diag_s*          diag_t;
-typedef struct option_s*        option_t;
-typedef struct reader_s*        reader_t;
-typedef struct lexer_s*         lexer_t;
-typedef struct preprocessor_s*  preprocessor_t;
-
-
-typedef enum stage_type_e {
-    STAGE_READER,
-    STAGE_LEXER,
-    STAGE_PREPROCESSOR,
-} stage_type_t;
-
-
-typedef struct stage_s {
-    diag_t diag;
-    reader_t reader;
-    lexer_t lexer;
-    preprocessor_t pp;
-} *stage_t;
-
-
-#endif
\ No newline at end of file
+#ifndef __STAGE__H__
+#define __STAGE__H__
+
+
+#include "config.h"
+
+
+typedef struct cspool_s         cspool_t;
+typedef struct fcache_s         fcache_t;
+typedef struct diagnostor_s     diagnostor_t;
+typedef struct reader_s         reader_t;
+typedef struct lexer_s          lexer_t;
+typedef struct preprocessor_s   preprocessor_t;
+
+
+typedef enum stage_type_e {
+    STAGE_READER,
+    STAGE_LEXER,
+    STAGE_PREPROCESSOR,
+} stage_type_t;
+
+
+/**
+ * The pipeline of one translation unit. Stages own nothing shared with
+ * other stages except the string pool and the file cache, so each worker
+ * runs its own. A stage reports to the diagnostor of the thread that
+ * created it, which the driver makes a sink of its own for each job.
+ **/
+typedef struct stage_s {
+    diagnostor_t *diag;
+    reader_t *reader;
+    lexer_t *lexer;
+    preprocessor_t *pp;
+} stage_t;
+
+
+stage_t* stage_create(cspool_t *csp, fcache_t *fcache);
+void stage_destroy(stage_t *stage);
+const char* stage_name(stage_type_t type);
+
+
+#endif
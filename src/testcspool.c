@@ -5,6 +5,10 @@
 #include "unittest.h"
 
 
+#define TEST_CSPOOL_THREADS     8
+#define TEST_CSPOOL_STRINGS     2000
+
+
 static void test_cspool(void)
 {
     cspool_t *pool;
@@ -22,6 +26,84 @@ static void test_cspool(void)
 }
 
 
+static void test_cspool_large(void)
+{
+    cspool_t *pool;
+    cstring_t cs, large;
+
+    pool = cspool_create();
+
+    large = cstring_new_n(NULL, CSPOOL_CHUNK_SIZE);
+    while (cstring_length(large) < CSPOOL_CHUNK_SIZE) {
+        large = cstring_push_ch(large, 'a' + cstring_length(large) % 26);
+    }
+
+    cs = cspool_push_cs(pool, large);
+    TEST_COND("cspool_push_cs() adopts large strings", cs == large);
+    TEST_COND("cspool_push() finds large strings", cspool_push(pool, (char*) large) == cs);
+    TEST_COND("cspool_push_cs() of a short string", cspool_push_cs(pool, cstring_new("abc")) == cspool_push(pool, "abc"));
+    TEST_COND("cspool_length()", cspool_length(pool) == 2);
+
+    cspool_destroy(pool);
+}
+
+
+#if defined(UNIX)
+
+static cspool_t *shared_pool;
+static cstring_t interned[TEST_CSPOOL_THREADS][TEST_CSPOOL_STRINGS];
+
+
+static void* __push_strings__(void *arg)
+{
+    cstring_t *out = arg;
+    char buf[32];
+    int i;
+
+    for (i = 0; i < TEST_CSPOOL_STRINGS; i++) {
+        sprintf(buf, "identifier_%d", i);
+        out[i] = cspool_push(shared_pool, buf);
+    }
+
+    return NULL;
+}
+
+
+static void test_cspool_threads(void)
+{
+    pthread_t threads[TEST_CSPOOL_THREADS];
+    bool same = true;
+    int i, j;
+
+    shared_pool = cspool_create();
+
+    for (i = 0; i < TEST_CSPOOL_THREADS; i++) {
+        pthread_create(&threads[i], NULL, __push_strings__, interned[i]);
+    }
+
+    for (i = 0; i < TEST_CSPOOL_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 1; i < TEST_CSPOOL_THREADS; i++) {
+        for (j = 0; j < TEST_CSPOOL_STRINGS; j++) {
+            if (interned[i][j] != interned[0][j]) {
+                same = false;
+            }
+        }
+    }
+
+    TEST_COND("threads get the same pointers", same);
+    TEST_COND("threads intern each string once", cspool_length(shared_pool) == TEST_CSPOOL_STRINGS);
+    TEST_COND("cspool_push() of an interned string", cspool_push(shared_pool, "identifier_7") == interned[0][7] &&
+        cstring_compare(interned[0][7], "identifier_7") == 0);
+
+    cspool_destroy(shared_pool);
+}
+
+#endif
+
+
 int main(void)
 {
 
@@ -30,6 +112,10 @@ int main(void)
 #endif
 
     test_cspool();
+    test_cspool_large();
+#if defined(UNIX)
+    test_cspool_threads();
+#endif
     TEST_REPORT();
     return 0;
 }
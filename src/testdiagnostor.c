@@ -3,7 +3,211 @@
 #include "config.h"
 
 #include "token.h"
+#include "array.h"
+#include "option.h"
 #include "diagnostor.h"
+#include "unittest.h"
+
+
+#if defined(UNIX)
+#   include <unistd.h>
+#endif
+
+
+static void test_queue(void)
+{
+    diagnostor_t *diag;
+    diagnostic_t *d;
+    char message[32];
+    size_t i;
+
+    diag = diagnostor_create();
+    diag->resident = true;
+
+    strcpy(message, "unused variable");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 5, "%s 'x'", message);
+    strcpy(message, "overwritten");
+
+    TEST_COND("queued", diag->queue != NULL && array_length(diag->queue) == 1);
+    d = array_prototype(diag->queue, diagnostic_t);
+    TEST_COND("filename copied", strcmp((char*) diag->text + d[0].filename, "a.c") == 0);
+    TEST_COND("message copied", strcmp((char*) diag->text + d[0].message, "unused variable 'x'") == 0);
+    TEST_COND("location", d[0].line == 3 && d[0].column == 5);
+
+    for (i = 0; i < 10000; i++) {
+        diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 5, "unused variable 'x'");
+        diagnostor_notef(diag, DIAGNOSTOR_LEVEL_NOTE, "declared here");
+    }
+
+    TEST_COND("repeats dropped", array_length(diag->queue) == 1);
+    TEST_COND("repeats counted", diag->nwarnings == 1 && diag->nrepeats == 10000);
+
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 6, "unused variable 'x'");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_ERROR, "a.c", 3, 5, "unused variable 'x'");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "b.c", 3, 5, "unused variable 'x'");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 5, "unused variable 'y'");
+    diagnostor_notef(diag, DIAGNOSTOR_LEVEL_NOTE, "declared here");
+
+    TEST_COND("others kept", array_length(diag->queue) == 6);
+    TEST_COND("others counted", diag->nwarnings == 4 && diag->nerrors == 1);
+
+    d = array_prototype(diag->queue, diagnostic_t);
+    TEST_COND("filename shared", d[0].filename == d[1].filename && d[0].filename == d[2].filename &&
+                                 d[3].filename != d[0].filename);
+
+    diagnostor_flush(diag);
+    TEST_COND("flushed", array_is_empty(diag->queue));
+
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 5, "unused variable 'x'");
+    TEST_COND("seen across flushes", array_is_empty(diag->queue) && diag->nrepeats == 10001);
+
+    for (i = 0; i < DIAGNOSTOR_FLUSH_SIZE / 16; i++) {
+        diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "c.c", i + 1, 1, "unused variable");
+    }
+
+    TEST_COND("flushed when large", array_length(diag->queue) < DIAGNOSTOR_FLUSH_SIZE / 16);
+    TEST_COND("seen grows", diag->nwarnings == 4 + DIAGNOSTOR_FLUSH_SIZE / 16);
+
+    diagnostor_reset(diag);
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 3, 5, "unused variable 'x'");
+    TEST_COND("reset", array_length(diag->queue) == 1 && diag->nwarnings == 1 && diag->nrepeats == 0);
+
+    diagnostor_destroy(diag);
+}
+
+
+static void test_sink(void)
+{
+    diagnostor_t *diag, *sink;
+    diagnostic_t *d;
+    size_t i;
+
+    diag = diagnostor_create();
+    diag->resident = true;
+
+    sink = diagnostor_create();
+    sink->sink = true;
+
+    for (i = 0; i < 2 * option->ferror_limit; i++) {
+        diagnostor_notef_with_location(sink, DIAGNOSTOR_LEVEL_ERROR, "a.c", i + 1, 1, "error %lu",
+                                       (unsigned long) i);
+    }
+    diagnostor_notef_with_location(sink, DIAGNOSTOR_LEVEL_WARNING, "a.c", 1, 1, "shared");
+    diagnostor_notef_with_location(sink, DIAGNOSTOR_LEVEL_WARNING, "a.c", 1, 1, "shared");
+    diagnostor_flush(sink);
+
+    TEST_COND("sink past the error limit", sink->nerrors == 2 * option->ferror_limit);
+    TEST_COND("sink keeps its queue", array_length(sink->queue) == 2 * option->ferror_limit + 1);
+
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 1, 1, "shared");
+    diagnostor_merge(diag, sink);
+
+    TEST_COND("sink emptied", array_is_empty(sink->queue));
+    TEST_COND("merged in order", array_length(diag->queue) == 2 * option->ferror_limit + 1);
+
+    d = array_prototype(diag->queue, diagnostic_t);
+    TEST_COND("merged strings",
+        strcmp((char*) diag->text + d[1].message, "error 0") == 0 && d[1].line == 1 &&
+        strcmp((char*) diag->text + d[2].message, "error 1") == 0 && d[2].line == 2 &&
+        strcmp((char*) diag->text + d[1].filename, "a.c") == 0);
+    TEST_COND("merged counts and repeats",
+        diag->nerrors == 2 * option->ferror_limit && diag->nwarnings == 1 && diag->nrepeats == 2);
+
+    diagnostor_destroy(sink);
+    diagnostor_destroy(diag);
+}
+
+
+#if defined(UNIX)
+
+/* what the diagnostor writes to stdout on diagnostor_report() */
+static cstring_t __report__(diagnostor_t *diag)
+{
+    char buf[256];
+    cstring_t cs;
+    FILE *fp;
+    size_t n;
+    int saved;
+
+    fflush(stdout);
+    fp = tmpfile();
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(fp), STDOUT_FILENO);
+
+    diagnostor_report(diag);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    cs = cstring_new_n(NULL, sizeof(buf));
+    fseek(fp, 0, SEEK_SET);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) != 0) {
+        cs = cstring_concat_n(cs, buf, n);
+    }
+    fclose(fp);
+
+    return cs;
+}
+
+
+static void test_formats(void)
+{
+    diagnostor_t *diag;
+    linenote_caution_t lc;
+    cstring_t cs;
+
+    lc.start = 9;
+    lc.length = 3;
+
+    diag = diagnostor_create();
+    diag->resident = true;
+
+    option->diagnostics_format = DIAGNOSTICS_FORMAT_JSON;
+
+    diagnostor_notef_with_linenote_caution(diag, DIAGNOSTOR_LEVEL_WARNING, "dir\\a.c", 2, 9,
+                                           "int x = \"y\";", &lc, "unused \"%s\"\t\x01", "x");
+    diagnostor_notef(diag, DIAGNOSTOR_LEVEL_NOTE, "bytes \xc3\xa9\xff");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_ERROR, "b.c", 1, 1, "stop");
+
+    cs = __report__(diag);
+    TEST_COND("json records",
+        strcmp((char*) cs,
+               "{\"level\":\"warning\",\"file\":\"dir\\\\a.c\",\"line\":2,\"column\":9,"
+               "\"caution\":{\"start\":9,\"length\":3},\"message\":\"unused \\\"x\\\"\\t\\u0001\"}\n"
+               "{\"level\":\"note\",\"message\":\"bytes \xc3\xa9\\ufffd\"}\n"
+               "{\"level\":\"error\",\"file\":\"b.c\",\"line\":1,\"column\":1,\"message\":\"stop\"}\n") == 0);
+    cstring_free(cs);
+
+    option->diagnostics_format = DIAGNOSTICS_FORMAT_SARIF;
+
+    cs = __report__(diag);
+    TEST_COND("sarif log without results",
+        strstr((char*) cs, "\"version\":\"2.1.0\"") != NULL &&
+        strstr((char*) cs, "\"results\":[\n]}]}\n") != NULL);
+    cstring_free(cs);
+
+    diagnostor_notef_with_linenote_caution(diag, DIAGNOSTOR_LEVEL_WARNING, "a.c", 2, 9,
+                                           "int x = y;", &lc, "unused");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_ERROR, "b.c", 1, 1, "stop");
+    diagnostor_notef_with_location(diag, DIAGNOSTOR_LEVEL_ERROR, "b.c", 1, 1, "again");
+
+    cs = __report__(diag);
+    TEST_COND("sarif results",
+        strstr((char*) cs,
+               "\n{\"level\":\"warning\",\"message\":{\"text\":\"unused\"},"
+               "\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":\"a.c\"},"
+               "\"region\":{\"startLine\":2,\"startColumn\":9,\"endColumn\":12}}}]},") != NULL &&
+        strstr((char*) cs, "{\"text\":\"again\"}") != NULL &&
+        strstr((char*) cs, "}}}]}\n]}]}\n") != NULL);
+    cstring_free(cs);
+
+    option->diagnostics_format = DIAGNOSTICS_FORMAT_TEXT;
+
+    diagnostor_destroy(diag);
+}
+
+#endif
 
 
 static void test_diagnostor()
@@ -40,6 +244,13 @@ int main(void)
     _CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
 #endif
 
+    test_queue();
+    test_sink();
+#if defined(UNIX)
+    test_formats();
+#endif
+    TEST_REPORT();
+
     test_diagnostor();
     test_panic();
     return 0;
@@ -0,0 +1,194 @@
+#include "config.h"
+#include "cstring.h"
+#include "encoding.h"
+#include "unittest.h"
+
+
+/* random text, mostly runs of ASCII, with the units expected of it */
+static cstring_t __random_text__(uint32_t *seed, uint32_t *runes, size_t *nrunes)
+{
+    cstring_t cs;
+    uint32_t x, rune;
+    size_t i, run;
+
+    cs = cstring_new_n(NULL, 256);
+    *nrunes = 0;
+
+    x = *seed;
+    for (i = 0; i < 24; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        for (run = x % 40; run > 0; run--) {
+            rune = 0x20 + (x >> (run % 24)) % 0x5F;
+            cs = cstring_append_utf8(cs, rune);
+            runes[(*nrunes)++] = rune;
+        }
+
+        switch ((x >> 8) % 4) {
+        case 0:
+            rune = 0x80 + (x >> 12) % 0x780;
+            break;
+        case 1:
+            rune = 0x800 + (x >> 12) % 0xD000;
+            break;
+        case 2:
+            rune = 0x10000 + (x >> 12) % 0x100000;
+            break;
+        default:
+            continue;
+        }
+
+        cs = cstring_append_utf8(cs, rune);
+        runes[(*nrunes)++] = rune;
+    }
+
+    *seed = x;
+    return cs;
+}
+
+
+static void test_transcoding(void)
+{
+    cstring_t cs, utf16, utf32;
+    uint32_t runes[1024], seed;
+    unsigned char expect16[4096], expect32[4096];
+    size_t n16, n32, nrunes, i;
+    bool ok16, ok32, valid;
+    int round;
+
+    cs = cstring_new("a\xE2\x82\xAC" "b");
+    utf16 = cstring_cast_to_utf16(cs);
+    TEST_COND("cstring_cast_to_utf16()", cstring_length(utf16) == 6 &&
+              memcmp(utf16, "a\0\xAC\x20" "b\0", 6) == 0);
+    utf32 = cstring_cast_to_utf32(cs);
+    TEST_COND("cstring_cast_to_utf32()", cstring_length(utf32) == 12 &&
+              memcmp(utf32, "a\0\0\0\xAC\x20\0\0" "b\0\0\0", 12) == 0);
+    cstring_free(utf16);
+    cstring_free(utf32);
+    cstring_free(cs);
+
+    cs = cstring_new("\xF0\x9F\x98\x80");
+    utf16 = cstring_cast_to_utf16(cs);
+    TEST_COND("cstring_cast_to_utf16() surrogates", cstring_length(utf16) == 4 &&
+              memcmp(utf16, "\x3D\xD8\x00\xDE", 4) == 0);
+    cstring_free(utf16);
+    cstring_free(cs);
+
+    cs = cstring_new("0123456789abcdef0123456789abcdef\xE2\x82");
+    TEST_COND("cstring_cast_to_utf16() truncated", cstring_cast_to_utf16(cs) == NULL);
+    TEST_COND("cstring_cast_to_utf32() truncated", cstring_cast_to_utf32(cs) == NULL);
+    cstring_free(cs);
+
+    ok16 = ok32 = valid = true;
+    seed = 2463534242u;
+
+    for (round = 0; round < 2000; round++) {
+        cs = __random_text__(&seed, runes, &nrunes);
+
+        n16 = n32 = 0;
+        for (i = 0; i < nrunes; i++) {
+            uint32_t rune = runes[i];
+
+            if (rune >= 0x10000) {
+                expect16[n16++] = (unsigned char) ((rune >> 10) + 0xD7C0);
+                expect16[n16++] = (unsigned char) (((rune >> 10) + 0xD7C0) >> 8);
+                rune = (rune & 0x3FF) + 0xDC00;
+            }
+            expect16[n16++] = (unsigned char) rune;
+            expect16[n16++] = (unsigned char) (rune >> 8);
+
+            rune = runes[i];
+            expect32[n32++] = (unsigned char) rune;
+            expect32[n32++] = (unsigned char) (rune >> 8);
+            expect32[n32++] = (unsigned char) (rune >> 16);
+            expect32[n32++] = (unsigned char) (rune >> 24);
+        }
+
+        utf16 = cstring_cast_to_utf16(cs);
+        utf32 = cstring_cast_to_utf32(cs);
+
+        ok16 = ok16 && utf16 != NULL && cstring_length(utf16) == n16 && memcmp(utf16, expect16, n16) == 0;
+        ok32 = ok32 && utf32 != NULL && cstring_length(utf32) == n32 && memcmp(utf32, expect32, n32) == 0;
+        valid = valid && utf8_validate(cs, cstring_length(cs));
+
+        if (utf16 != NULL) {
+            cstring_free(utf16);
+        }
+        if (utf32 != NULL) {
+            cstring_free(utf32);
+        }
+        cstring_free(cs);
+    }
+
+    TEST_COND("random text to UTF-16", ok16);
+    TEST_COND("random text to UTF-32", ok32);
+    TEST_COND("random text is valid", valid);
+}
+
+
+static void test_validation(void)
+{
+    static const struct {
+        const char *bytes;
+        bool valid;
+    } cases[] = {
+        { "\xC2\x80", true },
+        { "\xDF\xBF", true },
+        { "\xE0\xA0\x80", true },
+        { "\xED\x9F\xBF", true },
+        { "\xEE\x80\x80", true },
+        { "\xF0\x90\x80\x80", true },
+        { "\xF4\x8F\xBF\xBF", true },
+        { "\x80", false },
+        { "\xBF", false },
+        { "\xC0\x80", false },
+        { "\xC1\xBF", false },
+        { "\xE0\x9F\xBF", false },
+        { "\xED\xA0\x80", false },
+        { "\xF0\x8F\xBF\xBF", false },
+        { "\xF4\x90\x80\x80", false },
+        { "\xF5\x80\x80\x80", false },
+        { "\xFF", false },
+        { "\xC2", false },
+        { "\xE2\x82", false },
+        { "\xE2\x28\xA1", false },
+        { "\xF0\x9F\x98", false },
+    };
+    char buf[128];
+    size_t i, offset, n;
+    bool ok;
+
+    TEST_COND("utf8_validate() empty", utf8_validate((const unsigned char*) "", 0));
+    TEST_COND("utf8_ascii_span()", utf8_ascii_span((const unsigned char*) "0123456789abcdefgh\xC2\x80", 20) == 18);
+
+    /* at every offset in and around a block of ASCII */
+    ok = true;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for (offset = 0; offset < 40; offset++) {
+            memset(buf, 'x', offset);
+            n = strlen(cases[i].bytes);
+            memcpy(buf + offset, cases[i].bytes, n);
+            memset(buf + offset + n, 'y', 20);
+
+            if (utf8_validate((unsigned char*) buf, offset + n) != cases[i].valid ||
+                utf8_validate((unsigned char*) buf, offset + n + 20) != cases[i].valid ||
+                utf8_ascii_span((unsigned char*) buf, offset + n) != offset) {
+                printf("case %lu at %lu\n", (unsigned long) i, (unsigned long) offset);
+                ok = false;
+            }
+        }
+    }
+
+    TEST_COND("utf8_validate() sequences", ok);
+}
+
+
+int main(void)
+{
+    test_transcoding();
+    test_validation();
+    TEST_REPORT();
+    return 0;
+}
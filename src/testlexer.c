@@ -38,6 +38,159 @@ static void test_restore_text(void)
     lexer_destroy(lexer);
 }
 
+static token_type_t paste_type(token_type_t lt, const char *ls, token_type_t rt, const char *rs)
+{
+    token_t *left, *right, *token;
+    token_type_t type;
+
+    left = token_create(lt, cstring_new(ls), NULL);
+    right = token_create(rt, cstring_new(rs), NULL);
+
+    token = lexer_paste(left, right);
+    type = token ? token->type : TOKEN_UNKNOWN;
+
+    if (token) {
+        token_destroy(token);
+    }
+
+    token_destroy(left);
+    token_destroy(right);
+
+    return type;
+}
+
+
+static void test_paste(void)
+{
+    TEST_COND("lexer_paste() identifier",
+        paste_type(TOKEN_IDENTIFIER, "x", TOKEN_NUMBER, "1") == TOKEN_IDENTIFIER);
+    TEST_COND("lexer_paste() number",
+        paste_type(TOKEN_PERIOD, "", TOKEN_NUMBER, "5") == TOKEN_NUMBER);
+    TEST_COND("lexer_paste() exponent sign",
+        paste_type(TOKEN_NUMBER, "1e", TOKEN_PLUS, "") == TOKEN_NUMBER);
+    TEST_COND("lexer_paste() punctuator",
+        paste_type(TOKEN_MINUS, "", TOKEN_GREATER, "") == TOKEN_ARROW);
+    TEST_COND("lexer_paste() digraph",
+        paste_type(TOKEN_PERCENT, "", TOKEN_COLON, "") == TOKEN_HASH);
+    TEST_COND("lexer_paste() digraph of digraphs",
+        paste_type(TOKEN_HASH, "%:", TOKEN_HASH, "%:") == TOKEN_HASHHASH);
+    TEST_COND("lexer_paste() encoding prefix",
+        paste_type(TOKEN_IDENTIFIER, "L", TOKEN_CONSTANT_STRING, "s") == TOKEN_CONSTANT_WSTRING);
+    TEST_COND("lexer_paste() invalid punctuator",
+        paste_type(TOKEN_PLUS, "", TOKEN_MINUS, "") == TOKEN_UNKNOWN);
+    TEST_COND("lexer_paste() invalid identifier",
+        paste_type(TOKEN_IDENTIFIER, "x", TOKEN_PLUS, "") == TOKEN_UNKNOWN);
+    TEST_COND("lexer_paste() invalid literal",
+        paste_type(TOKEN_CONSTANT_STRING, "s", TOKEN_IDENTIFIER, "x") == TOKEN_UNKNOWN);
+}
+
+
+static void test_literal_run(void)
+{
+    lexer_t *lexer;
+    array_t *split;
+    token_t *token, *run;
+    cstring_t cs;
+    size_t nruns, nnumbers;
+
+    lexer = lexer_create();
+    lexer->literal_runs = true;
+
+    lexer_push(lexer, STREAM_TYPE_STRING,
+        "{ 1, 2,  3 ,0x1F, 017, 4u, 5, 18446744073709551616, 6, 7 }\n"
+        "#define T 1, 2\n"
+        "f(8, x);\n");
+
+    run = NULL;
+    nruns = 0;
+    nnumbers = 0;
+
+    cs = cstring_new_n(NULL, 64);
+
+    for (;;) {
+        token = lexer_get(lexer);
+        if (token->type == TOKEN_END) {
+            token_destroy(token);
+            break;
+        }
+
+        if (token->type == TOKEN_LITERAL_RUN) {
+            nruns++;
+        } else if (token->type == TOKEN_NUMBER) {
+            nnumbers++;
+        }
+
+        cs = cstring_concat_pf(cs, "%s|", token_as_text(token));
+
+        if (token->type == TOKEN_LITERAL_RUN && run == NULL) {
+            run = token;
+        } else {
+            token_destroy(token);
+        }
+    }
+
+    TEST_COND("literal runs end at anything but integers",
+        cstring_compare(cs, "{|1, 2,  3 ,0x1F, 017|,|4u|,|5|,|18446744073709551616|,|6, 7|}|\n|"
+                            "#|define|T|1|,|2|\n|f|(|8|,|x|)|;|\n|<EOF>|") == 0);
+    TEST_COND("literal runs are not lexed on directive lines", nruns == 2 && nnumbers == 6);
+
+    TEST_COND("values of a literal run", run != NULL && array_length(run->run) == 5 &&
+        array_cast_at(unsigned long long, run->run, 2) == 3 &&
+        array_cast_at(unsigned long long, run->run, 3) == 31 &&
+        array_cast_at(unsigned long long, run->run, 4) == 15);
+
+    if (run != NULL) {
+        split = lexer_split_run(run);
+        cstring_free(cs);
+        cs = tokens_to_text(split);
+        TEST_COND("lexer_split_run() spelling", cstring_compare(cs, " 1, 2,  3 ,0x1F, 017") == 0);
+        TEST_COND("lexer_split_run()", array_length(split) == 9 &&
+            array_cast_at(token_t*, split, 1)->type == TOKEN_COMMA &&
+            array_cast_at(token_t*, split, 5)->spaces == 1 &&
+            array_cast_at(token_t*, split, 6)->location.column == run->location.column + 10);
+        tokens_free(split);
+        token_destroy(run);
+    }
+
+    cstring_free(cs);
+    lexer_destroy(lexer);
+}
+
+
+static void test_identifier(void)
+{
+    static const char *expect[] = { "int", "abcd", "caf\xC3\xA9", "x$1", "\xCE\xB1\xCE\xB2", "e" };
+    lexer_t *lexer;
+    token_t *token;
+    size_t i;
+    bool ok;
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_STRING, "int ab\\\ncd caf\xC3\xA9 x$1+\xCE\xB1\xCE\xB2(e)\n");
+
+    ok = true;
+    i = 0;
+    for (;;) {
+        token = lexer_get(lexer);
+        if (token->type == TOKEN_END) {
+            token_destroy(token);
+            break;
+        }
+
+        if (token->type == TOKEN_IDENTIFIER) {
+            ok = ok && i < sizeof(expect) / sizeof(expect[0]) && cstring_compare(token->cs, expect[i]) == 0;
+            i++;
+        }
+
+        token_destroy(token);
+    }
+
+    TEST_COND("identifiers", ok && i == sizeof(expect) / sizeof(expect[0]));
+
+    lexer_destroy(lexer);
+}
+
+
 static void test_lexer(void)
 {
     lexer_t *lexer;
@@ -74,6 +227,9 @@ int main(void)
 #endif
 
     test_restore_text();
+    test_paste();
+    test_literal_run();
+    test_identifier();
     //test_lexer();
 
     TEST_REPORT();
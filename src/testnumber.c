@@ -2,29 +2,31 @@
 
 #include "config.h"
 #include "unittest.h"
+#include "token.h"
+#include "reader.h"
 #include "diagnostor.h"
 #include "option.h"
 #include "number.h"
-#include "token.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 
 #define EXCEPT_INTEGER_EQ(tok, expect, num)                                                 \
     do {                                                                                    \
         number_t n;                                                                         \
         (tok)->cs = cstring_copy_n((tok)->cs, num, strlen(num));                             \
-        TEST_COND(num, parse_number(diag, &option, tok, &n)== true && n.ul == expect);      \
+        TEST_COND(num, parse_number(tok, &n)== true && n.ul == expect);      \
     } while(0)
 
 #define EXCEPT_INTEGER_NEQ(tok, expect, num)                                                \
     do {                                                                                    \
         number_t n;                                                                         \
         (tok)->cs = cstring_copy_n((tok)->cs, num, strlen(num));                             \
-        TEST_COND(num, !parse_number(diag, &option, tok, &n));                              \
+        TEST_COND(num, !parse_number(tok, &n));                              \
     } while(0)
 
 #define EXCEPT_HEX_CONST(except)    \
@@ -52,14 +54,9 @@
 static
 void test_number1()
 {
-    diag_t diag;
-    struct option_s option;
-    token_t tok;
-
-    diag = diag_create();
-    tok = token_create();
+    token_t *tok;
 
-    tok->type = TOKEN_NUMBER;
+    tok = token_create(TOKEN_NUMBER, cstring_new_n(NULL, 32), NULL);
 
     CHECK_DEC_CONST(1);
     CHECK_DEC_CONST(2);
@@ -579,34 +576,238 @@ void test_number1()
     EXCEPT_INTEGER_NEQ(tok, 0, "0b1234");
 
     token_destroy(tok);
-    diag_destroy(diag);
 }
 
 static
 void test_number2()
 {
-    diag_t diag;
-    struct option_s option;
-    token_t tok;
+    token_t *tok;
     number_t n;
+    size_t nerrors;
 
-    diag = diag_create();
-    tok = token_create();
-
-    tok->type = TOKEN_NUMBER;
+    tok = token_create(TOKEN_NUMBER, cstring_new_n(NULL, 32), NULL);
 
     CHECK_HEX_CONST(fful);
     CHECK_HEX_CONST(ffull);
     CHECK_HEX_CONST(ffllu);
     
     tok->cs = cstring_copy_n(tok->cs, "0xFFFFFFFFFFFFFFFFFFFFull", strlen("0xFFFFFFFFFFFFFFFFFFFFull"));
-    parse_number(diag, &option, tok, &n);
+    parse_number(tok, &n);
     printf("%llu\n", n.ul);
     CHECK_DEP_CONST(123456, "12'3'4'56");
-    CHECK_DEP_CONST(123456, "12'3'4'56'");
+
+    nerrors = diagnostor->nerrors;
+    EXCEPT_INTEGER_NEQ(tok, 123456, "12'3'4'56'");
+    TEST_COND("trailing digit separator diagnosed", diagnostor->nerrors == nerrors + 1);
+
+    token_destroy(tok);
+}
+
+static
+void test_number_fast()
+{
+    token_t *tok;
+    number_t n;
+    unsigned long long x;
+    char buf[64];
+    bool ok;
+    int i;
+
+    tok = token_create(TOKEN_NUMBER, cstring_new_n(NULL, 32), NULL);
+
+    CHECK_DEC_CONST(7);
+    CHECK_DEC_CONST(99999999);
+    CHECK_DEC_CONST(100000000);
+    CHECK_DEC_CONST(1234567890123456789);
+    CHECK_DEC_CONST(12345678u);
+    CHECK_DEC_CONST(87654321UL);
+    CHECK_DEP_CONST(18446744073709551615ULL, "18446744073709551615");
+    CHECK_DEP_CONST(18446744073709551615ULL, "18446744073709551616");
+    CHECK_DEP_CONST(18446744073709551615ULL, "99999999999999999999999");
+    CHECK_HEX_CONST(DeadBeef);
+    CHECK_HEX_CONST(0123456789abcdef);
+    CHECK_HEX_CONST(FEDCBA9876543210);
+    CHECK_HEX_CONST(ABCDEFabcdef);
+    CHECK_DEP_CONST(0xFFFFFFFFFFFFFFFFULL, "0x0FFFFFFFFFFFFFFFF");
+    EXCEPT_INTEGER_NEQ(tok, 0, "12345678x");
+    EXCEPT_INTEGER_NEQ(tok, 0, "0x12345678g");
+
+    tok->cs = cstring_copy_n(tok->cs, "0x1234abcdU", strlen("0x1234abcdU"));
+    TEST_COND("0x1234abcdU", parse_number(tok, &n) && n.radix == 16 &&
+              n.property == (NUMBER_INTEGER | NUMBER_HEX | NUMBER_UNSIGNED | NUMBER_SMALL));
+
+    tok->cs = cstring_copy_n(tok->cs, "123456789l", strlen("123456789l"));
+    TEST_COND("123456789l", parse_number(tok, &n) && n.radix == 10 &&
+              n.property == (NUMBER_INTEGER | NUMBER_DECIMAL | NUMBER_MEDIUM));
+
+    tok->cs = cstring_copy_n(tok->cs, "12345678.5", strlen("12345678.5"));
+    TEST_COND("12345678.5", parse_number(tok, &n) && (n.property & NUMBER_FLOATING) &&
+              n.ld == 12345678.5L);
+
+    /* random values of every length, decimal and hexadecimal */
+    ok = true;
+    x = 88172645463325252ULL;
+    for (i = 0; i < 20000; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        sprintf(buf, (i & 1) ? "0x%llx" : "%llu", x >> (i % 64));
+        tok->cs = cstring_copy_n(tok->cs, buf, strlen(buf));
+        if (!parse_number(tok, &n) || n.ul != x >> (i % 64)) {
+            ok = false;
+            break;
+        }
+    }
+    TEST_COND("random integer constants", ok);
+
+    token_destroy(tok);
+}
+
+static
+bool __float_matches__(token_t *tok, const char *spelling, const char *suffix)
+{
+    number_t n;
+    long double expect;
+
+    tok->cs = cstring_copy_n(tok->cs, spelling, strlen(spelling));
+    tok->cs = cstring_concat_n(tok->cs, suffix, strlen(suffix));
+
+    if (!parse_number(tok, &n) || !(n.property & NUMBER_FLOATING)) {
+        return false;
+    }
+
+    if (*suffix == 'f') {
+        expect = strtof(spelling, NULL);
+    } else if (*suffix == 'L') {
+        expect = strtold(spelling, NULL);
+    } else {
+        expect = strtod(spelling, NULL);
+    }
+
+    if (n.ld != expect) {
+        printf("%s%s: %.21Lg, expected %.21Lg\n", spelling, suffix, n.ld, expect);
+        return false;
+    }
+
+    return true;
+}
+
+
+static
+void test_number_floating()
+{
+    static const char *suffixes[] = { "", "f", "L" };
+    static const int exponents[] = { 330, 40, 4950 };
+    token_t *tok;
+    char buf[1024];
+    unsigned long long x;
+    double d, next;
+    float f, nextf;
+    number_t n;
+    int i, j, k, len, ndigits;
+    bool ok;
+
+    tok = token_create(TOKEN_NUMBER, cstring_new_n(NULL, 32), NULL);
+
+    TEST_COND("1e3", __float_matches__(tok, "1e3", ""));
+    TEST_COND("1.5e-3f", __float_matches__(tok, "1.5e-3", "f"));
+    TEST_COND("0.1", __float_matches__(tok, "0.1", ""));
+    TEST_COND("0.1f", __float_matches__(tok, "0.1", "f"));
+    TEST_COND("0.1L", __float_matches__(tok, "0.1", "L"));
+    TEST_COND("1e23", __float_matches__(tok, "1e23", ""));
+    TEST_COND("9007199254740993", __float_matches__(tok, "9007199254740993.0", ""));
+    TEST_COND("2.2250738585072011e-308", __float_matches__(tok, "2.2250738585072011e-308", ""));
+    TEST_COND("4.9406564584124654e-324", __float_matches__(tok, "4.9406564584124654e-324", ""));
+    TEST_COND("2.4703282292062327e-324", __float_matches__(tok, "2.4703282292062327e-324", ""));
+    TEST_COND("2.4703282292062328e-324", __float_matches__(tok, "2.4703282292062328e-324", ""));
+    TEST_COND("1.7976931348623157e308", __float_matches__(tok, "1.7976931348623157e308", ""));
+    TEST_COND("1.7976931348623159e308", __float_matches__(tok, "1.7976931348623159e308", ""));
+    TEST_COND("3.4028235e38f", __float_matches__(tok, "3.4028235e38", "f"));
+    TEST_COND("1.18973149535723176502e4932L", __float_matches__(tok, "1.18973149535723176502e4932", "L"));
+    TEST_COND("3.64519953188247460253e-4951L", __float_matches__(tok, "3.64519953188247460253e-4951", "L"));
+    TEST_COND("1e-99999", __float_matches__(tok, "1e-99999", ""));
+    TEST_COND("1e99999L", __float_matches__(tok, "1e99999", "L"));
+    TEST_COND(".000000000000000000000000000000000000001e39", __float_matches__(tok, ".000000000000000000000000000000000000001e39", ""));
+    TEST_COND("0x1.8p3", __float_matches__(tok, "0x1.8p3", ""));
+    TEST_COND("0x1.fffffffffffff8p1023", __float_matches__(tok, "0x1.fffffffffffff8p1023", ""));
+    TEST_COND("0x1.000001p0f", __float_matches__(tok, "0x1.000001p0", "f"));
+    TEST_COND("0x1.00000000000000018p0L", __float_matches__(tok, "0x1.00000000000000018p0", "L"));
+    TEST_COND("0x.8p-1074", __float_matches__(tok, "0x.8p-1074", ""));
+    TEST_COND("0x.80001p-1074", __float_matches__(tok, "0x.80001p-1074", ""));
+
+    tok->cs = cstring_copy_n(tok->cs, "1'000.25e1'0", strlen("1'000.25e1'0"));
+    TEST_COND("1'000.25e1'0", parse_number(tok, &n) && n.ld == 1000.25e10);
+
+    /* random digits at random scales, against the C library */
+    ok = true;
+    x = 88172645463325252ULL;
+    for (i = 0; i < 60000 && ok; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        k = i % 3;
+        ndigits = 1 + (int) (x % (i % 7 == 0 ? 60 : 20));
+        len = 0;
+        for (j = 0; j < ndigits; j++) {
+            if (j == (int) ((x >> 8) % ndigits) && (x & 0x10000)) {
+                buf[len++] = '.';
+            }
+            buf[len++] = '0' + (int) (((x >> (j % 50)) ^ (x >> 40) ^ (unsigned) j * 7) % 10);
+        }
+        len += sprintf(buf + len, "e%d", (int) ((x >> 20) % (2 * exponents[k] + 1)) - exponents[k]);
+        buf[len] = '\0';
+
+        ok = __float_matches__(tok, buf, suffixes[k]);
+    }
+    TEST_COND("random decimal floating constants", ok);
+
+    /* the halfway points between neighbours, spelled out exactly */
+    ok = true;
+    for (i = 0; i < 10000 && ok; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        if (i & 1) {
+            memcpy(&d, &x, sizeof(d));
+            d = fabs(d);
+            if (isnan(d) || isinf(d)) {
+                continue;
+            }
+            next = nextafter(d, HUGE_VAL);
+            sprintf(buf, "%.800Le", ((long double) d + next) / 2);
+            ok = __float_matches__(tok, buf, "");
+        } else {
+            uint32_t bits = (uint32_t) x;
+            memcpy(&f, &bits, sizeof(f));
+            f = fabsf(f);
+            if (isnan(f) || isinf(f)) {
+                continue;
+            }
+            nextf = nextafterf(f, HUGE_VALF);
+            sprintf(buf, "%.200e", ((double) f + nextf) / 2);
+            ok = __float_matches__(tok, buf, "f");
+        }
+    }
+    TEST_COND("halfway floating constants", ok);
+
+    /* hexadecimal ones, of every length */
+    ok = true;
+    for (i = 0; i < 30000 && ok; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        k = i % 3;
+        len = sprintf(buf, "0x%llx.%llxp%d", x >> (x % 64), x & 0xffffff,
+                      (int) ((x >> 24) % (2 * (exponents[k] * 4) + 1)) - exponents[k] * 4);
+        ok = __float_matches__(tok, buf, suffixes[k]);
+    }
+    TEST_COND("random hexadecimal floating constants", ok);
 
     token_destroy(tok);
-    diag_destroy(diag);
 }
 
 int main(void)
@@ -617,6 +818,8 @@ int main(void)
 
     test_number1();
     test_number2();
+    test_number_fast();
+    test_number_floating();
     TEST_REPORT();
     return 0;
 }
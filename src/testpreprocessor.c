@@ -2,20 +2,25 @@
 
 #include "config.h"
 #include "unittest.h"
-#include "diagnostor.h"
-#include "lexer.h"
-#include "option.h"
 #include "token.h"
 #include "reader.h"
+#include "lexer.h"
+#include "diagnostor.h"
+#include "option.h"
+#include "dict.h"
 #include "preprocessor.h"
+#include "array.h"
+#include "trace.h"
 
 
-static 
-void print_pp(preprocessor_t pp)
+static
+cstring_t print_pp(preprocessor_t *pp)
 {
-    unsigned int spaces;
+    size_t spaces;
+    cstring_t cs = cstring_new_n(NULL, 64);
+
     for (;;) {
-        token_t tok = preprocessor_expand(pp);
+        token_t *tok = preprocessor_expand(pp);
         if (tok->type == TOKEN_END || tok->type == TOKEN_EOF) {
             token_destroy(tok);
             break;
@@ -23,49 +28,842 @@ void print_pp(preprocessor_t pp)
 
         if (tok->type == TOKEN_NEWLINE) {
             token_destroy(tok);
-            printf("\n");
+            cs = cstring_push_ch(cs, '\n');
             continue;
         }
 
         spaces = tok->spaces;
-        while (spaces--)
-            printf(" ");
-            ;
+        while (spaces--) {
+            cs = cstring_push_ch(cs, ' ');
+        }
 
-        printf("%s", token_as_text(tok));
+        cs = cstring_concat_n(cs, token_as_text(tok), strlen(token_as_text(tok)));
         token_destroy(tok);
     }
+
+    return cs;
 }
 
 
+static
+cstring_t preprocess_runs(const char *s, bool literal_runs)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    cstring_t cs;
+
+    lexer = lexer_create();
+    lexer->literal_runs = literal_runs;
+
+    lexer_push(lexer, STREAM_TYPE_STRING, s);
+
+    pp = preprocessor_create(lexer);
+
+    cs = print_pp(pp);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+
+    return cs;
+}
+
+
+static
+cstring_t preprocess(const char *s)
+{
+    return preprocess_runs(s, false);
+}
+
+
+#define EXPECT_PREPROCESS(desc, src, expect)                    \
+    do {                                                        \
+        cstring_t cs = preprocess(src);                         \
+        TEST_COND(desc, cstring_compare(cs, expect) == 0);      \
+        cstring_free(cs);                                       \
+    } while (false)
+
+
 static
 void test_preprocessor(void)
 {
-    preprocessor_t pp;
-    reader_t reader;
-    diag_t diag;
-    lexer_t lexer;
-    struct option_s option;
+    EXPECT_PREPROCESS("object-like macro",
+        "#define N 42\nint a = N;\n",
+        "\nint a = 42;\n");
+
+    EXPECT_PREPROCESS("object-like macro with many tokens",
+        "#define EXPR (1 + 2) * 3\nEXPR EXPR\n",
+        "\n(1 + 2) * 3 (1 + 2) * 3\n");
+
+    EXPECT_PREPROCESS("self-referential macro",
+        "#define A A B\n#define B A\nA\n",
+        "\n\nA A\n");
+
+    EXPECT_PREPROCESS("function-like macro",
+        "#define ADD(x, y) ((x) + (y))\nADD(1, 2)\n",
+        "\n((1) + (2))\n");
+
+    EXPECT_PREPROCESS("nested function-like macro",
+        "#define ADD(x, y) ((x) + (y))\n#define N 3\nADD(ADD(1, N), 2)\n",
+        "\n\n((((1) + (3))) + (2))\n");
+
+    EXPECT_PREPROCESS("function-like macro without arguments",
+        "#define F() f\nF() F\n",
+        "\nf F\n");
+
+    EXPECT_PREPROCESS("token pasting",
+        "#define CAT(a, b) a ## b\nCAT(x, y) CAT(, y) CAT(x, )\n",
+        "\nxy y x\n");
+
+    EXPECT_PREPROCESS("token pasting forms one token",
+        "#define CAT(a, b) a ## b\nCAT(-, >) CAT(<<, =) CAT(1, e) CAT(x, 1) CAT(1e, +)\n",
+        "\n-> <<= 1e x1 1e+\n");
+
+    EXPECT_PREPROCESS("token pasting keeps the spelling of digraphs",
+        "#define CAT(a, b) a ## b\nCAT(%:, %:) CAT(<, :) CAT(%, >) <: %:%:\n",
+        "\n%:%: <: %> <: %:%:\n");
+
+    EXPECT_PREPROCESS("token pasting an encoding prefix",
+        "#define WIDE(s) L ## s\nWIDE(\"abc\")\n",
+        "\nabc\n");
+
+    EXPECT_PREPROCESS("variadic macro",
+        "#define V(...) f(__VA_ARGS__)\nV(1, 2)\n",
+        "\nf(1, 2)\n");
+
+    EXPECT_PREPROCESS("undef",
+        "#define N 1\nN\n#undef N\nN\n",
+        "\n1\n\nN\n");
+}
+
+
+static
+void test_conditional(void)
+{
+    EXPECT_PREPROCESS("#ifdef",
+        "#define A\n#ifdef A\na\n#endif\n#ifdef B\nb\n#endif\n",
+        "\n\na\n\n\n");
+
+    EXPECT_PREPROCESS("#ifndef and #else",
+        "#ifndef A\na\n#else\nb\n#endif\n",
+        "\na\n\n");
+
+    EXPECT_PREPROCESS("#if and #elif",
+        "#if 0\na\n#elif 1\nb\n#elif 1\nc\n#else\nd\n#endif\n",
+        "\nb\n\n");
+
+    EXPECT_PREPROCESS("nested false groups",
+        "#if 0\n#if 1\na\n#else\nb\n#endif\n#else\nc\n#endif\n",
+        "\nc\n\n");
+
+    EXPECT_PREPROCESS("false group with comments, literals and splices",
+        "#if 0\n"
+        "don't /* #else\n*/ # else\n"
+        "\"#else\" x \\\n#else\n"
+        "// #else \\\n#else\n"
+        "  /* */ # endif\n"
+        "a\n",
+        "\na\n");
+
+    EXPECT_PREPROCESS("false group is not tokenized",
+        "#ifdef A\n'unterminated \\ @ `\n#endif\nb\n",
+        "\nb\n");
+}
+
+
+static
+void test_condition_expression(void)
+{
+    EXPECT_PREPROCESS("#if arithmetic and precedence",
+        "#if 1 + 2 * 3 == 7 && 10 / 3 == 3 && 10 % 3 == 1 && (1 << 4 | 1) == 17\na\n#endif\n",
+        "\na\n\n");
+
+    EXPECT_PREPROCESS("#if signed and unsigned semantics",
+        "#if -1 < 0 && -1 > 0u && -8 >> 1 == -4 && 0xffffffffffffffff == -1\na\n#endif\n",
+        "\na\n\n");
+
+    EXPECT_PREPROCESS("#if short-circuit and conditional operator",
+        "#if (0 && 1 / 0) || (1 || 1 % 0) ? (0 ? 1 / 0 : 2) == 2 : 0\na\n#endif\n",
+        "\na\n\n");
+
+    EXPECT_PREPROCESS("#if defined and macros",
+        "#define A 4\n#define F(x) x * 2\n"
+        "#if defined A && defined(A) && !defined B && F(A) == 8 && B == 0\na\n#endif\n",
+        "\n\n\na\n\n");
+
+    EXPECT_PREPROCESS("#if character constants",
+        "#if 'a' == 97 && '\\n' == 10\na\n#endif\n",
+        "\na\n\n");
+
+    EXPECT_PREPROCESS("#if cache follows redefinitions",
+        "#define V 1\n#if V == 1\na\n#endif\n#undef V\n#define V 2\n#if V == 1\nb\n#endif\n",
+        "\n\na\n\n\n\n\n");
+
+    EXPECT_PREPROCESS("#if cache follows nested macros",
+        "#define A B\n#define B 1\n#if A\na\n#endif\n#undef B\n#if A\nb\n#endif\n",
+        "\n\n\na\n\n\n\n");
+
+    EXPECT_PREPROCESS("#if cache follows undefined macros",
+        "#if X\na\n#endif\n#define X 1\n#if X\nb\n#endif\n",
+        "\n\n\nb\n\n");
+}
+
+
+static
+void test_condition_cache(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    cstring_t cs;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING,
+        "#if defined(A) && A >= 4\n#endif\n"
+        "#define A 4\n"
+        "#if defined(A) && A >= 4\n#endif\n"
+        "#if defined(A) && A >= 4\n#endif\n");
+
+    pp = preprocessor_create(lexer);
+
+    cs = print_pp(pp);
+
+    TEST_COND("#if results are cached by spelling", dict_length((dict_t*)pp->condition_cache) == 1);
+
+    cstring_free(cs);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+}
+
+
+static
+void test_macro_filter(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    cstring_t cs;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING, "#define A 1\n#define B 2\n#undef B\nx y A B z\n");
+
+    pp = preprocessor_create(lexer);
+
+    cs = print_pp(pp);
+
+    TEST_COND("macro filter keeps macros", cstring_compare(cs, "\n\n\nx y 1 B z\n") == 0);
+    TEST_COND("macro filter statistics", pp->stats.macro_lookups == 5 &&
+        pp->stats.macro_lookups_filtered == 4 && pp->stats.macro_lookups_missed == 0);
+
+    cstring_free(cs);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+}
+
+
+static
+void test_shared_macro_body(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *first, *second;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING, "#define N 42\nN N\n");
+
+    pp = preprocessor_create(lexer);
+
+    first = preprocessor_get(pp);
+    second = preprocessor_get(pp);
+
+    TEST_COND("expansion shares the macro body", first->cs == second->cs);
+    TEST_COND("expansion shares the hideset", first->hideset == second->hideset);
+    TEST_COND("expansion is located at the invocation",
+        first->location.column == 1 && second->location.column == 3);
+
+    token_unshare(second);
+    TEST_COND("token_unshare()", first->cs != second->cs &&
+        cstring_compare(second->cs, "42") == 0);
+
+    token_destroy(first);
+    token_destroy(second);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+}
+
+
+#define EXPECT_PREPROCESS_ERROR(desc, src, expect)              \
+    do {                                                        \
+        size_t nerrors = diagnostor->nerrors;                   \
+        cstring_t cs = preprocess(src);                         \
+        TEST_COND(desc, cstring_compare(cs, expect) == 0 &&     \
+            diagnostor->nerrors == nerrors + 1);                \
+        cstring_free(cs);                                       \
+    } while (false)
+
+
+static
+void test_macro_arguments(void)
+{
+    bool resident;
+
+    /* the errors are expected, they must not stop the tests at -ferror-limit */
+    resident = diagnostor->resident;
+    diagnostor->resident = true;
+
+    EXPECT_PREPROCESS("omitted variadic argument",
+        "#define V(a, ...) f(a __VA_ARGS__)\nV(1)\n",
+        "\nf(1)\n");
+
+    EXPECT_PREPROCESS("one parameter called with ()",
+        "#define ONE(x) [x]\nONE()\n",
+        "\n[]\n");
+
+    EXPECT_PREPROCESS("empty arguments",
+        "#define G(a, b) a + b\nG(,)\n",
+        "\n+\n");
+
+    EXPECT_PREPROCESS_ERROR("too few arguments",
+        "#define G1(a, b) a + b\nG1(1)\n",
+        "\nG1\n");
+
+    EXPECT_PREPROCESS_ERROR("too many arguments",
+        "#define G2(a, b) a + b\nG2(1, 2, 3) x\n",
+        "\nG2 x\n");
+
+    EXPECT_PREPROCESS_ERROR("too many arguments to stringify",
+        "#define S1(x) #x\nS1(1, 2)\n",
+        "\nS1\n");
+
+    EXPECT_PREPROCESS_ERROR("too many arguments after expansion",
+        "#define S2(x) #x\n#define XS(x) S2(x)\n#define N(x) 1, 2, x\nXS(N(4))\n",
+        "\n\n\nS2\n");
+
+    EXPECT_PREPROCESS_ERROR("argument to a macro without parameters",
+        "#define Z() z\nZ(1)\n",
+        "\nZ\n");
+
+    EXPECT_PREPROCESS_ERROR("too few arguments before a variadic one",
+        "#define V2(a, b, ...) a b\nV2(1)\n",
+        "\nV2\n");
+
+    diagnostor->resident = resident;
+}
+
+
+static
+void test_directives(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *tok;
+    size_t nerrors, nwarnings;
+    bool resident;
+
+    EXPECT_PREPROCESS("#pragma is passed on",
+        "#pragma omp  parallel for\nx\n#pragma\n",
+        "#pragma omp parallel for\nx\n#pragma\n");
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_STRING, "a\n#line 10 \"x.c\"\nb\n# 20 \"y.c\" 2\nc\n#line 30\nd\n");
+    pp = preprocessor_create(lexer);
+
+    tok = preprocessor_get(pp);
+    TEST_COND("before #line", tok->location.line == 1);
+    token_destroy(tok);
+
+    tok = preprocessor_get(pp);
+    TEST_COND("#line with a filename", tok->location.line == 10 &&
+        cstring_compare(tok->location.filename, "x.c") == 0);
+    token_destroy(tok);
+
+    tok = preprocessor_get(pp);
+    TEST_COND("GNU line marker", tok->location.line == 20 &&
+        cstring_compare(tok->location.filename, "y.c") == 0);
+    token_destroy(tok);
+
+    tok = preprocessor_get(pp);
+    TEST_COND("#line without a filename", tok->location.line == 30 &&
+        cstring_compare(tok->location.filename, "y.c") == 0);
+    token_destroy(tok);
+
+    preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+
+    resident = diagnostor->resident;
+    diagnostor->resident = true;
+
+    nwarnings = diagnostor->nwarnings;
+    EXPECT_PREPROCESS("#warning", "#warning careful\nw\n", "\nw\n");
+    TEST_COND("#warning is a warning", diagnostor->nwarnings == nwarnings + 1);
+
+    EXPECT_PREPROCESS_ERROR("#error", "#error boom\ne\n", "\ne\n");
+    EXPECT_PREPROCESS_ERROR("unknown directive", "#frobnicate x\nu\n", "\nu\n");
+    EXPECT_PREPROCESS_ERROR("#line without a number", "#line x\nl\n", "\nl\n");
+
+    nerrors = diagnostor->nerrors;
+    EXPECT_PREPROCESS("directives in a skipped group",
+        "#if 0\n#error no\n#frobnicate\n#endif\nk\n", "\nk\n");
+    TEST_COND("no errors from a skipped group", diagnostor->nerrors == nerrors);
+
+    diagnostor->resident = resident;
+}
+
+
+static
+cstring_t get_text(const char *s, size_t batch)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *tokens[8];
+    cstring_t cs;
+    size_t i, n;
+    bool end;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING, s);
+
+    pp = preprocessor_create(lexer);
+
+    cs = cstring_new_n(NULL, 64);
+
+    for (end = false; !end; ) {
+        if (batch == 0) {
+            tokens[0] = preprocessor_get(pp);
+            n = 1;
+        } else {
+            n = preprocessor_get_n(pp, tokens, batch);
+        }
+
+        for (i = 0; i < n; i++) {
+            cs = cstring_concat_pf(cs, "%s:%s ", token_as_name(tokens[i]),
+                tokens[i]->cs ? (char*) tokens[i]->cs : "");
+            end = end || tokens[i]->type == TOKEN_END;
+            token_destroy(tokens[i]);
+        }
+    }
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+
+    return cs;
+}
+
+
+static
+void test_get_n(void)
+{
+    const char *src =
+        "#define F(x) x + x\n"
+        "#define N 4\n"
+        "a F(N)\n"
+        "#if N > 3\n"
+        "b c d\n"
+        "#else\n"
+        "e\n"
+        "#endif\n"
+        "# \n"
+        "F(F(1)) f\n";
+    cstring_t one, batch;
+    size_t n;
+    bool same = true;
+
+    one = get_text(src, 0);
+
+    for (n = 1; n <= 8; n++) {
+        batch = get_text(src, n);
+        if (cstring_compare_cs(one, batch) != 0) {
+            same = false;
+        }
+        cstring_free(batch);
+    }
+
+    TEST_COND("preprocessor_get_n() is preprocessor_get() in batches", same);
+
+    cstring_free(one);
+}
+
+
+static
+void test_literal_run(void)
+{
+    const char *src =
+        "#define F(a, b) [a|b]\n"
+        "#define G(...) <__VA_ARGS__>\n"
+        "#define S(...) #__VA_ARGS__\n"
+        "#if 1, 2\n"
+        "t = { 1, 2,  3 ,0x1F, 017, 4u };\n"
+        "#endif\n"
+        "F(1, 2) G(1, 2, 3) S(4 , 5) F(6,7\n"
+        ")\n";
+    cstring_t runs, plain;
+    size_t nerrors;
+
+    runs = preprocess_runs(src, true);
+    plain = preprocess_runs(src, false);
+
+    TEST_COND("literal runs preprocess the same", cstring_compare_cs(runs, plain) == 0);
+    TEST_COND("literal runs split for macro arguments",
+        strstr((char*) runs, "[1|2] <1, 2, 3> 4 , 5 [6|7]") != NULL);
+
+    cstring_free(runs);
+    cstring_free(plain);
+
+    /* a stringified run is one argument of ONE */
+    nerrors = diagnostor->nerrors;
+    src = "#define S(...) ONE(#__VA_ARGS__)\n"
+          "#define ONE(x) x\n"
+          "#define CAT(a, b) a ## b\n"
+          "S(1, 2) S(1,2) CAT(1, 2) CAT(1,2)\n";
+    runs = preprocess_runs(src, true);
+    plain = preprocess_runs(src, false);
+    TEST_COND("literal runs under # and ##", cstring_compare_cs(runs, plain) == 0 &&
+        strstr((char*) runs, "1, 2 1,2 12 12") != NULL && diagnostor->nerrors == nerrors);
+    cstring_free(runs);
+    cstring_free(plain);
+
+    diagnostor->resident = true;
+
+    nerrors = diagnostor->nerrors;
+    runs = preprocess_runs("#define ONE(x) x\nONE(1, 2)\n", true);
+    TEST_COND("literal runs count as several arguments", diagnostor->nerrors == nerrors + 1);
+    cstring_free(runs);
+
+    nerrors = diagnostor->nerrors;
+    runs = preprocess_runs("#define F(a, b, c) a b c\nF(1, 2)\n", true);
+    TEST_COND("literal runs count the missing arguments", diagnostor->nerrors == nerrors + 1);
+    cstring_free(runs);
+
+    diagnostor->resident = false;
+}
+
+
+static
+void test_macro_profile(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    macro_profile_t *cat, *str, *n;
+    cstring_t cs, name;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING,
+        "#define N 1 2\n#define CAT(a, b) a ## b\n#define STR(x) #x\n"
+        "CAT(x, N) STR(N N) N\n#undef N\n#define N 3\nN\n");
+
+    pp = preprocessor_create(lexer);
+    preprocessor_enable_profile(pp);
+
+    cs = print_pp(pp);
+
+    name = cstring_new("CAT");
+    cat = map_find(pp->macro_profiles, name);
+    cstring_free(name);
+
+    name = cstring_new("STR");
+    str = map_find(pp->macro_profiles, name);
+    cstring_free(name);
+
+    name = cstring_new("N");
+    n = map_find(pp->macro_profiles, name);
+    cstring_free(name);
+
+    TEST_COND("profile of pastes", cat != NULL && cat->expansions == 1 &&
+        cat->arg_tokens == 2 && cat->pastes == 1 && cat->tokens == 1);
+    TEST_COND("profile of stringifies", str != NULL && str->expansions == 1 &&
+        str->arg_tokens == 2 && str->stringifies == 1);
+    TEST_COND("profile across redefinitions", n != NULL && n->expansions == 2 && n->tokens == 3);
+
+    cstring_free(cs);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+}
+
+
+static
+void test_trace(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    trace_t *trace;
+    trace_event_t *event;
+    cstring_t cs, json;
+    FILE *fp;
+    size_t n;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING, "#define A(x) x x\nA(1) 2\n");
+
+    pp = preprocessor_create(lexer);
+    trace = trace_create(3);
+    preprocessor_set_trace(pp, trace);
+
+    TEST_COND("trace opens the span of the file", trace_depth(trace) == 1);
+
+    cs = print_pp(pp);
+
+    TEST_COND("trace closes the span of the file", trace_depth(trace) == 0);
+
+    event = &array_cast_at(trace_event_t, trace->events, 0);
+    TEST_COND("trace span of the file",
+        strcmp(event->category, "source") == 0 &&
+        cstring_compare(event->name, "<string>") == 0 &&
+        event->duration != (uint64_t) -1 &&
+        cstring_compare(event->args, "\"bytes\":24,\"tokens\":6") == 0);
+
+    fp = tmpfile();
+    TEST_COND("trace_write()", trace_write(fp, &trace, 1, event->start));
+
+    json = cstring_new_n(NULL, 256);
+    fseek(fp, 0, SEEK_SET);
+    n = fread(json, 1, 255, fp);
+    json[n] = '\0';
+    fclose(fp);
+
+    TEST_COND("trace_write() writes complete events",
+        strstr((char*) json, "{\"ph\":\"X\",\"pid\":1,\"tid\":3,\"cat\":\"source\","
+                             "\"name\":\"<string>\",\"ts\":0.000,") != NULL &&
+        strstr((char*) json, "\"args\":{\"bytes\":24,\"tokens\":6}}") != NULL);
+
+    cstring_free(json);
+    cstring_free(cs);
+
+    trace_destroy(trace);
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+}
+
+
+static
+void write_file(const char *dir, const char *name, const char *text)
+{
+    char path[256];
+    FILE *fp;
 
-    diag = diag_create();
+    sprintf(path, "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    fputs(text, fp);
+    fclose(fp);
+}
 
-    reader = reader_create(diag, &option);
 
-    lexer = lexer_create(reader, &option, diag);
+static
+void remove_file(const char *dir, const char *name)
+{
+    char path[256];
 
-    lexer_push(lexer, STREAM_TYPE_FILE, "1.c");
+    sprintf(path, "%s/%s", dir, name);
+    remove(path);
+}
 
-    pp = preprocessor_create(lexer, &option, diag);
 
-    preprocessor_add_include_path(pp, "/usr/include");
+static
+void test_include(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *tok;
+    token_type_t type;
+    cstring_t cs, deps;
+    char dir[] = "/tmp/tppXXXXXX";
+    char path[256], expect[1024];
+    size_t nerrors;
+
+    if (mkdtemp(dir) == NULL) {
+        TEST_COND("mkdtemp()", false);
+        return;
+    }
+
+    sprintf(path, "%s/sys", dir);
+    mkdir(path, 0700);
+
+    write_file(dir, "main.c",
+        "#if 1\n#include \"a.h\"\n#endif\n#define S <s.h>\n#include S\n#include \"a.h\"\n"
+        "#include \"o.h\"\n#include \"o.h\"\nmain A\n");
+    write_file(dir, "a.h", "#ifndef A\n#define A a\n#include \"sys/b.h\"\n#endif\n");
+    write_file(dir, "sys/b.h", "b\n");
+    write_file(dir, "sys/s.h", "s\n");
+    write_file(dir, "o.h", "#pragma once\no\n");
+
+    sprintf(path, "%s/main.c", dir);
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_FILE, path);
+
+    pp = preprocessor_create(lexer);
+
+    sprintf(path, "%s/sys", dir);
+    preprocessor_add_include_path(pp, path);
 
-    print_pp(pp);
+    nerrors = diagnostor->nerrors;
+
+    cs = cstring_new_n(NULL, 64);
+    do {
+        tok = preprocessor_expand(pp);
+        type = tok->type;
+        if (type != TOKEN_NEWLINE && type != TOKEN_EOF && type != TOKEN_END) {
+            cs = cstring_concat_pf(cs, "%s ", token_as_text(tok));
+        }
+        token_destroy(tok);
+    } while (type != TOKEN_END);
+
+    TEST_COND("#include of quoted, computed and nested headers",
+        cstring_compare(cs, "b s o main a ") == 0);
+    TEST_COND("#pragma once", strstr((char*) cs, "o o") == NULL);
+    TEST_COND("#include within a conditional", diagnostor->nerrors == nerrors);
+
+    deps = preprocessor_dependencies(pp, "m.o", "m.c", true);
+    sprintf(expect, "m.o: m.c %s/a.h %s/sys/b.h %s/sys/s.h \\\n %s/o.h\n", dir, dir, dir, dir);
+    TEST_COND("dependencies of the included files, once each", cstring_compare(deps, expect) == 0);
+
+    cstring_free(deps);
+    cstring_free(cs);
 
     preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+
+    remove_file(dir, "main.c");
+    remove_file(dir, "a.h");
+    remove_file(dir, "sys/b.h");
+    remove_file(dir, "sys/s.h");
+    remove_file(dir, "o.h");
+    remove_file(dir, "sys");
+    remove(dir);
+}
 
+
+static
+void test_embed(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    token_t *tok;
+    token_type_t type;
+    cstring_t cs;
+    char dir[] = "/tmp/tppXXXXXX";
+    char path[256];
+    size_t nerrors, nembeds, size;
+
+    if (mkdtemp(dir) == NULL) {
+        TEST_COND("mkdtemp()", false);
+        return;
+    }
+
+    write_file(dir, "main.c",
+        "#define N 2\n"
+        "#embed \"d.bin\"\n"
+        "#embed \"d.bin\" limit(N) prefix(0,) suffix(,9) if_empty(-1)\n"
+        "#embed \"e.bin\" prefix(0,) if_empty(-1)\n"
+        "#embed \"d.bin\" __limit__(0) if_empty(7)\n");
+    write_file(dir, "d.bin", "\001\012\377");
+    write_file(dir, "e.bin", "");
+
+    sprintf(path, "%s/main.c", dir);
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_FILE, path);
+
+    pp = preprocessor_create(lexer);
+
+    nerrors = diagnostor->nerrors;
+    nembeds = 0;
+    size = 0;
+
+    cs = cstring_new_n(NULL, 64);
+    do {
+        tok = preprocessor_expand(pp);
+        type = tok->type;
+        if (type == TOKEN_PP_EMBED) {
+            nembeds++;
+            size += tok->embed->size;
+        }
+        if (type != TOKEN_NEWLINE && type != TOKEN_EOF && type != TOKEN_END) {
+            cs = token_concat_spelling(cs, tok);
+            cs = cstring_push_ch(cs, ' ');
+        }
+        token_destroy(tok);
+    } while (type != TOKEN_END);
+
+    TEST_COND("#embed with limit, prefix, suffix and if_empty",
+        cstring_compare(cs, "1,10,255 0 , 1,10 , 9 - 1 7 ") == 0);
+    TEST_COND("#embed bytes are one token each", nembeds == 2 && size == 5);
+    TEST_COND("#embed without errors", diagnostor->nerrors == nerrors);
+
+    cstring_free(cs);
+
+    preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+
+    remove_file(dir, "main.c");
+    remove_file(dir, "d.bin");
+    remove_file(dir, "e.bin");
+    remove(dir);
+}
+
+
+static
+void test_dependencies(void)
+{
+    preprocessor_t *pp;
+    lexer_t *lexer;
+    include_file_t *file;
+    cstring_t deps, target;
+    size_t i;
+
+    lexer = lexer_create();
+    pp = preprocessor_create(lexer);
+
+    file = array_push_back(pp->includes);
+    file->filename = cstring_new("my header.h");
+    file->system = false;
+
+    file = array_push_back(pp->includes);
+    file->filename = cstring_new("/usr/include/stdio.h");
+    file->system = true;
+
+    deps = preprocessor_dependencies(pp, "$out", "main.c", false);
+    TEST_COND("dependencies without system headers, escaped",
+        cstring_compare(deps, "$$out: main.c my\\ header.h\n") == 0);
+    cstring_free(deps);
+
+    deps = preprocessor_dependencies(pp,
+        "a_target_long_enough_to_wrap_the_line_of_the_dependencies.o", "main.c", true);
+    TEST_COND("dependencies wrapped",
+        cstring_compare(deps, "a_target_long_enough_to_wrap_the_line_of_the_dependencies.o: main.c \\\n"
+                              " my\\ header.h /usr/include/stdio.h\n") == 0);
+    cstring_free(deps);
+
+    /* longer than any fixed buffer once escaped */
+    target = cstring_new_n(NULL, PATH_MAX * 2);
+    for (i = 0; i < PATH_MAX; i++) {
+        target = cstring_concat_n(target, "a$", 2);
+    }
+    deps = preprocessor_dependencies(pp, target, "main.c", false);
+    TEST_COND("dependencies of a long target, not cut short",
+        cstring_length(deps) == PATH_MAX * 3 + sizeof(": \\\n main.c my\\ header.h\n") - 1 &&
+        memcmp(deps + PATH_MAX * 3 - 3, "a$$:", 4) == 0);
+    cstring_free(deps);
+    cstring_free(target);
+
+    cstring_free(array_cast_at(include_file_t, pp->includes, 0).filename);
+    cstring_free(array_cast_at(include_file_t, pp->includes, 1).filename);
+
+    preprocessor_destroy(pp);
     lexer_destroy(lexer);
-    reader_destroy(reader);
-    diag_destroy(diag);
 }
 
 
@@ -78,5 +876,21 @@ int main(void)
 }
 
     test_preprocessor();
+    test_conditional();
+    test_condition_expression();
+    test_condition_cache();
+    test_macro_filter();
+    test_shared_macro_body();
+    test_macro_arguments();
+    test_directives();
+    test_get_n();
+    test_macro_profile();
+    test_trace();
+    test_include();
+    test_embed();
+    test_literal_run();
+    test_dependencies();
+
+    TEST_REPORT();
     return 0;
 }
@@ -0,0 +1,276 @@
+
+
+#include "config.h"
+#include "unittest.h"
+#include "token.h"
+#include "reader.h"
+#include "lexer.h"
+#include "diagnostor.h"
+#include "option.h"
+#include "preprocessor.h"
+#include "printer.h"
+
+
+static
+cstring_t print_source(const char *s, bool line_markers)
+{
+    preprocessor_t *pp;
+    printer_t *printer;
+    lexer_t *lexer;
+    cstring_t cs;
+
+    lexer = lexer_create();
+
+    lexer_push(lexer, STREAM_TYPE_STRING, s);
+
+    pp = preprocessor_create(lexer);
+
+    printer = printer_create(-1);
+    printer->line_markers = line_markers;
+
+    printer_preprocess(printer, pp);
+    cs = printer_release(printer);
+
+    printer_destroy(printer);
+
+    preprocessor_destroy(pp);
+
+    lexer_destroy(lexer);
+
+    return cs;
+}
+
+
+#define EXPECT_PRINT(desc, src, expect)                         \
+    do {                                                        \
+        cstring_t cs = print_source(src, true);                 \
+        TEST_COND(desc, cstring_compare(cs, expect) == 0);      \
+        cstring_free(cs);                                       \
+    } while (false)
+
+
+static
+void test_printer(void)
+{
+    EXPECT_PRINT("line marker of the file",
+        "int a;\n",
+        "# 1 \"<string>\"\nint a;\n");
+
+    EXPECT_PRINT("directives leave blank lines",
+        "#define A 1\n\nint a = A;\n",
+        "# 3 \"<string>\"\nint a = 1;\n");
+
+    EXPECT_PRINT("short gaps are blank lines",
+        "a\n#if 0\nb\n#endif\nc\n",
+        "# 1 \"<string>\"\na\n\n\n\nc\n");
+
+    EXPECT_PRINT("#pragma on a line of its own",
+        "a\n#pragma pack(1)\nb\n",
+        "# 1 \"<string>\"\na\n#pragma pack(1)\nb\n");
+
+    EXPECT_PRINT("stringified backslashes escaped only in literals",
+        "#define STR(x) #x\nSTR(hello \"world\" \\n) STR(\"a\\\\b\" '\\'')\n",
+        "# 2 \"<string>\"\n\"hello \\\"world\\\" \\n\" \"\\\"a\\\\\\\\b\\\" '\\\\''\"\n");
+
+    EXPECT_PRINT("#line renames the file",
+        "a\n#line 40 \"x.c\"\nb\n",
+        "# 1 \"<string>\"\na\n# 40 \"x.c\"\nb\n");
+
+    EXPECT_PRINT("long gaps are line markers",
+        "a\n#if 0\n\n\n\n\n\n\n\n\n\n#endif\nc\n",
+        "# 1 \"<string>\"\na\n# 13 \"<string>\"\nc\n");
+
+    EXPECT_PRINT("spaces are kept",
+        "  a  =\tb;\n",
+        "# 1 \"<string>\"\n  a  = b;\n");
+
+    EXPECT_PRINT("expanded tokens are not pasted",
+        "#define M -\n#define E(x) x\n-M M- E(a)E(b) E(1)E(.2) E(+)= E(/)E(/)\n",
+        "# 3 \"<string>\"\n- - - - a b 1 .2 + = / /\n");
+
+    EXPECT_PRINT("literals are spelled back",
+        "s = L\"a\\\"b\\\\c\\n\" 'x' u8\"\\t\" '\\'';\n",
+        "# 1 \"<string>\"\ns = L\"a\\\"b\\\\c\\n\" 'x' u8\"\\t\" '\\'';\n");
+
+    EXPECT_PRINT("stringified literals are escaped",
+        "#define S(x) #x\nS(\"a\\n\" 'b')\n",
+        "# 2 \"<string>\"\n\"\\\"a\\\\n\\\" 'b'\"\n");
+}
+
+
+static
+void test_printer_without_line_markers(void)
+{
+    cstring_t cs;
+
+    cs = print_source("a\n#if 0\n\n\n\n\n\n\n\n\n\n#endif\nc\n", false);
+    TEST_COND("printer without line markers", cstring_compare(cs, "a\nc\n") == 0);
+    cstring_free(cs);
+}
+
+
+static
+void test_printer_large(void)
+{
+    preprocessor_t *pp;
+    printer_t *printer;
+    lexer_t *lexer;
+    cstring_t src, expect, cs;
+    FILE *fp;
+    size_t i, n;
+
+    src = cstring_new_n(NULL, 4 * PRINTER_BUFFER_SIZE);
+    for (i = 0; i < PRINTER_BUFFER_SIZE / 4; i++) {
+        src = cstring_concat_pf(src, "x%lu = y;\n", (unsigned long) i);
+    }
+
+    src = cstring_concat_n(src, "s = \"", 5);
+    for (i = 0; i < 2 * PRINTER_BUFFER_SIZE; i++) {
+        src = cstring_push_ch(src, 'a' + i % 26);
+    }
+    src = cstring_concat_n(src, "\";\n", 3);
+
+    expect = cstring_concat_n(cstring_new("# 1 \"<string>\"\n"), src, cstring_length(src));
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_STRING, src);
+    pp = preprocessor_create(lexer);
+
+    fp = tmpfile();
+    printer = printer_create(fileno(fp));
+
+    TEST_COND("printer_preprocess() to a file", printer_preprocess(printer, pp));
+    TEST_COND("printer buffer stays bounded", printer->size == PRINTER_BUFFER_SIZE);
+
+    printer_destroy(printer);
+
+    cs = cstring_new_n(NULL, cstring_length(expect) + 1);
+    fseek(fp, 0, SEEK_SET);
+    n = fread(cs, 1, cstring_length(expect) + 1, fp);
+    fclose(fp);
+
+    TEST_COND("printer output through write and writev",
+        n == cstring_length(expect) && memcmp(cs, expect, n) == 0);
+
+    cstring_free(cs);
+    cstring_free(expect);
+    cstring_free(src);
+
+    preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+}
+
+
+static
+void write_file(const char *dir, const char *name, const char *text)
+{
+    char path[256];
+    FILE *fp;
+
+    sprintf(path, "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    fputs(text, fp);
+    fclose(fp);
+}
+
+
+static
+void remove_file(const char *dir, const char *name)
+{
+    char path[256];
+
+    sprintf(path, "%s/%s", dir, name);
+    remove(path);
+}
+
+
+static
+void test_printer_includes(void)
+{
+    char dir[] = "/tmp/tppXXXXXX";
+    char path[256];
+    preprocessor_t *pp;
+    printer_t *printer;
+    lexer_t *lexer;
+    cstring_t cs, expect;
+
+    if (mkdtemp(dir) == NULL) {
+        TEST_COND("mkdtemp()", false);
+        return;
+    }
+
+    sprintf(path, "%s/sys", dir);
+    mkdir(path, 0700);
+
+    write_file(dir, "main.c",
+        "int a;\n#include \"b.h\"\n#include <s.h>\nint z;\n#include \"e.h\"\nint y;\n");
+    write_file(dir, "b.h", "int b;\n#include \"c.h\"\nint b2;\n");
+    write_file(dir, "c.h", "int c;\n");
+    write_file(dir, "e.h", "");
+    write_file(dir, "sys/s.h", "int s;\n");
+
+    sprintf(path, "%s/main.c", dir);
+
+    lexer = lexer_create();
+    lexer_push(lexer, STREAM_TYPE_FILE, path);
+
+    pp = preprocessor_create(lexer);
+
+    /* searched as a predefined path, its headers are system headers */
+    sprintf(path, "%s/sys", dir);
+    preprocessor_add_include_path(pp, path);
+    pp->system_include_paths = array_length(pp->std_include_paths);
+
+    printer = printer_create(-1);
+    printer_preprocess(printer, pp);
+    cs = printer_release(printer);
+    printer_destroy(printer);
+
+    expect = cstring_concat_pf(cstring_new_n(NULL, 256),
+        "# 1 \"%s/main.c\"\nint a;\n"
+        "# 1 \"%s/b.h\" 1\nint b;\n"
+        "# 1 \"%s/c.h\" 1\nint c;\n"
+        "# 3 \"%s/b.h\" 2\nint b2;\n"
+        "# 3 \"%s/main.c\" 2\n"
+        "# 1 \"%s/sys/s.h\" 1 3\nint s;\n"
+        "# 4 \"%s/main.c\" 2\nint z;\n"
+        "# 1 \"%s/e.h\" 1\n"
+        "# 6 \"%s/main.c\" 2\nint y;\n",
+        dir, dir, dir, dir, dir, dir, dir, dir, dir);
+
+    TEST_COND("line markers flag the includes", cstring_compare_cs(cs, expect) == 0);
+
+    cstring_free(expect);
+    cstring_free(cs);
+
+    preprocessor_destroy(pp);
+    lexer_destroy(lexer);
+
+    remove_file(dir, "main.c");
+    remove_file(dir, "b.h");
+    remove_file(dir, "c.h");
+    remove_file(dir, "e.h");
+    remove_file(dir, "sys/s.h");
+
+    sprintf(path, "%s/sys", dir);
+    rmdir(path);
+    rmdir(dir);
+}
+
+
+int main(void)
+{
+{
+    #ifdef WIN32
+    _CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
+    #endif
+}
+
+    test_printer();
+    test_printer_without_line_markers();
+    test_printer_large();
+    test_printer_includes();
+
+    TEST_REPORT();
+    return 0;
+}
@@ -1,13 +1,17 @@
 
 
 #include "config.h"
+#include "cspool.h"
 #include "reader.h"
+#include "fcache.h"
+#include "option.h"
 #include "unittest.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <utime.h>
 
 
 static void test_reader_case1()
@@ -120,6 +124,153 @@ static void test_reader_case2()
 }
 
 
+static cstring_t read_file(reader_t *reader, const char *fn)
+{
+    cstring_t cs;
+    int ch;
+
+    cs = cstring_new_n(NULL, 64);
+
+    reader_push(reader, STREAM_TYPE_FILE, fn);
+    while ((ch = reader_get(reader)) != EOF) {
+        cs = cstring_push_ch(cs, ch);
+    }
+    reader_pop(reader);
+
+    return cs;
+}
+
+
+static void write_file(const char *fn, const char *s)
+{
+    FILE *fp = fopen(fn, "wb");
+    fputs(s, fp);
+    fclose(fp);
+}
+
+
+static void test_reader_fcache()
+{
+    char dir[] = "/tmp/tppXXXXXX";
+    struct utimbuf times;
+    struct stat st;
+    cspool_t *csp;
+    fcache_t *cache;
+    reader_t *reader;
+    cstring_t fn, cs, key;
+    bool system;
+
+    if (mkdtemp(dir) == NULL) {
+        return;
+    }
+
+    fn = cstring_concat_pf(cstring_new(dir), "/a.h");
+    write_file(fn, "int a;\n");
+
+    csp = cspool_create();
+    cache = fcache_create(csp);
+
+    reader = reader_create_csp(csp);
+    reader_set_fcache(reader, cache);
+
+    cs = read_file(reader, fn);
+    TEST_COND("fcache: first read", cstring_compare(cs, "int a;\n") == 0);
+    cstring_free(cs);
+
+    stat(fn, &st);
+    TEST_COND("fcache: file cached", fcache_find_file(cache, cspool_push(csp, fn), &st) != NULL);
+
+    cs = read_file(reader, fn);
+    TEST_COND("fcache: read from the cache", cstring_compare(cs, "int a;\n") == 0);
+    cstring_free(cs);
+
+    write_file(fn, "int ab;\n");
+    stat(fn, &st);
+    TEST_COND("fcache: changed file missed", fcache_find_file(cache, cspool_push(csp, fn), &st) == NULL);
+
+    cs = read_file(reader, fn);
+    TEST_COND("fcache: changed file reread", cstring_compare(cs, "int ab;\n") == 0);
+    cstring_free(cs);
+
+    /* within the same second, only the nanoseconds tell */
+    write_file(fn, "int ac;\n");
+    cs = read_file(reader, fn);
+    TEST_COND("fcache: file of the same size reread", cstring_compare(cs, "int ac;\n") == 0);
+    cstring_free(cs);
+
+    key = cstring_new("\"a.h\"");
+    fcache_add_include(cache, key, fn, true);
+    fcache_watch(cache, fn);
+
+    TEST_COND("fcache: include found",
+        cstring_compare_cs(fcache_find_include(cache, key, &system), fn) == 0 && system);
+    TEST_COND("fcache: unchanged directory", fcache_revalidate(cache));
+    TEST_COND("fcache: include kept", fcache_find_include(cache, key, &system) != NULL);
+
+    stat(dir, &st);
+    times.actime = st.st_atime;
+    times.modtime = st.st_mtime + 10;
+    utime(dir, &times);
+
+    TEST_COND("fcache: changed directory", !fcache_revalidate(cache));
+    TEST_COND("fcache: include dropped", fcache_find_include(cache, key, &system) == NULL);
+
+    cstring_free(key);
+
+    reader_destroy(reader);
+    fcache_destroy(cache);
+    cspool_destroy(csp);
+
+    remove(fn);
+    rmdir(dir);
+    cstring_free(fn);
+}
+
+
+static void test_reader_encoding()
+{
+    char dir[] = "/tmp/tppXXXXXX";
+    reader_t *reader;
+    cstring_t fn, cs;
+
+    if (mkdtemp(dir) == NULL) {
+        return;
+    }
+
+    fn = cstring_concat_pf(cstring_new(dir), "/a.c");
+    reader = reader_create();
+
+    write_file(fn, "\xEF\xBB\xBFint a;\n");
+    reader_push(reader, STREAM_TYPE_FILE, fn);
+    TEST_COND("encoding: BOM skipped", reader_get(reader) == 'i' && reader_column(reader) == 2);
+    TEST_COND("encoding: ASCII", reader_is_ascii(reader));
+    reader_pop(reader);
+
+    write_file(fn, "\xEF\xBB");
+    cs = read_file(reader, fn);
+    TEST_COND("encoding: partial BOM kept", cstring_length(cs) == 3 && cs[0] == 0xEF);
+    cstring_free(cs);
+
+    write_file(fn, "int caf\xC3\xA9;\n");
+    reader_push(reader, STREAM_TYPE_FILE, fn);
+    TEST_COND("encoding: UTF-8", !reader_is_ascii(reader));
+    reader_pop(reader);
+
+    write_file(fn, "\xEF\xBB\xBF" "a\n\xC3\xA9\xFFz\n");
+    option->w_invalid_utf8 = true;
+    cs = read_file(reader, fn);
+    option->w_invalid_utf8 = false;
+    TEST_COND("encoding: invalid UTF-8 kept", cstring_length(cs) == 7 && cs[4] == 0xFF);
+    cstring_free(cs);
+
+    reader_destroy(reader);
+
+    remove(fn);
+    rmdir(dir);
+    cstring_free(fn);
+}
+
+
 int main(void)
 {
 #ifdef WIN32
@@ -128,6 +279,8 @@ int main(void)
 
     test_reader_case1();
     test_reader_case2();
+    test_reader_fcache();
+    test_reader_encoding();
     TEST_REPORT();
     return 0;
 }
@@ -0,0 +1,110 @@
+
+
+#include "unittest.h"
+#include "vec.h"
+
+
+VEC_DEFINE(int_vec, int)
+VEC_DEFINE_SMALL(small_vec, int, 4)
+
+
+static void test_vec(void)
+{
+    int_vec_t v;
+    int *a;
+    int i;
+
+    int_vec_init(&v);
+
+    TEST_COND("int_vec_is_empty()", int_vec_is_empty(&v));
+    TEST_COND("int_vec_length()", int_vec_length(&v) == 0);
+    TEST_COND("int_vec_init()", v.data == NULL && v.capacity == 0);
+
+    for (i = 0; i < 100; i++) {
+        int_vec_push(&v, i);
+    }
+
+    TEST_COND("int_vec_length()", int_vec_length(&v) == 100);
+    TEST_COND("int_vec_push()", v.capacity == 128);
+    TEST_COND("int_vec_front()", int_vec_front(&v) == 0);
+    TEST_COND("int_vec_back()", int_vec_back(&v) == 99);
+
+    for (i = 0; i < 100; i++) {
+        if (int_vec_at(&v, i) != i) {
+            break;
+        }
+    }
+    TEST_COND("int_vec_at()", i == 100);
+
+    vec_foreach(&v, a, i) {
+        if (a[i] != i) {
+            break;
+        }
+    }
+    TEST_COND("vec_foreach()", i == 100);
+
+    TEST_COND("int_vec_pop()", int_vec_pop(&v) == 99);
+    TEST_COND("int_vec_pop()", int_vec_length(&v) == 99);
+
+    int_vec_reserve(&v, 1000);
+    TEST_COND("int_vec_reserve()", v.capacity == 1000 && int_vec_back(&v) == 98);
+
+    int_vec_reserve(&v, 10);
+    TEST_COND("int_vec_reserve()", v.capacity == 1000);
+
+    int_vec_clear(&v);
+    TEST_COND("int_vec_clear()", int_vec_is_empty(&v) && v.capacity == 1000);
+
+    int_vec_free(&v);
+    TEST_COND("int_vec_free()", v.data == NULL && v.length == 0);
+}
+
+
+static void test_small_vec(void)
+{
+    small_vec_t v;
+    int i;
+
+    small_vec_init(&v);
+
+    TEST_COND("small_vec_init()", v.data == v.small && v.capacity == 4);
+
+    for (i = 0; i < 4; i++) {
+        small_vec_push(&v, i);
+    }
+    TEST_COND("small_vec_push()", v.data == v.small && small_vec_back(&v) == 3);
+
+    small_vec_push(&v, 4);
+    TEST_COND("small_vec_push()", v.data != v.small && v.capacity == 8);
+
+    for (i = 0; i < 5; i++) {
+        if (small_vec_at(&v, i) != i) {
+            break;
+        }
+    }
+    TEST_COND("small_vec_at()", i == 5);
+
+    small_vec_free(&v);
+    TEST_COND("small_vec_free()", v.data == v.small && v.length == 0);
+
+    small_vec_reserve(&v, 2);
+    TEST_COND("small_vec_reserve()", v.data == v.small);
+
+    small_vec_reserve(&v, 20);
+    TEST_COND("small_vec_reserve()", v.data != v.small && v.capacity == 20);
+
+    small_vec_free(&v);
+}
+
+
+int main(void)
+{
+#ifdef WIN32
+    _CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
+#endif
+
+    test_vec();
+    test_small_vec();
+    TEST_REPORT();
+    return 0;
+}
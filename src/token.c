@@ -111,6 +111,8 @@ token_t* token_create(token_type_t type, cstring_t cs, token_location_t *locatio
     token->begin_of_line = false;
     token->spaces = 0;
     token->is_vararg = false;
+    token->origin = NULL;
+    token->embed = NULL;
 
     return token;
 }
@@ -122,23 +124,33 @@ void token_destroy(token_t *token)
 
 //    source_location_destroy(token->loc);
 
-    if (token->hideset != NULL) {
-        set_destroy(token->hideset);
-    }
+    /* hidesets are interned and owned by the preprocessor. */
 
-    if (token->cs) {
+    if (token->cs && token->origin == NULL) {
         cstring_free(token->cs);
     }
 
+    if (token->type == TOKEN_LITERAL_RUN && token->origin == NULL) {
+        array_destroy(token->run);
+    }
+
     pfree(token);
 }
 
 
 void token_init(token_t *token)
 {
-    cstring_clear(token->cs);
+    if (token->type == TOKEN_LITERAL_RUN && token->origin == NULL) {
+        array_destroy(token->run);
+    }
+
+    /* both name the same storage, cleared as whichever the token used */
+    token->run = NULL;
+    token->embed = NULL;
 
-    if (token->hideset != NULL) set_destroy(token->hideset);
+    token_unshare(token);
+
+    cstring_clear(token->cs);
 
     token->type = TOKEN_UNKNOWN;
 
@@ -154,24 +166,89 @@ void token_init(token_t *token)
 }
 
 
-token_t* token_copy(token_t *tok)
+token_t* token_dup(token_t *tok)
 {
     token_t* ret;
-    cstring_t cs = NULL;
+
+    if (tok->origin != NULL) {
+        return token_share(tok);
+    }
 
     ret = pmalloc(sizeof(token_t));
 
+    *ret = *tok;
+    ret->cs = tok->cs ? cstring_dup(tok->cs) : NULL;
+
+    if (tok->type == TOKEN_LITERAL_RUN) {
+        ret->run = array_create_n(sizeof(unsigned long long), array_length(tok->run));
+        array_extend(ret->run, tok->run);
+    }
+
+    return ret;
+}
+
+
+/**
+ * Creates a lightweight token that shares the spelling of a macro body
+ * token. The origin must outlive the reference, the preprocessor keeps
+ * every macro body alive until it is destroyed.
+ **/
+token_t* token_ref(token_t *origin, token_location_t *location)
+{
+    token_t *ret;
+
+    if (origin->origin != NULL) {
+        origin = origin->origin;
+    }
+
+    ret = pmalloc(sizeof(token_t));
+
+    ret->type = origin->type;
+    ret->cs = origin->cs;
+    ret->location = location ? *location : origin->location;
+    ret->hideset = NULL;
+    ret->begin_of_line = false;
+    ret->spaces = origin->spaces;
+    ret->is_vararg = origin->is_vararg;
+    ret->origin = origin;
+    ret->embed = origin->embed;
+
+    return ret;
+}
+
+
+/**
+ * Creates a reference token with the type, hideset and spacing of the
+ * token, which must outlive it unless it is itself a reference.
+ **/
+token_t* token_share(token_t *tok)
+{
+    token_t *ret;
+
+    ret = token_ref(tok, &tok->location);
     ret->type = tok->type;
-    ret->hideset = tok->hideset ? set_dup(tok->hideset) : NULL;// set_dup(tok->hideset);
+    ret->hideset = tok->hideset;
     ret->begin_of_line = tok->begin_of_line;
     ret->spaces = tok->spaces;
-    ret->cs = cstring_dup(tok->cs);
-    ret->is_vararg = false;
+    ret->is_vararg = tok->is_vararg;
 
     return ret;
 }
 
 
+/**
+ * Gives a reference token its own spelling, must be called before
+ * the spelling of a token from a macro expansion is modified.
+ **/
+void token_unshare(token_t *token)
+{
+    if (token->origin != NULL) {
+        token->cs = token->cs ? cstring_dup(token->cs) : NULL;
+        token->origin = NULL;
+    }
+}
+
+
 const char* token_as_name(token_t *token)
 {
     size_t i, length;
@@ -206,6 +283,203 @@ const char* token_as_text(token_t *token)
 }
 
 
+static inline
+bool __token_is_literal__(token_type_t type)
+{
+    return TOKEN_CONSTANT_STRING <= type && type <= TOKEN_CONSTANT_UTF8CHAR;
+}
+
+
+static inline
+const char* __token_literal_prefix__(token_type_t type)
+{
+    switch (type) {
+    case TOKEN_CONSTANT_WSTRING:
+    case TOKEN_CONSTANT_WCHAR:
+        return "L";
+    case TOKEN_CONSTANT_STRING16:
+    case TOKEN_CONSTANT_CHAR16:
+        return "u";
+    case TOKEN_CONSTANT_STRING32:
+    case TOKEN_CONSTANT_CHAR32:
+        return "U";
+    case TOKEN_CONSTANT_UTF8STRING:
+    case TOKEN_CONSTANT_UTF8CHAR:
+        return "u8";
+    default:
+        return "";
+    }
+}
+
+
+/**
+ * An upper bound of the length of the spelling of the token, the value of
+ * a literal may need up to four characters per byte once escaped.
+ **/
+size_t token_spelling_size(token_t *token)
+{
+    const char *s;
+
+    if (token->type == TOKEN_PP_EMBED) {
+        return token->embed->size * 4;
+    }
+
+    if (__token_is_literal__(token->type)) {
+        return 4 + (token->cs ? cstring_length(token->cs) * 4 : 0);
+    }
+
+    s = token_as_text(token);
+    return s ? strlen(s) : 0;
+}
+
+
+/**
+ * Writes the spelling of the token as it would appear in a source file,
+ * literals are lexed to their value and are quoted and escaped back here,
+ * the bytes of an #embed are spelled as a list of integers.
+ * Returns the length, at most token_spelling_size().
+ **/
+size_t token_spell(token_t *token, unsigned char *buf)
+{
+    const unsigned char *p, *pe;
+    const char *s;
+    unsigned char *q, quote;
+    size_t n;
+
+    if (token->type == TOKEN_PP_EMBED) {
+        q = buf;
+        p = token->embed->data;
+        pe = p + token->embed->size;
+
+        for (; p < pe; p++) {
+            if (*p >= 100) {
+                *q++ = '0' + *p / 100;
+            }
+            if (*p >= 10) {
+                *q++ = '0' + *p / 10 % 10;
+            }
+            *q++ = '0' + *p % 10;
+            *q++ = ',';
+        }
+
+        return (size_t) (q - buf) - (q != buf);
+    }
+
+    if (!__token_is_literal__(token->type)) {
+        s = token_as_text(token);
+        n = s ? strlen(s) : 0;
+        memcpy(buf, s, n);
+        return n;
+    }
+
+    q = buf;
+
+    for (s = __token_literal_prefix__(token->type); *s; s++) {
+        *q++ = *s;
+    }
+
+    quote = token->type >= TOKEN_CONSTANT_CHAR ? '\'' : '"';
+    *q++ = quote;
+
+    p = token->cs;
+    pe = p + (p ? cstring_length(token->cs) : 0);
+
+    for (; p < pe; p++) {
+        switch (*p) {
+        case '\\':
+            *q++ = '\\';
+            *q++ = '\\';
+            break;
+        case '\n':
+            *q++ = '\\';
+            *q++ = 'n';
+            break;
+        case '\t':
+            *q++ = '\\';
+            *q++ = 't';
+            break;
+        default:
+            if (*p == quote) {
+                *q++ = '\\';
+                *q++ = quote;
+            } else if (*p < 0x20 || *p == 0x7f) {
+                *q++ = '\\';
+                *q++ = '0' + ((*p >> 6) & 7);
+                *q++ = '0' + ((*p >> 3) & 7);
+                *q++ = '0' + (*p & 7);
+            } else {
+                *q++ = *p;
+            }
+            break;
+        }
+    }
+
+    *q++ = quote;
+
+    return (size_t) (q - buf);
+}
+
+
+cstring_t token_concat_spelling(cstring_t cs, token_t *token)
+{
+    unsigned char buf[256], *p;
+    size_t size, n;
+
+    size = token_spelling_size(token);
+    p = size <= sizeof(buf) ? buf : pmalloc(size);
+
+    n = token_spell(token, p);
+    cs = cstring_concat_n(cs, p, n);
+
+    if (p != buf) {
+        pfree(p);
+    }
+
+    return cs;
+}
+
+
+/**
+ * Maps the spelling of a punctuator, digraphs included, to its token type.
+ * Returns TOKEN_UNKNOWN if the whole spelling is not exactly one punctuator.
+ **/
+token_type_t token_lookup_punctuator(const char *s, size_t n)
+{
+    static const struct {
+        const char *spelling;
+        token_type_t type;
+    } digraphs[] = {
+        {"<:", TOKEN_L_SQUARE}, {":>", TOKEN_R_SQUARE},
+        {"<%", TOKEN_L_BRACE},  {"%>", TOKEN_R_BRACE},
+        {"%:", TOKEN_HASH},     {"%:%:", TOKEN_HASHHASH},
+    };
+    size_t i, length;
+
+    length = sizeof(__token_dictionary__) / sizeof(struct token_dictionary_s);
+
+    for (i = 0; i < length; i++) {
+        const char *name = __token_dictionary__[i].name;
+
+        if (__token_dictionary__[i].type < TOKEN_L_SQUARE ||
+            __token_dictionary__[i].type > TOKEN_HASHHASH) {
+            continue;
+        }
+
+        if (strlen(name) == n && memcmp(name, s, n) == 0) {
+            return __token_dictionary__[i].type;
+        }
+    }
+
+    for (i = 0; i < sizeof(digraphs) / sizeof(digraphs[0]); i++) {
+        if (strlen(digraphs[i].spelling) == n && memcmp(digraphs[i].spelling, s, n) == 0) {
+            return digraphs[i].type;
+        }
+    }
+
+    return TOKEN_UNKNOWN;
+}
+
+
 void token_add_linenote_caution(token_t *token, size_t start, size_t length)
 {
     token->location.linenote_caution.start = start;
@@ -223,7 +497,6 @@ cstring_t tokens_to_text(array_t *tokens)
 
     array_foreach(tokens, toks, i) {
         int spaces;
-        const char *s;
 
         if (toks[i]->type == TOKEN_UNKNOWN ||
                 toks[i]->type == TOKEN_EOF ||
@@ -237,8 +510,7 @@ cstring_t tokens_to_text(array_t *tokens)
             cs = cstring_push_ch(cs, ' ');
         }
 
-        s = token_as_text(toks[i]);
-        cs = cstring_concat_n(cs, s, strlen(s));
+        cs = token_concat_spelling(cs, toks[i]);
     }
 
     return cs;
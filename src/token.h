@@ -6,6 +6,7 @@
 
 #include "config.h"
 #include "array.h"
+#include "vec.h"
 #include "set.h"
 #include "cstring.h"
 #include "encoding.h"
@@ -87,6 +88,8 @@ typedef enum token_type_e {
     TOKEN_CONSTANT_UTF8CHAR,                /* u8'' */
 
     TOKEN_PP_HEADER_NAME,                   /* pp header name */
+    TOKEN_PP_EMBED,                         /* the bytes of an #embed */
+    TOKEN_LITERAL_RUN,                      /* 1, 2, 3 */
 
     TOKEN_CONST,
     TOKEN_RESTRICT,
@@ -174,6 +177,13 @@ typedef struct linenote_caution_s {
 } linenote_caution_t;
 
 
+/* the bytes of a TOKEN_PP_EMBED, a range of a file mapped by the preprocessor */
+typedef struct token_embed_s {
+    const unsigned char *data;
+    size_t size;
+} token_embed_t;
+
+
 typedef struct token_location_s {
     cstring_t filename;
     linenote_t linenote;
@@ -194,15 +204,40 @@ typedef struct token_s {
     bool begin_of_line;
     size_t spaces;
     bool is_vararg;
+
+    /* macro body token whose cs is borrowed, see token_ref() */
+    struct token_s *origin;
+
+    /**
+     * The bytes of a TOKEN_PP_EMBED, owned by the preprocessor, or the
+     * values of a TOKEN_LITERAL_RUN as unsigned long long, owned by the
+     * token. NULL for any other token. The two share their storage, the
+     * type of the token tells which one is set.
+     **/
+    union {
+        const token_embed_t *embed;
+        array_t *run;
+    };
 } token_t;
 
 
+/* the token pointers of the expansions and of the pushed back tokens */
+VEC_DEFINE_SMALL(token_vec, token_t*, 8)
+
+
 token_t* token_create(token_type_t type, cstring_t cs, token_location_t *location);
 void token_init(token_t *token);
 void token_destroy(token_t *token);
-token_t* token_copy(token_t *token);
+token_t* token_dup(token_t *token);
+token_t* token_ref(token_t *origin, token_location_t *location);
+token_t* token_share(token_t *token);
+void token_unshare(token_t *token);
 const char* token_as_name(token_t *token);
 const char* token_as_text(token_t *token);
+size_t token_spelling_size(token_t *token);
+size_t token_spell(token_t *token, unsigned char *buf);
+cstring_t token_concat_spelling(cstring_t cs, token_t *token);
+token_type_t token_lookup_punctuator(const char *s, size_t n);
 void token_add_linenote_caution(token_t *token, size_t start, size_t length);
 
 cstring_t tokens_to_text(array_t *tokens);
@@ -0,0 +1,182 @@
+
+
+#include "config.h"
+#include "pmalloc.h"
+#include "array.h"
+#include "cstring.h"
+#include "utils.h"
+#include "trace.h"
+
+
+static trace_event_t* __trace_push__(trace_t *trace, const char *category, const char *name);
+static void __trace_write_string__(FILE *fp, const unsigned char *s);
+
+
+trace_t* trace_create(size_t tid)
+{
+    trace_t *trace;
+
+    trace = pmalloc(sizeof(trace_t));
+
+    trace->tid = tid;
+    trace->events = array_create_n(sizeof(trace_event_t), 64);
+    trace->open = array_create_n(sizeof(size_t), 8);
+
+    return trace;
+}
+
+
+void trace_destroy(trace_t *trace)
+{
+    trace_event_t *events;
+    size_t i;
+
+    assert(trace != NULL);
+
+    array_foreach(trace->events, events, i) {
+        cstring_free(events[i].name);
+        if (events[i].args != NULL) {
+            cstring_free(events[i].args);
+        }
+    }
+
+    array_destroy(trace->events);
+    array_destroy(trace->open);
+    pfree(trace);
+}
+
+
+void trace_begin(trace_t *trace, const char *category, const char *name)
+{
+    trace_event_t *event;
+
+    event = __trace_push__(trace, category, name);
+    event->start = NANOTIME();
+
+    array_cast_append(size_t, trace->open, array_length(trace->events) - 1);
+}
+
+
+/**
+ * Ends the innermost span, fmt gives the members of its args object,
+ * such as "\"tokens\": %lu", or is NULL.
+ **/
+void trace_end(trace_t *trace, const char *fmt, ...)
+{
+    trace_event_t *event;
+    va_list ap;
+    size_t index;
+
+    assert(!array_is_empty(trace->open));
+
+    index = array_cast_back(size_t, trace->open);
+    array_pop_back(trace->open);
+
+    event = &array_cast_at(trace_event_t, trace->events, index);
+    event->duration = NANOTIME() - event->start;
+
+    if (fmt != NULL) {
+        va_start(ap, fmt);
+        event->args = cstring_concat_vpf(cstring_new_n(NULL, 32), fmt, ap);
+        va_end(ap);
+    }
+}
+
+
+/* a span measured by the caller */
+void trace_complete(trace_t *trace, const char *category, const char *name,
+                    uint64_t start, uint64_t duration, const char *fmt, ...)
+{
+    trace_event_t *event;
+    va_list ap;
+
+    event = __trace_push__(trace, category, name);
+    event->start = start;
+    event->duration = duration;
+
+    if (fmt != NULL) {
+        va_start(ap, fmt);
+        event->args = cstring_concat_vpf(cstring_new_n(NULL, 32), fmt, ap);
+        va_end(ap);
+    }
+}
+
+
+size_t trace_depth(trace_t *trace)
+{
+    return array_length(trace->open);
+}
+
+
+/**
+ * Writes the spans of the traces as one JSON document, with timestamps
+ * relative to origin. Spans still open are left out.
+ **/
+bool trace_write(FILE *fp, trace_t **traces, size_t n, uint64_t origin)
+{
+    trace_event_t *events;
+    bool first = true;
+    size_t i, j;
+
+    fprintf(fp, "{\"traceEvents\":[");
+
+    for (i = 0; i < n; i++) {
+        if (traces[i] == NULL) {
+            continue;
+        }
+
+        array_foreach(traces[i]->events, events, j) {
+            if (events[j].duration == (uint64_t) -1) {
+                continue;
+            }
+
+            fprintf(fp, "%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"cat\":\"%s\",\"name\":",
+                    first ? "" : ",", (unsigned long) traces[i]->tid, events[j].category);
+            __trace_write_string__(fp, events[j].name);
+            fprintf(fp, ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+                    (events[j].start - origin) / 1e3, events[j].duration / 1e3,
+                    events[j].args != NULL ? (char*) events[j].args : "");
+            first = false;
+        }
+    }
+
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    return ferror(fp) == 0;
+}
+
+
+static
+trace_event_t* __trace_push__(trace_t *trace, const char *category, const char *name)
+{
+    trace_event_t *event;
+
+    event = array_push_back(trace->events);
+    event->name = cstring_new(name);
+    event->category = category;
+    event->start = 0;
+    event->duration = (uint64_t) -1;
+    event->args = NULL;
+
+    return event;
+}
+
+
+static
+void __trace_write_string__(FILE *fp, const unsigned char *s)
+{
+    fputc('"', fp);
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        } else if (*s < 0x20) {
+            fprintf(fp, "\\u%04x", *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
@@ -0,0 +1,44 @@
+
+
+#ifndef __TRACE__H__
+#define __TRACE__H__
+
+
+#include "config.h"
+#include "cstring.h"
+
+
+typedef struct array_s array_t;
+
+
+typedef struct trace_event_s {
+    cstring_t name;
+    const char *category;
+    uint64_t start;                 /* nanoseconds */
+    uint64_t duration;
+    cstring_t args;                 /* the members of the args object, or NULL */
+} trace_event_t;
+
+
+/**
+ * The spans of one thread, written out as complete events of the Chrome
+ * trace event format, readable by chrome://tracing and Perfetto.
+ **/
+typedef struct trace_s {
+    size_t tid;
+    array_t *events;
+    array_t *open;                  /* indexes of the spans not ended yet */
+} trace_t;
+
+
+trace_t* trace_create(size_t tid);
+void trace_destroy(trace_t *trace);
+void trace_begin(trace_t *trace, const char *category, const char *name);
+void trace_end(trace_t *trace, const char *fmt, ...);
+void trace_complete(trace_t *trace, const char *category, const char *name,
+                    uint64_t start, uint64_t duration, const char *fmt, ...);
+size_t trace_depth(trace_t *trace);
+bool trace_write(FILE *fp, trace_t **traces, size_t n, uint64_t origin);
+
+
+#endif
@@ -71,4 +71,18 @@ int ISIDNUM(int ch)
 }
 
 
+/* a monotonic clock in nanoseconds, for the profiles */
+static inline
+uint64_t NANOTIME(void)
+{
+#if defined(UNIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#else
+    return (uint64_t) clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+
 #endif
@@ -0,0 +1,184 @@
+
+
+#ifndef __VEC__H__
+#define __VEC__H__
+
+
+#include "config.h"
+#include "pmalloc.h"
+
+
+/* the capacity of the first allocation of a vector without a small buffer */
+#ifndef VEC_MIN_CAPACITY
+#define VEC_MIN_CAPACITY        8
+#endif
+
+
+/* the functions of a vector are there whether or not a file uses them */
+#if defined(__GNUC__)
+#   define __VEC_UNUSED__       __attribute__((unused))
+#else
+#   define __VEC_UNUSED__
+#endif
+
+
+/**
+ * A vector of one element type, for the hot paths where array_t costs a
+ * multiplication by the element size and a call on every access. The
+ * element type is known to the compiler, push, pop and at are inline and
+ * the storage grows geometrically.
+ *
+ *     VEC_DEFINE(int_vec, int)
+ *
+ * defines int_vec_t along with int_vec_init(), int_vec_free(),
+ * int_vec_reserve(), int_vec_push(), int_vec_pop(), int_vec_at(),
+ * int_vec_front(), int_vec_back(), int_vec_length(), int_vec_is_empty()
+ * and int_vec_clear(). VEC_DEFINE_SMALL(name, type, n) also keeps the
+ * first n elements in the vector itself, so a short vector on the stack
+ * is never allocated; such a vector must not be copied or moved once
+ * initialized.
+ **/
+#define VEC_DEFINE(name, type)                                              \
+    typedef struct name##_s {                                               \
+        type   *data;                                                       \
+        size_t  length;                                                     \
+        size_t  capacity;                                                   \
+    } name##_t;                                                             \
+                                                                            \
+    __VEC_FUNCTIONS__(name, type, NULL, 0)
+
+
+#define VEC_DEFINE_SMALL(name, type, n)                                     \
+    typedef struct name##_s {                                               \
+        type   *data;                                                       \
+        size_t  length;                                                     \
+        size_t  capacity;                                                   \
+        type    small[n];                                                   \
+    } name##_t;                                                             \
+                                                                            \
+    __VEC_FUNCTIONS__(name, type, v->small, n)
+
+
+#define vec_foreach(v, base, index)                                         \
+    for ((base) = (v)->data, (index) = 0;                                   \
+         (size_t)(index) < (v)->length;                                     \
+         (index)++)
+
+
+#define __VEC_FUNCTIONS__(name, type, small, nsmall)                        \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void name##_init(name##_t *v)                                               \
+{                                                                           \
+    v->data = small;                                                        \
+    v->length = 0;                                                          \
+    v->capacity = nsmall;                                                   \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void name##_free(name##_t *v)                                               \
+{                                                                           \
+    if (v->data != NULL && v->data != (type*) small) {                      \
+        pfree(v->data);                                                     \
+    }                                                                       \
+    name##_init(v);                                                         \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void __##name##_grow__(name##_t *v, size_t n)                               \
+{                                                                           \
+    size_t capacity;                                                        \
+    type *data;                                                             \
+                                                                            \
+    capacity = v->capacity != 0 ? v->capacity * 2 : VEC_MIN_CAPACITY;       \
+    if (capacity < n) {                                                     \
+        capacity = n;                                                       \
+    }                                                                       \
+                                                                            \
+    if (v->data == NULL || v->data != (type*) small) {                      \
+        data = prealloc(v->data, sizeof(type) * capacity);                  \
+    } else {                                                                \
+        data = pmalloc(sizeof(type) * capacity);                            \
+        memcpy(data, v->data, sizeof(type) * v->length);                    \
+    }                                                                       \
+                                                                            \
+    v->data = data;                                                         \
+    v->capacity = capacity;                                                 \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void name##_reserve(name##_t *v, size_t n)                                  \
+{                                                                           \
+    if (n > v->capacity) {                                                  \
+        __##name##_grow__(v, n);                                            \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void name##_push(name##_t *v, type x)                                       \
+{                                                                           \
+    if (v->length == v->capacity) {                                         \
+        __##name##_grow__(v, v->length + 1);                                \
+    }                                                                       \
+    v->data[v->length++] = x;                                               \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+type name##_pop(name##_t *v)                                                \
+{                                                                           \
+    assert(v->length > 0);                                                  \
+    return v->data[--v->length];                                            \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+type name##_at(name##_t *v, size_t i)                                       \
+{                                                                           \
+    assert(i < v->length);                                                  \
+    return v->data[i];                                                      \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+type name##_front(name##_t *v)                                              \
+{                                                                           \
+    assert(v->length > 0);                                                  \
+    return v->data[0];                                                      \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+type name##_back(name##_t *v)                                               \
+{                                                                           \
+    assert(v->length > 0);                                                  \
+    return v->data[v->length - 1];                                          \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+size_t name##_length(name##_t *v)                                           \
+{                                                                           \
+    return v->length;                                                       \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+bool name##_is_empty(name##_t *v)                                           \
+{                                                                           \
+    return v->length == 0;                                                  \
+}                                                                           \
+                                                                            \
+                                                                            \
+static inline __VEC_UNUSED__                                                \
+void name##_clear(name##_t *v)                                              \
+{                                                                           \
+    v->length = 0;                                                          \
+}
+
+
+#endif